@@ -143,6 +143,19 @@ std::string TargetnameForLightStyle(int style);
 std::vector<std::unique_ptr<light_t>> &GetLights();
 const std::vector<entdict_t> &GetEntdicts();
 std::vector<sun_t> &GetSuns();
+
+/**
+ * With -skyvis, the sky dome suns are grouped by the nearest of a fixed set of
+ * stratified directions. Each direction is traced once per sample, and every
+ * sun in the group is lit from that one ray.
+ */
+struct skyvis_bin_t
+{
+    // unit vector towards the sky
+    qvec3f dir;
+    std::vector<const sun_t *> suns;
+};
+const std::vector<skyvis_bin_t> &GetSkyVisBins();
 std::vector<entdict_t> &GetRadLights();
 /**
  * Returns the light entity that has "_switchableshadow_target" set to the given value, or nullptr.
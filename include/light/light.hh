@@ -43,7 +43,6 @@ constexpr float MAX_SKY_DIST = 1000000;
 struct lightsample_t
 {
     qvec3f color;
-    qvec3f direction;
 };
 
 // CHECK: isn't average a bad algorithm for color brightness?
@@ -67,6 +66,10 @@ public:
     int style;
     std::string suntexture;
     const img::texture *suntexture_value;
+    // part of a _sunlight2/_sunlight3 dome
+    bool skydome = false;
+    // with -skyvis, index into GetSkyVisBins() for dome suns; -1 if traced on its own
+    int skyvis_bin = -1;
 };
 
 class modelinfo_t;
@@ -80,7 +83,17 @@ class lightmap_t
 public:
     int style;
     std::vector<lightsample_t> samples;
+    // sum of the incoming light directions for each sample; only allocated
+    // when a .lux or LIGHTINGDIR lump is written
+    std::vector<qvec3f> directions;
     qvec3f bounce_color;
+
+    void add_direction(size_t i, const qvec3f &direction)
+    {
+        if (!directions.empty()) {
+            directions[i] += direction;
+        }
+    }
 };
 
 using lightmapdict_t = std::vector<lightmap_t>;
@@ -259,6 +272,15 @@ enum class visapprox_t
     RAYS
 };
 
+enum class raypackets_t
+{
+    NONE,
+    AUTO,
+    PACKET4,
+    PACKET8,
+    PACKET16
+};
+
 enum class emissivequality_t
 {
     LOW,
@@ -396,6 +418,7 @@ public:
     setting_bool novanilla;
     setting_scalar gate;
     setting_int32 sunsamples;
+    setting_int32 skyvis;
     setting_bool arghradcompat;
     setting_bool nolighting;
     setting_vec3 debugface;
@@ -405,8 +428,16 @@ public:
     setting_set radlights;
     setting_int32 lightmap_scale;
     setting_extra extra;
+    setting_scalar adaptiveextra;
     setting_enum<emissivequality_t> emissivequality;
     setting_enum<visapprox_t> visapprox;
+    setting_enum<raypackets_t> raypackets;
+    setting_bool lighttree;
+    setting_scalar lighttree_error;
+    setting_bool lightcache;
+    setting_bool lightindex;
+    setting_bool facecost;
+    setting_bool streamfaces;
     setting_func lit;
     setting_func lit2;
     setting_func bspxlit;
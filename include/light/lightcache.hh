@@ -0,0 +1,82 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <light/light.hh>
+
+#include <common/fs.hh>
+
+#include <cstdint>
+#include <vector>
+
+class light_t;
+struct mbsp_t;
+
+/**
+ * One light style's worth of a light entity's contribution to a face, as
+ * LightFace_Entity would have accumulated it into an empty lightmapdict_t.
+ */
+struct lightcache_style_t
+{
+    int32_t style;
+    qvec3f bounce_color;
+    // one per lightsurf_t::samples
+    std::vector<lightsample_t> samples;
+    // empty unless directions are being stored, see lightmap_t::directions
+    std::vector<qvec3f> directions;
+};
+
+void ResetLightCache();
+
+/**
+ * Called after the lightmap surfaces are created. Computes the identity of
+ * each light entity, and loads the cache file at `path` if it was written for
+ * the same BSP geometry, lightmap sampling and settings.
+ */
+void LightCache_Init(const mbsp_t *bsp, const bspxentries_t &bspx, const fs::path &path);
+bool LightCache_Enabled();
+
+/**
+ * Returns the cached contribution of `light` to face `facenum`, or nullptr if
+ * it needs to be traced. An empty vector means the light doesn't reach the face.
+ * Thread safe as long as each face is only used by one thread at a time.
+ */
+const std::vector<lightcache_style_t> *LightCache_Find(int facenum, const light_t *light);
+void LightCache_Store(int facenum, const light_t *light, std::vector<lightcache_style_t> contribution);
+
+/**
+ * Writes the cache file for the lights in this run.
+ */
+void LightCache_Save();
+
+struct lightcache_stats_t
+{
+    // lights whose contributions were all loaded from the cache
+    size_t lights_loaded = 0;
+    // lights that were new or changed, and so traced
+    size_t lights_traced = 0;
+    // faces those lights reached
+    size_t faces_traced = 0;
+};
+
+/**
+ * What the last run with -lightcache loaded and traced.
+ */
+lightcache_stats_t LightCache_Stats();
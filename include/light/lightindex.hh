@@ -0,0 +1,56 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <common/aabb.hh>
+#include <common/qvec.hh>
+
+#include <cstdint>
+#include <vector>
+
+class light_t;
+
+struct lightindex_node_t
+{
+    // union of the influence spheres' bounds below this node
+    aabb3f bounds;
+    // indices into lightindex nodes, or -1 for leaf nodes
+    int32_t children[2] = {-1, -1};
+    // range of the light list below this node
+    uint32_t first_light, num_lights;
+
+    bool is_leaf() const { return children[0] == -1; }
+};
+
+void ResetLightIndex();
+/**
+ * Builds a BVH over the influence spheres of GetLights(): the distance past
+ * which CullLight would reject the light for any face (see LightInfluenceRadius).
+ * Lights whose influence never falls below -gate are kept in a separate list
+ * that every query returns.
+ */
+void LightIndex_Build();
+bool LightIndex_Enabled();
+/**
+ * Returns the lights whose influence sphere reaches the sphere at `origin` with
+ * `radius`, in the same order as GetLights(). Thread safe.
+ */
+std::vector<const light_t *> LightIndex_Query(const qvec3f &origin, float radius);
+void LightIndex_PrintStats();
@@ -0,0 +1,93 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <light/surflight.hh>
+
+#include <common/aabb.hh>
+#include <common/qvec.hh>
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+struct lightsurf_t;
+struct mleaf_t;
+
+/**
+ * One surface light style (a direct emitter, or a bounce VPL) stored in a light tree.
+ */
+struct lighttree_emitter_t
+{
+    const lightsurf_t *surf;
+    const surfacelight_t::per_style_t *style;
+    // bounds of the emitter's points
+    aabb3f bounds;
+    // per-point intensity * number of points
+    float power;
+};
+
+struct lighttree_node_t
+{
+    aabb3f bounds;
+    // sum of the emitters' power
+    float power;
+    // largest color component of any of the emitters
+    float max_color;
+    // indices into lighttree_t::nodes, or -1 for leaf nodes
+    int32_t children[2] = {-1, -1};
+    // range of lighttree_t::emitters below this node
+    uint32_t first_emitter, num_emitters;
+
+    // the whole subtree collapsed into a single point emitter, placed on the member
+    // point closest to the power-weighted centroid. only set when the members' normals
+    // are close enough for a single surfnormal to stand in for all of them.
+    std::optional<surfacelight_t> aggregate;
+    // every leaf the members are in, sorted; the aggregate is only PVS culled if none are visible
+    std::vector<const mleaf_t *> leaves;
+
+    bool is_leaf() const { return children[0] == -1; }
+};
+
+/**
+ * BVH over the emitters of one lighting pass that share the same style,
+ * omnidirectional, rescale and atten values, so any subtree can be evaluated
+ * as one surface light (see lighttree_node_t::aggregate).
+ */
+struct lighttree_t
+{
+    int32_t style;
+    bool omnidirectional;
+    bool rescale;
+    float atten;
+
+    std::vector<lighttree_emitter_t> emitters;
+    // nodes[0] is the root
+    std::vector<lighttree_node_t> nodes;
+};
+
+void ResetLightTree();
+/**
+ * Builds the light trees for the emitters in EmissiveLightSurfaces() whose
+ * bounce_level matches `bounce_level` (std::nullopt = direct surface lights).
+ */
+void LightTree_Build(std::optional<size_t> bounce_level);
+const std::vector<lighttree_t> &LightTrees();
+std::optional<size_t> LightTreesBounceLevel();
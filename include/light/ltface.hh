@@ -53,6 +53,8 @@ lightsurf_t CreateLightmapSurface(const mbsp_t *bsp, const mface_t *face, const
 bool Face_IsLightmapped(const mbsp_t *bsp, const mface_t *face);
 bool Face_IsEmissive(const mbsp_t *bsp, const mface_t *face);
 void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg);
+float LightInfluenceRadius(const light_t *entity);
+float DirectLightFace_EstimateCost(const mbsp_t *bsp, const lightsurf_t &lightsurf, size_t surflight_points);
 void IndirectLightFace(
     const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg, size_t bounce_depth);
 void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg);
@@ -44,6 +44,13 @@ void ResetEmbree();
 void Embree_TraceInit(const mbsp_t *bsp);
 const std::set<const mface_t *> &ShadowCastingSolidFacesSet();
 
+/**
+ * Number of rays traced together by the raystreams (4, 8 or 16), or 1 if
+ * rays are traced individually. Chosen in Embree_TraceInit from `-raypackets`
+ * and the packet widths natively supported by the embree device.
+ */
+int Embree_PacketWidth();
+
 struct ray_io
 {
     RTCRayHit ray;
@@ -63,6 +70,10 @@ struct ray_io
     int dynamic_style = 0;
 };
 
+// trace `rays` in packets of Embree_PacketWidth(); results are written back to each ray_io
+void Embree_TraceIntersectionPackets(aligned_vector<ray_io> &rays, RTCIntersectArguments *args);
+void Embree_TraceOcclusionPackets(aligned_vector<ray_io> &rays, RTCOccludedArguments *args);
+
 struct alignas(16) aligned_vec3
 {
     float x, y, z, w;
@@ -87,10 +98,13 @@ public:
 
     void clearPushedRays() { _rays.clear(); }
 
-    inline qvec3f getPushedRayColor(size_t j) const
+    inline qvec3f getPushedRayColor(size_t j) const { return getPushedRayColor(j, getRay(j).color); }
+
+    // applies ray j's glass tint (if any) to `color` rather than the color the ray was pushed with
+    inline qvec3f getPushedRayColor(size_t j, const qvec3f &color) const
     {
         const ray_io &ray = getRay(j);
-        qvec3f result = ray.color;
+        qvec3f result = color;
 
         if (ray.hit_glass) {
             const qvec3f glasscolor = ray.glass_color;
@@ -222,6 +236,12 @@ public:
         ray_source_info ctx2(this, self, shadowmask);
 
         RTCIntersectArguments embree4_args = ctx2.setup_intersection_arguments();
+
+        if (_rays.size() > 1 && Embree_PacketWidth() > 1) {
+            Embree_TraceIntersectionPackets(_rays, &embree4_args);
+            return;
+        }
+
         for (auto &ray : _rays)
             rtcIntersect1(scene, &ray.ray, &embree4_args);
     }
@@ -282,6 +302,12 @@ public:
 
         ray_source_info ctx2(this, self, shadowmask);
         RTCOccludedArguments embree4_args = ctx2.setup_occluded_arguments();
+
+        if (_rays.size() > 1 && Embree_PacketWidth() > 1) {
+            Embree_TraceOcclusionPackets(_rays, &embree4_args);
+            return;
+        }
+
         for (auto &ray : _rays)
             rtcOccluded1(scene, &ray.ray.ray, &embree4_args);
     }
@@ -27,6 +27,7 @@
 
 struct mbsp_t;
 struct bspdata_t;
+struct lightsurf_t;
 
 constexpr size_t MAXLIGHTMAPSSUP = 16;
 constexpr uint16_t INVALID_LIGHTSTYLE = 0xffffu;
@@ -46,3 +47,12 @@ void WriteLitFile(const mbsp_t *bsp, const std::vector<facesup_t> &facesup, cons
 void WriteLuxFile(const mbsp_t *bsp, const fs::path &filename, int version, const std::vector<uint8_t> &lux_filebase);
 
 void SaveLightmapSurfaces(bspdata_t *bspdata, const fs::path &source);
+
+/**
+ * -streamfaces: after BeginEncodedLightmaps, faces are finished and encoded into
+ * their final lightmap bytes one at a time with EncodeLightmapSurface, so their
+ * samples can be freed straight away. SaveLightmapSurfaces then just concatenates
+ * the encoded faces instead of encoding LightSurfaces().
+ */
+void BeginEncodedLightmaps(const mbsp_t *bsp);
+void EncodeLightmapSurface(mbsp_t *bsp, size_t facenum, lightsurf_t &lightsurf);
@@ -42,6 +42,7 @@ struct side_t
     bool onnode; // has this face been used as a BSP node plane yet?
     bool bevel; // don't ever use for bsp splitting
     mapface_t *source; // the mapface we were generated from
+    uint8_t hullnum = 0; // which of the source's `visible` flags is ours
 
     bool tested;
 
@@ -49,6 +50,7 @@ struct side_t
     side_t clone() const;
 
     bool is_visible() const;
+    void set_visible(bool visible);
     const maptexinfo_t &get_texinfo() const;
     const qbsp_plane_t &get_plane() const;
     const qbsp_plane_t &get_positive_plane() const;
@@ -99,5 +99,6 @@ enum tree_split_t
 
 double BrushVolume(const bspbrush_t &brush);
 bspbrush_t::ptr BrushFromBounds(const aabb3d &bounds);
-void BrushBSP(tree_t &tree, mapentity_t &entity, const bspbrush_t::container &brushes, tree_split_t split_type);
+void AddHeadnodePlanes(const aabb3d &bounds, const bspbrush_t::container &brushes);
+void BrushBSP(tree_t &tree, const aabb3d &bounds, const bspbrush_t::container &brushes, tree_split_t split_type);
 void ChopBrushes(bspbrush_t::container &brushes, bool allow_fragmentation);
\ No newline at end of file
@@ -37,6 +37,8 @@
 #include <shared_mutex>
 #include <string_view>
 
+#include <tbb/concurrent_vector.h>
+
 struct mapface_t
 {
     size_t planenum;
@@ -68,9 +70,11 @@ struct mapface_t
     // with no transformations; this is for conversions only.
     std::optional<extended_texinfo_t> raw_info;
 
-    bool visible; // can any part of this side be seen from non-void parts of the level?
-                  // non-visible means we can discard the brush side
-                  // (avoiding generating a BSP spit, so expanding it outwards)
+    // can any part of this side be seen from non-void parts of the level?
+    // non-visible means we can discard the brush side
+    // (avoiding generating a BSP spit, so expanding it outwards)
+    // one flag per hull, since the clipping hulls are built concurrently
+    std::array<bool, MAX_MAP_HULLS_H2> visible{};
 
     // this face is a bevel added by AddBrushBevels, and shouldn't be used as a splitter
     // for the main hull.
@@ -126,6 +130,7 @@ public:
     // key/value pairs in the order they were parsed
     entdict_t epairs;
 
+    // bounds of the main hull; the clipping hulls keep theirs to themselves
     aabb3d bounds;
 
     std::optional<size_t> firstoutputfacenumber = std::nullopt;
@@ -192,9 +197,11 @@ struct mapdata_t
     // output in the BSP, from the map's own sides. The positive planes
     // come first (are even-numbered, with 0 being even) and the negative
     // planes are odd-numbered.
-    std::vector<mapplane_t> planes;
+    // concurrent_vector so the hulls can add planes while others are
+    // holding references to existing ones.
+    tbb::concurrent_vector<mapplane_t> planes;
 
-    // planes indices (into the `planes` vector)
+    // planes indices (into the `planes` vector), and the lock for adding planes
     std::unique_ptr<planehash_t> plane_hash;
 
     mapdata_t();
@@ -236,6 +243,7 @@ struct mapdata_t
 
     /* Misc other global state for the compile process */
     bool leakfile = false; /* Flag once we've written a leak (.por/.pts) file */
+    uint8_t leakfile_hull = 0; // the hull that leak file is from
 
     // Final, exported BSP
     mbsp_t bsp;
@@ -336,11 +344,24 @@ void WriteEntitiesToString();
 qvec3d FixRotateOrigin(mapentity_t &entity);
 
 /* Create BSP brushes from map brushes */
-void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::container &brushes, size_t &num_clipped);
+void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::container &brushes, aabb3d &bounds,
+    size_t &num_clipped);
 
 size_t EmitFaces(node_t *headnode);
 void EmitVertices(node_t *headnode);
-void ExportClipNodes(mapentity_t &entity, node_t *headnode, hull_index_t::value_type hullnum);
+
+// one entity's clipping hull, held back from map.bsp so the hulls can be
+// built concurrently and still be written in a fixed order.
+// planenums are map planes and children index `nodes` (or are contents).
+struct staged_clipnodes_t
+{
+    mapentity_t *entity;
+    std::vector<bsp2_dclipnode_t> nodes;
+    int32_t headnode;
+};
+
+staged_clipnodes_t StageClipNodes(mapentity_t &entity, node_t *headnode);
+void ExportClipNodes(const staged_clipnodes_t &staged, hull_index_t::value_type hullnum);
 void ExportDrawNodes(mapentity_t &entity, node_t *headnode, int firstface);
 void WriteBspBrushMap(std::string_view filename_suffix, const bspbrush_t::container &list);
 
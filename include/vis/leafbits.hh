@@ -19,23 +19,110 @@
 
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <common/cmdlib.hh>
 #include <common/bitflags.hh>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace detail
+{
+// the widest vector the bulk leafbits_t operations can use, and how many blocks it holds
+#if defined(__AVX2__)
+struct leafbits_vec_t
+{
+    static constexpr size_t blocks = 4;
+    __m256i v;
+
+    static inline leafbits_vec_t load(const uint64_t *p)
+    {
+        return {_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p))};
+    }
+    inline void store(uint64_t *p) const { _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v); }
+    static inline leafbits_vec_t zero() { return {_mm256_setzero_si256()}; }
+    inline leafbits_vec_t operator&(leafbits_vec_t o) const { return {_mm256_and_si256(v, o.v)}; }
+    inline leafbits_vec_t operator|(leafbits_vec_t o) const { return {_mm256_or_si256(v, o.v)}; }
+    // this & ~o
+    inline leafbits_vec_t andnot(leafbits_vec_t o) const { return {_mm256_andnot_si256(o.v, v)}; }
+    inline bool any() const { return !_mm256_testz_si256(v, v); }
+};
+#elif defined(__SSE2__)
+struct leafbits_vec_t
+{
+    static constexpr size_t blocks = 2;
+    __m128i v;
+
+    static inline leafbits_vec_t load(const uint64_t *p)
+    {
+        return {_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))};
+    }
+    inline void store(uint64_t *p) const { _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v); }
+    static inline leafbits_vec_t zero() { return {_mm_setzero_si128()}; }
+    inline leafbits_vec_t operator&(leafbits_vec_t o) const { return {_mm_and_si128(v, o.v)}; }
+    inline leafbits_vec_t operator|(leafbits_vec_t o) const { return {_mm_or_si128(v, o.v)}; }
+    // this & ~o
+    inline leafbits_vec_t andnot(leafbits_vec_t o) const { return {_mm_andnot_si128(o.v, v)}; }
+    inline bool any() const { return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff; }
+};
+#else
+struct leafbits_vec_t
+{
+    static constexpr size_t blocks = 1;
+    uint64_t v;
+
+    static inline leafbits_vec_t load(const uint64_t *p) { return {*p}; }
+    inline void store(uint64_t *p) const { *p = v; }
+    static inline leafbits_vec_t zero() { return {0}; }
+    inline leafbits_vec_t operator&(leafbits_vec_t o) const { return {v & o.v}; }
+    inline leafbits_vec_t operator|(leafbits_vec_t o) const { return {v | o.v}; }
+    // this & ~o
+    inline leafbits_vec_t andnot(leafbits_vec_t o) const { return {v & ~o.v}; }
+    inline bool any() const { return v != 0; }
+};
+#endif
+} // namespace detail
+
+class compact_leafbits_t;
+
 class leafbits_t
 {
+public:
+    using block_t = uint64_t;
+
+private:
+    using vec_t = detail::leafbits_vec_t;
+
     size_t _size = 0;
-    std::unique_ptr<uint32_t[]> bits{};
+    std::unique_ptr<block_t[]> bits{};
 
     constexpr size_t block_size() const { return (_size + mask) >> shift; }
-    inline std::unique_ptr<uint32_t[]> allocate() { return std::make_unique<uint32_t[]>(block_size()); }
+    inline std::unique_ptr<block_t[]> allocate() { return std::make_unique<block_t[]>(block_size()); }
     constexpr size_t byte_size() const { return block_size() * sizeof(*bits.get()); }
 
+    // calls func(i, n) over the blocks of this, first with n == vec_t::blocks as
+    // long as a whole vector fits, then with n == 1 for the rest
+    template<typename F>
+    inline void for_blocks(F &&func) const
+    {
+        const size_t numblocks = block_size();
+        size_t i = 0;
+        for (; i + vec_t::blocks <= numblocks; i += vec_t::blocks)
+            func(i, std::integral_constant<size_t, vec_t::blocks>());
+        for (; i < numblocks; i++)
+            func(i, std::integral_constant<size_t, 1>());
+    }
+
 public:
-    static constexpr size_t shift = 5;
-    static constexpr size_t mask = (sizeof(uint32_t) << 3) - 1UL;
+    static constexpr size_t shift = 6;
+    static constexpr size_t mask = (sizeof(block_t) << 3) - 1UL;
 
     leafbits_t() = default;
 
@@ -83,16 +170,17 @@ public:
     inline void clear() { memset(bits.get(), 0, byte_size()); }
     inline void setall() { memset(bits.get(), 0xff, byte_size()); }
 
-    inline uint32_t *data() { return bits.get(); }
-    inline const uint32_t *data() const { return bits.get(); }
+    inline block_t *data() { return bits.get(); }
+    inline const block_t *data() const { return bits.get(); }
+    constexpr size_t num_blocks() const { return block_size(); }
 
-    inline bool operator[](size_t index) const { return !!(bits[index >> shift] & nth_bit(index & mask)); }
+    inline bool operator[](size_t index) const { return !!(bits[index >> shift] & nth_bit<block_t>(index & mask)); }
 
     struct reference
     {
-        std::unique_ptr<uint32_t[]> &bits;
+        std::unique_ptr<block_t[]> &bits;
         size_t block_index;
-        size_t mask;
+        block_t mask;
 
         inline explicit operator bool() const { return !!(bits[block_index] & mask); }
 
@@ -107,5 +195,383 @@ public:
         }
     };
 
-    inline reference operator[](size_t index) { return {bits, index >> shift, nth_bit(index & mask)}; }
+    inline reference operator[](size_t index) { return {bits, index >> shift, nth_bit<block_t>(index & mask)}; }
+
+    // copies from/to a row of bytes, 8 leafs per byte with the lowest leaf in
+    // the lowest bit, as the vis lump stores them
+    inline void from_bytes(const uint8_t *src, size_t numbytes)
+    {
+        clear();
+        for (size_t i = 0; i < numbytes; i++)
+            bits[i >> (shift - 3)] |= static_cast<block_t>(src[i]) << ((i << 3) & mask);
+    }
+
+    inline void to_bytes(uint8_t *dst, size_t numbytes) const
+    {
+        for (size_t i = 0; i < numbytes; i++)
+            dst[i] = static_cast<uint8_t>(bits[i >> (shift - 3)] >> ((i << 3) & mask));
+    }
+
+    /*
+     * Bulk operations. The other operands must be the same size as this.
+     */
+
+    inline leafbits_t &operator|=(const leafbits_t &other)
+    {
+        block_t *dst = bits.get();
+        const block_t *src = other.bits.get();
+        for_blocks([&](size_t i, auto n) {
+            if constexpr (decltype(n)::value == 1)
+                dst[i] |= src[i];
+            else
+                (vec_t::load(dst + i) | vec_t::load(src + i)).store(dst + i);
+        });
+        return *this;
+    }
+
+    inline leafbits_t &operator&=(const leafbits_t &other)
+    {
+        block_t *dst = bits.get();
+        const block_t *src = other.bits.get();
+        for_blocks([&](size_t i, auto n) {
+            if constexpr (decltype(n)::value == 1)
+                dst[i] &= src[i];
+            else
+                (vec_t::load(dst + i) & vec_t::load(src + i)).store(dst + i);
+        });
+        return *this;
+    }
+
+    // this = a & b; returns whether any of the result isn't also set in exclude
+    inline bool assign_and(const leafbits_t &a, const leafbits_t &b, const leafbits_t &exclude)
+    {
+        block_t *dst = bits.get();
+        const block_t *pa = a.bits.get(), *pb = b.bits.get(), *pe = exclude.bits.get();
+        vec_t more = vec_t::zero();
+        block_t more_tail = 0;
+        for_blocks([&](size_t i, auto n) {
+            if constexpr (decltype(n)::value == 1) {
+                dst[i] = pa[i] & pb[i];
+                more_tail |= dst[i] & ~pe[i];
+            } else {
+                const vec_t v = vec_t::load(pa + i) & vec_t::load(pb + i);
+                v.store(dst + i);
+                more = more | v.andnot(vec_t::load(pe + i));
+            }
+        });
+        return more.any() || more_tail;
+    }
+
+    // this = a & ~b; returns whether any bits are set
+    inline bool assign_andnot(const leafbits_t &a, const leafbits_t &b)
+    {
+        block_t *dst = bits.get();
+        const block_t *pa = a.bits.get(), *pb = b.bits.get();
+        vec_t any = vec_t::zero();
+        block_t any_tail = 0;
+        for_blocks([&](size_t i, auto n) {
+            if constexpr (decltype(n)::value == 1) {
+                dst[i] = pa[i] & ~pb[i];
+                any_tail |= dst[i];
+            } else {
+                const vec_t v = vec_t::load(pa + i).andnot(vec_t::load(pb + i));
+                v.store(dst + i);
+                any = any | v;
+            }
+        });
+        return any.any() || any_tail;
+    }
+
+    // this &= ~other; returns whether any bits are still set
+    inline bool andnot(const leafbits_t &other) { return assign_andnot(*this, other); }
+
+    inline bool any() const
+    {
+        const block_t *src = bits.get();
+        vec_t any = vec_t::zero();
+        block_t any_tail = 0;
+        for_blocks([&](size_t i, auto n) {
+            if constexpr (decltype(n)::value == 1)
+                any_tail |= src[i];
+            else
+                any = any | vec_t::load(src + i);
+        });
+        return any.any() || any_tail;
+    }
+
+    // number of set bits
+    inline size_t count() const
+    {
+        const block_t *src = bits.get();
+        size_t total = 0;
+        for (size_t i = 0; i < block_size(); i++)
+            total += std::popcount(src[i]);
+        return total;
+    }
+
+    // calls func(index) for every set bit, in increasing order
+    template<typename F>
+    inline void for_each_set(F &&func) const
+    {
+        const block_t *src = bits.get();
+        for (size_t i = 0; i < block_size(); i++) {
+            for (block_t block = src[i]; block; block &= block - 1)
+                func((i << shift) + std::countr_zero(block));
+        }
+    }
+
+    /*
+     * The same operations with a compact_leafbits_t operand
+     */
+
+    inline leafbits_t &operator|=(const compact_leafbits_t &other);
+    inline leafbits_t &operator&=(const compact_leafbits_t &other);
+    inline bool assign_and(const leafbits_t &a, const compact_leafbits_t &b, const leafbits_t &exclude);
+    inline bool assign_andnot(const compact_leafbits_t &a, const compact_leafbits_t &b);
+    inline bool andnot(const compact_leafbits_t &other);
+};
+
+/*
+ * Storage for the mightsee and visbits of each portal, which are built once
+ * in a leafbits_t and then only read, or have bits cleared. Those of the
+ * portals that only see a small part of the map are stored as just their
+ * non-zero blocks; the rest are kept dense.
+ */
+class compact_leafbits_t
+{
+public:
+    using block_t = leafbits_t::block_t;
+
+private:
+    size_t _size = 0;
+    // all of the bits, if not sparse
+    leafbits_t dense{};
+    // otherwise the non-zero blocks, and their block numbers in increasing order
+    size_t numstored = 0;
+    std::unique_ptr<uint32_t[]> index{};
+    std::unique_ptr<block_t[]> blocks{};
+
+    // the stored block for blocknum, or nullptr if it is zero
+    inline block_t *find_block(size_t blocknum) const
+    {
+        uint32_t *end = index.get() + numstored;
+        uint32_t *it = std::lower_bound(index.get(), end, static_cast<uint32_t>(blocknum));
+        if (it == end || *it != blocknum)
+            return nullptr;
+        return &blocks[it - index.get()];
+    }
+
+public:
+    compact_leafbits_t() = default;
+
+    inline explicit compact_leafbits_t(const leafbits_t &bits) { *this = bits; }
+
+    inline compact_leafbits_t(const compact_leafbits_t &copy) { *this = copy; }
+    compact_leafbits_t(compact_leafbits_t &&move) noexcept = default;
+    compact_leafbits_t &operator=(compact_leafbits_t &&move) noexcept = default;
+
+    inline compact_leafbits_t &operator=(const compact_leafbits_t &copy)
+    {
+        if (this == &copy)
+            return *this;
+
+        _size = copy._size;
+        dense = copy.dense;
+        numstored = copy.numstored;
+        if (copy.sparse()) {
+            index = std::make_unique<uint32_t[]>(numstored);
+            blocks = std::make_unique<block_t[]>(numstored);
+            std::copy_n(copy.index.get(), numstored, index.get());
+            std::copy_n(copy.blocks.get(), numstored, blocks.get());
+        } else {
+            index.reset();
+            blocks.reset();
+        }
+        return *this;
+    }
+
+    // picks the representation for bits
+    inline compact_leafbits_t &operator=(const leafbits_t &bits)
+    {
+        const block_t *src = bits.data();
+        const size_t numblocks = bits.num_blocks();
+
+        size_t nonzero = 0;
+        for (size_t i = 0; i < numblocks; i++)
+            nonzero += src[i] != 0;
+
+        _size = bits.size();
+
+        // sparse blocks are slower to work with, so only go sparse if it at least halves the memory
+        if ((sizeof(uint32_t) + sizeof(block_t)) * nonzero * 2 > sizeof(block_t) * numblocks) {
+            dense = bits;
+            numstored = 0;
+            index.reset();
+            blocks.reset();
+            return *this;
+        }
+
+        dense = {};
+        numstored = nonzero;
+        index = std::make_unique<uint32_t[]>(numstored);
+        blocks = std::make_unique<block_t[]>(numstored);
+        for (size_t i = 0, j = 0; i < numblocks; i++) {
+            if (src[i]) {
+                index[j] = static_cast<uint32_t>(i);
+                blocks[j++] = src[i];
+            }
+        }
+        return *this;
+    }
+
+    constexpr size_t size() const { return _size; }
+
+    // this clears existing bit data!
+    inline void resize(size_t new_size)
+    {
+        _size = new_size;
+        dense = {};
+        numstored = 0;
+        index.reset();
+        blocks.reset();
+    }
+
+    inline bool sparse() const { return dense.size() != _size; }
+
+    // bytes allocated for the bits
+    inline size_t memory_size() const
+    {
+        if (sparse())
+            return (sizeof(uint32_t) + sizeof(block_t)) * numstored;
+        return sizeof(block_t) * dense.num_blocks();
+    }
+
+    inline bool operator[](size_t index) const
+    {
+        if (!sparse())
+            return dense[index];
+        const block_t *block = find_block(index >> leafbits_t::shift);
+        return block && (*block & nth_bit<block_t>(index & leafbits_t::mask));
+    }
+
+    // clears a bit without changing the representation, so other threads can
+    // keep reading the bits while it's done (as with a leafbits_t)
+    inline void reset(size_t index)
+    {
+        if (!sparse()) {
+            dense[index] = false;
+        } else if (block_t *block = find_block(index >> leafbits_t::shift)) {
+            *block &= ~nth_bit<block_t>(index & leafbits_t::mask);
+        }
+    }
+
+    // calls func(blocknum, block) for each block which may be non-zero, in increasing order
+    template<typename F>
+    inline void for_each_block(F &&func) const
+    {
+        if (!sparse()) {
+            for (size_t i = 0; i < dense.num_blocks(); i++)
+                func(i, dense.data()[i]);
+        } else {
+            for (size_t j = 0; j < numstored; j++)
+                func(static_cast<size_t>(index[j]), blocks[j]);
+        }
+    }
+
+    inline size_t count() const
+    {
+        if (!sparse())
+            return dense.count();
+        size_t total = 0;
+        for (size_t j = 0; j < numstored; j++)
+            total += std::popcount(blocks[j]);
+        return total;
+    }
+
+    // calls func(index) for every set bit, in increasing order
+    template<typename F>
+    inline void for_each_set(F &&func) const
+    {
+        for_each_block([&](size_t i, block_t block) {
+            for (; block; block &= block - 1)
+                func((i << leafbits_t::shift) + std::countr_zero(block));
+        });
+    }
+
+    // copies all of the bits into dst, resizing it if needed
+    inline void expand(leafbits_t &dst) const
+    {
+        if (!sparse()) {
+            dst = dense;
+            return;
+        }
+        if (dst.size() != _size)
+            dst.resize(_size);
+        else
+            dst.clear();
+        for (size_t j = 0; j < numstored; j++)
+            dst.data()[index[j]] = blocks[j];
+    }
+
+    inline leafbits_t expand() const
+    {
+        leafbits_t result;
+        expand(result);
+        return result;
+    }
+
+    friend class leafbits_t;
 };
+
+inline leafbits_t &leafbits_t::operator|=(const compact_leafbits_t &other)
+{
+    if (!other.sparse())
+        return *this |= other.dense;
+    for (size_t j = 0; j < other.numstored; j++)
+        bits[other.index[j]] |= other.blocks[j];
+    return *this;
+}
+
+inline leafbits_t &leafbits_t::operator&=(const compact_leafbits_t &other)
+{
+    if (!other.sparse())
+        return *this &= other.dense;
+    size_t i = 0;
+    for (size_t j = 0; j < other.numstored; j++) {
+        for (; i < other.index[j]; i++)
+            bits[i] = 0;
+        bits[i++] &= other.blocks[j];
+    }
+    for (; i < block_size(); i++)
+        bits[i] = 0;
+    return *this;
+}
+
+inline bool leafbits_t::assign_and(const leafbits_t &a, const compact_leafbits_t &b, const leafbits_t &exclude)
+{
+    if (!b.sparse())
+        return assign_and(a, b.dense, exclude);
+    clear();
+    block_t more = 0;
+    for (size_t j = 0; j < b.numstored; j++) {
+        const size_t i = b.index[j];
+        bits[i] = a.bits[i] & b.blocks[j];
+        more |= bits[i] & ~exclude.bits[i];
+    }
+    return more != 0;
+}
+
+inline bool leafbits_t::assign_andnot(const compact_leafbits_t &a, const compact_leafbits_t &b)
+{
+    a.expand(*this);
+    return andnot(b);
+}
+
+inline bool leafbits_t::andnot(const compact_leafbits_t &other)
+{
+    if (!other.sparse())
+        return andnot(other.dense);
+    for (size_t j = 0; j < other.numstored; j++)
+        bits[other.index[j]] &= ~other.blocks[j];
+    return any();
+}
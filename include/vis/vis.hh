@@ -26,6 +26,15 @@
 #include <common/prtfile.hh>
 #include <vis/leafbits.hh>
 
+#include <mutex>
+#include <unordered_map>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 constexpr double VIS_ON_EPSILON = 0.1;
 constexpr double VIS_EQUAL_EPSILON = 0.001;
 
@@ -51,6 +60,8 @@ enum pstatus_t
  */
 struct viswinding_t
 {
+    using plane_t = qplane3d;
+
     qvec3d origin; // Bounding sphere for fast clipping tests
     double radius; // Not updated, so won't shrink when clipping
 
@@ -121,23 +132,198 @@ struct viswinding_t
       Used for visdist to get the distance from a winding to a portal
       ============================================================================
     */
-    inline float distFromPortal(struct visportal_t &p);
+    inline float distFromPortal(const struct visportal_t &p) const;
 };
 
 static_assert(std::is_trivially_default_constructible_v<viswinding_t>);
 
+namespace detail
+{
+// the widest float vector the -floatclip winding clipper can use
+#if defined(__AVX2__)
+struct visfloat_vec_t
+{
+    static constexpr size_t lanes = 8;
+    __m256 v;
+
+    static inline visfloat_vec_t load(const float *p) { return {_mm256_load_ps(p)}; }
+    static inline visfloat_vec_t broadcast(float f) { return {_mm256_set1_ps(f)}; }
+    inline visfloat_vec_t operator+(visfloat_vec_t o) const { return {_mm256_add_ps(v, o.v)}; }
+    inline visfloat_vec_t operator-(visfloat_vec_t o) const { return {_mm256_sub_ps(v, o.v)}; }
+    inline visfloat_vec_t operator*(visfloat_vec_t o) const { return {_mm256_mul_ps(v, o.v)}; }
+    inline void store(float *p) const { _mm256_store_ps(p, v); }
+    // bit i set if lane i of this > lane i of o
+    inline uint32_t greater(visfloat_vec_t o) const
+    {
+        return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(v, o.v, _CMP_GT_OQ)));
+    }
+};
+#elif defined(__SSE2__)
+struct visfloat_vec_t
+{
+    static constexpr size_t lanes = 4;
+    __m128 v;
+
+    static inline visfloat_vec_t load(const float *p) { return {_mm_load_ps(p)}; }
+    static inline visfloat_vec_t broadcast(float f) { return {_mm_set1_ps(f)}; }
+    inline visfloat_vec_t operator+(visfloat_vec_t o) const { return {_mm_add_ps(v, o.v)}; }
+    inline visfloat_vec_t operator-(visfloat_vec_t o) const { return {_mm_sub_ps(v, o.v)}; }
+    inline visfloat_vec_t operator*(visfloat_vec_t o) const { return {_mm_mul_ps(v, o.v)}; }
+    inline void store(float *p) const { _mm_store_ps(p, v); }
+    // bit i set if lane i of this > lane i of o
+    inline uint32_t greater(visfloat_vec_t o) const
+    {
+        return static_cast<uint32_t>(_mm_movemask_ps(_mm_cmpgt_ps(v, o.v)));
+    }
+};
+#else
+struct visfloat_vec_t
+{
+    static constexpr size_t lanes = 1;
+    float v;
+
+    static inline visfloat_vec_t load(const float *p) { return {*p}; }
+    static inline visfloat_vec_t broadcast(float f) { return {f}; }
+    inline visfloat_vec_t operator+(visfloat_vec_t o) const { return {v + o.v}; }
+    inline visfloat_vec_t operator-(visfloat_vec_t o) const { return {v - o.v}; }
+    inline visfloat_vec_t operator*(visfloat_vec_t o) const { return {v * o.v}; }
+    inline void store(float *p) const { *p = v; }
+    // bit i set if lane i of this > lane i of o
+    inline uint32_t greater(visfloat_vec_t o) const { return v > o.v; }
+};
+#endif
+} // namespace detail
+
+/**
+ * Single precision viswinding_t for -floatclip, with the coordinates stored
+ * as separate x, y and z arrays so a whole vector of points can be tested
+ * against a plane at once.
+ *
+ * Always holds up to MAX_WINDING points; the clipper still stops at
+ * MAX_WINDING_FIXED like the double version. The points past numpoints up
+ * to the next whole vector are read (and ignored), so they must be valid
+ * floats: set_winding_sphere and ClipStackWinding fill them in.
+ */
+struct viswindingf_t
+{
+    using plane_t = qplane3f;
+    using vec_t = detail::visfloat_vec_t;
+
+    static_assert(MAX_WINDING % vec_t::lanes == 0);
+    static_assert(MAX_WINDING <= 64, "sides are returned as a 64 bit mask");
+
+    qvec3f origin; // Bounding sphere for fast clipping tests
+    float radius; // Not updated, so won't shrink when clipping
+
+    size_t numpoints;
+    alignas(32) float x[MAX_WINDING];
+    alignas(32) float y[MAX_WINDING];
+    alignas(32) float z[MAX_WINDING];
+
+    using unique_ptr = std::unique_ptr<viswindingf_t>;
+
+    static inline unique_ptr copy_winding(const viswinding_t &other)
+    {
+        if (other.size() > MAX_WINDING)
+            FError("too many points ({} > {})", other.size(), MAX_WINDING);
+
+        auto result = std::make_unique<viswindingf_t>();
+        result->numpoints = 0;
+        for (size_t i = 0; i < other.size(); ++i)
+            result->push_back(qvec3f(other[i]));
+
+        result->set_winding_sphere();
+        return result;
+    }
+
+    // getters
+
+    inline qvec3f at(size_t index) const { return {x[index], y[index], z[index]}; }
+    inline qvec3f operator[](size_t index) const { return at(index); }
+    inline size_t size() const { return numpoints; }
+
+    inline void push_back(const qvec3f &v)
+    {
+        x[numpoints] = v[0];
+        y[numpoints] = v[1];
+        z[numpoints] = v[2];
+        numpoints++;
+    }
+
+    // utils
+
+    // zeroes the points past numpoints up to the next whole vector
+    inline void pad_lanes()
+    {
+        for (size_t i = numpoints; i % vec_t::lanes; ++i)
+            x[i] = y[i] = z[i] = 0;
+    }
+
+    // sets origin & radius
+    inline void set_winding_sphere()
+    {
+        pad_lanes();
+
+        origin = {};
+        for (size_t i = 0; i < numpoints; ++i)
+            origin += at(i);
+        origin /= size();
+
+        radius = 0;
+        for (size_t i = 0; i < numpoints; ++i)
+            radius = std::max(radius, qv::distance(at(i), origin));
+    }
+
+    /**
+     * Stores the distance of each point to plane in dists (which needs room
+     * for MAX_WINDING), and returns the points more than epsilon in front of
+     * and behind it as bitmasks.
+     */
+    inline void plane_sides(const plane_t &plane, float epsilon, float *dists, uint64_t &front, uint64_t &back) const
+    {
+        const vec_t nx = vec_t::broadcast(plane.normal[0]);
+        const vec_t ny = vec_t::broadcast(plane.normal[1]);
+        const vec_t nz = vec_t::broadcast(plane.normal[2]);
+        const vec_t dist = vec_t::broadcast(plane.dist);
+        const vec_t pos_epsilon = vec_t::broadcast(epsilon);
+        const vec_t neg_epsilon = vec_t::broadcast(-epsilon);
+
+        front = back = 0;
+        for (size_t i = 0; i < numpoints; i += vec_t::lanes) {
+            const vec_t d = vec_t::load(x + i) * nx + vec_t::load(y + i) * ny + vec_t::load(z + i) * nz - dist;
+            d.store(dists + i);
+            front |= static_cast<uint64_t>(d.greater(pos_epsilon)) << i;
+            back |= static_cast<uint64_t>(neg_epsilon.greater(d)) << i;
+        }
+
+        const uint64_t valid = numpoints == 64 ? ~uint64_t(0) : (uint64_t(1) << numpoints) - 1;
+        front &= valid;
+        back &= valid;
+    }
+};
+
+static_assert(std::is_trivially_default_constructible_v<viswindingf_t>);
+
 struct visportal_t
 {
     qplane3d plane; // normal pointing into neighbor
     int leaf; // neighbor
     viswinding_t::unique_ptr winding;
+    // single precision copies, only with -floatclip
+    qplane3f planef;
+    viswindingf_t::unique_ptr windingf;
+    // while the full vis runs, RecursiveLeafFlow reads other portals' status
+    // without portal_mutex, so it's only written with the lock held and through
+    // std::atomic_ref. reads with the lock held can be plain, since nothing can
+    // write it then, as can every access before or after the flows, or between
+    // them in a -worker, which flows one portal at a time
     pstatus_t status;
-    leafbits_t visbits, mightsee;
+    compact_leafbits_t visbits, mightsee;
     int nummightsee;
     int numcansee;
 };
 
-inline float viswinding_t::distFromPortal(visportal_t &p)
+inline float viswinding_t::distFromPortal(const visportal_t &p) const
 {
     double mindist = 1e20;
 
@@ -156,24 +342,31 @@ struct leaf_t
 constexpr size_t MAX_SEPARATORS = MAX_WINDING;
 constexpr size_t STACK_WINDINGS = 3; // source, pass and a temp for clipping
 
-struct pstack_t
+template<typename W>
+struct basic_pstack_t
 {
-    pstack_t *next;
+    using plane_t = typename W::plane_t;
+
+    basic_pstack_t *next;
     leaf_t *leaf;
     visportal_t *portal; // portal exiting
-    viswinding_t *source, *pass;
-    viswinding_t windings[STACK_WINDINGS]; // Fixed size windings
+    W *source, *pass;
+    W windings[STACK_WINDINGS]; // Fixed size windings
     bool windings_used[STACK_WINDINGS];
-    qplane3d portalplane;
+    plane_t portalplane;
     leafbits_t *mightsee; // bit string
-    qplane3d separators[2][MAX_SEPARATORS]; /* Separator cache */
+    plane_t separators[2][MAX_SEPARATORS]; /* Separator cache */
     int numseparators[2];
     char did_targetchecks;
     unsigned num_expected_targetchecks;
 };
 
+using pstack_t = basic_pstack_t<viswinding_t>;
+using pstackf_t = basic_pstack_t<viswindingf_t>;
+
 // important for perf as a ton of these are stack allocated, needs to be be just a pointer bump
 static_assert(std::is_trivially_default_constructible_v<pstack_t>);
+static_assert(std::is_trivially_default_constructible_v<pstackf_t>);
 
 struct visstats_t
 {
@@ -188,6 +381,14 @@ struct visstats_t
     int64_t c_leafskip = 0;
     int64_t c_portalskip = 0;
     int64_t c_targetcheck = 0;
+    int64_t c_sepcachehit = 0;
+    int64_t c_sepcachemiss = 0;
+
+    auto stream_data()
+    {
+        return std::tie(c_portaltest, c_portalpass, c_portalcheck, c_mightseeupdate, c_noclip, c_vistest, c_mighttest,
+            c_chains, c_leafskip, c_portalskip, c_targetcheck, c_sepcachehit, c_sepcachemiss);
+    }
 
     visstats_t operator+(const visstats_t &other) const
     {
@@ -203,22 +404,29 @@ struct visstats_t
         result.c_leafskip = this->c_leafskip + other.c_leafskip;
         result.c_portalskip = this->c_portalskip + other.c_portalskip;
         result.c_targetcheck = this->c_targetcheck + other.c_targetcheck;
+        result.c_sepcachehit = this->c_sepcachehit + other.c_sepcachehit;
+        result.c_sepcachemiss = this->c_sepcachemiss + other.c_sepcachemiss;
         return result;
     }
 };
 
-viswinding_t *AllocStackWinding(pstack_t &stack);
-void FreeStackWinding(viswinding_t *&w, pstack_t &stack);
+template<typename W>
+W *AllocStackWinding(basic_pstack_t<W> &stack);
+template<typename W>
+void FreeStackWinding(W *&w, basic_pstack_t<W> &stack);
 viswinding_t *ClipStackWinding(visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d &split);
+viswindingf_t *ClipStackWinding(visstats_t &stats, viswindingf_t *in, pstackf_t &stack, const qplane3f &split);
 
+template<typename W>
 struct threaddata_t
 {
     leafbits_t &leafvis;
     visportal_t *base;
-    pstack_t pstack_head;
+    basic_pstack_t<W> pstack_head;
     visstats_t stats;
     unsigned numsteps;
     unsigned numtargetchecks;
+    struct portalreads_t *reads;
 };
 
 extern int numportals;
@@ -233,7 +441,7 @@ extern int leafbytes;
 extern int leafbytes_real;
 extern int leaflongs;
 
-extern fs::path portalfile, statefile, statetmpfile;
+extern fs::path portalfile, statefile, statetmpfile, journalfile, incrementalfile;
 
 namespace vis
 {
@@ -242,17 +450,87 @@ extern std::vector<surfflags_t> extended_texinfo_flags;
 
 void BasePortalVis();
 
-visstats_t PortalFlow(visportal_t *p);
+/*
+ * What a flow depended on, for the distributed vis coordinator: for each
+ * portal that wasn't done when it was flowed through, the leafs its mightsee
+ * was tested against. A flow only sees the part of such a portal's
+ * mightsee (or later, visbits) that's in these.
+ */
+struct portalreads_t
+{
+    std::unordered_map<size_t, leafbits_t> tested;
+
+    void add(size_t portalnum, const leafbits_t &against)
+    {
+        auto [it, inserted] = tested.try_emplace(portalnum, against);
+        if (!inserted) {
+            it->second |= against;
+        }
+    }
+};
+
+visstats_t PortalFlow(visportal_t *p, portalreads_t *reads = nullptr);
+// sets the size of the separating plane cache shared by the flows, and empties it; 0 disables it
+void ResetSeparatorCache(size_t capacity_bytes);
+
+/*
+ * -approx: estimates each portal's visbits by casting numsamples rays towards
+ * every portal it might see, instead of flowing it. A ray that misses a portal
+ * by up to graze_distance units is let through it. Runs after BasePortalVis.
+ */
+void ApproximatePortalVis(int numsamples, double graze_distance);
+
+/*
+ * Timing of the full vis portal flows, for the progress estimate and -trace.
+ * PortalTimed is called with portal_mutex held, after the portal is committed.
+ */
+void StartPortalTimings();
+void PortalTimed(const visportal_t *p, duration elapsed, const visstats_t &stats);
+void StopPortalTimings();
 
 void CalcAmbientSounds(mbsp_t *bsp);
 
 void CalcPHS(mbsp_t *bsp);
 
-extern qtime_point starttime, endtime, statetime;
+extern qtime_point starttime, endtime;
 
 void SaveVisState();
 bool LoadVisState();
 void CleanVisState();
+// returns the compressed length; out needs room for (portalleafs + 7) / 8 bytes
+int CompressBits(uint8_t *out, const leafbits_t &in);
+int CompressBits(uint8_t *out, const compact_leafbits_t &in);
+void UncompressBits(leafbits_t &dst, const uint8_t *src, size_t len);
+
+/*
+ * The state journal records portals as they complete, so a checkpoint costs
+ * only the new work; it's folded back into the state file once it grows
+ * larger than it. Records are written by a background thread which only
+ * takes portal_mutex to compact.
+ */
+void StartVisJournal(duration interval, std::mutex &portal_mutex);
+// called with portal_mutex held
+void JournalPortalCompleted(const visportal_t *p);
+void StopVisJournal();
+// updates the other portals' mightsee for a portal loaded from the journal
+void ReplayPortalCompleted(visportal_t *p);
+
+/*
+ * -incremental: after BasePortalVis, marks the portals an edit can't have
+ * changed as done, with their visbits from the last -incremental run
+ */
+void LoadIncrementalVis();
+void SaveIncrementalVis();
+
+/*
+ * Distributed vis: a -coordinator vis owns the portal queue and the mightsee
+ * propagation, and hands portals out to -worker processes over TCP.
+ */
+extern std::mutex portal_mutex;
+// called with portal_mutex held
+void CommitPortal(visstats_t &stats, visportal_t *completed, std::vector<visportal_t *> &changed);
+visstats_t RunVisCoordinator(int port, size_t numwaiting);
+int RunVisWorker(const std::string &address);
 
 #include <common/settings.hh>
 #include <common/fs.hh>
@@ -266,6 +544,13 @@ class vis_settings : public common_settings
 {
 public:
     setting_bool fast{this, "fast", false, &performance_group, "run very simple & fast vis procedure"};
+    setting_int32 approx{this, "approx", 0, 0, 256, &performance_group,
+        "instead of the full vis, estimate it by casting this many rays from each portal to each portal it might see "
+        "(0 = off)"};
+    // the smallest power of two at which -approx 8 found every leaf the full vis did on E1M1 and base1. at 0 they
+    // missed about 0.15% of the leafs the full vis sees, at 64 E1M1 still missed a handful
+    setting_scalar approxgraze{this, "approxgraze", 128.0, 0.0, 8192.0, &performance_group,
+        "with -approx, let a ray through a portal it misses by up to this many units, erring towards seeing too much"};
     setting_int32 level{this, "level", 4, 0, 4, &vis_advanced_group, "number of iterations for tests"};
     setting_bool noambientsky{this, "noambientsky", false, &vis_output_group, "don't output ambient sky sounds"};
     setting_bool noambientwater{this, "noambientwater", false, &vis_output_group, "don't output ambient water sounds"};
@@ -276,10 +561,31 @@ public:
     setting_scalar visdist{
         this, "visdist", 0.0, &vis_advanced_group, "control the distance required for a portal to be considered seen"};
     setting_bool nostate{this, "nostate", false, &vis_advanced_group, "ignore saved state files, for forced re-runs"};
+    setting_scalar stateinterval{this, "stateinterval", 300.0, 0.0, 86400.0, &vis_advanced_group,
+        "seconds between writing the portals completed since the last write to the state journal"};
+    setting_int32 stopafter{this, "stopafter", 0, 0, std::numeric_limits<int32_t>::max(), &vis_advanced_group,
+        "stop after flowing this many full vis portals, keeping the state to resume from on the next run"};
+    setting_bool incremental{this, "incremental", false, &vis_advanced_group,
+        "keep the finished vis next to the map, and on the next -incremental run only redo the portals edits could "
+        "have changed"};
     setting_bool phsonly{
         this, "phsonly", false, &vis_advanced_group, "re-calculate the PHS of a Quake II BSP without touching the PVS"};
     setting_invertible_bool autoclean{
         this, "autoclean", true, &vis_output_group, "remove any extra files on successful completion"};
+    setting_int32 coordinator{this, "coordinator", 0, 0, 65535, &vis_advanced_group,
+        "hand out the full vis portals to -worker processes connecting on this TCP port"};
+    setting_string worker{this, "worker", "", "\"host:port\"", &vis_advanced_group,
+        "flow portals for the -coordinator vis at host:port instead of writing the .bsp"};
+    setting_int32 coordinatorwait{this, "coordinatorwait", 300, 0, std::numeric_limits<int32_t>::max(),
+        &vis_advanced_group, "with -coordinator, give up after this many seconds without any workers (0 = never)"};
+    setting_int32 workerwait{this, "workerwait", 60, 0, std::numeric_limits<int32_t>::max(), &vis_advanced_group,
+        "with -worker, keep trying to connect to the coordinator for this many seconds"};
+    setting_bool floatclip{this, "floatclip", false, &performance_group,
+        "clip portal windings in single precision, testing several points at once; results can differ slightly"};
+    setting_int32 separatorcache{this, "separatorcache", 0, 0, 65536, &performance_group,
+        "megabytes of separating planes between unclipped portals to reuse across portal flows (0 = off)"};
+    setting_string trace{this, "trace", "", "\"file.csv\" or \"file.json\"", &vis_advanced_group,
+        "write the flow time, mightsee, cansee and counters of each full vis portal to a CSV or JSON file"};
     setting_scalar targetratio{this, "targetchecks", 0.5, 0.0, 9999.0, &performance_group,
         "target ratio of target checks to regular checks (0.0 = no target checks, 1.0 = equal amounts of regular and target checks)"};
 
@@ -36,6 +36,7 @@
 
 static std::vector<std::unique_ptr<light_t>> all_lights;
 static std::vector<sun_t> all_suns;
+static std::vector<skyvis_bin_t> skyvis_bins;
 static std::vector<entdict_t> entdicts;
 static std::vector<entdict_t> radlights;
 static std::vector<std::pair<std::string, int>> lightstyleForTargetname;
@@ -51,6 +52,7 @@ void ResetLightEntities()
 {
     all_lights.clear();
     all_suns.clear();
+    skyvis_bins.clear();
     entdicts.clear();
     radlights.clear();
 
@@ -77,6 +79,11 @@ std::vector<sun_t> &GetSuns()
     return all_suns;
 }
 
+const std::vector<skyvis_bin_t> &GetSkyVisBins()
+{
+    return skyvis_bins;
+}
+
 std::vector<entdict_t> &GetRadLights()
 {
     return radlights;
@@ -403,11 +410,11 @@ static bool Dirt_ResolveFlag(const settings::worldspawn_keys &cfg, int dirtInt)
  * AddSun
  * =============
  */
-static void AddSun(const settings::worldspawn_keys &cfg, const qvec3f &sunvec, float light, const qvec3f &color,
+static sun_t *AddSun(const settings::worldspawn_keys &cfg, const qvec3f &sunvec, float light, const qvec3f &color,
     int dirtInt, float sun_anglescale, const int style, const std::string &suntexture)
 {
     if (light == 0.0f)
-        return;
+        return nullptr;
 
     // add to list
     sun_t &sun = all_suns.emplace_back();
@@ -428,6 +435,8 @@ static void AddSun(const settings::worldspawn_keys &cfg, const qvec3f &sunvec, f
     //  anglescale,
     //  dirtInt,
     //  (int)sun->dirt);
+
+    return &sun;
 }
 
 /*
@@ -585,7 +594,8 @@ static void SetupSkyDome(const settings::worldspawn_keys &cfg, float upperLight,
             /* insert top hemisphere light */
             if (sunlight2value > 0) {
                 AddSun(cfg, direction, sunlight2value, upperColor, upperDirt, upperAnglescale, upperStyle,
-                    upperSuntexture);
+                    upperSuntexture)
+                    ->skydome = true;
             }
 
             direction[2] = -direction[2];
@@ -593,7 +603,8 @@ static void SetupSkyDome(const settings::worldspawn_keys &cfg, float upperLight,
             /* insert bottom hemisphere light */
             if (sunlight3value > 0) {
                 AddSun(cfg, direction, sunlight3value, lowerColor, lowerDirt, lowerAnglescale, lowerStyle,
-                    lowerSuntexture);
+                    lowerSuntexture)
+                    ->skydome = true;
             }
 
             /* move */
@@ -608,12 +619,14 @@ static void SetupSkyDome(const settings::worldspawn_keys &cfg, float upperLight,
     /* create vertical sun */
     if (sunlight2value > 0) {
         AddSun(
-            cfg, {0.0, 0.0, -1.0}, sunlight2value, upperColor, upperDirt, upperAnglescale, upperStyle, upperSuntexture);
+            cfg, {0.0, 0.0, -1.0}, sunlight2value, upperColor, upperDirt, upperAnglescale, upperStyle, upperSuntexture)
+            ->skydome = true;
     }
 
     if (sunlight3value > 0) {
         AddSun(
-            cfg, {0.0, 0.0, 1.0}, sunlight3value, lowerColor, lowerDirt, lowerAnglescale, lowerStyle, lowerSuntexture);
+            cfg, {0.0, 0.0, 1.0}, sunlight3value, lowerColor, lowerDirt, lowerAnglescale, lowerStyle, lowerSuntexture)
+            ->skydome = true;
     }
 }
 
@@ -644,6 +657,69 @@ static void SetupSkyDomes(const settings::worldspawn_keys &cfg)
     }
 }
 
+/*
+ * =============
+ * SetupSkyVis
+ *
+ * Assigns each sky dome sun to the nearest of -skyvis directions, spread
+ * evenly over the sphere (Fibonacci lattice). LightFace_SkyVis traces the
+ * used directions once per sample instead of one ray per dome sun.
+ * =============
+ */
+static void SetupSkyVis()
+{
+    const int numdirs = light_options.skyvis.value();
+
+    if (!numdirs) {
+        return;
+    }
+
+    std::vector<qvec3f> dirs(numdirs);
+    const float golden_angle = Q_PI * (3.0f - sqrt(5.0f));
+
+    for (int i = 0; i < numdirs; i++) {
+        const float z = 1.0f - (2.0f * i + 1.0f) / numdirs;
+        const float r = sqrt(std::max(0.0f, 1.0f - z * z));
+        const float phi = golden_angle * i;
+
+        dirs[i] = {cos(phi) * r, sin(phi) * r, z};
+    }
+
+    // dirs index -> skyvis_bins index
+    std::vector<int> bin_for_dir(numdirs, -1);
+
+    for (sun_t &sun : all_suns) {
+        if (!sun.skydome) {
+            continue;
+        }
+
+        const qvec3f incoming = qv::normalize(sun.sunvec);
+
+        int best = 0;
+        float best_dp = -2.0f;
+
+        for (int i = 0; i < numdirs; i++) {
+            const float dp = qv::dot(incoming, dirs[i]);
+
+            if (dp > best_dp) {
+                best_dp = dp;
+                best = i;
+            }
+        }
+
+        if (bin_for_dir[best] == -1) {
+            bin_for_dir[best] = static_cast<int>(skyvis_bins.size());
+            skyvis_bins.push_back(skyvis_bin_t{.dir = dirs[best]});
+        }
+
+        sun.skyvis_bin = bin_for_dir[best];
+        skyvis_bins[sun.skyvis_bin].suns.push_back(&sun);
+    }
+
+    logging::print("SetupSkyVis: {} sky directions traced for {} dome suns\n", skyvis_bins.size(),
+        std::count_if(all_suns.begin(), all_suns.end(), [](const sun_t &sun) { return sun.skydome; }));
+}
+
 /*
  * =============
  * DuplicateEntity
@@ -1235,6 +1311,7 @@ void SetupLights(const settings::worldspawn_keys &cfg, const mbsp_t *bsp)
     SetupSpotlights(bsp, cfg);
     SetupSuns(cfg);
     SetupSkyDomes(cfg);
+    SetupSkyVis();
     FixLightsOnFaces(bsp);
     if (light_options.visapprox.value() == visapprox_t::RAYS) {
         EstimateLightVisibility();
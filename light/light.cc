@@ -27,6 +27,9 @@
 #include <light/phong.hh>
 #include <light/bounce.hh>
 #include <light/surflight.hh> //mxd
+#include <light/lighttree.hh>
+#include <light/lightcache.hh>
+#include <light/lightindex.hh>
 #include <light/entities.hh>
 #include <light/ltface.hh>
 #include <light/write.hh> // for facesup_t
@@ -50,6 +53,7 @@
 #include <map>
 #include <set>
 #include <algorithm>
+#include <numeric>
 #include <mutex>
 #include <string>
 
@@ -292,6 +296,8 @@ light_settings::light_settings()
       novanilla{this, "novanilla", false, &experimental_group, "implies -bspxlit; don't write vanilla lighting"},
       gate{this, "gate", LIGHT_EQUAL_EPSILON, &performance_group, "cutoff lights at this brightness level"},
       sunsamples{this, "sunsamples", 64, 8, 2048, &performance_group, "set samples for _sunlight2, default 64"},
+      skyvis{this, "skyvis", 0, 0, 4096, &performance_group,
+          "trace this many fixed directions per sample for _sunlight2/_sunlight3 domes instead of one ray per dome sun; 0 = off"},
       arghradcompat{this, "arghradcompat", false, &output_group, "enable compatibility for Arghrad-specific keys"},
       nolighting{this, "nolighting", false, &output_group, "don't output main world lighting (Q2RTX)"},
       debugface{this, "debugface", std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::quiet_NaN(),
@@ -307,6 +313,8 @@ light_settings::light_settings()
           this, "lightmap_scale", 0, &experimental_group, "force change lightmap scale; vanilla engines only allow 16"},
       extra{
           this, {"extra", "extra4"}, 1, &performance_group, "supersampling; 2x2 (extra) or 4x4 (extra4) respectively"},
+      adaptiveextra{this, "adaptiveextra", 0.f, 0.f, std::numeric_limits<float>::max(), &performance_group,
+          "with -extra/-extra4, only supersample luxels whose brightness differs from a neighbour's by more than n; 0 = off"},
       emissivequality{this, "emissivequality", emissivequality_t::LOW,
           {{"LOW", emissivequality_t::LOW}, {"MEDIUM", emissivequality_t::MEDIUM}, {"HIGH", emissivequality_t::HIGH}},
           &performance_group,
@@ -316,6 +324,23 @@ light_settings::light_settings()
               {"rays", visapprox_t::RAYS}},
           &debug_group,
           "change approximate visibility algorithm. auto = choose default based on format. vis = use BSP vis data (slow but precise). rays = use sphere culling with fired rays (fast but may miss faces)"},
+      raypackets{this, "raypackets", raypackets_t::NONE,
+          {{"auto", raypackets_t::AUTO}, {"none", raypackets_t::NONE}, {"4", raypackets_t::PACKET4},
+              {"8", raypackets_t::PACKET8}, {"16", raypackets_t::PACKET16}},
+          &performance_group,
+          "trace batches of rays with embree's packet API. auto = widest packet natively supported by the CPU, none = trace rays one at a time"},
+      lighttree{this, "lighttree", false, &performance_group,
+          "use a BVH over surface lights and bounce lights to skip or merge distant emitters"},
+      lighttree_error{this, "lighttree_error", 0.25, 0.0, 1.0, &performance_group,
+          "with -lighttree, merge emitter clusters whose radius is less than this fraction of their distance; 0 = never merge"},
+      lightcache{this, "lightcache", false, &performance_group,
+          "keep each light entity's contribution to each face in a .lcache file, and only re-trace lights that changed"},
+      lightindex{this, "lightindex", false, &performance_group,
+          "use a BVH over the range of each light entity, so faces only consider the lights that can reach them"},
+      facecost{this, "facecost", false, &performance_group,
+          "estimate how long each face will take to light, and start the most expensive faces first"},
+      streamfaces{this, "streamfaces", false, &performance_group,
+          "light, post-process and encode each face in one go and free its samples straight away, to reduce peak memory use"},
       lit{this, "lit",
           [&](const std::string &, parser_base_t &, source) {
               write_litfile |= lightfile_t::lit;
@@ -652,38 +677,47 @@ static void CacheTextures(const mbsp_t &bsp)
     }
 }
 
-static void CreateLightmapSurfaces(mbsp_t *bsp)
+static void CreateFaceLightmapSurface(mbsp_t *bsp, size_t i)
 {
-    light_surfaces = std::make_unique<lightsurf_t[]>(bsp->dfaces.size());
-    light_surfaces_span = {light_surfaces.get(), light_surfaces.get() + bsp->dfaces.size()};
-    logging::funcheader();
-    logging::parallel_for(static_cast<size_t>(0), bsp->dfaces.size(), [&bsp](size_t i) {
-        auto facesup = faces_sup.empty() ? nullptr : &faces_sup[i];
-        auto facesup_decoupled = facesup_decoupled_global.empty() ? nullptr : &facesup_decoupled_global[i];
-        auto face = &bsp->dfaces[i];
-
-        /* One extra lightmap is allocated to simplify handling overflow */
-        if (!light_options.litonly.value()) {
-            // if litonly is set we need to preserve the existing lightofs
-
-            /* some surfaces don't need lightmaps */
-            if (facesup) {
-                facesup->lightofs = -1;
-                for (size_t i = 0; i < MAXLIGHTMAPSSUP; i++) {
-                    facesup->styles[i] = INVALID_LIGHTSTYLE;
-                }
-            } else {
-                face->lightofs = -1;
-                face->styles.fill(INVALID_LIGHTSTYLE_OLD);
+    auto facesup = faces_sup.empty() ? nullptr : &faces_sup[i];
+    auto facesup_decoupled = facesup_decoupled_global.empty() ? nullptr : &facesup_decoupled_global[i];
+    auto face = &bsp->dfaces[i];
 
-                if (facesup_decoupled) {
-                    facesup_decoupled->offset = -1;
-                }
+    /* One extra lightmap is allocated to simplify handling overflow */
+    if (!light_options.litonly.value()) {
+        // if litonly is set we need to preserve the existing lightofs
+
+        /* some surfaces don't need lightmaps */
+        if (facesup) {
+            facesup->lightofs = -1;
+            for (size_t i = 0; i < MAXLIGHTMAPSSUP; i++) {
+                facesup->styles[i] = INVALID_LIGHTSTYLE;
+            }
+        } else {
+            face->lightofs = -1;
+            face->styles.fill(INVALID_LIGHTSTYLE_OLD);
+
+            if (facesup_decoupled) {
+                facesup_decoupled->offset = -1;
             }
         }
+    }
 
-        light_surfaces[i] = CreateLightmapSurface(bsp, face, facesup, facesup_decoupled, light_options);
-    });
+    light_surfaces[i] = CreateLightmapSurface(bsp, face, facesup, facesup_decoupled, light_options);
+}
+
+static void AllocateLightmapSurfaces(mbsp_t *bsp)
+{
+    light_surfaces = std::make_unique<lightsurf_t[]>(bsp->dfaces.size());
+    light_surfaces_span = {light_surfaces.get(), light_surfaces.get() + bsp->dfaces.size()};
+}
+
+static void CreateLightmapSurfaces(mbsp_t *bsp)
+{
+    AllocateLightmapSurfaces(bsp);
+    logging::funcheader();
+    logging::parallel_for(
+        static_cast<size_t>(0), bsp->dfaces.size(), [&bsp](size_t i) { CreateFaceLightmapSurface(bsp, i); });
 }
 
 static void ClearLightmapSurfaces()
@@ -775,6 +809,156 @@ static void FindModelInfo(const mbsp_t *bsp)
     Q_assert(modelinfo.size() == bsp->dmodels.size());
 }
 
+/*
+ * -streamfaces: each face is created, lit, post-processed and encoded in one task,
+ * then freed, so only the faces in flight hold samples and lightmaps. tbb hands
+ * each thread a contiguous range of faces, and qbsp emits faces node by node, so
+ * neighbouring tasks work on nearby geometry.
+ */
+static void LightFacesStreamed(mbsp_t *bsp)
+{
+    AllocateLightmapSurfaces(bsp);
+
+    MakeRadiositySurfaceLights(light_options, bsp);
+    UpdateEmissiveLightSurfacesList();
+
+    // surface lights are vis culled against their face's leaves, so emitting faces are
+    // set up front, and keep everything but their samples and lightmaps once lit
+    logging::funcheader();
+    logging::parallel_for_each(EmissiveLightSurfaces(), [bsp](lightsurf_t *surf) {
+        auto vpl = std::move(surf->vpl);
+        CreateFaceLightmapSurface(bsp, surf - light_surfaces.get());
+        surf->vpl = std::move(vpl);
+    });
+
+    if (light_options.lighttree.value()) {
+        LightTree_Build(std::nullopt);
+    }
+
+    BeginEncodedLightmaps(bsp);
+
+    logging::header("Direct Lighting"); // mxd
+    logging::parallel_for(static_cast<size_t>(0), bsp->dfaces.size(), [bsp](size_t i) {
+        lightsurf_t &surf = light_surfaces[i];
+
+        if (!surf.vpl) {
+            CreateFaceLightmapSurface(bsp, i);
+        }
+
+        if (Face_IsLightmapped(bsp, &bsp->dfaces[i])) {
+#if defined(HAVE_EMBREE) && defined(__SSE2__)
+            _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+#endif
+            DirectLightFace(bsp, surf, light_options);
+
+            if (!light_options.nolighting.value()) {
+                PostProcessLightFace(bsp, surf, light_options);
+            }
+        }
+
+        EncodeLightmapSurface(bsp, i, surf);
+
+        if (surf.vpl) {
+            surf.samples = {};
+            surf.lightmapsByStyle = {};
+        } else {
+            surf = {};
+        }
+    });
+}
+
+/*
+ * -facecost: estimated cost of lighting each face, or empty to light the faces in index order
+ */
+static std::vector<float> EstimateDirectLightCosts(const mbsp_t *bsp)
+{
+    std::vector<float> costs;
+
+    if (!light_options.facecost.value()) {
+        return costs;
+    }
+
+    size_t surflight_points = 0;
+    for (const lightsurf_t *surf : emissive_light_surfaces) {
+        surflight_points += surf->vpl->points.size();
+    }
+
+    costs.resize(bsp->dfaces.size());
+    tbb::parallel_for(static_cast<size_t>(0), bsp->dfaces.size(), [&](size_t i) {
+        if (Face_IsLightmapped(bsp, &bsp->dfaces[i])) {
+            costs[i] = DirectLightFace_EstimateCost(bsp, light_surfaces[i], surflight_points);
+        }
+    });
+
+    return costs;
+}
+
+// every sample traces against the same bounce lights, so only the sample count differs
+static std::vector<float> EstimateIndirectLightCosts(const mbsp_t *bsp)
+{
+    std::vector<float> costs;
+
+    if (!light_options.facecost.value()) {
+        return costs;
+    }
+
+    costs.resize(bsp->dfaces.size());
+    for (size_t i = 0; i < bsp->dfaces.size(); i++) {
+        costs[i] = static_cast<float>(light_surfaces[i].samples.size());
+    }
+
+    return costs;
+}
+
+/*
+ * Runs `func` on each face. With `costs`, the faces are started from the most to
+ * the least expensive: each task claims the next face in that order rather than
+ * the index tbb handed it, so the expensive faces are spread over all threads
+ * instead of queueing up at the start of one thread's range, and the end of the
+ * pass is made up of cheap faces.
+ */
+template<typename Body>
+static void ParallelForFaces(const mbsp_t *bsp, const std::vector<float> &costs, const char *pass, const Body &func)
+{
+    if (costs.empty()) {
+        logging::parallel_for(static_cast<size_t>(0), bsp->dfaces.size(), func);
+        return;
+    }
+
+    std::vector<size_t> order(costs.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&costs](size_t a, size_t b) { return costs[a] > costs[b]; });
+
+    std::vector<double> seconds(costs.size());
+    std::atomic_size_t next = 0;
+
+    logging::parallel_for(static_cast<size_t>(0), order.size(), [&](size_t) {
+        const size_t i = order[next++];
+        const auto start = I_FloatTime();
+        func(i);
+        seconds[i] = (I_FloatTime() - start).count();
+    });
+
+    // report the slowest faces, to help tune the estimate
+    std::vector<size_t> slowest(order.size());
+    std::iota(slowest.begin(), slowest.end(), 0);
+    const size_t count = std::min<size_t>(10, slowest.size());
+    std::partial_sort(slowest.begin(), slowest.begin() + count, slowest.end(),
+        [&seconds](size_t a, size_t b) { return seconds[a] > seconds[b]; });
+
+    std::vector<size_t> rank(order.size());
+    for (size_t r = 0; r < order.size(); r++) {
+        rank[order[r]] = r;
+    }
+
+    logging::print(logging::flag::VERBOSE, "slowest faces in {}:\n", pass);
+    for (size_t k = 0; k < count; k++) {
+        const size_t i = slowest[k];
+        logging::print(logging::flag::VERBOSE, "    face {}: {:.3}s, estimated cost {} (started {} of {})\n", i,
+            seconds[i], costs[i], rank[i] + 1, order.size());
+    }
+}
+
 /*
  * =============
  *  LightWorld
@@ -830,64 +1014,95 @@ static void LightWorld(bspdata_t *bspdata, const fs::path &source, bool forcedsc
 
     CalculateVertexNormals(&bsp);
 
-    // create lightmap surfaces
-    CreateLightmapSurfaces(&bsp);
-
     const bool bouncerequired =
         light_options.bounce.value() &&
         (light_options.debugmode == debugmodes::none || light_options.debugmode == debugmodes::bounce ||
             light_options.debugmode == debugmodes::bouncelights); // mxd
 
-    MakeRadiositySurfaceLights(light_options, &bsp);
-    UpdateEmissiveLightSurfacesList();
+    bool streamfaces = light_options.streamfaces.value();
 
-    logging::header("Direct Lighting"); // mxd
-    logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
-        if (Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
+    if (streamfaces && (bouncerequired || light_options.litonly.value() || light_options.lightcache.value())) {
+        logging::print("WARNING: -streamfaces can't be used with bounce, -litonly or -lightcache, ignoring\n");
+        streamfaces = false;
+    }
+
+    if (light_options.lightindex.value()) {
+        LightIndex_Build();
+    }
+
+    if (streamfaces) {
+        LightFacesStreamed(&bsp);
+    } else {
+        // create lightmap surfaces
+        CreateLightmapSurfaces(&bsp);
+
+        MakeRadiositySurfaceLights(light_options, &bsp);
+        UpdateEmissiveLightSurfacesList();
+
+        if (light_options.lighttree.value()) {
+            LightTree_Build(std::nullopt);
+        }
+
+        if (light_options.lightcache.value()) {
+            LightCache_Init(&bsp, bspdata->bspx.entries, fs::path(source).replace_extension("lcache"));
+        }
+
+        logging::header("Direct Lighting"); // mxd
+        ParallelForFaces(&bsp, EstimateDirectLightCosts(&bsp), "direct lighting", [&bsp](size_t i) {
+            if (Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
-            _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+                _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 #endif
-            DirectLightFace(&bsp, light_surfaces[i], light_options);
-        }
-    });
+                DirectLightFace(&bsp, light_surfaces[i], light_options);
+            }
+        });
 
-    if (bouncerequired && !light_options.nolighting.value()) {
+        LightCache_Save();
 
-        for (size_t i = 0; i < light_options.bounce.value(); i++) {
+        if (bouncerequired && !light_options.nolighting.value()) {
 
-            if (!MakeBounceLights(light_options, &bsp, i)) {
-                logging::header("No bounces; indirect lighting halted");
-                break;
-            }
-            UpdateEmissiveLightSurfacesList();
+            for (size_t i = 0; i < light_options.bounce.value(); i++) {
 
-            logging::header(fmt::format("Indirect Lighting (pass {0})", i).c_str()); // mxd
+                if (!MakeBounceLights(light_options, &bsp, i)) {
+                    logging::header("No bounces; indirect lighting halted");
+                    break;
+                }
+                UpdateEmissiveLightSurfacesList();
+
+                if (light_options.lighttree.value()) {
+                    LightTree_Build(i);
+                }
 
-            logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [i, &bsp](size_t f) {
-                if (Face_IsLightmapped(&bsp, &bsp.dfaces[f])) {
+                logging::header(fmt::format("Indirect Lighting (pass {0})", i).c_str()); // mxd
+
+                ParallelForFaces(&bsp, EstimateIndirectLightCosts(&bsp), "indirect lighting", [i, &bsp](size_t f) {
+                    if (Face_IsLightmapped(&bsp, &bsp.dfaces[f])) {
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
-                    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+                        _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 #endif
 
-                    IndirectLightFace(&bsp, light_surfaces[f], light_options, i);
-                }
-            });
+                        IndirectLightFace(&bsp, light_surfaces[f], light_options, i);
+                    }
+                });
+            }
         }
-    }
 
-    if (!light_options.nolighting.value()) {
-        logging::header("Post-Processing"); // mxd
-        logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
-            if (Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
+        if (!light_options.nolighting.value()) {
+            logging::header("Post-Processing"); // mxd
+            logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
+                if (Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
-                _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+                    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 #endif
 
-                PostProcessLightFace(&bsp, light_surfaces[i], light_options);
-            }
-        });
+                    PostProcessLightFace(&bsp, light_surfaces[i], light_options);
+                }
+            });
+        }
     }
 
+    LightIndex_PrintStats();
+
     SaveLightmapSurfaces(bspdata, source);
 
     // kill this stuff if its somehow found.
@@ -1236,6 +1451,9 @@ void light_reset()
     ResetLtFace();
     ResetPhong();
     ResetSurflight();
+    ResetLightTree();
+    ResetLightCache();
+    ResetLightIndex();
     ResetEmbree();
 
     light_options.reset();
@@ -0,0 +1,511 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/lightcache.hh>
+
+#include <light/entities.hh>
+#include <light/light.hh>
+
+#include <common/bspfile.hh>
+#include <common/cmdlib.hh>
+#include <common/log.hh>
+
+#include <atomic>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+
+constexpr uint32_t LIGHT_CACHE_VERSION = ('L' << 24 | 'C' << 16 | 'H' << 8 | '2');
+
+struct dlightcache_t
+{
+    uint32_t version;
+    // hash of the BSP geometry and the settings; see LightCache_Init
+    uint64_t key;
+    uint32_t numfaces;
+    uint32_t numlights;
+
+    auto stream_data() { return std::tie(version, key, numfaces, numlights); }
+};
+
+struct lightcache_face_t
+{
+    uint32_t numsamples = 0;
+    // light identity -> contribution. lights that don't reach the face have no entry
+    std::unordered_map<uint64_t, std::vector<lightcache_style_t>> lights;
+};
+
+static bool cache_enabled = false;
+static fs::path cache_path;
+static uint64_t cache_key = 0;
+static std::unordered_map<const light_t *, uint64_t> light_keys;
+// lights whose contributions to every face were loaded from the cache file
+static std::unordered_set<uint64_t> cached_lights;
+static std::vector<lightcache_face_t> cache_faces;
+// faces LightCache_Store was given a contribution for, from the lighting threads
+static std::atomic<size_t> faces_traced = 0;
+
+void ResetLightCache()
+{
+    cache_enabled = false;
+    cache_path.clear();
+    cache_key = 0;
+    light_keys.clear();
+    cached_lights.clear();
+    cache_faces.clear();
+    faces_traced = 0;
+}
+
+bool LightCache_Enabled()
+{
+    return cache_enabled;
+}
+
+namespace
+{
+// 64-bit FNV-1a; only needs to be stable between runs, not cryptographic
+struct hasher_t
+{
+    uint64_t value = 0xcbf29ce484222325ull;
+
+    void bytes(const void *data, size_t size)
+    {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+
+        for (size_t i = 0; i < size; i++) {
+            value ^= p[i];
+            value *= 0x100000001b3ull;
+        }
+    }
+
+    template<typename T>
+    std::enable_if_t<std::is_arithmetic_v<T>> operator()(const T &v)
+    {
+        bytes(&v, sizeof(v));
+    }
+
+    template<typename T, size_t N>
+    void operator()(const qvec<T, N> &v)
+    {
+        for (size_t i = 0; i < N; i++) {
+            (*this)(v[i]);
+        }
+    }
+
+    void operator()(const std::string &s)
+    {
+        (*this)(s.size());
+        bytes(s.data(), s.size());
+    }
+};
+} // namespace
+
+static uint64_t HashString(const std::string &s)
+{
+    hasher_t h;
+    h(s);
+    return h.value;
+}
+
+/**
+ * Order independent hash of the settings that can affect lighting. settings are
+ * stored in a pointer-ordered set, so the individual hashes are combined with xor.
+ */
+static uint64_t HashSettings(const settings::setting_container &container)
+{
+    uint64_t result = 0;
+
+    for (const settings::setting_base *setting : container) {
+        const settings::setting_group *group = setting->group();
+
+        if (group == &settings::logging_group || group == &settings::output_group ||
+            group == &settings::postprocessing_group) {
+            continue;
+        }
+        if (setting->primary_name() == "threads" || setting->primary_name() == "lowpriority") {
+            continue;
+        }
+
+        result ^= HashString(setting->primary_name() + "=" + setting->string_value());
+    }
+
+    return result;
+}
+
+static uint64_t HashEntDict(const entdict_t &dict)
+{
+    hasher_t h;
+
+    for (const auto &[key, value] : dict) {
+        h(key);
+        h(value);
+    }
+
+    return h.value;
+}
+
+/**
+ * Everything in the BSP that can change what a ray hits or where the samples
+ * are. Face numbers and lightmap sizes are only stable as long as these are,
+ * so this also keys the per-face data. Lighting, styles and the entity lump
+ * are left out; entities are covered by the light identities instead.
+ */
+static uint64_t HashBSPGeometry(const mbsp_t *bsp, const bspxentries_t &bspx)
+{
+    hasher_t h;
+
+    for (const qvec3f &v : bsp->dvertexes) {
+        h(v);
+    }
+    for (const dplane_t &plane : bsp->dplanes) {
+        h(plane.normal);
+        h(plane.dist);
+    }
+    for (const bsp2_dedge_t &edge : bsp->dedges) {
+        h(edge[0]);
+        h(edge[1]);
+    }
+    for (const int32_t surfedge : bsp->dsurfedges) {
+        h(surfedge);
+    }
+    for (const mface_t &face : bsp->dfaces) {
+        h(face.planenum);
+        h(face.side);
+        h(face.firstedge);
+        h(face.numedges);
+        h(face.texinfo);
+    }
+    for (const mtexinfo_t &texinfo : bsp->texinfo) {
+        for (size_t i = 0; i < 2; i++) {
+            for (size_t j = 0; j < 4; j++) {
+                h(texinfo.vecs.at(i, j));
+            }
+        }
+        h(static_cast<int32_t>(texinfo.flags.native_q1));
+        h(static_cast<int32_t>(texinfo.flags.native_q2));
+        h(texinfo.miptex);
+        h(texinfo.value);
+        h(texinfo.texturename);
+    }
+    for (const auto &miptex : bsp->dtex.textures) {
+        h(miptex.name);
+    }
+    for (const bsp2_dnode_t &node : bsp->dnodes) {
+        h(node.planenum);
+        h(node.children[0]);
+        h(node.children[1]);
+    }
+    for (const mleaf_t &leaf : bsp->dleafs) {
+        h(leaf.contents);
+    }
+    for (const dmodelh2_t &model : bsp->dmodels) {
+        h(model.firstface);
+        h(model.numfaces);
+        h(model.headnode[0]);
+    }
+
+    // lightmap sampling: per-face scales, decoupled lightmaps and supersampling
+    for (const char *lump : {"LMSHIFT", "DECOUPLED_LM"}) {
+        if (auto it = bspx.find(lump); it != bspx.end()) {
+            h(std::string(lump));
+            h(it->second.size());
+            h.bytes(it->second.data(), it->second.size());
+        }
+    }
+    h(light_options.extra.value());
+    h(light_options.world_units_per_luxel.value());
+    h(light_options.lmshift.value());
+    for (const lightsurf_t &surf : LightSurfaces()) {
+        h(surf.lightmapscale);
+        h(surf.samples.size());
+    }
+
+    return h.value;
+}
+
+static uint64_t LightKey(const light_t &light)
+{
+    hasher_t h;
+
+    h(HashSettings(light));
+    h(light.origin.value());
+    h(light.spotvec);
+    h(light.generated);
+    if (light.epairs) {
+        h(HashEntDict(*light.epairs));
+    }
+
+    return h.value;
+}
+
+// forgets what LoadLightCache loaded before finding out the file can't be used
+static void DiscardLoadedCache()
+{
+    cached_lights.clear();
+    for (lightcache_face_t &face : cache_faces) {
+        face.lights.clear();
+    }
+}
+
+static bool LoadLightCache(const mbsp_t *bsp)
+{
+    if (!fs::exists(cache_path)) {
+        return false;
+    }
+
+    std::ifstream in(cache_path, std::ios_base::in | std::ios_base::binary);
+    in >> endianness<std::endian::little>;
+
+    dlightcache_t header;
+    in >= header;
+
+    if (!in || header.version != LIGHT_CACHE_VERSION) {
+        logging::print("Light cache {} is from a different version, will be overwritten\n", cache_path);
+        return false;
+    }
+    if (header.key != cache_key || header.numfaces != bsp->dfaces.size()) {
+        logging::print("Light cache {} is out of date, will be overwritten\n", cache_path);
+        return false;
+    }
+
+    std::unordered_set<uint64_t> current_lights;
+    for (const auto &[light, key] : light_keys) {
+        current_lights.insert(key);
+    }
+
+    // only keep lights that are still in the map
+    for (uint32_t i = 0; i < header.numlights; i++) {
+        uint64_t key;
+        in >= key;
+
+        if (current_lights.count(key)) {
+            cached_lights.insert(key);
+        }
+    }
+
+    for (uint32_t f = 0; f < header.numfaces; f++) {
+        lightcache_face_t &face = cache_faces[f];
+        uint32_t numsamples, numentries;
+        in >= numsamples >= numentries;
+
+        if (!in) {
+            break;
+        }
+        if (numsamples != face.numsamples) {
+            logging::print("Light cache {} doesn't match the lightmap surfaces, will be overwritten\n", cache_path);
+            DiscardLoadedCache();
+            return false;
+        }
+
+        for (uint32_t e = 0; e < numentries; e++) {
+            uint64_t key;
+            uint32_t numstyles;
+            in >= key >= numstyles;
+
+            std::vector<lightcache_style_t> styles(numstyles);
+
+            for (lightcache_style_t &style : styles) {
+                in >= style.style >= style.bounce_color;
+
+                style.samples.resize(face.numsamples);
+                for (lightsample_t &sample : style.samples) {
+                    in >= sample.color;
+                }
+
+                if (light_options.write_luxfile) {
+                    style.directions.resize(face.numsamples);
+                    for (qvec3f &direction : style.directions) {
+                        in >= direction;
+                    }
+                }
+            }
+
+            if (cached_lights.count(key)) {
+                face.lights.emplace(key, std::move(styles));
+            }
+        }
+    }
+
+    if (!in) {
+        logging::print("Light cache {} is truncated, will be overwritten\n", cache_path);
+        DiscardLoadedCache();
+        return false;
+    }
+
+    return true;
+}
+
+void LightCache_Init(const mbsp_t *bsp, const bspxentries_t &bspx, const fs::path &path)
+{
+    logging::funcheader();
+
+    ResetLightCache();
+
+    if (light_options.extra.value() > 1 && light_options.adaptiveextra.value() > 0) {
+        logging::print("WARNING: -lightcache can't be used with -adaptiveextra, ignoring\n");
+        return;
+    }
+
+    cache_enabled = true;
+    cache_path = path;
+    cache_key = HashBSPGeometry(bsp, bspx);
+    cache_key ^= HashSettings(light_options) * 0x9e3779b97f4a7c15ull;
+    // the lux options are output settings, but decide whether directions are stored
+    if (light_options.write_luxfile) {
+        cache_key = ~cache_key;
+    }
+    // bmodel entity keys (_shadow, _switchableshadow, etc.) affect occlusion
+    for (const entdict_t &dict : GetEntdicts()) {
+        if (!dict.get("model").empty()) {
+            cache_key ^= HashEntDict(dict);
+        }
+    }
+
+    for (const auto &light : GetLights()) {
+        light_keys[light.get()] = LightKey(*light);
+    }
+
+    cache_faces.resize(bsp->dfaces.size());
+    const auto &surfaces = LightSurfaces();
+    for (size_t i = 0; i < cache_faces.size() && i < surfaces.size(); i++) {
+        cache_faces[i].numsamples = surfaces[i].samples.size();
+    }
+
+    if (LoadLightCache(bsp)) {
+        logging::print(logging::flag::STAT, "     {:8} of {} lights loaded from {}\n", cached_lights.size(),
+            light_keys.size(), cache_path);
+    }
+}
+
+const std::vector<lightcache_style_t> *LightCache_Find(int facenum, const light_t *light)
+{
+    static const std::vector<lightcache_style_t> no_contribution;
+
+    const uint64_t key = light_keys.at(light);
+
+    if (!cached_lights.count(key)) {
+        return nullptr;
+    }
+
+    const lightcache_face_t &face = cache_faces[facenum];
+
+    if (auto it = face.lights.find(key); it != face.lights.end()) {
+        return &it->second;
+    }
+
+    return &no_contribution;
+}
+
+void LightCache_Store(int facenum, const light_t *light, std::vector<lightcache_style_t> contribution)
+{
+    if (contribution.empty()) {
+        return;
+    }
+
+    cache_faces[facenum].lights[light_keys.at(light)] = std::move(contribution);
+    faces_traced++;
+}
+
+void LightCache_Save()
+{
+    if (!cache_enabled) {
+        return;
+    }
+
+    logging::funcheader();
+
+    std::unordered_set<uint64_t> current_lights;
+    for (const auto &[light, key] : light_keys) {
+        current_lights.insert(key);
+    }
+
+    const lightcache_stats_t stats = LightCache_Stats();
+    logging::print(logging::flag::STAT, "     {:8} faces lit by the {} lights that weren't cached\n", stats.faces_traced,
+        stats.lights_traced);
+
+    const fs::path tmp_path = fs::path(cache_path).concat(".tmp");
+
+    {
+        std::ofstream out(tmp_path, std::ios_base::out | std::ios_base::binary);
+        out << endianness<std::endian::little>;
+
+        dlightcache_t header;
+        header.version = LIGHT_CACHE_VERSION;
+        header.key = cache_key;
+        header.numfaces = cache_faces.size();
+        header.numlights = current_lights.size();
+
+        out <= header;
+
+        for (const uint64_t key : current_lights) {
+            out <= key;
+        }
+
+        for (const lightcache_face_t &face : cache_faces) {
+            uint32_t numentries = 0;
+            for (const auto &[key, styles] : face.lights) {
+                numentries += current_lights.count(key);
+            }
+
+            out <= face.numsamples <= numentries;
+
+            for (const auto &[key, styles] : face.lights) {
+                if (!current_lights.count(key)) {
+                    continue;
+                }
+
+                out <= key <= static_cast<uint32_t>(styles.size());
+
+                for (const lightcache_style_t &style : styles) {
+                    out <= style.style <= style.bounce_color;
+
+                    for (const lightsample_t &sample : style.samples) {
+                        out <= sample.color;
+                    }
+
+                    for (const qvec3f &direction : style.directions) {
+                        out <= direction;
+                    }
+                }
+            }
+        }
+    }
+
+    std::error_code ec;
+    fs::rename(tmp_path, cache_path, ec);
+    if (ec) {
+        FError("error renaming light cache ({})", ec.message());
+    }
+}
+
+lightcache_stats_t LightCache_Stats()
+{
+    lightcache_stats_t stats;
+
+    for (const auto &[light, key] : light_keys) {
+        if (cached_lights.count(key)) {
+            stats.lights_loaded++;
+        } else {
+            stats.lights_traced++;
+        }
+    }
+    stats.faces_traced = faces_traced;
+
+    return stats;
+}
@@ -0,0 +1,217 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/lightindex.hh>
+
+#include <light/entities.hh>
+#include <light/light.hh>
+#include <light/ltface.hh>
+
+#include <common/log.hh>
+#include <common/parallel.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+// a light in the BVH
+struct lightindex_light_t
+{
+    // index into GetLights()
+    uint32_t index;
+    qvec3f origin;
+    float radius;
+};
+
+static bool index_built = false;
+static std::vector<lightindex_light_t> index_lights;
+static std::vector<lightindex_node_t> index_nodes;
+// indices into GetLights() that every query returns
+static std::vector<uint32_t> unbounded_lights;
+
+static std::atomic_size_t stat_queries, stat_candidates, stat_max_candidates;
+
+// leaves hold at most this many lights
+static constexpr uint32_t MAX_LIGHTS_PER_LEAF = 4;
+
+void ResetLightIndex()
+{
+    index_built = false;
+    index_lights.clear();
+    index_nodes.clear();
+    unbounded_lights.clear();
+    stat_queries = 0;
+    stat_candidates = 0;
+    stat_max_candidates = 0;
+}
+
+bool LightIndex_Enabled()
+{
+    return index_built;
+}
+
+static aabb3f SphereBounds(const qvec3f &origin, float radius)
+{
+    return aabb3f(origin).grow(qvec3f(radius));
+}
+
+static int32_t BuildNode_r(uint32_t first, uint32_t count)
+{
+    const int32_t index = static_cast<int32_t>(index_nodes.size());
+    index_nodes.emplace_back();
+
+    aabb3f bounds, centroid_bounds;
+
+    for (uint32_t i = first; i < first + count; i++) {
+        const lightindex_light_t &light = index_lights[i];
+
+        bounds += SphereBounds(light.origin, light.radius);
+        centroid_bounds += light.origin;
+    }
+
+    {
+        lightindex_node_t &node = index_nodes[index];
+        node.bounds = bounds;
+        node.first_light = first;
+        node.num_lights = count;
+    }
+
+    if (count > MAX_LIGHTS_PER_LEAF) {
+        // median split along the longest axis of the light origins
+        const qvec3f size = centroid_bounds.size();
+        const int axis = (size[0] >= size[1] && size[0] >= size[2]) ? 0 : (size[1] >= size[2]) ? 1 : 2;
+
+        if (size[axis] > 0) {
+            const uint32_t mid = first + count / 2;
+
+            std::nth_element(index_lights.begin() + first, index_lights.begin() + mid,
+                index_lights.begin() + first + count,
+                [axis](const lightindex_light_t &a, const lightindex_light_t &b) {
+                    return a.origin[axis] < b.origin[axis];
+                });
+
+            // NOTE: recursion can reallocate index_nodes, so don't hold a reference across it
+            const int32_t front = BuildNode_r(first, mid - first);
+            const int32_t back = BuildNode_r(mid, first + count - mid);
+
+            index_nodes[index].children[0] = front;
+            index_nodes[index].children[1] = back;
+        }
+    }
+
+    return index;
+}
+
+void LightIndex_Build()
+{
+    logging::funcheader();
+
+    ResetLightIndex();
+
+    const auto &lights = GetLights();
+    std::vector<float> radii(lights.size());
+
+    logging::parallel_for(static_cast<size_t>(0), lights.size(),
+        [&](size_t i) { radii[i] = LightInfluenceRadius(lights[i].get()); });
+
+    for (uint32_t i = 0; i < lights.size(); i++) {
+        if (std::isfinite(radii[i])) {
+            index_lights.push_back({i, lights[i]->origin.value(), radii[i]});
+        } else {
+            unbounded_lights.push_back(i);
+        }
+    }
+
+    if (!index_lights.empty()) {
+        index_nodes.reserve(2 * (index_lights.size() / MAX_LIGHTS_PER_LEAF + 1));
+        BuildNode_r(0, static_cast<uint32_t>(index_lights.size()));
+    }
+
+    index_built = true;
+
+    logging::print(logging::flag::STAT, "     {:8} lights indexed\n", index_lights.size());
+    logging::print(logging::flag::STAT, "     {:8} lights with unbounded range\n", unbounded_lights.size());
+    logging::print(logging::flag::STAT, "     {:8} light index nodes\n", index_nodes.size());
+}
+
+std::vector<const light_t *> LightIndex_Query(const qvec3f &origin, float radius)
+{
+    std::vector<uint32_t> found = unbounded_lights;
+
+    if (!index_nodes.empty()) {
+        const aabb3f query_bounds = SphereBounds(origin, radius);
+
+        int32_t stack[64];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size) {
+            const lightindex_node_t &node = index_nodes[stack[--stack_size]];
+
+            if (node.bounds.disjoint(query_bounds)) {
+                continue;
+            }
+
+            if (!node.is_leaf()) {
+                stack[stack_size++] = node.children[0];
+                stack[stack_size++] = node.children[1];
+                continue;
+            }
+
+            for (uint32_t i = node.first_light; i < node.first_light + node.num_lights; i++) {
+                const lightindex_light_t &light = index_lights[i];
+                const float reach = light.radius + radius;
+
+                // same test as CullLight: can't cull when the light is in reach of the surface's bounding sphere
+                if (qv::distance2(light.origin, origin) <= reach * reach) {
+                    found.push_back(light.index);
+                }
+            }
+        }
+    }
+
+    // lights are accumulated in this order, keep it the same as without the index
+    std::sort(found.begin(), found.end());
+
+    const auto &lights = GetLights();
+    std::vector<const light_t *> result;
+    result.reserve(found.size());
+    for (const uint32_t i : found) {
+        result.push_back(lights[i].get());
+    }
+
+    stat_queries++;
+    stat_candidates += result.size();
+    size_t prev_max = stat_max_candidates;
+    while (prev_max < result.size() && !stat_max_candidates.compare_exchange_weak(prev_max, result.size())) { }
+
+    return result;
+}
+
+void LightIndex_PrintStats()
+{
+    if (!index_built || !stat_queries) {
+        return;
+    }
+
+    logging::print(logging::flag::STAT, "     {:8} light index queries\n", stat_queries.load());
+    logging::print(logging::flag::STAT, "     {:8.1f} lights considered per query (of {})\n",
+        static_cast<double>(stat_candidates) / stat_queries, GetLights().size());
+    logging::print(logging::flag::STAT, "     {:8} lights considered by the worst query\n", stat_max_candidates.load());
+}
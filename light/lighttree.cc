@@ -0,0 +1,242 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/lighttree.hh>
+
+#include <light/light.hh>
+
+#include <common/log.hh>
+
+#include <tbb/parallel_for_each.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <tuple>
+
+static std::vector<lighttree_t> light_trees;
+static std::optional<size_t> light_trees_bounce_level;
+
+// leaves hold at most this many emitters
+static constexpr uint32_t MAX_EMITTERS_PER_LEAF = 4;
+
+// directional emitters are only collapsed into an aggregate if all of their
+// normals are within ~25 degrees of the (power weighted) average normal
+static constexpr float AGGREGATE_MIN_NORMAL_DOT = 0.9f;
+
+void ResetLightTree()
+{
+    light_trees.clear();
+    light_trees_bounce_level = std::nullopt;
+}
+
+const std::vector<lighttree_t> &LightTrees()
+{
+    return light_trees;
+}
+
+std::optional<size_t> LightTreesBounceLevel()
+{
+    return light_trees_bounce_level;
+}
+
+static void MakeAggregate(const lighttree_t &tree, lighttree_node_t &node)
+{
+    if (node.power <= 0) {
+        return;
+    }
+
+    const auto first = tree.emitters.begin() + node.first_emitter;
+    const auto last = first + node.num_emitters;
+
+    qvec3f weighted_center{}, weighted_color{}, normal_sum{};
+    float totalintensity = 0;
+
+    for (auto it = first; it != last; ++it) {
+        weighted_center += it->bounds.centroid() * it->power;
+        weighted_color += it->style->color * it->power;
+        normal_sum += it->surf->vpl->surfnormal * it->power;
+        totalintensity += it->style->totalintensity;
+    }
+
+    const qvec3f center = weighted_center / node.power;
+    qvec3f normal = qv::normalize(normal_sum);
+
+    if (!tree.omnidirectional) {
+        for (auto it = first; it != last; ++it) {
+            if (qv::dot(it->surf->vpl->surfnormal, normal) < AGGREGATE_MIN_NORMAL_DOT) {
+                return;
+            }
+        }
+    }
+
+    // use a real emitter point rather than the centroid, which could be inside a wall
+    const lightsurf_t *representative = nullptr;
+    qvec3f representative_point{};
+    float best_dist2 = std::numeric_limits<float>::max();
+
+    for (auto it = first; it != last; ++it) {
+        for (const qvec3f &pt : it->surf->vpl->points) {
+            const float dist2 = qv::distance2(pt, center);
+
+            if (dist2 < best_dist2) {
+                best_dist2 = dist2;
+                representative = it->surf;
+                representative_point = pt;
+            }
+        }
+    }
+
+    if (tree.omnidirectional) {
+        // not used by GetSurfaceLighting, but keep it a valid unit vector
+        normal = representative->vpl->surfnormal;
+    }
+
+    surfacelight_t &aggregate = node.aggregate.emplace();
+    aggregate.pos = representative_point;
+    aggregate.surfnormal = normal;
+    aggregate.points = {representative_point};
+    aggregate.points_before_culling = 1;
+    aggregate.bounds = node.bounds;
+
+    // style, bounce_level, omnidirectional, rescale and atten are shared by the whole tree
+    surfacelight_t::per_style_t &style = aggregate.styles.emplace_back(*first->style);
+    style.intensity = node.power;
+    style.totalintensity = totalintensity;
+    style.color = weighted_color / node.power;
+
+    for (auto it = first; it != last; ++it) {
+        node.leaves.insert(node.leaves.end(), it->surf->leaves.begin(), it->surf->leaves.end());
+    }
+    std::sort(node.leaves.begin(), node.leaves.end());
+    node.leaves.erase(std::unique(node.leaves.begin(), node.leaves.end()), node.leaves.end());
+}
+
+static int32_t BuildNode_r(lighttree_t &tree, uint32_t first, uint32_t count)
+{
+    const int32_t index = static_cast<int32_t>(tree.nodes.size());
+    tree.nodes.emplace_back();
+
+    aabb3f bounds, centroid_bounds;
+    float power = 0, max_color = 0;
+
+    for (uint32_t i = first; i < first + count; i++) {
+        const lighttree_emitter_t &emitter = tree.emitters[i];
+
+        bounds += emitter.bounds;
+        centroid_bounds += emitter.bounds.centroid();
+        power += emitter.power;
+        max_color = std::max(max_color, qv::max(emitter.style->color));
+    }
+
+    {
+        lighttree_node_t &node = tree.nodes[index];
+        node.bounds = bounds;
+        node.power = power;
+        node.max_color = max_color;
+        node.first_emitter = first;
+        node.num_emitters = count;
+    }
+
+    if (count > MAX_EMITTERS_PER_LEAF) {
+        // median split along the longest axis of the emitter centroids
+        const qvec3f size = centroid_bounds.size();
+        const int axis = (size[0] >= size[1] && size[0] >= size[2]) ? 0 : (size[1] >= size[2]) ? 1 : 2;
+
+        if (size[axis] > 0) {
+            const uint32_t mid = first + count / 2;
+
+            std::nth_element(tree.emitters.begin() + first, tree.emitters.begin() + mid,
+                tree.emitters.begin() + first + count,
+                [axis](const lighttree_emitter_t &a, const lighttree_emitter_t &b) {
+                    return a.bounds.centroid()[axis] < b.bounds.centroid()[axis];
+                });
+
+            // NOTE: recursion can reallocate tree.nodes, so don't hold a reference across it
+            const int32_t front = BuildNode_r(tree, first, mid - first);
+            const int32_t back = BuildNode_r(tree, mid, first + count - mid);
+
+            tree.nodes[index].children[0] = front;
+            tree.nodes[index].children[1] = back;
+        }
+    }
+
+    if (count > 1) {
+        MakeAggregate(tree, tree.nodes[index]);
+    }
+
+    return index;
+}
+
+void LightTree_Build(std::optional<size_t> bounce_level)
+{
+    logging::funcheader();
+
+    ResetLightTree();
+    light_trees_bounce_level = bounce_level;
+
+    // emitters can only be aggregated with others that get lit the same way
+    std::map<std::tuple<int32_t, bool, bool, float>, size_t> tree_for_key;
+
+    for (const lightsurf_t *surf : EmissiveLightSurfaces()) {
+        const surfacelight_t &vpl = *surf->vpl;
+
+        if (vpl.points.empty()) {
+            continue;
+        }
+
+        const aabb3f bounds(vpl.points.begin(), vpl.points.end());
+
+        for (const auto &style : vpl.styles) {
+            if (style.bounce_level != bounce_level) {
+                continue;
+            }
+
+            const auto key = std::make_tuple(style.style, style.omnidirectional, style.rescale, style.atten);
+            auto [it, inserted] = tree_for_key.try_emplace(key, light_trees.size());
+
+            if (inserted) {
+                light_trees.push_back(lighttree_t{.style = style.style,
+                    .omnidirectional = style.omnidirectional,
+                    .rescale = style.rescale,
+                    .atten = style.atten});
+            }
+
+            light_trees[it->second].emitters.push_back(lighttree_emitter_t{.surf = surf,
+                .style = &style,
+                .bounds = bounds,
+                .power = style.intensity * static_cast<float>(vpl.points.size())});
+        }
+    }
+
+    tbb::parallel_for_each(light_trees, [](lighttree_t &tree) {
+        tree.nodes.reserve(2 * (tree.emitters.size() / MAX_EMITTERS_PER_LEAF + 1));
+        BuildNode_r(tree, 0, static_cast<uint32_t>(tree.emitters.size()));
+    });
+
+    size_t num_emitters = 0, num_nodes = 0;
+    for (const lighttree_t &tree : light_trees) {
+        num_emitters += tree.emitters.size();
+        num_nodes += tree.nodes.size();
+    }
+
+    logging::print(logging::flag::STAT, "     {:8} emitters\n", num_emitters);
+    logging::print(logging::flag::STAT, "     {:8} light trees\n", light_trees.size());
+    logging::print(logging::flag::STAT, "     {:8} light tree nodes\n", num_nodes);
+}
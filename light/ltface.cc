@@ -23,6 +23,9 @@
 #include <light/trace_embree.hh>
 #include <light/phong.hh>
 #include <light/surflight.hh> //mxd
+#include <light/lighttree.hh>
+#include <light/lightcache.hh>
+#include <light/lightindex.hh>
 #include <light/entities.hh>
 #include <light/lightgrid.hh>
 #include <light/trace.hh>
@@ -735,9 +738,15 @@ static void Lightmap_AllocOrClear(lightmap_t *lightmap, const lightsurf_t *light
     if (!lightmap->samples.size()) {
         /* first use of this lightmap, allocate the storage for it. */
         lightmap->samples.resize(lightsurf->samples.size());
+        if (light_options.write_luxfile) {
+            lightmap->directions.resize(lightsurf->samples.size());
+        }
     } else if (lightmap->style != INVALID_LIGHTSTYLE) {
         /* clear only the data that is going to be merged to it. there's no point clearing more */
         std::fill_n(lightmap->samples.begin(), lightsurf->samples.size(), lightsample_t{});
+        if (!lightmap->directions.empty()) {
+            std::fill_n(lightmap->directions.begin(), lightsurf->samples.size(), qvec3f{});
+        }
         lightmap->bounce_color = {};
     }
 }
@@ -889,6 +898,41 @@ static float GetLightValue(const settings::worldspawn_keys &cfg, const light_t *
         entity->atten.value(), dist, LF_SCALE);
 }
 
+/*
+ * Distance past which the light value is at most -gate, so CullLight rejects
+ * `entity` for any surface whose bounding sphere is further away than this.
+ * Infinity if the light never fades out (infinite and localmin formulas, or
+ * no -gate with an inverse falloff).
+ */
+float LightInfluenceRadius(const light_t *entity)
+{
+    const settings::worldspawn_keys &cfg = light_options;
+    const float gate = light_options.gate.value();
+
+    auto culled = [&](float dist) { return fabs(GetLightValue(cfg, entity, dist)) <= gate; };
+
+    // every formula falls off monotonically, so find a distance where the light
+    // is culled, then bisect down towards the closest one
+    float lo = 0, hi = 1;
+    while (!culled(hi)) {
+        lo = hi;
+        hi *= 2;
+        if (hi > 1e8f) {
+            return std::numeric_limits<float>::infinity();
+        }
+    }
+    for (int i = 0; i < 24; i++) {
+        const float mid = (lo + hi) * 0.5f;
+        if (culled(mid)) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+
+    return hi;
+}
+
 static float GetLightValueWithAngle(const settings::worldspawn_keys &cfg, const light_t *entity, const qvec3f &surfnorm,
     bool use_surfnorm, const qvec3f &surfpointToLightDir, float dist, bool twosided)
 {
@@ -1195,26 +1239,19 @@ static bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> &pvs, co
 }
 
 /*
- * ================
- * LightFace_Entity
- * ================
+ * Whether LightFace_Entity can skip `entity` for this face without tracing anything
  */
-static void LightFace_Entity(
-    const mbsp_t *bsp, const light_t *entity, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+static bool LightFace_EntityCulled(const mbsp_t *bsp, const light_t *entity, const lightsurf_t *lightsurf)
 {
-    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
-    const modelinfo_t *modelinfo = lightsurf->modelinfo;
-    const qplane3f &plane = lightsurf->plane;
-
     /* vis cull */
     if (light_options.visapprox.value() == visapprox_t::VIS &&
         entity->light_channel_mask.value() == CHANNEL_MASK_DEFAULT &&
         entity->shadow_channel_mask.value() == CHANNEL_MASK_DEFAULT &&
         VisCullEntity(bsp, lightsurf->pvs, entity->leaf)) {
-        return;
+        return true;
     }
 
-    const float planedist = plane.distance_to(entity->origin.value());
+    const float planedist = lightsurf->plane.distance_to(entity->origin.value());
 
     /* don't bother with lights behind the surface.
 
@@ -1224,16 +1261,34 @@ static void LightFace_Entity(
        test in the curved case.
     */
     if (planedist < 0 && !entity->bleed.value() && !lightsurf->curved && !lightsurf->twosided) {
-        return;
+        return true;
     }
 
     /* sphere cull surface and light */
     if (CullLight(entity, lightsurf)) {
-        return;
+        return true;
     }
 
     // check lighting channels
     if (!(entity->light_channel_mask.value() & lightsurf->object_channel_mask)) {
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * ================
+ * LightFace_Entity
+ * ================
+ */
+static void LightFace_Entity(
+    const mbsp_t *bsp, const light_t *entity, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
+    const modelinfo_t *modelinfo = lightsurf->modelinfo;
+
+    if (LightFace_EntityCulled(bsp, entity, lightsurf)) {
         return;
     }
 
@@ -1320,7 +1375,7 @@ static void LightFace_Entity(
 
         sample.color += rs.getPushedRayColor(j);
         cached_lightmap->bounce_color += rs.getPushedRayColor(j);
-        sample.direction += ray.normalcontrib;
+        cached_lightmap->add_direction(i, ray.normalcontrib);
 
         Lightmap_Save(bsp, lightmaps, lightsurf, cached_lightmap, cached_style);
     }
@@ -1483,7 +1538,7 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
 
         sample.color += rs.getPushedRayColor(j);
         cached_lightmap->bounce_color += rs.getPushedRayColor(j);
-        sample.direction += ray.normalcontrib;
+        cached_lightmap->add_direction(i, ray.normalcontrib);
 #if 0
         total_light_ray_hits++;
 #endif
@@ -1492,6 +1547,127 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
     }
 }
 
+/*
+ * =============
+ * LightFace_SkyVis
+ *
+ * -skyvis version of LightFace_Sky for the sky dome suns: each direction in
+ * GetSkyVisBins() is traced once per sample, and every sun in that bin whose
+ * sign matches `negative` is lit from the result.
+ * =============
+ */
+static void LightFace_SkyVis(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps, bool negative)
+{
+    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
+    const modelinfo_t *modelinfo = lightsurf->modelinfo;
+    const qplane3f &plane = lightsurf->plane;
+
+    // check lighting channels (currently sunlight is always on CHANNEL_MASK_DEFAULT)
+    if (!(lightsurf->object_channel_mask & CHANNEL_MASK_DEFAULT)) {
+        return;
+    }
+
+    raystream_intersection_t &rs = intersection_stream;
+    std::vector<const sun_t *> suns;
+
+    for (const skyvis_bin_t &bin : GetSkyVisBins()) {
+        suns.clear();
+
+        for (const sun_t *sun : bin.suns) {
+            if ((sun->sunlight < 0) != negative) {
+                continue;
+            }
+
+            /* Don't bother if surface facing away from sun */
+            const float dp = qv::dot(qv::normalize(sun->sunvec), plane.normal);
+            if (dp < -LIGHT_ANGLE_EPSILON && !lightsurf->curved && !lightsurf->twosided) {
+                continue;
+            }
+
+            suns.push_back(sun);
+        }
+
+        if (suns.empty()) {
+            continue;
+        }
+
+        rs.clearPushedRays();
+
+        for (int i = 0; i < lightsurf->samples.size(); i++) {
+            const auto &sample = lightsurf->samples[i];
+
+            if (sample.occluded)
+                continue;
+
+            rs.pushRay(i, sample.point, bin.dir, MAX_SKY_DIST);
+        }
+
+        rs.tracePushedRaysIntersection(modelinfo, CHANNEL_MASK_DEFAULT);
+
+        const int N = rs.numPushedRays();
+
+        for (int j = 0; j < N; j++) {
+            if (rs.getPushedRayHitType(j) != hittype_t::SKY) {
+                continue;
+            }
+
+            const ray_io &ray = rs.getRay(j);
+            const int i = ray.index;
+            const auto &sample = lightsurf->samples[i];
+            const triinfo *face = rs.getPushedRayHitFaceInfo(j);
+
+            for (const sun_t *sun : suns) {
+                // check if we hit the wrong texture
+                if (sun->suntexture_value && sun->suntexture_value != face->texture) {
+                    continue;
+                }
+
+                // same as LightFace_Sky, but using the sun's own direction rather than the bin's
+                const qvec3f incoming = qv::normalize(sun->sunvec);
+
+                float angle = qv::dot(incoming, sample.normal);
+                if (lightsurf->twosided) {
+                    if (angle < 0) {
+                        angle = -angle;
+                    }
+                }
+
+                angle = std::max(0.0f, angle);
+
+                angle = (1.0f - sun->anglescale) + sun->anglescale * angle;
+                float value = angle * sun->sunlight;
+
+                if (sun->dirt) {
+                    value *= Dirt_GetScaleFactor(cfg, sample.occlusion, NULL, 0.0f, lightsurf);
+                }
+
+                qvec3f color = sun->sunlight_color * (value / 255.0f);
+
+                if (fabs(LightSample_Brightness(color)) <= light_options.gate.value()) {
+                    continue;
+                }
+
+                color = rs.getPushedRayColor(j, color);
+
+                // check if we hit a dynamic shadow caster
+                int style = sun->style;
+                if (style == 0) {
+                    style = ray.dynamic_style;
+                }
+
+                lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, style, lightsurf);
+                lightsample_t &lightsample = lightmap->samples[i];
+
+                lightsample.color += color;
+                lightmap->bounce_color += color;
+                lightmap->add_direction(i, incoming * value);
+
+                Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, style);
+            }
+        }
+    }
+}
+
 static void LightPoint_Sky(const mbsp_t *bsp, raystream_intersection_t &rs, const sun_t *sun, const qvec3f &surfpoint,
     lightgrid_samples_t &result)
 {
@@ -1993,108 +2169,219 @@ static bool SurfaceLight_VisCull(const mbsp_t *bsp, const std::vector<uint8_t> *
     return false;
 }
 
-static void // mxd
-LightFace_SurfaceLight(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
-    std::optional<size_t> bounce_depth, float standard_scale, float sky_scale, float hotspot_clamp)
+// a light tree aggregate stands in for emitters in all of `leaves`, so it's only culled if none of them are visible
+static bool SurfaceLight_AggregateVisCull(
+    const mbsp_t *bsp, const std::vector<uint8_t> *pvs, const std::vector<const mleaf_t *> &leaves)
 {
-    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
-    const float surflight_gate = light_options.emissivequality.value() == emissivequality_t::HIGH ? 0.0f : 0.01f;
-
-    // check lighting channels (currently surface lights are always on CHANNEL_MASK_DEFAULT)
-    if (!(lightsurf->object_channel_mask & CHANNEL_MASK_DEFAULT)) {
-        return;
+    if (pvs && light_options.visapprox.value() == visapprox_t::VIS) {
+        for (const mleaf_t *leaf : leaves) {
+            if (!VisCullEntity(bsp, *pvs, leaf)) {
+                return false;
+            }
+        }
+        return !leaves.empty();
     }
 
-    for (const auto &surf_ptr : EmissiveLightSurfaces()) {
-        auto &vpl = *surf_ptr->vpl.get();
+    return false;
+}
 
-        for (const auto &vpl_setting : surf_ptr->vpl->styles) {
+// traces rays from each of `vpl`'s points to the lightsurf's samples and accumulates the result
+static void LightFace_SurfaceLightPoints(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
+    const surfacelight_t &vpl, const surfacelight_t::per_style_t &vpl_setting, float standard_scale, float sky_scale,
+    float hotspot_clamp, float surflight_gate)
+{
+    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
+    raystream_occlusion_t &rs = occlusion_stream;
 
-            if (vpl_setting.bounce_level != bounce_depth)
-                continue;
-            else if (SurfaceLight_SphereCull(&vpl, lightsurf, vpl_setting, surflight_gate, hotspot_clamp))
-                continue;
-            else if (SurfaceLight_VisCull(bsp, &lightsurf->pvs, surf_ptr))
-                continue;
+    for (int c = 0; c < vpl.points.size(); c++) {
+        rs.clearPushedRays();
 
-            raystream_occlusion_t &rs = occlusion_stream;
+        for (int i = 0; i < lightsurf->samples.size(); i++) {
+            const auto &sample = lightsurf->samples[i];
 
-            for (int c = 0; c < vpl.points.size(); c++) {
-                rs.clearPushedRays();
+            if (sample.occluded)
+                continue;
 
-                for (int i = 0; i < lightsurf->samples.size(); i++) {
-                    const auto &sample = lightsurf->samples[i];
+            const qvec3f &lightsurf_pos = sample.point;
+            const qvec3f &lightsurf_normal = sample.normal;
 
-                    if (sample.occluded)
-                        continue;
+            const qvec3f &pos = vpl.points[c];
+            qvec3f dir = lightsurf_pos - pos;
+            float dist = std::max(0.01f, qv::length(dir));
+            bool use_normal = true;
 
-                    const qvec3f &lightsurf_pos = sample.point;
-                    const qvec3f &lightsurf_normal = sample.normal;
-
-                    const qvec3f &pos = vpl.points[c];
-                    qvec3f dir = lightsurf_pos - pos;
-                    float dist = std::max(0.01f, qv::length(dir));
-                    bool use_normal = true;
-
-                    if (lightsurf->twosided) {
-                        use_normal = false;
-                        dir /= dist;
-                    } else if (dist == 0.0f) {
-                        dir = lightsurf_normal;
-                        use_normal = false;
-                    } else {
-                        dir /= dist;
-                    }
+            if (lightsurf->twosided) {
+                use_normal = false;
+                dir /= dist;
+            } else if (dist == 0.0f) {
+                dir = lightsurf_normal;
+                use_normal = false;
+            } else {
+                dir /= dist;
+            }
 
-                    const qvec3f indirect = GetSurfaceLighting(cfg, vpl, vpl_setting, dir, dist, lightsurf_normal,
-                        use_normal, standard_scale, sky_scale, hotspot_clamp);
-                    if (!qv::gate(indirect, surflight_gate)) { // Each point contributes very little to the final result
-                        rs.pushRay(i, pos, dir, dist, &indirect);
-                    }
-                }
+            const qvec3f indirect = GetSurfaceLighting(cfg, vpl, vpl_setting, dir, dist, lightsurf_normal, use_normal,
+                standard_scale, sky_scale, hotspot_clamp);
+            if (!qv::gate(indirect, surflight_gate)) { // Each point contributes very little to the final result
+                rs.pushRay(i, pos, dir, dist, &indirect);
+            }
+        }
 
-                if (!rs.numPushedRays())
-                    continue;
+        if (!rs.numPushedRays())
+            continue;
 
 #if 0
-                total_surflight_rays += rs.numPushedRays();
+        total_surflight_rays += rs.numPushedRays();
 #endif
-                rs.tracePushedRaysOcclusion(lightsurf->modelinfo, CHANNEL_MASK_DEFAULT);
+        rs.tracePushedRaysOcclusion(lightsurf->modelinfo, CHANNEL_MASK_DEFAULT);
 
-                const int lightmapstyle = vpl_setting.style;
-                lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, lightmapstyle, lightsurf);
+        const int lightmapstyle = vpl_setting.style;
+        lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, lightmapstyle, lightsurf);
 
-                bool hit = false;
-                const int numrays = rs.numPushedRays();
-                for (int j = 0; j < numrays; j++) {
-                    if (rs.getPushedRayOccluded(j))
-                        continue;
+        bool hit = false;
+        const int numrays = rs.numPushedRays();
+        for (int j = 0; j < numrays; j++) {
+            if (rs.getPushedRayOccluded(j))
+                continue;
 
-                    const ray_io &ray = rs.getRay(j);
-                    const int i = ray.index;
-                    qvec3f indirect = rs.getPushedRayColor(j);
+            const ray_io &ray = rs.getRay(j);
+            const int i = ray.index;
+            qvec3f indirect = rs.getPushedRayColor(j);
 
-                    // Q_assert(!std::isnan(indirect[0]));
+            // Q_assert(!std::isnan(indirect[0]));
 
-                    // Use dirt scaling on the surface lighting.
-                    const float dirtscale =
-                        Dirt_GetScaleFactor(cfg, lightsurf->samples[i].occlusion, nullptr, 0.0, lightsurf);
-                    indirect *= dirtscale;
+            // Use dirt scaling on the surface lighting.
+            const float dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->samples[i].occlusion, nullptr, 0.0, lightsurf);
+            indirect *= dirtscale;
 
-                    lightsample_t &sample = lightmap->samples[i];
-                    sample.color += indirect;
-                    lightmap->bounce_color += indirect;
+            lightsample_t &sample = lightmap->samples[i];
+            sample.color += indirect;
+            lightmap->bounce_color += indirect;
 
-                    hit = true;
+            hit = true;
 #if 0
-                    ++total_surflight_ray_hits;
+            ++total_surflight_ray_hits;
 #endif
+        }
+
+        // If surface light contributed anything, save.
+        if (hit)
+            Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, lightmapstyle);
+    }
+}
+
+// distance between the closest points of two boxes; 0 if they overlap
+static float AABB_Distance(const aabb3f &a, const aabb3f &b)
+{
+    qvec3f delta{};
+
+    for (int i = 0; i < 3; i++) {
+        delta[i] = std::max({0.0f, a.mins()[i] - b.maxs()[i], b.mins()[i] - a.maxs()[i]});
+    }
+
+    return qv::length(delta);
+}
+
+/**
+ * LightFace_SurfaceLight using the light trees (see lighttree.hh): subtrees
+ * that can't reach the gate are skipped as a whole, and subtrees that are small
+ * relative to their distance (controlled by -lighttree_error) are lit as a
+ * single aggregate emitter.
+ */
+static void LightFace_SurfaceLightTree(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
+    float standard_scale, float sky_scale, float hotspot_clamp, float surflight_gate)
+{
+    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
+    const float error = light_options.lighttree_error.value();
+    const aabb3f &surf_bounds = lightsurf->extents.bounds;
+
+    std::vector<int32_t> stack;
+
+    for (const lighttree_t &tree : LightTrees()) {
+        const float scale = tree.omnidirectional ? sky_scale : standard_scale;
+
+        stack.clear();
+        stack.push_back(0);
+
+        while (!stack.empty()) {
+            const lighttree_node_t &node = tree.nodes[stack.back()];
+            stack.pop_back();
+
+            const float dist = AABB_Distance(node.bounds, surf_bounds);
+
+            // upper bound on what the whole subtree can contribute (the angle factor is at most 1)
+            if (surflight_gate) {
+                const qvec3f bound = SurfaceLight_ColorAtDist(
+                    cfg, scale, node.power, qvec3f{node.max_color}, dist, tree.atten, hotspot_clamp);
+
+                if (qv::gate(bound, surflight_gate)) {
+                    continue;
                 }
+            }
 
-                // If surface light contributed anything, save.
-                if (hit)
-                    Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, lightmapstyle);
+            if (node.aggregate && error > 0 && qv::length(node.bounds.size()) * 0.5f < error * dist) {
+                if (!SurfaceLight_AggregateVisCull(bsp, &lightsurf->pvs, node.leaves)) {
+                    LightFace_SurfaceLightPoints(bsp, lightsurf, lightmaps, *node.aggregate,
+                        node.aggregate->styles.front(), standard_scale, sky_scale, hotspot_clamp, surflight_gate);
+                }
+                continue;
+            }
+
+            if (!node.is_leaf()) {
+                stack.push_back(node.children[1]);
+                stack.push_back(node.children[0]);
+                continue;
             }
+
+            for (uint32_t i = node.first_emitter; i < node.first_emitter + node.num_emitters; i++) {
+                const lighttree_emitter_t &emitter = tree.emitters[i];
+                const surfacelight_t &vpl = *emitter.surf->vpl;
+
+                if (SurfaceLight_SphereCull(&vpl, lightsurf, *emitter.style, surflight_gate, hotspot_clamp))
+                    continue;
+                else if (SurfaceLight_VisCull(bsp, &lightsurf->pvs, emitter.surf))
+                    continue;
+
+                LightFace_SurfaceLightPoints(bsp, lightsurf, lightmaps, vpl, *emitter.style, standard_scale,
+                    sky_scale, hotspot_clamp, surflight_gate);
+            }
+        }
+    }
+}
+
+static void // mxd
+LightFace_SurfaceLight(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
+    std::optional<size_t> bounce_depth, float standard_scale, float sky_scale, float hotspot_clamp)
+{
+    const float surflight_gate = light_options.emissivequality.value() == emissivequality_t::HIGH ? 0.0f : 0.01f;
+
+    // check lighting channels (currently surface lights are always on CHANNEL_MASK_DEFAULT)
+    if (!(lightsurf->object_channel_mask & CHANNEL_MASK_DEFAULT)) {
+        return;
+    }
+
+    if (light_options.lighttree.value()) {
+        Q_assert(LightTreesBounceLevel() == bounce_depth);
+
+        LightFace_SurfaceLightTree(
+            bsp, lightsurf, lightmaps, standard_scale, sky_scale, hotspot_clamp, surflight_gate);
+        return;
+    }
+
+    for (const auto &surf_ptr : EmissiveLightSurfaces()) {
+        auto &vpl = *surf_ptr->vpl.get();
+
+        for (const auto &vpl_setting : surf_ptr->vpl->styles) {
+
+            if (vpl_setting.bounce_level != bounce_depth)
+                continue;
+            else if (SurfaceLight_SphereCull(&vpl, lightsurf, vpl_setting, surflight_gate, hotspot_clamp))
+                continue;
+            else if (SurfaceLight_VisCull(bsp, &lightsurf->pvs, surf_ptr))
+                continue;
+
+            LightFace_SurfaceLightPoints(bsp, lightsurf, lightmaps, vpl, vpl_setting, standard_scale, sky_scale,
+                hotspot_clamp, surflight_gate);
         }
     }
 }
@@ -2556,6 +2843,321 @@ lightsurf_t CreateLightmapSurface(const mbsp_t *bsp, const mface_t *face, const
     return Lightsurf_Init(modelinfo, cfg, face, bsp, facesup, facesup_decoupled);
 }
 
+// adds a light's contribution (from LightCache_Find, or freshly traced) to the face's lightmaps
+static void LightFace_AddContribution(const mbsp_t *bsp, const std::vector<lightcache_style_t> &contribution,
+    lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    for (const lightcache_style_t &style : contribution) {
+        lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, style.style, lightsurf);
+
+        for (size_t i = 0; i < style.samples.size(); i++) {
+            lightmap->samples[i].color += style.samples[i].color;
+        }
+        for (size_t i = 0; i < style.directions.size(); i++) {
+            lightmap->add_direction(i, style.directions[i]);
+        }
+        lightmap->bounce_color += style.bounce_color;
+
+        Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, style.style);
+    }
+}
+
+/*
+ * =============
+ * LightFace_EntityCached
+ *
+ * LightFace_Entity via the -lightcache: lights that haven't changed since the
+ * cache was written are copied from it, the others are traced into an empty
+ * lightmapdict_t so their contribution can be stored on its own.
+ * =============
+ */
+static void LightFace_EntityCached(
+    const mbsp_t *bsp, const light_t *entity, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    const int facenum = Face_GetNum(bsp, lightsurf->face);
+
+    if (const auto *cached = LightCache_Find(facenum, entity)) {
+        LightFace_AddContribution(bsp, *cached, lightsurf, lightmaps);
+        return;
+    }
+
+    lightmapdict_t traced;
+    LightFace_Entity(bsp, entity, lightsurf, &traced);
+
+    std::vector<lightcache_style_t> contribution;
+    for (lightmap_t &lightmap : traced) {
+        if (lightmap.style == INVALID_LIGHTSTYLE) {
+            continue;
+        }
+        lightmap.samples.resize(lightsurf->samples.size());
+        if (!lightmap.directions.empty()) {
+            lightmap.directions.resize(lightsurf->samples.size());
+        }
+        contribution.push_back(
+            {lightmap.style, lightmap.bounce_color, std::move(lightmap.samples), std::move(lightmap.directions)});
+    }
+
+    LightFace_AddContribution(bsp, contribution, lightsurf, lightmaps);
+    LightCache_Store(facenum, entity, std::move(contribution));
+}
+
+/*
+ * Calls `func` for each of GetLights() that might reach the face, in order. With
+ * -lightindex that's only the lights whose influence sphere touches the face's
+ * bounding sphere, otherwise all of them, for LightFace_Entity to cull.
+ */
+template<typename F>
+static void LightFace_ForEachLight(const lightsurf_t *lightsurf, F &&func)
+{
+    if (LightIndex_Enabled()) {
+        for (const light_t *entity : LightIndex_Query(lightsurf->extents.origin, lightsurf->extents.radius)) {
+            func(entity);
+        }
+    } else {
+        for (const auto &entity : GetLights()) {
+            func(entity.get());
+        }
+    }
+}
+
+// all positive direct light sources; samples marked occluded are skipped
+static void LightFace_PositiveDirect(
+    const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps, const settings::worldspawn_keys &cfg)
+{
+    LightFace_ForEachLight(lightsurf, [&](const light_t *entity) {
+        if (entity->getFormula() == LF_LOCALMIN)
+            return;
+        if (entity->nostaticlight.value())
+            return;
+        if (entity->light.value() <= 0)
+            return;
+
+        if (LightCache_Enabled())
+            LightFace_EntityCached(bsp, entity, lightsurf, lightmaps);
+        else
+            LightFace_Entity(bsp, entity, lightsurf, lightmaps);
+    });
+    for (const sun_t &sun : GetSuns())
+        if (sun.sunlight > 0 && sun.skyvis_bin == -1)
+            LightFace_Sky(bsp, &sun, lightsurf, lightmaps);
+    LightFace_SkyVis(bsp, lightsurf, lightmaps, false);
+
+    // mxd. Add surface lights...
+    // FIXME: negative surface lights
+    LightFace_SurfaceLight(
+        bsp, lightsurf, lightmaps, std::nullopt, cfg.surflightscale.value(), cfg.surflightskyscale.value(), 16.0f);
+}
+
+/*
+ * Rough relative cost of DirectLightFace, used to start the most expensive
+ * faces first (-facecost): the number of samples times the rays traced per
+ * sample. Counts the entity lights that LightFace_Entity won't cull, suns,
+ * -skyvis directions, dirt rays and `surflight_points`, the number of surface
+ * light points in the map (left to the caller since it's the same for every face).
+ */
+float DirectLightFace_EstimateCost(const mbsp_t *bsp, const lightsurf_t &lightsurf, size_t surflight_points)
+{
+    size_t rays = 0;
+
+    if (dirt_in_use && !lightsurf.nodirt) {
+        rays += numDirtVectors;
+    }
+
+    const surfflags_t &extended_flags = extended_texinfo_flags[lightsurf.face->texinfo];
+
+    if (!(lightsurf.modelinfo->lightignore.value() || extended_flags.light_ignore)) {
+        LightFace_ForEachLight(&lightsurf, [&](const light_t *entity) {
+            if (entity->getFormula() == LF_LOCALMIN || entity->nostaticlight.value() || entity->light.value() <= 0) {
+                return;
+            }
+            if (!LightFace_EntityCulled(bsp, entity, &lightsurf)) {
+                rays++;
+            }
+        });
+        for (const sun_t &sun : GetSuns()) {
+            if (sun.sunlight > 0 && sun.skyvis_bin == -1) {
+                rays++;
+            }
+        }
+        rays += GetSkyVisBins().size();
+        rays += surflight_points;
+    }
+
+    return static_cast<float>(lightsurf.samples.size()) * std::max<size_t>(rays, 1);
+}
+
+/*
+ * ============
+ * LightFace_AdaptiveDirect
+ *
+ * -adaptiveextra version of LightFace_PositiveDirect. Each extra*extra block of
+ * samples (one output luxel) is first lit at a single representative sample.
+ * The rest of a block's samples are only lit if its representative differs
+ * from a neighbouring block's by more than the threshold in any style, if it
+ * borders a block with no unoccluded samples, or if it straddles several
+ * faces. Unrefined samples copy their representative, so
+ * IntegerDownsampleImage still sees a full resolution image.
+ *
+ * Works by temporarily marking the samples that shouldn't be lit in a pass as
+ * occluded, which all of the LightFace_* functions already skip.
+ * ============
+ */
+static void LightFace_AdaptiveDirect(
+    const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps, const settings::worldspawn_keys &cfg)
+{
+    const int extra = light_options.extra.value();
+    const float threshold = light_options.adaptiveextra.value();
+    const int blocks_w = lightsurf->width / extra;
+    const int blocks_h = lightsurf->height / extra;
+    const int num_blocks = blocks_w * blocks_h;
+    auto &samples = lightsurf->samples;
+
+    Q_assert(blocks_w * extra == lightsurf->width && blocks_h * extra == lightsurf->height);
+
+    std::vector<bool> occluded(samples.size());
+    for (size_t i = 0; i < samples.size(); i++) {
+        occluded[i] = samples[i].occluded;
+    }
+
+    // representative sample of each block: the unoccluded one nearest the block center, or -1
+    std::vector<int> rep(num_blocks, -1);
+    std::vector<bool> refine(num_blocks, false);
+
+    const auto for_each_in_block = [&](int block, auto &&fn) {
+        const int bs = (block % blocks_w) * extra;
+        const int bt = (block / blocks_w) * extra;
+
+        for (int t = bt; t < bt + extra; t++) {
+            for (int s = bs; s < bs + extra; s++) {
+                fn(t * lightsurf->width + s);
+            }
+        }
+    };
+
+    for (int block = 0; block < num_blocks; block++) {
+        const int cs = (block % blocks_w) * extra + extra / 2;
+        const int ct = (block / blocks_w) * extra + extra / 2;
+        int best_dist = std::numeric_limits<int>::max();
+
+        for_each_in_block(block, [&](int i) {
+            const int ds = (i % lightsurf->width) - cs;
+            const int dt = (i / lightsurf->width) - ct;
+
+            if (!occluded[i] && ds * ds + dt * dt < best_dist) {
+                best_dist = ds * ds + dt * dt;
+                rep[block] = i;
+            }
+        });
+
+        if (rep[block] == -1) {
+            continue;
+        }
+
+        // phong / neighbouring face boundaries aren't visible from a single sample
+        for_each_in_block(block, [&](int i) {
+            if (!occluded[i] && samples[i].realfacenum != samples[rep[block]].realfacenum) {
+                refine[block] = true;
+            }
+        });
+    }
+
+    /* pass 1: representatives only */
+    for (auto &sample : samples) {
+        sample.occluded = true;
+    }
+    for (int i : rep) {
+        if (i != -1) {
+            samples[i].occluded = false;
+        }
+    }
+
+    LightFace_PositiveDirect(bsp, lightsurf, lightmaps, cfg);
+
+    /* compare neighbouring blocks */
+    const auto differs = [&](int a, int b) {
+        if ((rep[a] == -1) != (rep[b] == -1)) {
+            return true;
+        }
+        if (rep[a] == -1) {
+            return false;
+        }
+        for (const lightmap_t &lightmap : *lightmaps) {
+            if (lightmap.style == INVALID_LIGHTSTYLE) {
+                continue;
+            }
+            const float delta = LightSample_Brightness(lightmap.samples[rep[a]].color) -
+                                LightSample_Brightness(lightmap.samples[rep[b]].color);
+            if (fabs(delta) > threshold) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    for (int bt = 0; bt < blocks_h; bt++) {
+        for (int bs = 0; bs < blocks_w; bs++) {
+            const int block = bt * blocks_w + bs;
+
+            if (bs + 1 < blocks_w && differs(block, block + 1)) {
+                refine[block] = refine[block + 1] = true;
+            }
+            if (bt + 1 < blocks_h && differs(block, block + blocks_w)) {
+                refine[block] = refine[block + blocks_w] = true;
+            }
+        }
+    }
+
+    /* pass 2: the remaining samples of the refined blocks */
+    bool any_refined = false;
+
+    for (auto &sample : samples) {
+        sample.occluded = true;
+    }
+    for (int block = 0; block < num_blocks; block++) {
+        if (rep[block] == -1 || !refine[block]) {
+            continue;
+        }
+        for_each_in_block(block, [&](int i) {
+            if (i != rep[block] && !occluded[i]) {
+                samples[i].occluded = false;
+                any_refined = true;
+            }
+        });
+    }
+
+    if (any_refined) {
+        LightFace_PositiveDirect(bsp, lightsurf, lightmaps, cfg);
+    }
+
+    /* fill in the unrefined blocks */
+    for (lightmap_t &lightmap : *lightmaps) {
+        if (lightmap.style == INVALID_LIGHTSTYLE) {
+            continue;
+        }
+        for (int block = 0; block < num_blocks; block++) {
+            if (rep[block] == -1 || refine[block]) {
+                continue;
+            }
+            const lightsample_t rep_sample = lightmap.samples[rep[block]];
+            const qvec3f rep_direction = lightmap.directions.empty() ? qvec3f{} : lightmap.directions[rep[block]];
+
+            for_each_in_block(block, [&](int i) {
+                if (i != rep[block] && !occluded[i]) {
+                    lightmap.samples[i] = rep_sample;
+                    lightmap.bounce_color += rep_sample.color;
+                    if (!lightmap.directions.empty()) {
+                        lightmap.directions[i] = rep_direction;
+                    }
+                }
+            });
+        }
+    }
+
+    for (size_t i = 0; i < samples.size(); i++) {
+        samples[i].occluded = occluded[i];
+    }
+}
+
 /*
  * ============
  * LightFace
@@ -2587,22 +3189,11 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
 
         /* positive lights */
         if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
-            for (const auto &entity : GetLights()) {
-                if (entity->getFormula() == LF_LOCALMIN)
-                    continue;
-                if (entity->nostaticlight.value())
-                    continue;
-                if (entity->light.value() > 0)
-                    LightFace_Entity(bsp, entity.get(), &lightsurf, lightmaps);
+            if (light_options.extra.value() > 1 && light_options.adaptiveextra.value() > 0) {
+                LightFace_AdaptiveDirect(bsp, &lightsurf, lightmaps, cfg);
+            } else {
+                LightFace_PositiveDirect(bsp, &lightsurf, lightmaps, cfg);
             }
-            for (const sun_t &sun : GetSuns())
-                if (sun.sunlight > 0)
-                    LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
-
-            // mxd. Add surface lights...
-            // FIXME: negative surface lights
-            LightFace_SurfaceLight(bsp, &lightsurf, lightmaps, std::nullopt, cfg.surflightscale.value(),
-                cfg.surflightskyscale.value(), 16.0f);
         }
 
         LightFace_LocalMin(bsp, face, &lightsurf, lightmaps);
@@ -2704,17 +3295,18 @@ void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const setti
 
         /* negative lights */
         if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
-            for (const auto &entity : GetLights()) {
+            LightFace_ForEachLight(&lightsurf, [&](const light_t *entity) {
                 if (entity->getFormula() == LF_LOCALMIN)
-                    continue;
+                    return;
                 if (entity->nostaticlight.value())
-                    continue;
+                    return;
                 if (entity->light.value() < 0)
-                    LightFace_Entity(bsp, entity.get(), &lightsurf, lightmaps);
-            }
+                    LightFace_Entity(bsp, entity, &lightsurf, lightmaps);
+            });
             for (const sun_t &sun : GetSuns())
-                if (sun.sunlight < 0)
+                if (sun.sunlight < 0 && sun.skyvis_bin == -1)
                     LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
+            LightFace_SkyVis(bsp, &lightsurf, lightmaps, true);
         }
     }
 
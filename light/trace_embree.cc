@@ -40,6 +40,8 @@ RTCScene scene;
 
 static const mbsp_t *bsp_static;
 
+static int packet_width = 1;
+
 void ResetEmbree()
 {
     skygeom = {};
@@ -58,6 +60,12 @@ void ResetEmbree()
     }
 
     bsp_static = nullptr;
+    packet_width = 1;
+}
+
+int Embree_PacketWidth()
+{
+    return packet_width;
 }
 
 const std::set<const mface_t *> &ShadowCastingSolidFacesSet()
@@ -544,6 +552,211 @@ static void MakeFaces(
     Q_assert(planes.empty());
 }
 
+/**
+ * Picks the packet width for raystream tracing, based on the -raypackets setting
+ * and what the embree device natively supports.
+ */
+static int ChoosePacketWidth(RTCDevice device)
+{
+    const bool supported4 = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_NATIVE_RAY4_SUPPORTED);
+    const bool supported8 = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_NATIVE_RAY8_SUPPORTED);
+    const bool supported16 = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_NATIVE_RAY16_SUPPORTED);
+
+    const int widest = supported16 ? 16 : supported8 ? 8 : supported4 ? 4 : 1;
+
+    switch (light_options.raypackets.value()) {
+        case raypackets_t::NONE: return 1;
+        case raypackets_t::AUTO: return widest;
+        case raypackets_t::PACKET4:
+            if (supported4)
+                return 4;
+            break;
+        case raypackets_t::PACKET8:
+            if (supported8)
+                return 8;
+            break;
+        case raypackets_t::PACKET16:
+            if (supported16)
+                return 16;
+            break;
+    }
+
+    logging::print("WARNING: -raypackets {} isn't supported by this embree build/CPU, using {}\n",
+        light_options.raypackets.string_value(), widest);
+    return widest;
+}
+
+// maps a packet width to embree's RTCRayN/RTCRayHitN types and trace functions
+template<int N>
+struct embree_packet_t;
+
+template<>
+struct embree_packet_t<4>
+{
+    using ray_t = RTCRay4;
+    using rayhit_t = RTCRayHit4;
+
+    static void intersect(const int *valid, RTCScene scene, rayhit_t *rayhit, RTCIntersectArguments *args)
+    {
+        rtcIntersect4(valid, scene, rayhit, args);
+    }
+    static void occluded(const int *valid, RTCScene scene, ray_t *ray, RTCOccludedArguments *args)
+    {
+        rtcOccluded4(valid, scene, ray, args);
+    }
+};
+
+template<>
+struct embree_packet_t<8>
+{
+    using ray_t = RTCRay8;
+    using rayhit_t = RTCRayHit8;
+
+    static void intersect(const int *valid, RTCScene scene, rayhit_t *rayhit, RTCIntersectArguments *args)
+    {
+        rtcIntersect8(valid, scene, rayhit, args);
+    }
+    static void occluded(const int *valid, RTCScene scene, ray_t *ray, RTCOccludedArguments *args)
+    {
+        rtcOccluded8(valid, scene, ray, args);
+    }
+};
+
+template<>
+struct embree_packet_t<16>
+{
+    using ray_t = RTCRay16;
+    using rayhit_t = RTCRayHit16;
+
+    static void intersect(const int *valid, RTCScene scene, rayhit_t *rayhit, RTCIntersectArguments *args)
+    {
+        rtcIntersect16(valid, scene, rayhit, args);
+    }
+    static void occluded(const int *valid, RTCScene scene, ray_t *ray, RTCOccludedArguments *args)
+    {
+        rtcOccluded16(valid, scene, ray, args);
+    }
+};
+
+template<typename RayN>
+static inline void PacketStoreRay(RayN &packet, size_t lane, const RTCRay &ray)
+{
+    packet.org_x[lane] = ray.org_x;
+    packet.org_y[lane] = ray.org_y;
+    packet.org_z[lane] = ray.org_z;
+    packet.tnear[lane] = ray.tnear;
+    packet.dir_x[lane] = ray.dir_x;
+    packet.dir_y[lane] = ray.dir_y;
+    packet.dir_z[lane] = ray.dir_z;
+    packet.time[lane] = ray.time;
+    packet.tfar[lane] = ray.tfar;
+    packet.mask[lane] = ray.mask;
+    // NOTE: the id is the index into the raystream, which the filter functions rely on
+    packet.id[lane] = ray.id;
+    packet.flags[lane] = ray.flags;
+}
+
+/**
+ * Gathers `rays` into packets of N, with the lanes past the end of `rays` masked off
+ * (but still filled with a copy of the packet's first ray, so they hold sane values).
+ * Returns the number of active lanes.
+ */
+template<int N, typename RayN>
+static inline size_t PacketGather(const aligned_vector<ray_io> &rays, size_t first, int *valid, RayN &packet)
+{
+    const size_t count = std::min(static_cast<size_t>(N), rays.size() - first);
+
+    for (size_t lane = 0; lane < N; lane++) {
+        const bool active = lane < count;
+
+        valid[lane] = active ? -1 : 0;
+        PacketStoreRay(packet, lane, rays[first + (active ? lane : 0)].ray.ray);
+    }
+
+    return count;
+}
+
+template<int N>
+static void TraceIntersectionPacketsN(aligned_vector<ray_io> &rays, RTCIntersectArguments *args)
+{
+    using packet_t = embree_packet_t<N>;
+
+    alignas(64) int valid[N];
+    typename packet_t::rayhit_t rayhit;
+
+    for (size_t first = 0; first < rays.size(); first += N) {
+        const size_t count = PacketGather<N>(rays, first, valid, rayhit.ray);
+
+        for (size_t lane = 0; lane < N; lane++) {
+            rayhit.hit.geomID[lane] = RTC_INVALID_GEOMETRY_ID;
+            rayhit.hit.primID[lane] = RTC_INVALID_GEOMETRY_ID;
+            rayhit.hit.instID[0][lane] = RTC_INVALID_GEOMETRY_ID;
+        }
+
+        packet_t::intersect(valid, scene, &rayhit, args);
+
+        for (size_t lane = 0; lane < count; lane++) {
+            RTCRayHit &out = rays[first + lane].ray;
+
+            out.ray.tfar = rayhit.ray.tfar[lane];
+            out.hit.Ng_x = rayhit.hit.Ng_x[lane];
+            out.hit.Ng_y = rayhit.hit.Ng_y[lane];
+            out.hit.Ng_z = rayhit.hit.Ng_z[lane];
+            out.hit.u = rayhit.hit.u[lane];
+            out.hit.v = rayhit.hit.v[lane];
+            out.hit.primID = rayhit.hit.primID[lane];
+            out.hit.geomID = rayhit.hit.geomID[lane];
+            out.hit.instID[0] = rayhit.hit.instID[0][lane];
+        }
+    }
+}
+
+template<int N>
+static void TraceOcclusionPacketsN(aligned_vector<ray_io> &rays, RTCOccludedArguments *args)
+{
+    using packet_t = embree_packet_t<N>;
+
+    alignas(64) int valid[N];
+    typename packet_t::ray_t ray;
+
+    for (size_t first = 0; first < rays.size(); first += N) {
+        const size_t count = PacketGather<N>(rays, first, valid, ray);
+
+        packet_t::occluded(valid, scene, &ray, args);
+
+        // occluded rays get tfar set to -inf
+        for (size_t lane = 0; lane < count; lane++) {
+            rays[first + lane].ray.ray.tfar = ray.tfar[lane];
+        }
+    }
+}
+
+void Embree_TraceIntersectionPackets(aligned_vector<ray_io> &rays, RTCIntersectArguments *args)
+{
+    switch (packet_width) {
+        case 4: TraceIntersectionPacketsN<4>(rays, args); break;
+        case 8: TraceIntersectionPacketsN<8>(rays, args); break;
+        case 16: TraceIntersectionPacketsN<16>(rays, args); break;
+        default:
+            for (auto &ray : rays)
+                rtcIntersect1(scene, &ray.ray, args);
+            break;
+    }
+}
+
+void Embree_TraceOcclusionPackets(aligned_vector<ray_io> &rays, RTCOccludedArguments *args)
+{
+    switch (packet_width) {
+        case 4: TraceOcclusionPacketsN<4>(rays, args); break;
+        case 8: TraceOcclusionPacketsN<8>(rays, args); break;
+        case 16: TraceOcclusionPacketsN<16>(rays, args); break;
+        default:
+            for (auto &ray : rays)
+                rtcOccluded1(scene, &ray.ray.ray, args);
+            break;
+    }
+}
+
 void Embree_TraceInit(const mbsp_t *bsp)
 {
     bsp_static = bsp;
@@ -667,6 +880,8 @@ void Embree_TraceInit(const mbsp_t *bsp)
     const size_t ver_pat = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_VERSION_PATCH);
     logging::funcprint("Embree version: {}.{}.{}\n", ver_maj, ver_min, ver_pat);
 
+    packet_width = ChoosePacketWidth(device);
+
     scene = rtcNewScene(device);
     // necessary for RTCOccludedArguments::filter and RTCIntersectArguments::filter
     // to work, which we use (see: ray_source_info::setup_intersection_arguments() and
@@ -694,6 +909,9 @@ void Embree_TraceInit(const mbsp_t *bsp)
     logging::print("\t{} solid faces\n", solidfaces.size());
     logging::print("\t{} filtered faces\n", filterfaces.size());
     logging::print("\t{} shadow-casting skip faces\n", skipwindings.size());
+    if (packet_width > 1) {
+        logging::print("\ttracing rays in packets of {}\n", packet_width);
+    }
 }
 
 static void AddGlassToRay(ray_source_info *ctx, unsigned rayIndex, float opacity, const qvec3f &glasscolor)
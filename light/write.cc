@@ -118,7 +118,7 @@ static std::vector<qvec4f> LightmapNormalsToGLMVector(const lightsurf_t *lightsu
 {
     std::vector<qvec4f> res;
     for (int i = 0; i < lightsurf->samples.size(); i++) {
-        const qvec3f &color = lm->samples[i].direction;
+        const qvec3f &color = lm->directions[i];
         const float alpha = lightsurf->samples[i].occluded ? 0.0f : 1.0f;
         res.emplace_back(color[0], color[1], color[2], alpha);
     }
@@ -996,19 +996,236 @@ void SaveLightmapSurface(const mbsp_t *bsp, mface_t *face, facesup_t *facesup,
     }
 }
 
-void SaveLightmapSurfaces(bspdata_t *bspdata, const fs::path &source)
+/**
+ * Finishes the lightmaps of face `i` and reserves space for them in `lightmap_size`,
+ * storing the offsets in `id`. Returns whether the face has colored lighting.
+ */
+static bool CalculateFaceLightmap(mbsp_t *bsp, size_t i, lightsurf_t &surf, std::atomic_size_t &lightmap_size,
+    lightmap_intermediate_data_t &id)
 {
-    mbsp_t *bsp = &std::get<mbsp_t>(bspdata->bsp);
+    FinishLightmapSurface(bsp, &surf);
 
-    logging::funcheader();
+    auto f = &bsp->dfaces[i];
+    const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, i);
+    int num_styles;
+
+    if (!facesup_decoupled_global.empty()) {
+        num_styles = CalculateLightmapStyles(bsp, f, nullptr, &surf, surf.extents, lightmap_size, id);
+
+        if (!light_options.novanilla.value()) {
+            id.vanilla_lightofs = GetFileSpace(lightmap_size, surf.vanilla_extents.numsamples() * num_styles);
+        }
+    } else if (faces_sup.empty()) {
+        num_styles = CalculateLightmapStyles(bsp, f, nullptr, &surf, surf.extents, lightmap_size, id);
+    } else if (light_options.novanilla.value() || faces_sup[i].lmscale == face_modelinfo->lightmapscale) {
+        num_styles = CalculateLightmapStyles(bsp, f, &faces_sup[i], &surf, surf.extents, lightmap_size, id);
+    } else {
+        num_styles = CalculateLightmapStyles(bsp, f, nullptr, &surf, surf.extents, lightmap_size, id);
+        id.vanilla_lightofs = GetFileSpace(lightmap_size, surf.vanilla_extents.numsamples() * num_styles);
+    }
+
+    if (num_styles) {
+        id.lightofs = GetFileSpace(lightmap_size, surf.extents.numsamples() * num_styles);
+    }
+
+    return Lightsurf_HasColor(surf);
+}
+
+/**
+ * Writes the lightmaps of face `i` at the offsets reserved by CalculateFaceLightmap,
+ * and points the face (or its supplementary data) at them.
+ */
+static void SaveFaceLightmap(mbsp_t *bsp, size_t i, lightsurf_t &surf, std::vector<uint8_t> &filebase,
+    std::vector<uint8_t> &lit_filebase, std::vector<uint8_t> &lux_filebase, std::vector<uint8_t> &hdr_filebase,
+    lightmap_intermediate_data_t &id)
+{
+    auto f = &bsp->dfaces[i];
+    const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, i);
+
+    if (!facesup_decoupled_global.empty()) {
+        SaveLightmapSurface(bsp, f, nullptr, &facesup_decoupled_global[i], &surf, surf.extents, surf.extents, filebase,
+            lit_filebase, lux_filebase, hdr_filebase, id);
+    } else if (faces_sup.empty()) {
+        SaveLightmapSurface(bsp, f, nullptr, nullptr, &surf, surf.extents, surf.extents, filebase, lit_filebase,
+            lux_filebase, hdr_filebase, id);
+    } else if (light_options.novanilla.value() || faces_sup[i].lmscale == face_modelinfo->lightmapscale) {
+        if (faces_sup[i].lmscale == face_modelinfo->lightmapscale) {
+            f->lightofs = faces_sup[i].lightofs;
+        } else {
+            f->lightofs = -1;
+        }
+        SaveLightmapSurface(bsp, f, &faces_sup[i], nullptr, &surf, surf.extents, surf.extents, filebase, lit_filebase,
+            lux_filebase, hdr_filebase, id);
+        for (int j = 0; j < f->styles.size(); j++) {
+            f->styles[j] =
+                faces_sup[i].styles[j] == INVALID_LIGHTSTYLE ? INVALID_LIGHTSTYLE_OLD : faces_sup[i].styles[j];
+        }
+    } else {
+        SaveLightmapSurface(bsp, f, nullptr, nullptr, &surf, surf.extents, surf.vanilla_extents, filebase,
+            lit_filebase, lux_filebase, hdr_filebase, id);
+        SaveLightmapSurface(bsp, f, &faces_sup[i], nullptr, &surf, surf.extents, surf.extents, filebase, lit_filebase,
+            lux_filebase, hdr_filebase, id);
+    }
+}
+
+// one face's output from EncodeLightmapSurface. offsets stored in the face are
+// relative to the start of these buffers until AssembleEncodedLightmaps.
+struct encoded_lightmap_t
+{
+    size_t size = 0; // in greyscale samples, like lightmap_size
+    std::vector<uint8_t> filebase, lit_filebase, lux_filebase, hdr_filebase;
+};
 
+static bool encoding_lightmaps = false;
+static std::vector<encoded_lightmap_t> encoded_lightmaps;
+static std::atomic_bool encoded_has_color;
+
+void BeginEncodedLightmaps(const mbsp_t *bsp)
+{
     warned_about_light_map_overflow = warned_about_light_style_overflow = false;
     fully_transparent_lightmaps = 0;
 
+    encoding_lightmaps = true;
+    encoded_lightmaps.clear();
+    encoded_lightmaps.resize(bsp->dfaces.size());
+    encoded_has_color = false;
+}
+
+void EncodeLightmapSurface(mbsp_t *bsp, size_t facenum, lightsurf_t &lightsurf)
+{
+    Q_assert(encoding_lightmaps);
+
+    if (lightsurf.samples.empty()) {
+        return;
+    }
+
+    std::atomic_size_t lightmap_size = 0;
+    lightmap_intermediate_data_t id;
+
+    if (CalculateFaceLightmap(bsp, facenum, lightsurf, lightmap_size, id)) {
+        encoded_has_color = true;
+    }
+
+    encoded_lightmap_t &encoded = encoded_lightmaps[facenum];
+    encoded.size = lightmap_size;
+
+    // whether a .lit is needed isn't known until every face is done, so always keep the color
+    if (!bsp->loadversion->game->has_rgb_lightmap) {
+        encoded.filebase.resize(encoded.size);
+    }
+    encoded.lit_filebase.resize(encoded.size * 3);
+    if (light_options.write_luxfile) {
+        encoded.lux_filebase.resize(encoded.size * 3);
+    }
+    if (light_options.write_litfile & lightfile_t::all_hdr_formats) {
+        encoded.hdr_filebase.resize(encoded.size * 4);
+    }
+
+    SaveFaceLightmap(bsp, facenum, lightsurf, encoded.filebase, encoded.lit_filebase, encoded.lux_filebase,
+        encoded.hdr_filebase, id);
+}
+
+/**
+ * Concatenates the faces encoded by EncodeLightmapSurface in face order, and
+ * rebases the face offsets onto the combined buffers.
+ */
+static void AssembleEncodedLightmaps(bspdata_t *bspdata, std::vector<uint8_t> &filebase,
+    std::vector<uint8_t> &lit_filebase, std::vector<uint8_t> &lux_filebase, std::vector<uint8_t> &hdr_filebase)
+{
+    mbsp_t *bsp = &std::get<mbsp_t>(bspdata->bsp);
+
+    logging::print(logging::flag::STAT, "map uses color: {}\n", static_cast<bool>(encoded_has_color));
+    if (encoded_has_color) {
+        SetLitNeeded(*bspdata);
+    }
+
+    size_t lightmap_size = 0;
+    for (const encoded_lightmap_t &encoded : encoded_lightmaps) {
+        lightmap_size += encoded.size;
+    }
+
+    if (lightmap_size > std::numeric_limits<int>::max()) {
+        FError("exceeded max lightmap space");
+    }
+
+    if (!bsp->loadversion->game->has_rgb_lightmap) {
+        filebase.resize(lightmap_size);
+    }
+
+    if (bsp->loadversion->game->has_rgb_lightmap || light_options.write_litfile) {
+        lit_filebase.resize(lightmap_size * 3);
+    }
+
+    if (light_options.write_luxfile) {
+        lux_filebase.resize(lightmap_size * 3);
+    }
+
+    if (light_options.write_litfile & lightfile_t::all_hdr_formats) {
+        hdr_filebase.resize(lightmap_size * 4);
+    }
+
+    logging::print(logging::flag::STAT, "lightmap size (total): {}\n",
+        filebase.size() + lit_filebase.size() + lux_filebase.size() + hdr_filebase.size());
+
+    auto append = [](std::vector<uint8_t> &dst, size_t offset, std::vector<uint8_t> &src) {
+        if (!dst.empty()) {
+            std::copy(src.begin(), src.end(), dst.begin() + offset);
+        }
+        src = {};
+    };
+
+    size_t base = 0;
+
+    for (size_t i = 0; i < encoded_lightmaps.size(); i++) {
+        encoded_lightmap_t &encoded = encoded_lightmaps[i];
+
+        if (!encoded.size) {
+            continue;
+        }
+
+        append(filebase, base, encoded.filebase);
+        append(lit_filebase, base * 3, encoded.lit_filebase);
+        append(lux_filebase, base * 3, encoded.lux_filebase);
+        append(hdr_filebase, base * 4, encoded.hdr_filebase);
+
+        // face offsets are in bytes of the .bsp lighting lump
+        const int32_t rebase = static_cast<int32_t>(bsp->loadversion->game->has_rgb_lightmap ? base * 3 : base);
+        auto relocate = [rebase](int32_t &ofs) {
+            if (ofs >= 0) {
+                ofs += rebase;
+            }
+        };
+
+        relocate(bsp->dfaces[i].lightofs);
+        if (!faces_sup.empty()) {
+            relocate(faces_sup[i].lightofs);
+        }
+        if (!facesup_decoupled_global.empty()) {
+            relocate(facesup_decoupled_global[i].offset);
+        }
+
+        base += encoded.size;
+    }
+
+    encoding_lightmaps = false;
+    encoded_lightmaps = {};
+}
+
+void SaveLightmapSurfaces(bspdata_t *bspdata, const fs::path &source)
+{
+    mbsp_t *bsp = &std::get<mbsp_t>(bspdata->bsp);
+
+    logging::funcheader();
+
     // lightmap data storage
     std::vector<uint8_t> filebase, lit_filebase, lux_filebase, hdr_filebase;
 
-    if (light_options.litonly.value()) {
+    if (encoding_lightmaps) {
+        // the faces were already encoded by EncodeLightmapSurface as they were lit
+        AssembleEncodedLightmaps(bspdata, filebase, lit_filebase, lux_filebase, hdr_filebase);
+    } else if (light_options.litonly.value()) {
+        warned_about_light_map_overflow = warned_about_light_style_overflow = false;
+        fully_transparent_lightmaps = 0;
 
         if (bsp->dlightdata.empty()) {
             Error("no light data, but litonly was specified");
@@ -1045,6 +1262,9 @@ void SaveLightmapSurfaces(bspdata_t *bspdata, const fs::path &source)
                 bsp, f, &surf, surf.extents, surf.extents, filebase, lit_filebase, lux_filebase, hdr_filebase);
         });
     } else {
+        warned_about_light_map_overflow = warned_about_light_style_overflow = false;
+        fully_transparent_lightmaps = 0;
+
         std::atomic_size_t lightmap_size = 0;
         std::vector<lightmap_intermediate_data_t> intermediate_data;
         intermediate_data.resize(bsp->dfaces.size());
@@ -1060,38 +1280,7 @@ void SaveLightmapSurfaces(bspdata_t *bspdata, const fs::path &source)
                 return;
             }
 
-            FinishLightmapSurface(bsp, &surf);
-
-            auto f = &bsp->dfaces[i];
-            const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, i);
-            int num_styles;
-
-            if (!facesup_decoupled_global.empty()) {
-                num_styles =
-                    CalculateLightmapStyles(bsp, f, nullptr, &surf, surf.extents, lightmap_size, intermediate_data[i]);
-
-                if (!light_options.novanilla.value()) {
-                    intermediate_data[i].vanilla_lightofs =
-                        GetFileSpace(lightmap_size, surf.vanilla_extents.numsamples() * num_styles);
-                }
-            } else if (faces_sup.empty()) {
-                num_styles =
-                    CalculateLightmapStyles(bsp, f, nullptr, &surf, surf.extents, lightmap_size, intermediate_data[i]);
-            } else if (light_options.novanilla.value() || faces_sup[i].lmscale == face_modelinfo->lightmapscale) {
-                num_styles = CalculateLightmapStyles(
-                    bsp, f, &faces_sup[i], &surf, surf.extents, lightmap_size, intermediate_data[i]);
-            } else {
-                num_styles =
-                    CalculateLightmapStyles(bsp, f, nullptr, &surf, surf.extents, lightmap_size, intermediate_data[i]);
-                intermediate_data[i].vanilla_lightofs =
-                    GetFileSpace(lightmap_size, surf.vanilla_extents.numsamples() * num_styles);
-            }
-
-            if (num_styles) {
-                intermediate_data[i].lightofs = GetFileSpace(lightmap_size, surf.extents.numsamples() * num_styles);
-            }
-
-            if (Lightsurf_HasColor(surf)) {
+            if (CalculateFaceLightmap(bsp, i, surf, lightmap_size, intermediate_data[i])) {
                 has_color = true;
             }
         });
@@ -1129,33 +1318,8 @@ void SaveLightmapSurfaces(bspdata_t *bspdata, const fs::path &source)
                 return;
             }
 
-            auto f = &bsp->dfaces[i];
-            const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, i);
-
-            if (!facesup_decoupled_global.empty()) {
-                SaveLightmapSurface(bsp, f, nullptr, &facesup_decoupled_global[i], &surf, surf.extents, surf.extents,
-                    filebase, lit_filebase, lux_filebase, hdr_filebase, intermediate_data[i]);
-            } else if (faces_sup.empty()) {
-                SaveLightmapSurface(bsp, f, nullptr, nullptr, &surf, surf.extents, surf.extents, filebase, lit_filebase,
-                    lux_filebase, hdr_filebase, intermediate_data[i]);
-            } else if (light_options.novanilla.value() || faces_sup[i].lmscale == face_modelinfo->lightmapscale) {
-                if (faces_sup[i].lmscale == face_modelinfo->lightmapscale) {
-                    f->lightofs = faces_sup[i].lightofs;
-                } else {
-                    f->lightofs = -1;
-                }
-                SaveLightmapSurface(bsp, f, &faces_sup[i], nullptr, &surf, surf.extents, surf.extents, filebase,
-                    lit_filebase, lux_filebase, hdr_filebase, intermediate_data[i]);
-                for (int j = 0; j < f->styles.size(); j++) {
-                    f->styles[j] =
-                        faces_sup[i].styles[j] == INVALID_LIGHTSTYLE ? INVALID_LIGHTSTYLE_OLD : faces_sup[i].styles[j];
-                }
-            } else {
-                SaveLightmapSurface(bsp, f, nullptr, nullptr, &surf, surf.extents, surf.vanilla_extents, filebase,
-                    lit_filebase, lux_filebase, hdr_filebase, intermediate_data[i]);
-                SaveLightmapSurface(bsp, f, &faces_sup[i], nullptr, &surf, surf.extents, surf.extents, filebase,
-                    lit_filebase, lux_filebase, hdr_filebase, intermediate_data[i]);
-            }
+            SaveFaceLightmap(
+                bsp, i, surf, filebase, lit_filebase, lux_filebase, hdr_filebase, intermediate_data[i]);
         });
     }
 
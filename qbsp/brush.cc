@@ -36,6 +36,7 @@ side_t side_t::clone_non_winding_data() const
     result.onnode = this->onnode;
     result.bevel = this->bevel;
     result.source = this->source;
+    result.hullnum = this->hullnum;
     result.tested = this->tested;
     return result;
 }
@@ -59,7 +60,12 @@ bool side_t::is_visible() const
         return false;
     }
 
-    return source && source->visible;
+    return source && source->visible[hullnum];
+}
+
+void side_t::set_visible(bool visible)
+{
+    source->visible[hullnum] = visible;
 }
 
 const maptexinfo_t &side_t::get_texinfo() const
@@ -301,12 +307,12 @@ bool CreateBrushWindings(bspbrush_t &brush)
 
             side.w = std::move(*w);
             if (side.source) {
-                side.source->visible = true;
+                side.set_visible(true);
             }
         } else {
             side.w.clear();
             if (side.source) {
-                side.source->visible = false;
+                side.set_visible(false);
             }
         }
     }
@@ -596,6 +602,7 @@ std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush
         dst.planenum = src.planenum;
         dst.bevel = src.bevel;
         dst.source = &src;
+        dst.hullnum = hullnum.value_or(0);
     }
 
     // expand the brushes for the hull
@@ -679,7 +686,7 @@ std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush
 //=============================================================================
 
 static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hullnum, content_stats_t &stats,
-    bspbrush_t::container &brushes, logging::percent_clock &clock, size_t &num_clipped)
+    bspbrush_t::container &brushes, aabb3d &bounds, logging::percent_clock &clock, size_t &num_clipped)
 {
     clock.max += src.mapbrushes.size();
 
@@ -798,7 +805,7 @@ static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hu
         if (hullnum.has_value() && contents.is_clip()) {
             if (hullnum.value() == 0) {
                 if (auto brush = LoadBrush(src, mapbrush, contents, hullnum, num_clipped)) {
-                    dst.bounds += brush->bounds;
+                    bounds += brush->bounds;
                 }
                 continue;
                 // for hull1, 2, etc., convert clip to CONTENTS_SOLID
@@ -851,7 +858,7 @@ static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hu
 
         stats.count_contents_in_stats(brush->contents);
 
-        dst.bounds += brush->bounds;
+        bounds += brush->bounds;
         brushes.push_back(bspbrush_t::make_ptr(std::move(*brush)));
     }
 }
@@ -864,7 +871,8 @@ hullnum nullopt should contain ALL brushes; BSPX and Quake II, etc.
 hullnum 0 does not contain clip brushes.
 ============
 */
-void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::container &brushes, size_t &num_clipped)
+void Brush_LoadEntity(
+    mapentity_t &entity, hull_index_t hullnum, bspbrush_t::container &brushes, aabb3d &bounds, size_t &num_clipped)
 {
     logging::funcheader();
 
@@ -874,7 +882,7 @@ void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::con
     logging::percent_clock clock(0);
     clock.displayElapsed = is_world_entity;
 
-    Brush_LoadEntity(entity, entity, hullnum, stats, brushes, clock, num_clipped);
+    Brush_LoadEntity(entity, entity, hullnum, stats, brushes, bounds, clock, num_clipped);
 
     /*
      * If this is the world entity, find all func_group and func_detail
@@ -888,10 +896,13 @@ void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::con
         for (int i = 1; i < map.entities.size(); i++) {
             mapentity_t &source = map.entities.at(i);
 
-            ProcessAreaPortal(source);
+            // only once; the clipping hulls may be running concurrently
+            if (!hullnum.value_or(0)) {
+                ProcessAreaPortal(source);
+            }
 
             if (IsWorldBrushEntity(source) || IsNonRemoveWorldBrushEntity(source)) {
-                Brush_LoadEntity(entity, source, hullnum, stats, brushes, clock, num_clipped);
+                Brush_LoadEntity(entity, source, hullnum, stats, brushes, bounds, clock, num_clipped);
             }
         }
     }
@@ -910,7 +921,7 @@ void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::con
         for (auto &side : brush->sides) {
             if (!side.source) {
                 sourceless_sides_stat.count++;
-            } else if (side.source->visible) {
+            } else if (side.source->visible[side.hullnum]) {
                 visible_sides_stat.count++;
             } else {
                 invisible_sides_stat.count++;
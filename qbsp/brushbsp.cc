@@ -1247,19 +1247,45 @@ struct brushbsp_input_stats_t : logging::stat_tracker_t
     stat &clip_faces = register_stat("clip faces");
 };
 
+/*
+==================
+AddHeadnodePlanes
+
+Adds the planes of the headnode volume BrushBSP makes for these brushes.
+Building a tree adds no other planes, so once the brushes are loaded and
+this is called, trees can be built concurrently without the plane list
+depending on which finished first.
+==================
+*/
+void AddHeadnodePlanes(const aabb3d &bounds, const bspbrush_t::container &brushlist)
+{
+    // an empty tree doesn't need any
+    if (brushlist.empty()) {
+        return;
+    }
+
+    aabb3d tree_bounds = bounds;
+
+    for (const auto &b : brushlist) {
+        tree_bounds += b->bounds;
+    }
+
+    BrushFromBounds(tree_bounds.grow(SIDESPACE));
+}
+
 /*
 ==================
 BrushBSP
 ==================
 */
-void BrushBSP(tree_t &tree, mapentity_t &entity, const bspbrush_t::container &brushlist, tree_split_t split_type)
+void BrushBSP(tree_t &tree, const aabb3d &bounds, const bspbrush_t::container &brushlist, tree_split_t split_type)
 {
     logging::header(__func__);
 
     // NOTE: entity bounds may include brushes that were deleted
     // from the brush list (e.g. clip brushes in Q1 hull 0 still need to affect the model/node bounds)
     // so start with that.
-    tree.bounds = entity.bounds;
+    tree.bounds = bounds;
 
     if (brushlist.empty()) {
         /*
@@ -1269,7 +1295,7 @@ void BrushBSP(tree_t &tree, mapentity_t &entity, const bspbrush_t::container &br
          * smarter, but this works.
          */
         auto headnode = tree.create_node();
-        headnode->bounds = entity.bounds;
+        headnode->bounds = bounds;
 
         auto *nodedata = headnode->get_nodedata();
 
@@ -344,13 +344,15 @@ void MakeMarkFaces(node_t *node)
 // FixupDetailFence
 //===========================================================================
 
-// gathers markfaces from the node and descendants, if they're in detail fence leafs
-static void FixupDetailFence_FindDetailFenceFaces(std::set<face_t *> *dest, node_t *node)
+// gathers markfaces from the node and descendants, if they're in detail fence leafs.
+// they're kept in the order they're found, not pointer order, so the output doesn't
+// depend on where the faces were allocated
+static void FixupDetailFence_FindDetailFenceFaces(std::vector<face_t *> *dest, std::set<face_t *> *seen, node_t *node)
 {
     // descend to leafs
     if (nodedata_t *nodedata = node->get_nodedata()) {
-        FixupDetailFence_FindDetailFenceFaces(dest, nodedata->children[0]);
-        FixupDetailFence_FindDetailFenceFaces(dest, nodedata->children[1]);
+        FixupDetailFence_FindDetailFenceFaces(dest, seen, nodedata->children[0]);
+        FixupDetailFence_FindDetailFenceFaces(dest, seen, nodedata->children[1]);
         return;
     }
 
@@ -362,7 +364,9 @@ static void FixupDetailFence_FindDetailFenceFaces(std::set<face_t *> *dest, node
         return;
 
     for (auto *f : leafdata->markfaces) {
-        dest->insert(f);
+        if (seen->insert(f).second) {
+            dest->push_back(f);
+        }
     }
 }
 
@@ -408,7 +412,7 @@ static node_t *FixupMarkFaces_ProcessCluster_FindStorageLeaf(node_t *node)
 }
 
 // returns an invalid aabb if given an empty set
-static const aabb3d BoundFaces(const std::set<face_t *> &marfaces_to_add)
+static const aabb3d BoundFaces(const std::vector<face_t *> &marfaces_to_add)
 {
     aabb3d result;
     for (const face_t *face : marfaces_to_add) {
@@ -426,7 +430,7 @@ static void AddBoundsToNode(node_t *start, const aabb3d &bounds_to_add)
     }
 }
 
-static void FixupMarkFaces_AddFacesToLeaf(node_t *node, const std::set<face_t *> &marfaces_to_add)
+static void FixupMarkFaces_AddFacesToLeaf(node_t *node, const std::vector<face_t *> &marfaces_to_add)
 {
     Q_assert(!marfaces_to_add.empty());
     Q_assert(FixupMarkFaces_IsUsableLeaf(node));
@@ -436,12 +440,11 @@ static void FixupMarkFaces_AddFacesToLeaf(node_t *node, const std::set<face_t *>
     auto current_markfaces = std::set<face_t *>(leafdata->markfaces.begin(), leafdata->markfaces.end());
 
     for (face_t *f : marfaces_to_add) {
-        current_markfaces.insert(f);
+        if (current_markfaces.insert(f).second) {
+            leafdata->markfaces.push_back(f);
+        }
     }
 
-    auto new_markfaces = std::vector<face_t *>(current_markfaces.begin(), current_markfaces.end());
-    leafdata->markfaces = new_markfaces;
-
     // expand the bounds of `node` (plus all ancestors) to encompass `markfaces_to_add`, to prevent frustum culling
     // of the storage leaf when the markfaces_to_add are in view (fixes q1_detail_fence2.map test case).
     //
@@ -464,9 +467,10 @@ static void FixupMarkFaces_ProcessCluster(node_t *node)
 
     logging::print("fixing up cluster at {}\n", node->bounds.centroid());
 
-    // gather all marksurfaces of func_detail_fence containing leafs in the cluster into a std::set
-    std::set<face_t *> marfaces_to_propagate;
-    FixupDetailFence_FindDetailFenceFaces(&marfaces_to_propagate, node);
+    // gather all marksurfaces of func_detail_fence containing leafs in the cluster
+    std::vector<face_t *> marfaces_to_propagate;
+    std::set<face_t *> seen;
+    FixupDetailFence_FindDetailFenceFaces(&marfaces_to_propagate, &seen, node);
     if (marfaces_to_propagate.empty()) {
         // early exit if there are no markfaces to propagate (FixupMarkFaces_AddFacesToLeaf requires at least some work)
         return;
@@ -56,6 +56,9 @@ struct planehash_t
 {
     // planes indices (into the `planes` vector)
     pareto::spatial_map<double, 4, size_t> hash;
+
+    // the hulls add planes concurrently; finding them takes a shared lock
+    std::shared_mutex lock;
 };
 
 struct vertexhash_t
@@ -70,9 +73,11 @@ mapdata_t::mapdata_t()
 {
 }
 
-// add the specified plane to the list
-size_t mapdata_t::add_plane(const qplane3d &plane)
+// add the specified plane to the list; the plane lock must be held
+static size_t AddPlane(mapdata_t &data, const qplane3d &plane)
 {
+    auto &planes = data.planes;
+
     planes.emplace_back(plane);
     planes.emplace_back(-plane);
 
@@ -91,33 +96,47 @@ size_t mapdata_t::add_plane(const qplane3d &plane)
         result = positive_index;
     }
 
-    plane_hash->hash.emplace(pareto::point<double, 4>{positive.get_normal()[0], positive.get_normal()[1],
-                                 positive.get_normal()[2], positive.get_dist()},
+    data.plane_hash->hash.emplace(pareto::point<double, 4>{positive.get_normal()[0], positive.get_normal()[1],
+                                      positive.get_normal()[2], positive.get_dist()},
         positive_index);
-    plane_hash->hash.emplace(pareto::point<double, 4>{negative.get_normal()[0], negative.get_normal()[1],
-                                 negative.get_normal()[2], negative.get_dist()},
+    data.plane_hash->hash.emplace(pareto::point<double, 4>{negative.get_normal()[0], negative.get_normal()[1],
+                                      negative.get_normal()[2], negative.get_dist()},
         negative_index);
 
     return result;
 }
 
-std::optional<size_t> mapdata_t::find_plane_nonfatal(const qplane3d &plane)
+// the plane lock must be held
+static std::optional<size_t> FindPlane(const mapdata_t &data, const qplane3d &plane)
 {
     constexpr double HALF_NORMAL_EPSILON = NORMAL_EPSILON * 0.5;
     constexpr double HALF_DIST_EPSILON = DIST_EPSILON * 0.5;
 
-    if (auto it = plane_hash->hash.find_intersection(
+    if (auto it = data.plane_hash->hash.find_intersection(
             {plane.normal[0] - HALF_NORMAL_EPSILON, plane.normal[1] - HALF_NORMAL_EPSILON,
                 plane.normal[2] - HALF_NORMAL_EPSILON, plane.dist - HALF_DIST_EPSILON},
             {plane.normal[0] + HALF_NORMAL_EPSILON, plane.normal[1] + HALF_NORMAL_EPSILON,
                 plane.normal[2] + HALF_NORMAL_EPSILON, plane.dist + HALF_DIST_EPSILON});
-        it != plane_hash->hash.end()) {
+        it != data.plane_hash->hash.end()) {
         return it->second;
     }
 
     return std::nullopt;
 }
 
+// add the specified plane to the list
+size_t mapdata_t::add_plane(const qplane3d &plane)
+{
+    std::unique_lock lock(plane_hash->lock);
+    return AddPlane(*this, plane);
+}
+
+std::optional<size_t> mapdata_t::find_plane_nonfatal(const qplane3d &plane)
+{
+    std::shared_lock lock(plane_hash->lock);
+    return FindPlane(*this, plane);
+}
+
 // find the specified plane in the list if it exists. throws
 // if not.
 size_t mapdata_t::find_plane(const qplane3d &plane)
@@ -137,7 +156,14 @@ size_t mapdata_t::add_or_find_plane(const qplane3d &plane)
         return *index;
     }
 
-    return add_plane(plane);
+    std::unique_lock lock(plane_hash->lock);
+
+    // another hull may have added it in the meantime
+    if (auto index = FindPlane(*this, plane)) {
+        return *index;
+    }
+
+    return AddPlane(*this, plane);
 }
 
 const qbsp_plane_t &mapdata_t::get_plane(size_t pnum)
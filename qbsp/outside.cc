@@ -30,6 +30,7 @@
 #include <common/log.hh>
 #include <common/ostream.hh>
 #include <climits>
+#include <mutex>
 #include <vector>
 #include <set>
 #include <list>
@@ -409,10 +410,10 @@ void MarkBrushSidesInvisible(bspbrush_t::container &brushes)
     for (auto &brush : brushes) {
         for (auto &face : brush->sides) {
             if (face.source) {
-                face.source->visible = false;
+                face.set_visible(false);
 
                 if (face.source->get_texinfo().flags.is_hint()) {
-                    face.source->visible = true; // hints are always visible
+                    face.set_visible(true); // hints are always visible
                 }
             }
         }
@@ -459,7 +460,7 @@ static void MarkVisibleBrushSides_R(node_t *node)
                     if (side.source && qv::epsilonEqual(side.get_positive_plane(), portal->plane)) {
                         // we've found a brush side in an original brush in the neighbouring
                         // leaf, on a portal to this (non-opaque) leaf, so mark it as visible.
-                        side.source->visible = true;
+                        side.set_visible(true);
                     }
                 }
             }
@@ -645,6 +646,9 @@ static std::vector<portal_t *> MakeLeakLine(node_t *outleaf, mapentity_t *&leake
     return result;
 }
 
+// held while writing the leak files
+static std::mutex leakfile_mutex;
+
 /*
 ===========
 FillOutside
@@ -753,11 +757,17 @@ bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brus
     if (leakentity) {
         logging::print("WARNING: Reached occupant \"{}\" at ({}), no filling performed.\n",
             leakentity->epairs.get("classname"), leakentity->origin);
-        if (map.leakfile)
+
+        // the clipping hulls are filled concurrently; keep the leak of the
+        // lowest hull, as if they had been filled in order
+        std::unique_lock lock(leakfile_mutex);
+
+        if (map.leakfile && map.leakfile_hull <= hullnum.value_or(0))
             return false;
 
         WriteLeakLine(*leakentity, leakline);
         map.leakfile = true;
+        map.leakfile_hull = hullnum.value_or(0);
 
         // also write the leak portals to `<bsp_path>.leak.prt`
         WriteDebugPortals(leakline, "leak");
@@ -1148,7 +1148,7 @@ static void MarkVisibleSides_r(node_t *node, visible_faces_stats_t &stats)
         }
         for (int i = 0; i < 2; ++i) {
             if (p->sides[i] && p->sides[i]->source) {
-                p->sides[i]->source->visible = true;
+                p->sides[i]->set_visible(true);
                 stats.sides_visible++;
             }
         }
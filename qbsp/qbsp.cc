@@ -44,6 +44,8 @@
 
 #include <fmt/chrono.h>
 
+#include <tbb/parallel_for.h>
+
 namespace settings
 {
 bool wadpath::operator<(const wadpath &other) const
@@ -1007,13 +1009,40 @@ static bool ShouldGenerateClipnodes(mapentity_t &entity, hull_index_t hullnum)
     return hulls & (1 << hullnum.value_or(0));
 }
 
+/*
+ * One hull of an entity, as loaded by LoadEntity and built by ProcessEntity.
+ * The brushes are loaded one entity at a time, since that's what adds the
+ * planes; the trees are built concurrently and written out in entity order by
+ * EmitEntity and ExportClipNodes: the models share their vertices and planes,
+ * so writing them can't be split up per entity.
+ */
+struct staged_entity_t
+{
+    bool loaded = false;
+    // the bounds of this hull of the entity, if it has a tree to build
+    std::optional<aabb3d> bounds;
+    // the brushes the tree's leafs refer to
+    bspbrush_t::container brushes;
+    // the main hull's tree, with its faces made
+    std::unique_ptr<tree_t> tree;
+    // the tree is an empty stand-in for an entity without a main hull
+    bool placeholder = false;
+    // a clipping hull
+    std::optional<staged_clipnodes_t> clipnodes;
+};
+
 /*
 ===============
-ProcessEntity
+LoadEntity
+
+Loads the brushes of one hull of the entity into `staged`, and adds all the
+planes ProcessEntity will need.
 ===============
 */
-static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
+static void LoadEntity(mapentity_t &entity, hull_index_t hullnum, staged_entity_t &staged)
 {
+    staged.loaded = true;
+
     /* No map brushes means non-bmodel entity.
        We need to handle worldspawn containing no brushes, though. */
     if (!entity.mapbrushes.size() && !map.is_world_entity(entity)) {
@@ -1052,7 +1081,10 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
                 logging::print(logging::flag::STAT, "     MODEL: {}\n", mod);
             }
 
-            entity.epairs.set("model", mod);
+            // only once, when the model number is reserved
+            if (!hullnum.value_or(0)) {
+                entity.epairs.set("model", mod);
+            }
         }
     }
 
@@ -1060,19 +1092,23 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
         entity.epairs.set("_lmscale", std::to_string(qbsp_options.lmscale.value()));
     }
 
-    // Init the entity
-    entity.bounds = {};
-
     // reserve enough brushes; we would only make less,
     // never more
-    bspbrush_t::container brushes;
+    bspbrush_t::container &brushes = staged.brushes;
     brushes.reserve(entity.mapbrushes.size());
 
+    // the bounds of this hull of the entity
+    aabb3d bounds;
+
     /*
      * Convert the map brushes (planes) into BSP brushes (polygons)
      */
     size_t num_clipped = 0;
-    Brush_LoadEntity(entity, hullnum, brushes, num_clipped);
+    Brush_LoadEntity(entity, hullnum, brushes, bounds, num_clipped);
+
+    if (!hullnum.value_or(0)) {
+        entity.bounds = bounds;
+    }
 
     if (num_clipped && !qbsp_options.verbose.value()) {
         logging::print(logging::flag::STAT,
@@ -1088,6 +1124,39 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
     logging::print(
         logging::flag::STAT, "INFO: calculating BSP for {} brushes with {} sides\n", brushes.size(), num_sides);
 
+    // we're discarding the brush
+    if (discarded_trigger) {
+        if (!hullnum.value_or(0)) {
+            entity.epairs.set("mins", fmt::to_string(bounds.mins()));
+            entity.epairs.set("maxs", fmt::to_string(bounds.maxs()));
+        }
+        brushes.clear();
+        return;
+    }
+
+    if (ShouldGenerateClipnodes(entity, hullnum)) {
+        AddHeadnodePlanes(bounds, brushes);
+    }
+
+    staged.bounds = bounds;
+}
+
+/*
+===============
+ProcessEntity
+
+Builds one hull of the entity into `staged`, rather than writing it to map.bsp.
+===============
+*/
+static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum, staged_entity_t &staged)
+{
+    if (!staged.bounds) {
+        return;
+    }
+
+    const aabb3d &bounds = *staged.bounds;
+    bspbrush_t::container &brushes = staged.brushes;
+
     // sort by ascending (chop_index, line_number) pair
     std::ranges::sort(
         brushes, [](const auto &a, const auto &b) { return a->mapbrush->sort_key() < b->mapbrush->sort_key(); });
@@ -1097,17 +1166,8 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
         ChopBrushes(brushes, qbsp_options.chopfragment.value());
     }
 
-    // we're discarding the brush
-    if (discarded_trigger) {
-        if (!hullnum.value_or(0)) {
-            entity.epairs.set("mins", fmt::to_string(entity.bounds.mins()));
-            entity.epairs.set("maxs", fmt::to_string(entity.bounds.maxs()));
-        }
-        return;
-    }
-
     // corner case, -omitdetail with all detail in an bmodel
-    if (brushes.empty() && entity.bounds == aabb3d()) {
+    if (brushes.empty() && bounds == aabb3d()) {
         return;
     }
 
@@ -1116,13 +1176,14 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
         // We still need to emit an empty tree otherwise hull 0 will point past
         // the clipnode array (FIXME?).
         bspbrush_t::container empty;
-        tree_t tree;
-        BrushBSP(tree, entity, empty, tree_split_t::FAST);
+        auto tree = std::make_unique<tree_t>();
+        BrushBSP(*tree, bounds, empty, tree_split_t::FAST);
         if (hullnum.value_or(0)) {
-            ExportClipNodes(entity, tree.headnode, hullnum.value());
+            staged.clipnodes = StageClipNodes(entity, tree->headnode);
         } else {
-            MakeTreePortals(tree); // needed to assign leaf bounds
-            ExportDrawNodes(entity, tree.headnode, map.bsp.dfaces.size());
+            MakeTreePortals(*tree); // needed to assign leaf bounds
+            staged.tree = std::move(tree);
+            staged.placeholder = true;
         }
         return;
     }
@@ -1130,7 +1191,7 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
     // simpler operation for hulls
     if (hullnum.value_or(0)) {
         tree_t tree;
-        BrushBSP(tree, entity, brushes, tree_split_t::FAST);
+        BrushBSP(tree, bounds, brushes, tree_split_t::FAST);
         if (map.is_world_entity(entity) && !qbsp_options.nofill.value()) {
             // assume non-world bmodels are simple
             MakeTreePortals(tree);
@@ -1140,7 +1201,7 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
 
                 // make a really good tree
                 tree.clear();
-                BrushBSP(tree, entity, brushes, tree_split_t::PRECISE);
+                BrushBSP(tree, bounds, brushes, tree_split_t::PRECISE);
 
                 // fill again so PruneNodes works
                 MakeTreePortals(tree);
@@ -1153,14 +1214,15 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
             }
             CountLeafs(tree.headnode);
         }
-        ExportClipNodes(entity, tree.headnode, hullnum.value());
+        staged.clipnodes = StageClipNodes(entity, tree.headnode);
         return;
     }
 
     // full operation for collision (or main hull)
-    tree_t tree;
+    staged.tree = std::make_unique<tree_t>();
+    tree_t &tree = *staged.tree;
 
-    BrushBSP(tree, entity, brushes,
+    BrushBSP(tree, bounds, brushes,
         qbsp_options.forcegoodtree.value() ? tree_split_t::PRECISE : // we asked for the slow method
             !map.is_world_entity(entity) ? tree_split_t::FAST
                                          : // brush models are assumed to be simple
@@ -1195,7 +1257,7 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
 
             // make a really good tree
             tree.clear();
-            BrushBSP(tree, entity, brushes, tree_split_t::PRECISE);
+            BrushBSP(tree, bounds, brushes, tree_split_t::PRECISE);
 
             // debug output of bspbrushes
             if (!hullnum.value_or(0)) {
@@ -1230,7 +1292,7 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
 
         // rebuild BSP now that we've marked invisible brush sides
         tree.clear();
-        BrushBSP(tree, entity, brushes, tree_split_t::PRECISE);
+        BrushBSP(tree, bounds, brushes, tree_split_t::PRECISE);
     }
 
     MakeTreePortals(tree);
@@ -1296,6 +1358,27 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
     FixupDetailFence(tree);
 
     CountLeafs(tree.headnode);
+}
+
+/*
+===============
+EmitEntity
+
+Writes the main hull that ProcessEntity staged to map.bsp
+===============
+*/
+static void EmitEntity(mapentity_t &entity, staged_entity_t &staged)
+{
+    if (!staged.tree) {
+        return;
+    }
+
+    tree_t &tree = *staged.tree;
+
+    if (staged.placeholder) {
+        ExportDrawNodes(entity, tree.headnode, map.bsp.dfaces.size());
+        return;
+    }
 
     // output vertices first, since TJunc needs it
     EmitVertices(tree.headnode);
@@ -1519,43 +1602,145 @@ static void BSPX_CreateBrushList()
     map.exported_bspxbrushes = StringToVector(str.str());
 }
 
+// the logging mask for the entities and hulls that aren't logged
+static bitflags<logging::flag> UnloggedMask(bitflags<logging::flag> mask)
+{
+    return mask &
+           ~(bitflags<logging::flag>(logging::flag::STAT) | logging::flag::PROGRESS | logging::flag::CLOCK_ELAPSED);
+}
+
+// runs fn with the logging mask of this entity / hull combination
+template<typename F>
+static void WithEntityLogging(const mapentity_t &entity, hull_index_t hullnum, F &&fn)
+{
+    bool wants_logging = true;
+
+    // decide if we want to log this entity / hull combination
+    if (!map.is_world_entity(entity)) {
+        wants_logging = wants_logging && qbsp_options.logbmodels.value();
+    }
+    if (hullnum.value_or(0)) {
+        wants_logging = wants_logging && qbsp_options.loghulls.value();
+    }
+
+    // update logging mask if requested. only write it if it changes:
+    // the entities and hulls built concurrently have already been quieted
+    const auto prev_logging_mask = logging::mask;
+    const auto entity_logging_mask = wants_logging ? prev_logging_mask : UnloggedMask(prev_logging_mask);
+
+    if (entity_logging_mask != prev_logging_mask) {
+        logging::mask = entity_logging_mask;
+    }
+
+    fn();
+
+    // restore logging
+    if (entity_logging_mask != prev_logging_mask) {
+        logging::mask = prev_logging_mask;
+    }
+}
+
 /*
 =================
-CreateSingleHull
+LoadSingleHull
+
+Loads the brushes of every entity for one hull, for CreateSingleHull
 =================
 */
-static void CreateSingleHull(hull_index_t hullnum)
+static std::vector<staged_entity_t> LoadSingleHull(hull_index_t hullnum)
 {
-    if (hullnum.has_value()) {
-        logging::print("Processing hull {}...\n", hullnum.value());
-    } else {
-        logging::print("Processing map...\n");
+    std::vector<staged_entity_t> staged(map.entities.size());
+
+    for (size_t i = 0; i < map.entities.size(); i++) {
+        mapentity_t &entity = map.entities[i];
+        WithEntityLogging(entity, hullnum, [&] { LoadEntity(entity, hullnum, staged[i]); });
     }
 
-    // for each entity in the map file that has geometry
-    for (auto &entity : map.entities) {
-        bool wants_logging = true;
+    return staged;
+}
 
-        // decide if we want to log this entity / hull combination
-        if (!map.is_world_entity(entity)) {
-            wants_logging = wants_logging && qbsp_options.logbmodels.value();
+/*
+=================
+CreateSingleHull
+
+Entities that `staged` hasn't loaded yet are loaded as they're reached.
+Returns the staged clipnodes of a clipping hull, for ExportClipNodes
+=================
+*/
+static std::vector<staged_clipnodes_t> CreateSingleHull(hull_index_t hullnum, std::vector<staged_entity_t> staged = {})
+{
+    std::vector<staged_clipnodes_t> clipnodes;
+
+    staged.resize(map.entities.size());
+
+    auto load = [&](size_t i) {
+        if (!staged[i].loaded) {
+            WithEntityLogging(map.entities[i], hullnum, [&] { LoadEntity(map.entities[i], hullnum, staged[i]); });
         }
-        if (hullnum.value_or(0)) {
-            wants_logging = wants_logging && qbsp_options.loghulls.value();
+    };
+
+    auto build = [&](size_t i) {
+        WithEntityLogging(map.entities[i], hullnum, [&] { ProcessEntity(map.entities[i], hullnum, staged[i]); });
+    };
+
+    auto output = [&](size_t i) {
+        if (staged[i].clipnodes) {
+            clipnodes.push_back(std::move(*staged[i].clipnodes));
+        } else {
+            WithEntityLogging(map.entities[i], hullnum, [&] { EmitEntity(map.entities[i], staged[i]); });
         }
+        staged[i] = {};
+    };
 
-        // update logging mask if requested
-        const auto prev_logging_mask = logging::mask;
-        if (!wants_logging) {
-            logging::mask &= ~(
-                bitflags<logging::flag>(logging::flag::STAT) | logging::flag::PROGRESS | logging::flag::CLOCK_ELAPSED);
+    // the world comes first, as model 0
+    load(0);
+    build(0);
+    output(0);
+
+    const bool logged = qbsp_options.logbmodels.value() && (!hullnum.value_or(0) || qbsp_options.loghulls.value());
+    // every bmodel writes its missing portal sides to the same file
+    const bool debug_files = !hullnum.value_or(0) && qbsp_options.debug_missing_portal_sides.value();
+
+    if (logged || debug_files) {
+        // one at a time, so their logs don't interleave
+        for (size_t i = 1; i < map.entities.size(); i++) {
+            load(i);
+            build(i);
+            output(i);
         }
+        return clipnodes;
+    }
+
+    // the bmodels are independent builds once their planes are added, so
+    // they're loaded in entity order, then built concurrently
+    for (size_t i = 1; i < map.entities.size(); i++) {
+        load(i);
+    }
+
+    const size_t numplanes = map.planes.size();
 
-        ProcessEntity(entity, hullnum);
+    const auto prev_logging_mask = logging::mask;
+    const auto bmodel_logging_mask = UnloggedMask(prev_logging_mask);
 
-        // restore logging
+    if (bmodel_logging_mask != prev_logging_mask) {
+        logging::mask = bmodel_logging_mask;
+    }
+
+    tbb::parallel_for(static_cast<size_t>(1), map.entities.size(), build);
+
+    if (bmodel_logging_mask != prev_logging_mask) {
         logging::mask = prev_logging_mask;
     }
+
+    // a plane added while building would be numbered by whichever bmodel got there first
+    Q_assert(map.planes.size() == numplanes);
+
+    // write them out in entity order, so the output doesn't depend on which finished first
+    for (size_t i = 1; i < map.entities.size(); i++) {
+        output(i);
+    }
+
+    return clipnodes;
 }
 
 /*
@@ -1565,22 +1750,65 @@ CreateHulls
 */
 static void CreateHulls()
 {
-    /* create the hulls sequentially */
     auto hulls = qbsp_options.target_game->get_hull_sizes();
 
     // game has no hulls, so we have to export brush lists and stuff.
     if (!hulls.size()) {
+        logging::print("Processing map...\n");
         CreateSingleHull(std::nullopt);
         return;
     }
 
-    // all the hulls
-    for (size_t i = 0; i < hulls.size(); i++) {
-        CreateSingleHull(i);
+    // hull 0 comes first: it reserves the model numbers, and
+    // its planes are output before the clipping hulls'
+    logging::print("Processing hull 0...\n");
+    CreateSingleHull(0);
 
-        // only create hull 0 if fNoclip is set
-        if (qbsp_options.noclip.value()) {
-            break;
+    // only create hull 0 if fNoclip is set
+    if (qbsp_options.noclip.value()) {
+        return;
+    }
+
+    std::vector<std::vector<staged_clipnodes_t>> clipnodes(hulls.size());
+
+    if (qbsp_options.loghulls.value()) {
+        // one at a time, so their logs don't interleave
+        for (size_t i = 1; i < hulls.size(); i++) {
+            logging::print("Processing hull {}...\n", i);
+            clipnodes[i] = CreateSingleHull(i);
+        }
+    } else {
+        // the clipping hulls only share the plane list, so they're built
+        // concurrently; they aren't logged, so quiet them all up front
+        for (size_t i = 1; i < hulls.size(); i++) {
+            logging::print("Processing hull {}...\n", i);
+        }
+
+        const auto prev_logging_mask = logging::mask;
+        logging::mask = UnloggedMask(prev_logging_mask);
+
+        // the brushes are loaded in hull order first, so the planes are
+        // added in the same order as when the hulls are built one at a time
+        std::vector<std::vector<staged_entity_t>> staged(hulls.size());
+        for (size_t i = 1; i < hulls.size(); i++) {
+            staged[i] = LoadSingleHull(i);
+        }
+
+        const size_t numplanes = map.planes.size();
+
+        tbb::parallel_for(static_cast<size_t>(1), hulls.size(),
+            [&](size_t i) { clipnodes[i] = CreateSingleHull(i, std::move(staged[i])); });
+
+        // a plane added while building would be numbered by whichever hull got there first
+        Q_assert(map.planes.size() == numplanes);
+
+        logging::mask = prev_logging_mask;
+    }
+
+    // write them out in hull order, so the output doesn't depend on which finished first
+    for (size_t i = 1; i < hulls.size(); i++) {
+        for (auto &staged : clipnodes[i]) {
+            ExportClipNodes(staged, i);
         }
     }
 }
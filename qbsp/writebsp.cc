@@ -98,10 +98,10 @@ size_t ExportMapTexinfo(size_t texinfonum)
 
 /*
 ==================
-ExportClipNodes
+StageClipNodes
 ==================
 */
-static size_t ExportClipNodes(node_t *node)
+static int32_t StageClipNodes(std::vector<bsp2_dclipnode_t> &nodes, node_t *node)
 {
     if (auto *leafdata = node->get_leafdata()) {
         return qbsp_options.target_game->contents_to_native(leafdata->contents);
@@ -110,37 +110,78 @@ static size_t ExportClipNodes(node_t *node)
     auto *nodedata = node->get_nodedata();
 
     /* emit a clipnode */
-    const size_t nodenum = map.bsp.dclipnodes.size();
-    map.bsp.dclipnodes.emplace_back();
+    const int32_t nodenum = static_cast<int32_t>(nodes.size());
+    nodes.emplace_back();
 
-    const int child0 = ExportClipNodes(nodedata->children[0]);
-    const int child1 = ExportClipNodes(nodedata->children[1]);
+    const int32_t child0 = StageClipNodes(nodes, nodedata->children[0]);
+    const int32_t child1 = StageClipNodes(nodes, nodedata->children[1]);
 
     // Careful not to modify the vector while using this clipnode pointer
-    bsp2_dclipnode_t &clipnode = map.bsp.dclipnodes[nodenum];
-    clipnode.planenum = ExportMapPlane(nodedata->planenum);
+    bsp2_dclipnode_t &clipnode = nodes[nodenum];
+    clipnode.planenum = static_cast<int32_t>(nodedata->planenum);
     clipnode.children[0] = child0;
     clipnode.children[1] = child1;
 
     return nodenum;
 }
 
+/*
+==================
+StageClipNodes
+
+Called after the clipping hull is completed. Generates the disk format
+representation, but doesn't touch map.bsp or the output planes yet.
+==================
+*/
+staged_clipnodes_t StageClipNodes(mapentity_t &entity, node_t *headnode)
+{
+    staged_clipnodes_t staged{&entity};
+    staged.headnode = StageClipNodes(staged.nodes, headnode);
+    return staged;
+}
+
 /*
 ==================
 ExportClipNodes
+==================
+*/
+static int32_t ExportClipNodes(const staged_clipnodes_t &staged, int32_t nodenum, size_t firstnode)
+{
+    // contents
+    if (nodenum < 0) {
+        return nodenum;
+    }
+
+    const bsp2_dclipnode_t &src = staged.nodes[nodenum];
+
+    // the planes are output in the same order as when clipnodes were exported straight from the tree
+    const int32_t child0 = ExportClipNodes(staged, src.children[0], firstnode);
+    const int32_t child1 = ExportClipNodes(staged, src.children[1], firstnode);
+
+    bsp2_dclipnode_t &clipnode = map.bsp.dclipnodes[firstnode + nodenum];
+    clipnode.planenum = ExportMapPlane(src.planenum);
+    clipnode.children[0] = child0;
+    clipnode.children[1] = child1;
 
-Called after the clipping hull is completed.  Generates a disk format
-representation.
+    return static_cast<int32_t>(firstnode + nodenum);
+}
+
+/*
+==================
+ExportClipNodes
 
-This gets real ugly.  Gets called twice per entity, once for each clip hull.
-First time just store away data, second time fix up reference points to
-accomodate new data interleaved with old.
+Adds a staged clipping hull to map.bsp. The hulls must be exported in
+the same order every time, since this is where their planes and
+clipnodes are numbered.
 ==================
 */
-void ExportClipNodes(mapentity_t &entity, node_t *nodes, hull_index_t::value_type hullnum)
+void ExportClipNodes(const staged_clipnodes_t &staged, hull_index_t::value_type hullnum)
 {
-    auto &model = map.bsp.dmodels.at(entity.outputmodelnumber.value());
-    model.headnode[hullnum] = ExportClipNodes(nodes);
+    const size_t firstnode = map.bsp.dclipnodes.size();
+    map.bsp.dclipnodes.resize(firstnode + staged.nodes.size());
+
+    auto &model = map.bsp.dmodels.at(staged.entity->outputmodelnumber.value());
+    model.headnode[hullnum] = ExportClipNodes(staged, staged.headnode, firstnode);
 }
 
 //===========================================================================
@@ -143,6 +143,56 @@ TEST(benchmark, visWindings)
     });
 }
 
+// regular polygon in the z = 0 plane with the given number of points
+template<typename W>
+static void MakeRegularWinding(W &w, size_t numpoints)
+{
+    w.numpoints = 0;
+    for (size_t i = 0; i < numpoints; ++i) {
+        const double angle = 2.0 * Q_PI * i / numpoints;
+        w.push_back({64.0 * cos(angle), 64.0 * sin(angle), 0.0});
+    }
+    w.set_winding_sphere();
+}
+
+template<typename W>
+static void BenchClipStackWinding(ankerl::nanobench::Bench &b, const char *name, size_t numpoints, double dist)
+{
+    using plane_t = typename W::plane_t;
+
+    basic_pstack_t<W> stack;
+    for (int i = 0; i < 3; ++i)
+        stack.windings_used[i] = false;
+
+    // not on the stack, so like a portal winding it isn't freed by the clip
+    W in;
+    MakeRegularWinding(in, numpoints);
+
+    const plane_t split(qv::normalize(decltype(plane_t::normal)(1, 1, 0.25)), dist);
+    visstats_t stats;
+
+    b.run(name, [&]() {
+        W *w = ClipStackWinding(stats, &in, stack, split);
+        ankerl::nanobench::doNotOptimizeAway(w);
+        FreeStackWinding(w, stack);
+    });
+}
+
+TEST(benchmark, visClipStackWinding)
+{
+    for (size_t numpoints : {4, 8, 16, 24}) {
+        // through the middle, and only through the bounding sphere
+        for (double dist : {8.0, -60.0}) {
+            ankerl::nanobench::Bench b;
+            b.relative(true);
+            b.title(fmt::format("ClipStackWinding, {} points, plane dist {}", numpoints, dist));
+
+            BenchClipStackWinding<viswinding_t>(b, "double", numpoints, dist);
+            BenchClipStackWinding<viswindingf_t>(b, "float (-floatclip)", numpoints, dist);
+        }
+    }
+}
+
 TEST(benchmark, vectorMath)
 {
     ankerl::nanobench::Bench b;
@@ -1,6 +1,7 @@
 #include <gtest/gtest.h>
 
 #include <light/light.hh>
+#include <light/lightcache.hh>
 #include <light/ltface.hh>
 #include <light/surflight.hh>
 #include <common/bspinfo.hh>
@@ -12,6 +13,8 @@
 #include "test_qbsp.hh"
 #include "test_main.hh"
 
+#include <fstream>
+
 static testresults_t QbspVisLight_Common(const std::filesystem::path &name, std::vector<std::string> extra_qbsp_args,
     std::vector<std::string> extra_light_args, runvis_t run_vis)
 {
@@ -463,6 +466,32 @@ TEST(ltfaceQ2, emissiveLights)
     }
 }
 
+TEST(ltfaceQ2, emissiveLightsLightTree)
+{
+    {
+        SCOPED_TRACE("-lighttree without merging clusters only skips emitters that are below the gate anyway");
+
+        auto [bsp_ref, bspx_ref] = QbspVisLight_Q2("q2_light_flush.map", {"-bounce"});
+        auto [bsp, bspx] = QbspVisLight_Q2("q2_light_flush.map", {"-bounce", "-lighttree", "-lighttree_error", "0"});
+
+        // emitters are visited in a different order, so allow for rounding
+        ASSERT_EQ(bsp_ref.dlightdata.size(), bsp.dlightdata.size());
+        for (size_t i = 0; i < bsp.dlightdata.size(); i++) {
+            EXPECT_LE(std::abs(bsp_ref.dlightdata[i] - bsp.dlightdata[i]), 1) << "at byte " << i;
+        }
+    }
+
+    {
+        SCOPED_TRACE("merged clusters still light the angled faces");
+
+        auto [bsp, bspx] = QbspVisLight_Q2("q2_light_flush.map", {"-bounce", "-lighttree", "-lighttree_error", "1"});
+
+        auto *face = BSP_FindFaceAtPoint(&bsp, &bsp.dmodels[0], {244, -92, 92});
+        ASSERT_TRUE(face);
+        CheckFaceLuxelsNonBlack(bsp, *face);
+    }
+}
+
 TEST(ltfaceQ2, phongDoesntCrossContents)
 {
     auto [bsp, bspx] = QbspVisLight_Q2("q2_phong_doesnt_cross_contents.map", {"-wrnormals"});
@@ -565,6 +594,31 @@ TEST(ltfaceQ2, lightTranslucency)
     }
 }
 
+TEST(ltfaceQ2, lightTranslucencyRayPackets)
+{
+    SCOPED_TRACE("tracing in packets matches tracing single rays, including glass/alphatest filtering");
+
+    auto [bsp_single, bspx_single] = QbspVisLight_Q2("q2_light_translucency.map", {"-raypackets", "none"});
+    auto [bsp_packets, bspx_packets] = QbspVisLight_Q2("q2_light_translucency.map", {"-raypackets", "auto"});
+
+    EXPECT_EQ(bsp_single.dlightdata, bsp_packets.dlightdata);
+}
+
+TEST(ltfaceQ1, rayPacketsMatchSingleRays)
+{
+    SCOPED_TRACE("sunlight and dirt are the same traced in packets of each width");
+
+    auto [bsp_single, bspx_single, lit_single] = QbspVisLight_Q1("q1_sunlight.map", {"-dirt", "-raypackets", "none"});
+    ASSERT_FALSE(bsp_single.dlightdata.empty());
+
+    for (const char *width : {"auto", "4", "8", "16"}) {
+        SCOPED_TRACE(fmt::format("-raypackets {}", width));
+
+        auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_sunlight.map", {"-dirt", "-raypackets", width});
+        EXPECT_EQ(bsp_single.dlightdata, bsp.dlightdata);
+    }
+}
+
 TEST(ltfaceQ2, visapproxVisWithOpaqueLiquids)
 {
     SCOPED_TRACE("opaque liquids block vis, but don't cast shadows by default.");
@@ -1046,6 +1100,243 @@ TEST(ltfaceQ1, sunlight)
     CheckFaceLuxelAtPoint(&bsp, &bsp.dmodels[0], {49, 49, 49}, {0, 0, 0}, {0, 0, 1}, &lit);
 }
 
+TEST(ltfaceQ1, sunlight2SkyVis)
+{
+    SCOPED_TRACE("with enough -skyvis directions, each dome sun gets its own, nearly identical, direction");
+
+    const std::vector<std::string> dome_args{"-sunlight2", "100", "-sunsamples", "32"};
+    std::vector<std::string> skyvis_args = dome_args;
+    skyvis_args.insert(skyvis_args.end(), {"-skyvis", "4096"});
+
+    auto [bsp_ref, bspx_ref, lit_ref] = QbspVisLight_Q1("q1_sunlight.map", dome_args);
+    auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_sunlight.map", skyvis_args);
+
+    ASSERT_EQ(bsp_ref.dlightdata.size(), bsp.dlightdata.size());
+    ASSERT_FALSE(bsp.dlightdata.empty());
+
+    float total_delta = 0;
+    for (size_t i = 0; i < bsp.dlightdata.size(); i++) {
+        total_delta += std::abs(bsp_ref.dlightdata[i] - bsp.dlightdata[i]);
+    }
+    EXPECT_LT(total_delta / bsp.dlightdata.size(), 2.0f);
+}
+
+TEST(ltfaceQ1, adaptiveExtra)
+{
+    SCOPED_TRACE("-adaptiveextra only skips supersampling where neighbouring luxels agree");
+
+    auto [bsp_ref, bspx_ref, lit_ref] = QbspVisLight_Q1("q1_sunlight.map", {"-extra4"});
+    auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_sunlight.map", {"-extra4", "-adaptiveextra", "1"});
+
+    ASSERT_EQ(bsp_ref.dlightdata.size(), bsp.dlightdata.size());
+    ASSERT_FALSE(bsp.dlightdata.empty());
+
+    float total_delta = 0;
+    for (size_t i = 0; i < bsp.dlightdata.size(); i++) {
+        total_delta += std::abs(bsp_ref.dlightdata[i] - bsp.dlightdata[i]);
+    }
+    EXPECT_LT(total_delta / bsp.dlightdata.size(), 1.0f);
+
+    SCOPED_TRACE("lit area away from the shadow is unchanged");
+    CheckFaceLuxelAtPoint(&bsp, &bsp.dmodels[0], {49, 49, 49}, {0, 0, 0}, {0, 0, 1});
+}
+
+TEST(ltfaceQ1, lightCache)
+{
+    const char *map = "q1_light_switchableshadow_target.map";
+
+    auto [bsp_ref, bspx_ref, lit_ref] = QbspVisLight_Q1(map, {});
+
+    fs::path cache_path = bsp_ref.file;
+    cache_path.replace_extension(".lcache");
+    fs::remove(cache_path);
+
+    {
+        SCOPED_TRACE("first run traces everything and writes the cache");
+
+        auto [bsp, bspx, lit] = QbspVisLight_Q1(map, {"-lightcache"});
+        EXPECT_TRUE(fs::exists(cache_path));
+        EXPECT_EQ(bsp_ref.dlightdata, bsp.dlightdata);
+    }
+
+    {
+        SCOPED_TRACE("second run uses the cache, and gets the same result");
+
+        auto [bsp, bspx, lit] = QbspVisLight_Q1(map, {"-lightcache"});
+        EXPECT_EQ(bsp_ref.dlightdata, bsp.dlightdata);
+    }
+
+    {
+        SCOPED_TRACE("changed settings invalidate the cache");
+
+        auto [bsp_dirt, bspx_dirt, lit_dirt] = QbspVisLight_Q1(map, {"-dirt"});
+        auto [bsp, bspx, lit] = QbspVisLight_Q1(map, {"-dirt", "-lightcache"});
+        EXPECT_EQ(bsp_dirt.dlightdata, bsp.dlightdata);
+    }
+
+    {
+        SCOPED_TRACE("changed lightmap sampling invalidates the cache, rather than failing");
+
+        auto [bsp_shift, bspx_shift, lit_shift] = QbspVisLight_Q1(map, {"-lmshift", "3"});
+        auto [bsp, bspx, lit] = QbspVisLight_Q1(map, {"-lmshift", "3", "-lightcache"});
+        EXPECT_EQ(bsp_shift.dlightdata, bsp.dlightdata);
+    }
+}
+
+TEST(ltfaceQ1, lightCacheRelightsChangedLight)
+{
+    auto [bsp_ref, bspx_ref, lit_ref] = QbspVisLight_Q1("q1_litwater.map", {});
+
+    // the same map with one of its four lights brighter, written next to the .bsp
+    const fs::path edited_map = fs::path(bsp_ref.file).replace_filename("q1_litwater-edited.map");
+    {
+        std::ifstream f(fs::path(testmaps_dir) / "q1_litwater.map", std::ios_base::in | std::ios_base::binary);
+        std::string text((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+        const std::string wad = "\"deprecated/free_wad.wad\"";
+        const std::string light = "\"origin\" \"-284 124 212\"\n";
+        ASSERT_NE(text.find(wad), std::string::npos);
+        ASSERT_NE(text.find(light), std::string::npos);
+
+        text.replace(text.find(wad), wad.size(),
+            fmt::format("\"{}\"", (fs::path(testmaps_dir) / "deprecated" / "free_wad.wad").generic_string()));
+        text.insert(text.find(light) + light.size(), "\"light\" \"400\"\n");
+        std::ofstream(edited_map, std::ios_base::out | std::ios_base::binary) << text;
+    }
+
+    auto [bsp_uncached, bspx_uncached, lit_uncached] = QbspVisLight_Q1(edited_map, {});
+
+    // start the edited map from the original's cache, with everything traced into it
+    fs::path cache_path = bsp_ref.file;
+    cache_path.replace_extension(".lcache");
+    fs::path edited_cache_path = bsp_uncached.file;
+    edited_cache_path.replace_extension(".lcache");
+
+    fs::remove(cache_path);
+    auto [bsp_all, bspx_all, lit_all] = QbspVisLight_Q1("q1_litwater.map", {"-lightcache"});
+    const lightcache_stats_t all = LightCache_Stats();
+    EXPECT_EQ(0, all.lights_loaded);
+    EXPECT_EQ(4, all.lights_traced);
+    EXPECT_EQ(bsp_ref.dlightdata, bsp_all.dlightdata);
+    fs::copy_file(cache_path, edited_cache_path, fs::copy_options::overwrite_existing);
+
+    {
+        SCOPED_TRACE("only the changed light is traced, and only on the faces it reaches");
+
+        auto [bsp, bspx, lit] = QbspVisLight_Q1(edited_map, {"-lightcache"});
+        const lightcache_stats_t edited = LightCache_Stats();
+        EXPECT_EQ(3, edited.lights_loaded);
+        EXPECT_EQ(1, edited.lights_traced);
+        EXPECT_GT(edited.faces_traced, 0);
+        EXPECT_LT(edited.faces_traced, all.faces_traced);
+        EXPECT_EQ(bsp_uncached.dlightdata, bsp.dlightdata);
+    }
+
+    {
+        SCOPED_TRACE("and the next run traces nothing");
+
+        auto [bsp, bspx, lit] = QbspVisLight_Q1(edited_map, {"-lightcache"});
+        const lightcache_stats_t again = LightCache_Stats();
+        EXPECT_EQ(4, again.lights_loaded);
+        EXPECT_EQ(0, again.faces_traced);
+        EXPECT_EQ(bsp_uncached.dlightdata, bsp.dlightdata);
+    }
+}
+
+// compares lightmaps face by face, since their order in the lighting lump isn't fixed
+static void CheckSameFaceLightmaps(
+    const mbsp_t &ref, const lit_variant_t *ref_lit, const mbsp_t &bsp, const lit_variant_t *lit)
+{
+    ASSERT_EQ(ref.dfaces.size(), bsp.dfaces.size());
+
+    for (size_t i = 0; i < bsp.dfaces.size(); i++) {
+        const mface_t &ref_face = ref.dfaces[i];
+        const mface_t &face = bsp.dfaces[i];
+        SCOPED_TRACE(fmt::format("face {}", i));
+
+        ASSERT_EQ(ref_face.styles, face.styles);
+        ASSERT_EQ(ref_face.lightofs == -1, face.lightofs == -1);
+
+        const faceextents_t extents(face, bsp, LMSCALE_DEFAULT);
+
+        for (const uint8_t style : face.styles) {
+            if (style == INVALID_LIGHTSTYLE_OLD) {
+                break;
+            }
+
+            for (int x = 0; x < extents.width(); ++x) {
+                for (int y = 0; y < extents.height(); ++y) {
+                    EXPECT_EQ(LM_Sample(&ref, &ref_face, ref_lit, extents, ref_face.lightofs, {x, y}, style),
+                        LM_Sample(&bsp, &face, lit, extents, face.lightofs, {x, y}, style));
+                }
+            }
+        }
+    }
+}
+
+TEST(ltfaceQ1, streamFaces)
+{
+    const char *map = "q1_light_switchableshadow_target.map";
+
+    auto [bsp_ref, bspx_ref, lit_ref] = QbspVisLight_Q1(map, {"-lit", "-extra4"});
+    auto [bsp, bspx, lit] = QbspVisLight_Q1(map, {"-lit", "-extra4", "-streamfaces"});
+
+    EXPECT_EQ(bsp_ref.dlightdata.size(), bsp.dlightdata.size());
+    CheckSameFaceLightmaps(bsp_ref, &lit_ref, bsp, &lit);
+}
+
+TEST(ltfaceQ2, streamFacesEmissive)
+{
+    auto [bsp_ref, bspx_ref] = QbspVisLight_Q2("q2_light_flush.map", {});
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_flush.map", {"-streamfaces"});
+
+    EXPECT_EQ(bsp_ref.dlightdata.size(), bsp.dlightdata.size());
+    CheckSameFaceLightmaps(bsp_ref, nullptr, bsp, nullptr);
+}
+
+TEST(ltfaceQ1, lightIndex)
+{
+    const char *map = "q1_light_surflight_group.map";
+
+    auto [bsp_ref, bspx_ref, lit_ref] = QbspVisLight_Q1(map, {"-lit"});
+    auto [bsp, bspx, lit] = QbspVisLight_Q1(map, {"-lit", "-lightindex"});
+
+    CheckSameFaceLightmaps(bsp_ref, &lit_ref, bsp, &lit);
+}
+
+TEST(ltfaceQ2, faceCostScheduling)
+{
+    auto [bsp_ref, bspx_ref] = QbspVisLight_Q2("q2_light_flush.map", {"-bounce"});
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_flush.map", {"-bounce", "-facecost"});
+
+    CheckSameFaceLightmaps(bsp_ref, nullptr, bsp, nullptr);
+}
+
+TEST(ltfaceQ1, luxDirectionsOnlyWhenRequested)
+{
+    const char *map = "q1_light_switchableshadow_target.map";
+
+    auto [bsp_ref, bspx_ref, lit_ref] = QbspVisLight_Q1(map, {});
+    EXPECT_EQ(bspx_ref.find("LIGHTINGDIR"), bspx_ref.end());
+
+    auto [bsp, bspx, lit] = QbspVisLight_Q1(map, {"-bspxlux"});
+    EXPECT_EQ(bsp_ref.dlightdata, bsp.dlightdata);
+
+    auto it = bspx.find("LIGHTINGDIR");
+    ASSERT_NE(it, bspx.end());
+    ASSERT_EQ(it->second.size(), bsp.dlightdata.size() * 3);
+
+    // lit luxels get a direction, not just the "straight out of the face" fallback
+    bool any_tilted = false;
+    for (size_t i = 0; i < bsp.dlightdata.size(); i++) {
+        if (bsp.dlightdata[i] && (it->second[i * 3] != 128 || it->second[i * 3 + 1] != 128)) {
+            any_tilted = true;
+            break;
+        }
+    }
+    EXPECT_TRUE(any_tilted);
+}
+
 TEST(ltfaceQ1, sunlightTwoSuns)
 {
     auto [bsp, bspx, lit] = QbspVisLight_Q1("deprecated/suntest.map", {"-lit", "-lightgrid"});
@@ -1619,6 +1619,36 @@ TEST(testmapsQ1, detailFence2)
     ASSERT_TRUE(storage_leaf_bounds.contains(func_detail_fence_box));
 }
 
+TEST(testmapsQ1, detailFenceMarksurfaceOrder)
+{
+    // FixupDetailFence appends the faces it moves in the order it finds them, not the order they're
+    // allocated in, so the marksurfaces are the same however the build is scheduled
+    const auto [bsp, bspx, prt] = LoadTestmapQ1("q1_detail_fence.map", {"-threads", "1"});
+
+    const auto player_start_pos = qvec3d(-56, -96, 120);
+    const auto *player_start_leaf = BSP_FindLeafAtPoint(&bsp, &bsp.dmodels[0], player_start_pos);
+    const auto markfaces = Leaf_Markfaces(&bsp, player_start_leaf);
+
+    for (int run = 0; run < 3; run++) {
+        SCOPED_TRACE(fmt::format("run {}", run));
+
+        const auto [threaded_bsp, threaded_bspx, threaded_prt] =
+            LoadTestmapQ1("q1_detail_fence.map", {"-threads", "4"});
+
+        EXPECT_EQ(bsp.dleaffaces, threaded_bsp.dleaffaces);
+        EXPECT_EQ(bsp.dleafs, threaded_bsp.dleafs);
+
+        // the faces moved into the player start leaf, in the same order
+        const auto *threaded_leaf = BSP_FindLeafAtPoint(&threaded_bsp, &threaded_bsp.dmodels[0], player_start_pos);
+        const auto threaded_markfaces = Leaf_Markfaces(&threaded_bsp, threaded_leaf);
+
+        ASSERT_EQ(markfaces.size(), threaded_markfaces.size());
+        for (size_t i = 0; i < markfaces.size(); i++) {
+            EXPECT_EQ(Face_GetNum(&bsp, markfaces[i]), Face_GetNum(&threaded_bsp, threaded_markfaces[i]));
+        }
+    }
+}
+
 // corner case for FixupDetailFence; detail_fence brush but no faces inside to propagate
 // (broken in 2.0.0-alpha11, produced infinite mins/maxs)
 TEST(testmapsQ1, detailFence3)
@@ -1724,6 +1754,101 @@ TEST(testmapsQ1, hullsFlag)
     }
 }
 
+TEST(testmapsQ1, hullsConcurrent)
+{
+    // the clipping hulls are built concurrently unless -loghulls is used, but are written in the same order
+    const auto [bsp, bspx, prt] = LoadTestmapQ1("q1_hulls.map");
+    const auto [logged_bsp, logged_bspx, logged_prt] = LoadTestmapQ1("q1_hulls.map", {"-loghulls"});
+
+    ASSERT_EQ(bsp.dplanes.size(), logged_bsp.dplanes.size());
+    for (size_t i = 0; i < bsp.dplanes.size(); i++) {
+        EXPECT_EQ(bsp.dplanes[i].normal, logged_bsp.dplanes[i].normal);
+        EXPECT_EQ(bsp.dplanes[i].dist, logged_bsp.dplanes[i].dist);
+    }
+
+    ASSERT_EQ(bsp.dclipnodes.size(), logged_bsp.dclipnodes.size());
+    for (size_t i = 0; i < bsp.dclipnodes.size(); i++) {
+        EXPECT_EQ(bsp.dclipnodes[i].planenum, logged_bsp.dclipnodes[i].planenum);
+        EXPECT_EQ(bsp.dclipnodes[i].children, logged_bsp.dclipnodes[i].children);
+    }
+
+    ASSERT_EQ(bsp.dmodels.size(), logged_bsp.dmodels.size());
+    for (size_t i = 0; i < bsp.dmodels.size(); i++) {
+        EXPECT_EQ(bsp.dmodels[i].headnode, logged_bsp.dmodels[i].headnode);
+    }
+}
+
+TEST(testmapsQ1, hullsConcurrentPlanes)
+{
+    // the planes are added in the same order however the hulls and bmodels are scheduled
+    const auto [bsp, bspx, prt] = LoadTestmapQ1("q1_hull1_content_types.map", {"-threads", "1"});
+
+    for (int run = 0; run < 3; run++) {
+        SCOPED_TRACE(fmt::format("run {}", run));
+
+        const auto [threaded_bsp, threaded_bspx, threaded_prt] =
+            LoadTestmapQ1("q1_hull1_content_types.map", {"-threads", "4"});
+
+        ASSERT_EQ(bsp.dplanes.size(), threaded_bsp.dplanes.size());
+        for (size_t i = 0; i < bsp.dplanes.size(); i++) {
+            EXPECT_EQ(0, std::memcmp(&bsp.dplanes[i].normal, &threaded_bsp.dplanes[i].normal, sizeof(qvec3f)));
+            EXPECT_EQ(0, std::memcmp(&bsp.dplanes[i].dist, &threaded_bsp.dplanes[i].dist, sizeof(float)));
+            EXPECT_EQ(bsp.dplanes[i].type, threaded_bsp.dplanes[i].type);
+        }
+
+        ASSERT_EQ(bsp.dclipnodes.size(), threaded_bsp.dclipnodes.size());
+        for (size_t i = 0; i < bsp.dclipnodes.size(); i++) {
+            EXPECT_EQ(bsp.dclipnodes[i].planenum, threaded_bsp.dclipnodes[i].planenum);
+            EXPECT_EQ(bsp.dclipnodes[i].children, threaded_bsp.dclipnodes[i].children);
+        }
+    }
+}
+
+TEST(testmapsQ1, bmodelsConcurrent)
+{
+    // the bmodels are built concurrently unless -logbmodels is used, but are written in entity order
+    const auto [bsp, bspx, prt] = LoadTestmapQ1("q1_hull1_content_types.map");
+    const auto [logged_bsp, logged_bspx, logged_prt] =
+        LoadTestmapQ1("q1_hull1_content_types.map", {"-logbmodels", "-loghulls"});
+
+    EXPECT_EQ(bsp.dentdata, logged_bsp.dentdata);
+    EXPECT_EQ(bsp.dvertexes, logged_bsp.dvertexes);
+    EXPECT_EQ(bsp.dedges, logged_bsp.dedges);
+    EXPECT_EQ(bsp.dsurfedges, logged_bsp.dsurfedges);
+    EXPECT_EQ(bsp.dleafs, logged_bsp.dleafs);
+    EXPECT_EQ(bsp.dleaffaces, logged_bsp.dleaffaces);
+
+    ASSERT_EQ(bsp.dfaces.size(), logged_bsp.dfaces.size());
+    for (size_t i = 0; i < bsp.dfaces.size(); i++) {
+        EXPECT_EQ(bsp.dfaces[i].planenum, logged_bsp.dfaces[i].planenum);
+        EXPECT_EQ(bsp.dfaces[i].side, logged_bsp.dfaces[i].side);
+        EXPECT_EQ(bsp.dfaces[i].firstedge, logged_bsp.dfaces[i].firstedge);
+        EXPECT_EQ(bsp.dfaces[i].numedges, logged_bsp.dfaces[i].numedges);
+        EXPECT_EQ(bsp.dfaces[i].texinfo, logged_bsp.dfaces[i].texinfo);
+    }
+
+    ASSERT_EQ(bsp.dnodes.size(), logged_bsp.dnodes.size());
+    for (size_t i = 0; i < bsp.dnodes.size(); i++) {
+        EXPECT_EQ(bsp.dnodes[i].planenum, logged_bsp.dnodes[i].planenum);
+        EXPECT_EQ(bsp.dnodes[i].children, logged_bsp.dnodes[i].children);
+        EXPECT_EQ(bsp.dnodes[i].firstface, logged_bsp.dnodes[i].firstface);
+        EXPECT_EQ(bsp.dnodes[i].numfaces, logged_bsp.dnodes[i].numfaces);
+    }
+
+    ASSERT_EQ(bsp.dclipnodes.size(), logged_bsp.dclipnodes.size());
+    for (size_t i = 0; i < bsp.dclipnodes.size(); i++) {
+        EXPECT_EQ(bsp.dclipnodes[i].planenum, logged_bsp.dclipnodes[i].planenum);
+        EXPECT_EQ(bsp.dclipnodes[i].children, logged_bsp.dclipnodes[i].children);
+    }
+
+    ASSERT_EQ(bsp.dmodels.size(), logged_bsp.dmodels.size());
+    for (size_t i = 0; i < bsp.dmodels.size(); i++) {
+        EXPECT_EQ(bsp.dmodels[i].headnode, logged_bsp.dmodels[i].headnode);
+        EXPECT_EQ(bsp.dmodels[i].firstface, logged_bsp.dmodels[i].firstface);
+        EXPECT_EQ(bsp.dmodels[i].numfaces, logged_bsp.dmodels[i].numfaces);
+    }
+}
+
 TEST(testmapsQ1, 0125UnitFaces)
 {
     GTEST_SKIP();
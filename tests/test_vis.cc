@@ -1,12 +1,30 @@
 #include <common/bsputils.hh>
+#include <common/json.hh>
 #include <common/qvec.hh>
 
+#include <fstream>
+#include <random>
 #include <stdexcept>
+#include <thread>
 #include <vis/vis.hh>
 
+#include <testmaps.hh>
 #include "test_qbsp.hh"
+#include "test_main.hh"
 #include <gtest/gtest.h>
 
+#ifdef VIS_EXECUTABLE
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#endif
+
 static bool q2_leaf_sees(
     const mbsp_t &bsp, const std::unordered_map<int, std::vector<uint8_t>> &vis, const mleaf_t *a, const mleaf_t *b)
 {
@@ -102,6 +120,457 @@ TEST(vis, q2FuncIllusionaryVisblocker)
     ASSERT_EQ(Q2_CONTENTS_MIST, Leaf_Brushes(&bsp, in_visblocker_leaf).at(0)->contents);
 }
 
+TEST(vis, q2PhsIsUnionOfVisiblePvs)
+{
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_detail_leak_test.map", {}, runvis_t::yes);
+
+    const size_t numclusters = bsp.dvis.bit_offsets.size();
+    const size_t rowbytes = (numclusters + 7) >> 3;
+    ASSERT_GT(numclusters, 1);
+
+    auto decompress = [&](vistype_t type, size_t cluster) {
+        std::vector<uint8_t> row(rowbytes);
+        DecompressVis(bsp.dvis.bits.data() + bsp.dvis.get_bit_offset(type, cluster),
+            bsp.dvis.bits.data() + bsp.dvis.bits.size(), row.data(), row.data() + row.size());
+        return row;
+    };
+
+    std::vector<std::vector<uint8_t>> pvs;
+    for (size_t i = 0; i < numclusters; i++) {
+        pvs.push_back(decompress(VIS_PVS, i));
+    }
+
+    for (size_t i = 0; i < numclusters; i++) {
+        std::vector<uint8_t> expected = pvs[i];
+        for (size_t j = 0; j < numclusters; j++) {
+            if (pvs[i][j >> 3] & nth_bit(j & 7)) {
+                for (size_t k = 0; k < rowbytes; k++) {
+                    expected[k] |= pvs[j][k];
+                }
+            }
+        }
+
+        EXPECT_EQ(expected, decompress(VIS_PHS, i)) << "cluster " << i;
+    }
+}
+
+static std::string ReadFile(const fs::path &path)
+{
+    std::ifstream f(path, std::ios_base::in | std::ios_base::binary);
+    return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+// where QbspVisLight_Q1 writes the .bsp
+static fs::path VisBspDir()
+{
+    fs::path bsp_dir = fs::path(test_quake_maps_dir);
+    return bsp_dir.empty() ? fs::current_path() : fs::weakly_canonical(bsp_dir);
+}
+
+/**
+ * Compiles a Q1 test map (or one written to VisBspDir(), given its full path)
+ * without vis, and returns copies of the .bsp (with the .prt next to it) named
+ * after it plus each suffix, to run vis_main on.
+ */
+static std::vector<fs::path> CompileForVis(const std::string &name, const std::vector<std::string> &suffixes)
+{
+    QbspVisLight_Q1(name + ".map", {}, runvis_t::no);
+
+    const fs::path bsp_dir = VisBspDir();
+    const fs::path source = bsp_dir / (name + ".bsp");
+    std::vector<fs::path> result;
+
+    for (const std::string &suffix : suffixes) {
+        const fs::path &dest = result.emplace_back(bsp_dir / (name + suffix + ".bsp"));
+        fs::copy_file(source, dest, fs::copy_options::overwrite_existing);
+        fs::copy_file(fs::path(source).replace_extension("prt"), fs::path(dest).replace_extension("prt"),
+            fs::copy_options::overwrite_existing);
+    }
+
+    return result;
+}
+
+TEST(vis, separatorCacheMatchesUncached)
+{
+    const auto paths = CompileForVis("q1_func_illusionary_visblocker_interactions", {"-uncached", "-cached"});
+
+    vis_main({"", "-nostate", "-threads", "1", paths[0].string()});
+    vis_main({"", "-nostate", "-threads", "1", "-separatorcache", "1", paths[1].string()});
+
+    EXPECT_EQ(ReadFile(paths[0]), ReadFile(paths[1]));
+}
+
+/**
+ * The first number logged by vis_main on a line starting with `prefix`, or -1
+ */
+static int LoggedNumber(const std::string &prefix)
+{
+    for (const std::string &line : get_current_test_log()) {
+        if (line.starts_with(prefix)) {
+            return std::stoi(line.substr(prefix.size()));
+        }
+    }
+    return -1;
+}
+
+// the state files of a map, which a run that stopped early leaves behind
+static void RemoveVisState(const fs::path &bsp)
+{
+    fs::remove(fs::path(bsp).replace_extension("vis"));
+    fs::remove(fs::path(bsp).replace_extension("vsj"));
+}
+
+TEST(vis, resumeMatchesUninterrupted)
+{
+    const auto paths = CompileForVis("q1_tjunc_matrix", {"-uninterrupted", "-resumed"});
+
+    vis_main({"", "-nostate", "-threads", "1", paths[0].string()});
+
+    // the journal is only written when vis stops, so it holds every portal the first run flowed
+    RemoveVisState(paths[1]);
+    vis_main({"", "-threads", "1", "-stopafter", "100", paths[1].string()});
+    vis_main({"", "-threads", "1", paths[1].string()});
+
+    EXPECT_EQ(100, LoggedNumber("Replayed "));
+    EXPECT_EQ(100, LoggedNumber("Loaded previous state with "));
+    EXPECT_EQ(ReadFile(paths[0]), ReadFile(paths[1]));
+}
+
+TEST(vis, resumeAfterCompactingJournal)
+{
+    const auto paths = CompileForVis("q1_tjunc_matrix", {"-uninterrupted", "-compacted"});
+
+    vis_main({"", "-nostate", "-threads", "1", paths[0].string()});
+
+    // the journal outgrows the state file towards the end, and with no interval between writes it's folded into
+    // a new state file while the last portals are flowed
+    const int stopafter = static_cast<int>(portals.size()) - 6;
+
+    RemoveVisState(paths[1]);
+    vis_main({"", "-threads", "1", "-stateinterval", "0", "-stopafter", std::to_string(stopafter),
+        paths[1].string()});
+    vis_main({"", "-threads", "1", paths[1].string()});
+
+    // some were in the compacted state file, and none were lost
+    EXPECT_LT(LoggedNumber("Replayed "), stopafter);
+    EXPECT_EQ(stopafter, LoggedNumber("Loaded previous state with "));
+    EXPECT_EQ(ReadFile(paths[0]), ReadFile(paths[1]));
+}
+
+TEST(vis, resumeDropsTruncatedJournalRecord)
+{
+    const auto paths = CompileForVis("q1_tjunc_matrix", {"-uninterrupted", "-truncated"});
+
+    vis_main({"", "-nostate", "-threads", "1", paths[0].string()});
+
+    RemoveVisState(paths[1]);
+    vis_main({"", "-threads", "1", "-stopafter", "100", paths[1].string()});
+
+    // as if vis was killed partway through writing the last record
+    const fs::path journal = fs::path(paths[1]).replace_extension("vsj");
+    fs::resize_file(journal, fs::file_size(journal) - 5);
+
+    vis_main({"", "-threads", "1", paths[1].string()});
+
+    EXPECT_EQ(99, LoggedNumber("Replayed "));
+    EXPECT_EQ(99, LoggedNumber("Loaded previous state with "));
+    EXPECT_EQ(ReadFile(paths[0]), ReadFile(paths[1]));
+}
+
+static mbsp_t LoadVisBsp(fs::path path)
+{
+    bspdata_t bspdata;
+    LoadBSPFile(path, &bspdata);
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+    return std::move(std::get<mbsp_t>(bspdata.bsp));
+}
+
+/**
+ * Compares the Q1 PVS of two compiles of the same map, leaf pair by leaf pair:
+ * how many pairs `expected` sees, and how many of those `actual` misses or
+ * adds.
+ */
+struct vis_difference_t
+{
+    int visible = 0;
+    int missed = 0;
+    int added = 0;
+};
+
+static vis_difference_t CompareVis(const fs::path &expected, const fs::path &actual)
+{
+    const mbsp_t a = LoadVisBsp(expected);
+    const mbsp_t b = LoadVisBsp(actual);
+    const auto a_vis = DecompressAllVis(&a);
+    const auto b_vis = DecompressAllVis(&b);
+
+    const int visleafs = a.dmodels[0].visleafs;
+    EXPECT_EQ(visleafs, b.dmodels[0].visleafs);
+
+    vis_difference_t result;
+
+    for (int i = 1; i <= visleafs; i++) {
+        for (int j = 1; j <= visleafs; j++) {
+            const bool sees_a = q1_leaf_sees(a, a_vis, &a.dleafs[i], &a.dleafs[j]);
+            const bool sees_b = q1_leaf_sees(b, b_vis, &b.dleafs[i], &b.dleafs[j]);
+
+            result.visible += sees_a;
+            result.missed += sees_a && !sees_b;
+            result.added += !sees_a && sees_b;
+        }
+    }
+
+    return result;
+}
+
+TEST(vis, incrementalMatchesFull)
+{
+    const auto paths = CompileForVis("q1_func_illusionary_visblocker_interactions", {"-first", "-second"});
+
+    fs::remove(fs::path(paths[0]).replace_extension("vsi"));
+    vis_main({"", "-nostate", "-incremental", paths[0].string()});
+    ASSERT_TRUE(fs::exists(fs::path(paths[0]).replace_extension("vsi")));
+
+    // nothing changed, so the second run takes over every portal from the first without flowing any, and the
+    // flow order can't make a difference
+    fs::copy_file(fs::path(paths[0]).replace_extension("vsi"), fs::path(paths[1]).replace_extension("vsi"),
+        fs::copy_options::overwrite_existing);
+    vis_main({"", "-nostate", "-incremental", paths[1].string()});
+
+    EXPECT_EQ(ReadFile(paths[0]), ReadFile(paths[1]));
+}
+
+TEST(vis, incrementalAfterEditCloseToFull)
+{
+    const std::string name = "q1_func_illusionary_visblocker_interactions";
+    const auto before = CompileForVis(name, {"-before"});
+
+    // the same map with a pillar added in one corner, so only some of the portals change
+    const fs::path edited_map = VisBspDir() / (name + "-edited.map");
+    {
+        std::string text = ReadFile(fs::path(testmaps_dir) / (name + ".map"));
+        const size_t first_brush = text.find("// brush 0");
+        ASSERT_NE(first_brush, std::string::npos);
+        text.insert(first_brush, "// pillar\n"
+                                 "{\n"
+                                 "( 96 96 16 ) ( 96 97 16 ) ( 96 96 17 ) bolt8 0 0 0 1 1\n"
+                                 "( 96 96 16 ) ( 96 96 17 ) ( 97 96 16 ) bolt8 0 0 0 1 1\n"
+                                 "( 96 96 16 ) ( 97 96 16 ) ( 96 97 16 ) bolt8 0 0 0 1 1\n"
+                                 "( 160 160 240 ) ( 160 161 240 ) ( 161 160 240 ) bolt8 0 0 0 1 1\n"
+                                 "( 160 160 240 ) ( 161 160 240 ) ( 160 160 241 ) bolt8 0 0 0 1 1\n"
+                                 "( 160 160 240 ) ( 160 160 241 ) ( 160 161 240 ) bolt8 0 0 0 1 1\n"
+                                 "}\n");
+        std::ofstream(edited_map, std::ios_base::out | std::ios_base::binary) << text;
+    }
+    const auto after = CompileForVis(fs::path(edited_map).replace_extension().string(), {"-incremental", "-full"});
+
+    fs::remove(fs::path(before[0]).replace_extension("vsi"));
+    vis_main({"", "-nostate", "-incremental", before[0].string()});
+    ASSERT_TRUE(fs::exists(fs::path(before[0]).replace_extension("vsi")));
+
+    // the portals away from the pillar are taken over from the first run, the rest flowed again
+    fs::copy_file(fs::path(before[0]).replace_extension("vsi"), fs::path(after[0]).replace_extension("vsi"),
+        fs::copy_options::overwrite_existing);
+    vis_main({"", "-nostate", "-incremental", after[0].string()});
+    vis_main({"", "-nostate", after[1].string()});
+
+    // the portals flowed again see a different mix of finished neighbours than in a run from scratch, which can
+    // move a leaf on the edge of a portal's view in or out. it should be rare, so allow up to 0.5% of the leafs
+    // the full vis sees either way
+    const vis_difference_t diff = CompareVis(after[1], after[0]);
+    ASSERT_GT(diff.visible, 0);
+    EXPECT_LE(diff.missed, diff.visible / 200);
+    EXPECT_LE(diff.added, diff.visible / 200);
+}
+
+TEST(vis, traceListsEveryPortal)
+{
+    const auto paths = CompileForVis("q1_func_illusionary_visblocker_interactions", {"-trace"});
+    const fs::path csv = fs::path(paths[0]).replace_extension("csv");
+    const fs::path json = fs::path(paths[0]).replace_extension("json");
+
+    vis_main({"", "-nostate", "-trace", csv.string(), paths[0].string()});
+    vis_main({"", "-nostate", "-trace", json.string(), paths[0].string()});
+
+    // a header, then a line for each portal
+    std::ifstream f(csv);
+    std::string line;
+    size_t numlines = 0;
+    ASSERT_TRUE(std::getline(f, line));
+    EXPECT_EQ(line.rfind("portal,leaf,seconds,mightsee,cansee,", 0), 0);
+    while (std::getline(f, line)) {
+        numlines++;
+    }
+    EXPECT_EQ(numlines, static_cast<size_t>(numportals) * 2);
+
+    Json::Value j;
+    std::ifstream(json) >> j;
+    ASSERT_TRUE(j.isArray());
+    ASSERT_EQ(j.size(), static_cast<Json::ArrayIndex>(numportals) * 2);
+    for (const auto &record : j) {
+        EXPECT_LE(record["cansee"].asInt(), record["mightsee"].asInt());
+        EXPECT_GE(record["seconds"].asDouble(), 0.0);
+    }
+}
+
+TEST(vis, approximateBetweenFullAndFast)
+{
+    // a row of rooms joined by offset doors with a pillar in each, so there are leafs only visible through narrow
+    // gaps, which a few rays can easily miss
+    const auto paths = CompileForVis("q1_vis_baffles", {"-full", "-approx", "-fast"});
+
+    vis_main({"", "-nostate", paths[0].string()});
+    vis_main({"", "-nostate", "-approx", "8", paths[1].string()});
+    vis_main({"", "-nostate", "-fast", paths[2].string()});
+
+    const mbsp_t full = LoadVisBsp(paths[0]);
+    const mbsp_t approx = LoadVisBsp(paths[1]);
+    const mbsp_t fast = LoadVisBsp(paths[2]);
+    const auto full_vis = DecompressAllVis(&full);
+    const auto approx_vis = DecompressAllVis(&approx);
+    const auto fast_vis = DecompressAllVis(&fast);
+
+    const int visleafs = full.dmodels[0].visleafs;
+    ASSERT_GT(visleafs, 1);
+
+    int num_full = 0, num_approx = 0, num_fast = 0, num_missed = 0;
+
+    for (int i = 1; i <= visleafs; i++) {
+        for (int j = 1; j <= visleafs; j++) {
+            SCOPED_TRACE(fmt::format("leaf {} sees leaf {}", i, j));
+
+            const bool sees_full = q1_leaf_sees(full, full_vis, &full.dleafs[i], &full.dleafs[j]);
+            const bool sees_approx = q1_leaf_sees(approx, approx_vis, &approx.dleafs[i], &approx.dleafs[j]);
+            const bool sees_fast = q1_leaf_sees(fast, fast_vis, &fast.dleafs[i], &fast.dleafs[j]);
+
+            // -fast is a true upper bound, the rays only ever remove leafs from it
+            if (sees_approx) {
+                EXPECT_TRUE(sees_fast);
+            }
+
+            num_full += sees_full;
+            num_approx += sees_approx;
+            num_fast += sees_fast;
+            num_missed += sees_full && !sees_approx;
+        }
+    }
+
+    // it's sampled, so it can miss a leaf the full vis sees; with the default -approxgraze that should be rare, so
+    // allow up to 1% of what the full vis sees (it was 0 here, and about 0.1% on id1 maps with -approxgraze 0)
+    EXPECT_LE(num_missed, num_full / 100);
+
+    // and the rays did rule some out
+    EXPECT_LT(num_approx, num_fast);
+}
+
+#ifdef VIS_EXECUTABLE
+// binds port 0 so the OS picks a port nothing is listening on, and reads back which one
+static int FindFreePort()
+{
+#ifdef _WIN32
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+        return 0;
+    }
+#endif
+
+    const auto s = socket(AF_INET, SOCK_STREAM, 0);
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addrlen = sizeof(addr);
+
+    int port = 0;
+    if (bind(s, (const sockaddr *)&addr, sizeof(addr)) == 0 && getsockname(s, (sockaddr *)&addr, &addrlen) == 0) {
+        port = ntohs(addr.sin_port);
+    }
+
+#ifdef _WIN32
+    closesocket(s);
+#else
+    close(s);
+#endif
+    return port;
+}
+
+// runs a vis worker process, returning its exit code
+static int RunWorker(int port, const fs::path &bsp, const std::string &options = {})
+{
+    std::string command = fmt::format(
+        "\"{}\" -nopercent {} -worker 127.0.0.1:{} \"{}\"", VIS_EXECUTABLE, options, port, bsp.string());
+#ifdef _WIN32
+    // cmd strips the outer quotes
+    command = "\"" + command + "\"";
+#endif
+    return std::system(command.c_str());
+}
+
+TEST(vis, distributedMatchesSingleThread)
+{
+    const int port = FindFreePort();
+    ASSERT_NE(0, port);
+
+    const auto paths = CompileForVis("q1_func_illusionary_visblocker_interactions", {"-single", "-distributed"});
+    const fs::path &single = paths[0];
+    const fs::path &distributed = paths[1];
+
+    vis_main({"", "-nostate", "-threads", "1", single.string()});
+
+    // a single worker is still handed portals ahead of the commit order, so its results are checked
+    // against the portals committed in the meantime
+    std::thread worker([&]() { EXPECT_EQ(0, RunWorker(port, distributed)); });
+
+    vis_main({"", "-nostate", "-coordinator", std::to_string(port), distributed.string()});
+
+    worker.join();
+
+    EXPECT_EQ(ReadFile(single), ReadFile(distributed));
+}
+
+TEST(vis, distributedWorkersJoiningLate)
+{
+    const int port = FindFreePort();
+    ASSERT_NE(0, port);
+
+    const auto paths = CompileForVis("q1_tjunc_matrix", {"-single", "-distributed"});
+    const fs::path &single = paths[0];
+    const fs::path &distributed = paths[1];
+
+    vis_main({"", "-nostate", "-threads", "1", single.string()});
+
+    // the late workers read their own copy, since the coordinator writes its .bsp once it's done
+    const fs::path late = fs::path(distributed).replace_filename(distributed.stem().string() + "-late.bsp");
+    fs::copy_file(distributed, late, fs::copy_options::overwrite_existing);
+    fs::copy_file(fs::path(distributed).replace_extension(".prt"), fs::path(late).replace_extension(".prt"),
+        fs::copy_options::overwrite_existing);
+
+    // three workers race each other for the portals, and a fourth turns up partway through or after the
+    // last portal is handed out; either way every worker exits cleanly. The map is small enough that a
+    // worker can start after the coordinator has finished, so none of them wait long to connect
+    std::vector<std::thread> workers;
+    for (int i = 0; i < 3; i++) {
+        workers.emplace_back([&]() { EXPECT_EQ(0, RunWorker(port, distributed, "-workerwait 2")); });
+    }
+    workers.emplace_back([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        EXPECT_EQ(0, RunWorker(port, late, "-workerwait 2"));
+    });
+
+    vis_main({"", "-nostate", "-coordinator", std::to_string(port), distributed.string()});
+
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+
+    EXPECT_EQ(ReadFile(single), ReadFile(distributed));
+
+    // one that turns up after the coordinator has finished gives up without an error
+    EXPECT_EQ(0, RunWorker(port, late, "-workerwait 1"));
+}
+#endif
+
 TEST(vis, q1FuncIllusionaryVisblocker)
 {
     auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_func_illusionary_visblocker.map", {}, runvis_t::yes);
@@ -183,6 +652,227 @@ TEST(vis, ClipStackWinding)
     FreeStackWinding(w1, stack);
 }
 
+TEST(vis, ClipStackWindingFloat)
+{
+    pstackf_t stack{};
+    visstats_t stats{};
+
+    auto *w1 = AllocStackWinding(stack);
+    w1->numpoints = 0;
+    w1->push_back({0, 0, 0});
+    w1->push_back({32, 0, 0});
+    w1->push_back({32, 0, -32});
+    w1->push_back({0, 0, -32});
+    w1->set_winding_sphere();
+
+    w1 = ClipStackWinding(stats, w1, stack, qplane3f({-1, 0, 0}, -16));
+    ASSERT_TRUE(w1);
+    EXPECT_EQ(w1->size(), 4);
+    EXPECT_EQ((*w1)[0], qvec3f(0, 0, 0));
+    EXPECT_EQ((*w1)[1], qvec3f(16, 0, 0));
+    EXPECT_EQ((*w1)[2], qvec3f(16, 0, -32));
+    EXPECT_EQ((*w1)[3], qvec3f(0, 0, -32));
+
+    // the half below z = -16 is cut off, with a split point on each side it crossed
+    w1 = ClipStackWinding(stats, w1, stack, qplane3f({0, 0, 1}, -16));
+    ASSERT_TRUE(w1);
+    EXPECT_EQ(w1->size(), 4);
+    EXPECT_EQ((*w1)[2], qvec3f(16, 0, -16));
+    EXPECT_EQ((*w1)[3], qvec3f(0, 0, -16));
+
+    // entirely behind
+    w1 = ClipStackWinding(stats, w1, stack, qplane3f({0, 0, 1}, 0));
+    EXPECT_FALSE(w1);
+}
+
+TEST(vis, ClipStackWindingFloatMatchesDouble)
+{
+    pstack_t stack{};
+    pstackf_t stackf{};
+    visstats_t stats{};
+
+    std::mt19937 engine(0);
+    std::uniform_real_distribution<double> coord(-512, 512);
+    std::uniform_real_distribution<double> unit(-1, 1);
+    std::uniform_real_distribution<double> fraction(0, 1);
+    std::uniform_int_distribution<int> numsides(3, 12);
+
+    int numsplit = 0;
+
+    for (int i = 0; i < 1000; i++) {
+        SCOPED_TRACE(fmt::format("winding {}", i));
+
+        // a convex polygon, with its points spread around a circle on a random plane
+        const qvec3d center(coord(engine), coord(engine), coord(engine));
+        const qvec3d normal = qv::normalize(qvec3d(unit(engine), unit(engine), unit(engine)));
+        auto [tangent, bitangent] = qv::MakeTangentAndBitangentUnnormalized(normal);
+        tangent = qv::normalize(tangent);
+        bitangent = qv::normalize(bitangent);
+        const double radius = 8 + 248 * fraction(engine);
+        const int numpoints = numsides(engine);
+
+        // both clip the same float points against the same float plane, so they only differ in the clipping
+        std::vector<qvec3f> points;
+        for (int j = 0; j < numpoints; j++) {
+            const double angle = (j + 0.5 * fraction(engine)) * 2 * Q_PI / numpoints;
+            points.emplace_back(center + (tangent * std::cos(angle) + bitangent * std::sin(angle)) * radius);
+        }
+
+        const qvec3d split_normal = qv::normalize(qvec3d(unit(engine), unit(engine), unit(engine)));
+        const float split_dist = static_cast<float>(qv::dot(split_normal, center) + radius * unit(engine));
+        const qplane3f splitf(qvec3f(split_normal), split_dist);
+        const qplane3d split(qvec3d(splitf.normal), splitf.dist);
+
+        // the two can round a point within VIS_ON_EPSILON of the plane to opposite sides of that, so skip those
+        bool borderline = false;
+        for (auto &point : points) {
+            borderline |= std::abs(std::abs(split.distance_to(qvec3d(point))) - VIS_ON_EPSILON) < 0.5;
+        }
+        if (borderline) {
+            continue;
+        }
+
+        auto *w = AllocStackWinding(stack);
+        w->numpoints = 0;
+        auto *wf = AllocStackWinding(stackf);
+        wf->numpoints = 0;
+        for (auto &point : points) {
+            w->push_back(qvec3d(point));
+            wf->push_back(point);
+        }
+        w->set_winding_sphere();
+        wf->set_winding_sphere();
+
+        w = ClipStackWinding(stats, w, stack, split);
+        wf = ClipStackWinding(stats, wf, stackf, splitf);
+
+        ASSERT_EQ(w == nullptr, wf == nullptr);
+        if (!w) {
+            continue;
+        }
+
+        ASSERT_EQ(w->size(), wf->size());
+        for (size_t j = 0; j < w->size(); j++) {
+            EXPECT_LT(qv::distance((*w)[j], qvec3d((*wf)[j])), 0.1) << j;
+        }
+        if (w->size() != static_cast<size_t>(numpoints)) {
+            numsplit++;
+        }
+
+        FreeStackWinding(w, stack);
+        FreeStackWinding(wf, stackf);
+    }
+
+    // enough of them were actually split to be worth comparing
+    EXPECT_GT(numsplit, 100);
+}
+
+TEST(vis, leafbitsBulkOps)
+{
+    // enough bits for whole vectors plus a partial tail block
+    constexpr size_t numbits = 64 * 9 + 13;
+
+    leafbits_t a(numbits), b(numbits), vis(numbits), out(numbits);
+    for (size_t i = 0; i < numbits; i += 3)
+        a[i] = true;
+    for (size_t i = 0; i < numbits; i += 5)
+        b[i] = true;
+
+    // a & b is every 15th bit
+    std::vector<size_t> expected;
+    for (size_t i = 0; i < numbits; i += 15)
+        expected.push_back(i);
+
+    EXPECT_TRUE(out.assign_and(a, b, vis));
+    EXPECT_EQ(out.count(), expected.size());
+
+    std::vector<size_t> found;
+    out.for_each_set([&](size_t i) { found.push_back(i); });
+    EXPECT_EQ(found, expected);
+
+    // nothing new once every bit of the result is already in vis
+    vis = out;
+    EXPECT_FALSE(out.assign_and(a, b, vis));
+
+    // ...except the one in the tail block
+    vis[expected.back()] = false;
+    EXPECT_TRUE(out.assign_and(a, b, vis));
+
+    EXPECT_TRUE(out.andnot(vis));
+    EXPECT_EQ(out.count(), 1);
+    EXPECT_TRUE(out[expected.back()]);
+
+    EXPECT_FALSE(out.assign_andnot(a, a));
+    EXPECT_FALSE(out.any());
+
+    out |= b;
+    out &= a;
+    EXPECT_EQ(out.count(), expected.size());
+}
+
+TEST(vis, compactLeafbits)
+{
+    constexpr size_t numbits = 64 * 40 + 13;
+
+    // a few bits in 3 blocks go sparse, every 3rd bit stays dense
+    leafbits_t few(numbits), many(numbits);
+    for (size_t i : {size_t(5), size_t(64 * 7 + 1), size_t(64 * 7 + 62), numbits - 1})
+        few[i] = true;
+    for (size_t i = 0; i < numbits; i += 3)
+        many[i] = true;
+
+    const compact_leafbits_t sparse(few), dense(many);
+    EXPECT_TRUE(sparse.sparse());
+    EXPECT_FALSE(dense.sparse());
+    EXPECT_LT(sparse.memory_size(), dense.memory_size());
+
+    for (size_t i = 0; i < numbits; i++) {
+        EXPECT_EQ(sparse[i], bool(few[i]));
+        EXPECT_EQ(dense[i], bool(many[i]));
+    }
+    EXPECT_EQ(sparse.count(), few.count());
+    EXPECT_EQ(dense.count(), many.count());
+
+    std::vector<size_t> found, expected;
+    sparse.for_each_set([&](size_t i) { found.push_back(i); });
+    few.for_each_set([&](size_t i) { expected.push_back(i); });
+    EXPECT_EQ(found, expected);
+
+    // the same results as with the dense operands
+    leafbits_t vis(numbits), out(numbits), check(numbits);
+    vis[5] = true;
+    EXPECT_EQ(out.assign_and(many, sparse, vis), check.assign_and(many, few, vis));
+    EXPECT_EQ(out.count(), check.count());
+    EXPECT_EQ(out.assign_and(few, dense, vis), check.assign_and(few, many, vis));
+    EXPECT_EQ(out.count(), check.count());
+
+    out = many;
+    out &= sparse;
+    check = many;
+    check &= few;
+    EXPECT_EQ(out.count(), check.count());
+
+    out.clear();
+    out |= sparse;
+    out |= dense;
+    check = few;
+    check |= many;
+    EXPECT_EQ(out.count(), check.count());
+
+    EXPECT_FALSE(out.assign_andnot(sparse, sparse));
+    EXPECT_TRUE(out.assign_andnot(dense, sparse));
+    EXPECT_EQ(out.count(), many.count() - 1); // bit 64 * 7 + 62 is in both
+
+    // clearing a bit keeps the representation
+    compact_leafbits_t bits = sparse;
+    bits.reset(64 * 7 + 1);
+    bits.reset(64 * 20); // in a zero block
+    EXPECT_TRUE(bits.sparse());
+    EXPECT_FALSE(bits[64 * 7 + 1]);
+    EXPECT_EQ(bits.count(), few.count() - 1);
+    EXPECT_EQ(bits.expand().count(), few.count() - 1);
+}
+
 TEST(vis, q1NoambientFuncGroup)
 {
     auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_vis_noambient_func_group.map", {}, runvis_t::yes);
@@ -0,0 +1,341 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <vis/vis.hh>
+#include <common/log.hh>
+#include <common/parallel.hh>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/*
+ * Approximate vis: the leafs are convex cells bounded by their portals and
+ * solid, so a ray cast from a point on a portal can be walked leaf to leaf
+ * through whichever portal it leaves by, until it either arrives or leaves a
+ * leaf through solid. A handful of rays can't find every narrow gap, so a ray
+ * that only just misses a portal is counted as going through it; the result
+ * errs towards seeing too much, like -fast does, rather than too little.
+ */
+
+// how far outside a portal's winding a ray can cross it and still be let through, from -approxgraze
+static double approx_graze_distance;
+
+// inward facing edge planes of a portal winding, for testing where a ray crosses it
+struct approx_portal_t
+{
+    std::vector<qplane3d> edges;
+    std::vector<qvec3d> samples;
+    std::vector<qvec3d> corners;
+};
+
+static std::vector<approx_portal_t> approx_portals;
+
+// small deterministic generator, so the samples (and so the .bsp) don't depend on scheduling
+static inline double Approx_Random(uint64_t &state)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return static_cast<double>(state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void Approx_SetupPortal(size_t portalnum, int numsamples)
+{
+    const visportal_t &p = portals[portalnum];
+    const viswinding_t &w = *p.winding;
+    approx_portal_t &ap = approx_portals[portalnum];
+
+    for (size_t i = 0; i < w.size(); i++) {
+        const qvec3d &p0 = w.at(i);
+        const qvec3d &p1 = w.at((i + 1) % w.size());
+        qvec3d normal = qv::cross(p.plane.normal, p1 - p0);
+
+        if (qv::normalizeInPlace(normal) == 0) {
+            continue;
+        }
+
+        qplane3d edge{normal, qv::dot(normal, p0)};
+        if (edge.distance_to(w.origin) < 0) {
+            edge = -edge;
+        }
+        ap.edges.push_back(edge);
+    }
+
+    // the winding points, moved in a little so the rays don't start or end on an edge
+    for (size_t i = 0; i < w.size(); i++) {
+        ap.corners.push_back(w.at(i) + (w.origin - w.at(i)) * 0.01);
+    }
+
+    // the winding as a fan of triangles around its first point, to place samples by area
+    std::vector<double> area(w.size() - 2);
+    double totalarea = 0;
+    for (size_t i = 0; i < area.size(); i++) {
+        area[i] = qv::length(qv::cross(w.at(i + 1) - w.at(0), w.at(i + 2) - w.at(0)));
+        totalarea += area[i];
+    }
+
+    uint64_t state = portalnum + 1;
+
+    // one sample in each of numsamples equal slices of the area
+    for (int s = 0; s < numsamples; s++) {
+        double target = (s + Approx_Random(state)) / numsamples * totalarea;
+        size_t tri = 0;
+        while (tri + 1 < area.size() && target > area[tri]) {
+            target -= area[tri++];
+        }
+
+        double u = Approx_Random(state), v = Approx_Random(state);
+        if (u + v > 1) {
+            u = 1 - u;
+            v = 1 - v;
+        }
+
+        ap.samples.push_back(w.at(0) + (w.at(tri + 1) - w.at(0)) * u + (w.at(tri + 2) - w.at(0)) * v);
+    }
+}
+
+// how far outside the winding a point on the portal's plane is, or 0 if it's inside
+static double Approx_DistanceOutside(const approx_portal_t &ap, const qvec3d &point)
+{
+    double outside = 0;
+    for (auto &edge : ap.edges) {
+        outside = std::max(outside, -edge.distance_to(point));
+    }
+
+    return outside;
+}
+
+/*
+ * Walks the ray from start through end, which starts on a portal leading into
+ * `leafnum`, marking each leaf it enters in `visible` until it leaves a leaf
+ * through solid. Carrying on past the end point costs little and finds the
+ * leafs behind the target too. The leafs behind the portals it grazes are
+ * marked as well, and where it would hit solid it carries on through the
+ * nearest of them instead.
+ */
+static void Approx_CastRay(int leafnum, const qvec3d &start, const qvec3d &end, leafbits_t &visible)
+{
+    const qvec3d delta = end - start;
+    double t = 0;
+
+    visible[leafnum] = true;
+
+    for (int steps = 0; steps < portalleafs; steps++) {
+        const visportal_t *exit = nullptr, *grazed = nullptr;
+        double exit_t = std::numeric_limits<double>::infinity();
+        double grazed_t = std::numeric_limits<double>::infinity();
+
+        for (const visportal_t *p : leafs[leafnum].portals) {
+            const double d0 = p->plane.distance_to(start);
+            const double d1 = p->plane.distance_to(end);
+
+            // leaving the leaf means crossing from behind the portal to in front of it
+            if (d1 <= d0) {
+                continue;
+            }
+
+            const double hit_t = -d0 / (d1 - d0);
+            if (hit_t <= t + 1e-6) {
+                continue;
+            }
+
+            const double outside = Approx_DistanceOutside(approx_portals[p - portals.data()], start + delta * hit_t);
+            if (outside <= VIS_ON_EPSILON) {
+                if (hit_t < exit_t) {
+                    exit = p;
+                    exit_t = hit_t;
+                }
+            } else if (outside <= approx_graze_distance) {
+                visible[p->leaf] = true;
+                if (hit_t < grazed_t) {
+                    grazed = p;
+                    grazed_t = hit_t;
+                }
+            }
+        }
+
+        if (!exit) {
+            if (!grazed) {
+                return;
+            }
+            exit = grazed;
+            exit_t = grazed_t;
+        }
+
+        leafnum = exit->leaf;
+        t = exit_t;
+        visible[leafnum] = true;
+    }
+}
+
+static void Approx_PortalVis(visportal_t &p, int numsamples)
+{
+    const size_t portalnum = &p - portals.data();
+    const approx_portal_t &source = approx_portals[portalnum];
+    const leafbits_t mightsee = p.mightsee.expand();
+
+    leafbits_t visible(portalleafs);
+    visible.clear();
+    visible[p.leaf] = true;
+
+    // aim at the farthest targets first; their rays cross most of the nearer leafs on
+    // the way, which then don't need rays of their own
+    std::vector<std::pair<double, size_t>> targets;
+    for (size_t i = 0; i < portals.size(); i++) {
+        const visportal_t &target = portals[i];
+        if (i == portalnum || !mightsee[target.leaf]) {
+            continue;
+        }
+        if (p.plane.distance_to(target.winding->origin) < -target.winding->radius) {
+            continue;
+        }
+        targets.emplace_back(qv::distance2(p.winding->origin, target.winding->origin), i);
+    }
+    std::sort(targets.begin(), targets.end(), std::greater<>());
+
+    for (auto &[dist, i] : targets) {
+        const visportal_t &target = portals[i];
+        if (visible[target.leaf]) {
+            continue;
+        }
+
+        const approx_portal_t &dest = approx_portals[i];
+
+        // pair the samples up with a different offset for each target, so each source
+        // sample is aimed at a spread of target samples over the whole pass
+        const size_t offset = i % numsamples;
+        for (int s = 0; s < numsamples && !visible[target.leaf]; s++) {
+            const qvec3d &start = source.samples[s];
+            const qvec3d &end = dest.samples[(s + offset) % numsamples];
+
+            if (p.plane.distance_to(end) <= VIS_ON_EPSILON) {
+                continue;
+            }
+
+            Approx_CastRay(p.leaf, start, end, visible);
+        }
+
+        // the corners too, since a narrow gap is most often only seen past the edges of the portals
+        for (size_t c = 0; c < source.corners.size() && !visible[target.leaf]; c++) {
+            const qvec3d &start = source.corners[c];
+            const qvec3d &end = dest.corners[(c + i) % dest.corners.size()];
+
+            if (p.plane.distance_to(end) <= VIS_ON_EPSILON) {
+                continue;
+            }
+
+            Approx_CastRay(p.leaf, start, end, visible);
+        }
+    }
+
+    p.visbits = visible;
+}
+
+static int64_t Approx_CountLeafs(const std::vector<leafbits_t> &leafvis)
+{
+    int64_t total = 0;
+    for (auto &bits : leafvis) {
+        total += bits.count();
+    }
+    return total;
+}
+
+// a ray is a line of sight both ways, so a leaf reached from another sees it too
+static void Approx_MakeSymmetric(std::vector<leafbits_t> &leafvis, const std::vector<leafbits_t> &leafmightsee)
+{
+    for (int i = 0; i < portalleafs; i++) {
+        leafvis[i].for_each_set([&](size_t j) {
+            if (leafmightsee[j][i]) {
+                leafvis[j][i] = true;
+            }
+        });
+    }
+}
+
+void ApproximatePortalVis(int numsamples, double graze_distance)
+{
+    logging::funcheader();
+
+    approx_graze_distance = graze_distance;
+
+    approx_portals.clear();
+    approx_portals.resize(portals.size());
+
+    logging::parallel_for(static_cast<size_t>(0), portals.size(), [&](size_t i) { Approx_SetupPortal(i, numsamples); });
+    logging::parallel_for(static_cast<size_t>(0), portals.size(), [&](size_t i) {
+        Approx_PortalVis(portals[i], numsamples);
+    });
+
+    approx_portals.clear();
+
+    // everything the portals of each leaf reached, and everything they might see
+    std::vector<leafbits_t> leafvis(portalleafs, leafbits_t(portalleafs));
+    std::vector<leafbits_t> leafmightsee(portalleafs, leafbits_t(portalleafs));
+    for (int i = 0; i < portalleafs; i++) {
+        leafvis[i].clear();
+        leafmightsee[i].clear();
+        for (const visportal_t *p : leafs[i].portals) {
+            leafvis[i] |= p->visbits;
+            leafmightsee[i] |= p->mightsee;
+        }
+    }
+
+    const int64_t numhit = Approx_CountLeafs(leafvis);
+
+    Approx_MakeSymmetric(leafvis, leafmightsee);
+
+    const int64_t numsymmetric = Approx_CountLeafs(leafvis);
+
+    // the rays can slip past small leafs, so also let through the neighbours of
+    // every leaf they reached that the leaf might see
+    std::vector<leafbits_t> grownvis(leafvis);
+    logging::parallel_for(0, portalleafs, [&](int i) {
+        leafvis[i].for_each_set([&](size_t j) {
+            for (const visportal_t *next : leafs[j].portals) {
+                if (leafmightsee[i][next->leaf]) {
+                    grownvis[i][next->leaf] = true;
+                }
+            }
+        });
+    });
+
+    // and a neighbour let through one way is let through both ways too
+    Approx_MakeSymmetric(grownvis, leafmightsee);
+
+    const int64_t numcansee = Approx_CountLeafs(grownvis);
+
+    // ClusterFlow takes the union of the leaf's portals, so each can keep just its own share
+    logging::parallel_for(0, portalleafs, [&](int i) {
+        for (visportal_t *p : leafs[i].portals) {
+            leafbits_t share = grownvis[i];
+            share &= p->mightsee;
+            p->visbits = share;
+            p->numcansee = static_cast<int>(share.count());
+            p->status = pstat_done;
+        }
+    });
+
+    const int64_t nummightsee = Approx_CountLeafs(leafmightsee);
+
+    const double n = static_cast<double>(portalleafs);
+    logging::print("average leafs visible: {:.1f} hit by rays, {:.1f} both ways, {:.1f} with their neighbours, "
+                   "of {:.1f} in mightsee ({:.1f}%)\n",
+        numhit / n, numsymmetric / n, numcansee / n, nummightsee / n,
+        nummightsee ? 100.0 * numcansee / nummightsee : 0.0);
+}
@@ -0,0 +1,1130 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <vis/vis.hh>
+#include <common/cmdlib.hh>
+#include <common/log.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+using socket_t = SOCKET;
+
+static void CloseSocket(socket_t s)
+{
+    closesocket(s);
+}
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using socket_t = int;
+constexpr socket_t INVALID_SOCKET = -1;
+
+static void CloseSocket(socket_t s)
+{
+    close(s);
+}
+#endif
+
+/*
+  ============================================================================
+  Protocol
+
+  Every message is a little endian uint32 length followed by that many
+  bytes. The worker starts with a hello, then repeatedly sends a request
+  carrying the result of the portal it was last given (if any), and the
+  coordinator answers with the next portal and the portals that changed
+  since its last answer to that worker.
+  ============================================================================
+*/
+
+constexpr uint32_t VIS_NET_VERSION = ('T' << 24 | 'Y' << 16 | 'N' << 8 | '2');
+
+// portal numbers in a reply that aren't portals
+constexpr int32_t NET_NO_PORTAL = -1; // no more work, disconnect
+constexpr int32_t NET_WAIT = -2; // the remaining portals are being flowed, ask again later
+
+// a result that tested more portals than this sends NET_TESTED_MERGED, their
+// numbers and the union of their bits instead, which is checked as if each of
+// them had been tested against all of it
+constexpr uint32_t MAX_NET_TESTED = 256;
+constexpr uint32_t NET_TESTED_MERGED = std::numeric_limits<uint32_t>::max();
+
+struct dnethello_t
+{
+    uint32_t version;
+    uint32_t numportals;
+    uint32_t numleafs;
+    int32_t level;
+    float visdist;
+    float targetratio;
+    uint32_t floatclip;
+
+    auto stream_data() { return std::tie(version, numportals, numleafs, level, visdist, targetratio, floatclip); }
+
+    bool operator==(const dnethello_t &) const = default;
+};
+
+// workers must have the same portals and flow them the same way
+static dnethello_t CurrentHello()
+{
+    return {VIS_NET_VERSION, static_cast<uint32_t>(numportals), static_cast<uint32_t>(portalleafs),
+        vis_options.level.value(), vis_options.visdist.value(), vis_options.targetratio.value(),
+        vis_options.floatclip.value()};
+}
+
+struct dnetupdate_t
+{
+    uint32_t portalnum;
+    uint32_t status;
+    uint32_t nummightsee;
+    uint32_t numcansee;
+
+    auto stream_data() { return std::tie(portalnum, status, nummightsee, numcansee); }
+};
+
+static void InitSockets()
+{
+#ifdef _WIN32
+    static std::once_flag once;
+    std::call_once(once, [] {
+        WSADATA data;
+        if (WSAStartup(MAKEWORD(2, 2), &data) != 0) {
+            FError("WSAStartup failed");
+        }
+    });
+#endif
+}
+
+static bool SendAll(socket_t s, const char *data, size_t len)
+{
+    while (len) {
+#if defined(_WIN32)
+        const int sent = send(s, data, static_cast<int>(std::min<size_t>(len, INT_MAX)), 0);
+#elif defined(MSG_NOSIGNAL)
+        const ssize_t sent = send(s, data, len, MSG_NOSIGNAL);
+#else
+        const ssize_t sent = send(s, data, len, 0);
+#endif
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static bool RecvAll(socket_t s, char *data, size_t len)
+{
+    while (len) {
+#ifdef _WIN32
+        const int got = recv(s, data, static_cast<int>(std::min<size_t>(len, INT_MAX)), 0);
+#else
+        const ssize_t got = recv(s, data, len, 0);
+#endif
+        if (got <= 0) {
+            return false;
+        }
+        data += got;
+        len -= got;
+    }
+    return true;
+}
+
+static bool SendMessage(socket_t s, const std::ostringstream &message)
+{
+    const std::string data = message.str();
+
+    std::ostringstream header;
+    header << endianness<std::endian::little>;
+    header <= static_cast<uint32_t>(data.size());
+
+    const std::string header_data = header.str();
+
+    return SendAll(s, header_data.data(), header_data.size()) && SendAll(s, data.data(), data.size());
+}
+
+// the biggest request a worker can legitimately send: a result with its visbits
+// and MAX_NET_TESTED tested portals, or the number of every portal
+static size_t MaxRequestSize()
+{
+    const size_t leafbytes = (portalleafs + 7) >> 3;
+    return 1024 + (1 + MAX_NET_TESTED) * (2 * sizeof(uint32_t) + leafbytes) + portals.size() * sizeof(uint32_t);
+}
+
+// the biggest reply the coordinator can legitimately send: one updating every portal
+static size_t MaxReplySize()
+{
+    const size_t leafbytes = (portalleafs + 7) >> 3;
+    return 1024 + portals.size() * (sizeof(dnetupdate_t) + 2 * (sizeof(uint32_t) + leafbytes));
+}
+
+static bool RecvMessage(socket_t s, std::istringstream &message, size_t maxsize)
+{
+    char header_data[sizeof(uint32_t)];
+    if (!RecvAll(s, header_data, sizeof(header_data))) {
+        return false;
+    }
+
+    std::istringstream header(std::string(header_data, sizeof(header_data)));
+    header >> endianness<std::endian::little>;
+
+    uint32_t size;
+    header >= size;
+
+    // don't let a bad length allocate whatever it says
+    if (size > maxsize) {
+        logging::print("WARNING: message of {} bytes is too large for these portals\n", size);
+        return false;
+    }
+
+    std::string data(size, '\0');
+    if (!RecvAll(s, data.data(), size)) {
+        return false;
+    }
+
+    message = std::istringstream(std::move(data));
+    message >> endianness<std::endian::little>;
+    return true;
+}
+
+static std::ostringstream NewMessage()
+{
+    std::ostringstream message;
+    message << endianness<std::endian::little>;
+    return message;
+}
+
+template<typename T>
+static void WriteBits(std::ostream &s, const T &bits, std::vector<uint8_t> &compressed)
+{
+    const uint32_t len = CompressBits(compressed.data(), bits);
+    s <= len;
+    s.write((const char *)compressed.data(), len);
+}
+
+static bool ReadBits(std::istream &s, leafbits_t &bits, std::vector<uint8_t> &compressed)
+{
+    uint32_t len;
+    s >= len;
+    if (!s || len > compressed.size()) {
+        return false;
+    }
+    s.read((char *)compressed.data(), len);
+    UncompressBits(bits, compressed.data(), len);
+    return static_cast<bool>(s);
+}
+
+static bool ReadBits(std::istream &s, compact_leafbits_t &bits, std::vector<uint8_t> &compressed)
+{
+    leafbits_t dense;
+    if (!ReadBits(s, dense, compressed)) {
+        return false;
+    }
+    bits = dense;
+    return true;
+}
+
+static void SetNoDelay(socket_t s)
+{
+    // requests and replies are small and strictly alternate
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one));
+#if !defined(_WIN32) && !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+    setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, (const char *)&one, sizeof(one));
+#endif
+}
+
+/*
+  ============================================================================
+  Coordinator
+
+  Results are committed in the order a single thread would have flowed the
+  portals: the waiting portal with the lowest nummightsee, then the lowest
+  number, like GetNextPortal. Workers are handed the portals after the ones
+  being flowed, so a result can be computed from older state than the one
+  it's committed on. Each result carries what its flow read of the other
+  portals, and is only committed if no commit since it was handed out
+  changed that or the portal itself; otherwise the portal is flowed again.
+  This keeps the output identical to -threads 1.
+  ============================================================================
+*/
+
+struct worker_connection_t
+{
+    socket_t sock;
+    std::string name;
+    // portals changed since the last reply to this worker
+    leafbits_t dirty;
+    // the portal this worker is flowing, and the commit it was handed out after
+    visportal_t *working = nullptr;
+    uint64_t version = 0;
+};
+
+struct portal_result_t
+{
+    leafbits_t visbits;
+    int numcansee;
+    visstats_t stats;
+    portalreads_t reads;
+    uint64_t version;
+};
+
+// everything below is guarded by portal_mutex
+static std::list<worker_connection_t *> connections;
+
+// waiting portals, in the order they're committed
+static std::set<std::pair<int, size_t>> serial_order;
+// the nummightsee each portal is filed under in serial_order
+static std::vector<int> serial_key;
+static std::vector<uint8_t> in_flight;
+static std::map<size_t, portal_result_t> results;
+
+/*
+ * What each commit changed: the portal that was committed (and what it
+ * stopped letting through, now its visbits are used instead of its
+ * mightsee), and the portals that lost its leaf from their mightsee
+ */
+struct commit_t
+{
+    size_t portalnum;
+    int leaf;
+    leafbits_t lost;
+    std::vector<size_t> changed;
+};
+
+// commits a handed out portal or a waiting result may not have seen
+static std::deque<commit_t> commit_log;
+// number of commits before commit_log.front()
+static uint64_t commit_log_base;
+
+static uint64_t CommitVersion()
+{
+    return commit_log_base + commit_log.size();
+}
+
+static visstats_t coordinator_stats;
+static size_t coordinator_reflowed;
+static std::atomic_size_t coordinator_remaining;
+static std::atomic_size_t coordinator_connected;
+static logging::percent_clock *coordinator_clock;
+
+/*
+  ==============
+  ResultValid
+
+  Whether any commit since the portal was handed out changed what its flow
+  saw: its own mightsee, or the bits of another portal's mightsee that the
+  flow tested, either by the portal being done (so its visbits are tested
+  instead) or by losing the committed portal's leaf.
+  ==============
+*/
+static bool ResultValid(size_t portalnum, const portal_result_t &result)
+{
+    const visportal_t &p = portals[portalnum];
+
+    for (uint64_t version = result.version; version < CommitVersion(); version++) {
+        const commit_t &commit = commit_log[version - commit_log_base];
+
+        if (std::binary_search(commit.changed.begin(), commit.changed.end(), portalnum)) {
+            return false;
+        }
+
+        // everything tested is within our mightsee
+        if (!p.mightsee[commit.leaf]) {
+            continue;
+        }
+
+        if (auto it = result.reads.tested.find(commit.portalnum); it != result.reads.tested.end()) {
+            leafbits_t lost = commit.lost;
+            if (lost &= it->second, lost.any()) {
+                return false;
+            }
+        }
+        for (size_t changed : commit.changed) {
+            auto it = result.reads.tested.find(changed);
+            if (it != result.reads.tested.end() && it->second[commit.leaf]) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// drops the commits everything handed out or waiting has already seen
+static void TrimCommitLog()
+{
+    uint64_t oldest = CommitVersion();
+
+    for (const worker_connection_t *conn : connections) {
+        if (conn->working) {
+            oldest = std::min(oldest, conn->version);
+        }
+    }
+    for (const auto &[portalnum, result] : results) {
+        oldest = std::min(oldest, result.version);
+    }
+
+    while (commit_log_base < oldest) {
+        commit_log.pop_front();
+        commit_log_base++;
+    }
+}
+
+/*
+  ==============
+  CommitResults
+
+  Commits results for as long as there's one for the next portal in order
+  ==============
+*/
+static void CommitResults()
+{
+    std::vector<visportal_t *> changed;
+
+    while (!serial_order.empty()) {
+        const size_t portalnum = serial_order.begin()->second;
+        auto it = results.find(portalnum);
+
+        if (it == results.end()) {
+            return;
+        }
+        if (!ResultValid(portalnum, it->second)) {
+            results.erase(it);
+            coordinator_reflowed++;
+            return;
+        }
+
+        visportal_t *p = &portals[portalnum];
+        portal_result_t &result = it->second;
+
+        p->visbits = result.visbits;
+        p->numcansee = result.numcansee;
+        coordinator_stats = coordinator_stats + result.stats;
+
+        results.erase(it);
+        serial_order.erase(serial_order.begin());
+
+        changed.clear();
+        CommitPortal(coordinator_stats, p, changed);
+
+        commit_t &commit = commit_log.emplace_back();
+        commit.portalnum = portalnum;
+        commit.leaf = p->leaf;
+        commit.lost.assign_andnot(p->mightsee, p->visbits);
+
+        // changed is sorted by address, so these are sorted too
+        for (visportal_t *p2 : changed) {
+            const size_t p2num = p2 - portals.data();
+            serial_order.erase({serial_key[p2num], p2num});
+            serial_key[p2num] = p2->nummightsee;
+            serial_order.emplace(serial_key[p2num], p2num);
+            commit.changed.push_back(p2num);
+        }
+
+        for (worker_connection_t *conn : connections) {
+            conn->dirty[portalnum] = true;
+            for (size_t p2num : commit.changed) {
+                conn->dirty[p2num] = true;
+            }
+        }
+
+        logging::print(logging::flag::VERBOSE, "portal:{:4}  mightsee:{:4}  cansee:{:4}\n", portalnum,
+            p->nummightsee, p->numcansee);
+
+        coordinator_clock->increase();
+        coordinator_remaining--;
+    }
+}
+
+/*
+  ==============
+  DispatchPortal
+
+  Picks a waiting portal that isn't being flowed and has no result yet.
+  Prefers one whose mightsee has none of the leafs of the portals committed
+  before it, since none of their commits can then change what it sees;
+  otherwise the first one in order.
+  ==============
+*/
+constexpr size_t MAX_DISPATCH_LOOKAHEAD = 64;
+
+static int32_t DispatchPortal(worker_connection_t &conn)
+{
+    if (serial_order.empty()) {
+        return NET_NO_PORTAL;
+    }
+
+    // leafs of the portals that commit first
+    leafbits_t earlier(portalleafs);
+    std::optional<size_t> fallback;
+    size_t examined = 0;
+
+    for (const auto &[key, portalnum] : serial_order) {
+        const visportal_t &p = portals[portalnum];
+
+        if (!in_flight[portalnum] && !results.count(portalnum)) {
+            if (!fallback) {
+                fallback = portalnum;
+            }
+
+            leafbits_t overlap = earlier;
+            overlap &= p.mightsee;
+            if (!overlap.any()) {
+                fallback = portalnum;
+                break;
+            }
+        }
+
+        earlier[p.leaf] = true;
+
+        if (++examined == MAX_DISPATCH_LOOKAHEAD) {
+            break;
+        }
+    }
+
+    if (!fallback) {
+        return NET_WAIT;
+    }
+
+    in_flight[*fallback] = true;
+    conn.working = &portals[*fallback];
+    conn.version = CommitVersion();
+    return static_cast<int32_t>(*fallback);
+}
+
+struct portal_update_t
+{
+    const visportal_t *portal;
+    dnetupdate_t header;
+    // copy of the mightsee of portals that can still change
+    std::optional<compact_leafbits_t> mightsee;
+};
+
+static std::vector<portal_update_t> CollectUpdates(worker_connection_t &conn)
+{
+    std::vector<portal_update_t> updates;
+
+    conn.dirty.for_each_set([&](size_t i) {
+        const visportal_t &p = portals[i];
+        portal_update_t &update = updates.emplace_back();
+        update.portal = &p;
+        update.header.portalnum = i;
+        update.header.status = p.status;
+        update.header.nummightsee = p.nummightsee;
+        update.header.numcansee = p.numcansee;
+        if (p.status != pstat_done) {
+            update.mightsee = p.mightsee;
+        }
+    });
+    conn.dirty.clear();
+
+    return updates;
+}
+
+// done portals don't change, so this runs without the lock
+static void WriteUpdates(std::ostream &s, const std::vector<portal_update_t> &updates)
+{
+    std::vector<uint8_t> compressed((portalleafs + 7) >> 3);
+
+    s <= static_cast<uint32_t>(updates.size());
+    for (const portal_update_t &update : updates) {
+        s <= update.header;
+        WriteBits(s, update.mightsee ? *update.mightsee : update.portal->mightsee, compressed);
+        if (update.header.status == pstat_done) {
+            WriteBits(s, update.portal->visbits, compressed);
+        }
+    }
+}
+
+static bool ServeWorkerRequests(worker_connection_t &conn)
+{
+    std::vector<uint8_t> compressed((portalleafs + 7) >> 3);
+
+    while (true) {
+        std::istringstream request;
+        if (!RecvMessage(conn.sock, request, MaxRequestSize())) {
+            return false;
+        }
+
+        int32_t portalnum;
+        request >= portalnum;
+
+        portal_result_t result;
+
+        if (portalnum != NET_NO_PORTAL) {
+            if (!conn.working || portalnum != conn.working - portals.data()) {
+                logging::print("WARNING: {} returned portal {} which it wasn't given\n", conn.name, portalnum);
+                return false;
+            }
+
+            uint32_t numcansee, numtested;
+
+            if (!ReadBits(request, result.visbits, compressed)) {
+                return false;
+            }
+            request >= numcansee >= result.stats >= numtested;
+            if (numtested == NET_TESTED_MERGED) {
+                request >= numtested;
+                if (numtested > portals.size()) {
+                    return false;
+                }
+                std::vector<uint32_t> testednums(numtested);
+                for (uint32_t &testednum : testednums) {
+                    request >= testednum;
+                    if (testednum >= portals.size()) {
+                        return false;
+                    }
+                }
+                leafbits_t merged;
+                if (!ReadBits(request, merged, compressed)) {
+                    return false;
+                }
+                for (uint32_t testednum : testednums) {
+                    result.reads.tested.emplace(testednum, merged);
+                }
+            } else if (numtested <= MAX_NET_TESTED) {
+                for (uint32_t i = 0; i < numtested && request; i++) {
+                    uint32_t testednum;
+                    request >= testednum;
+                    if (testednum >= portals.size() ||
+                        !ReadBits(request, result.reads.tested[testednum], compressed)) {
+                        return false;
+                    }
+                }
+            } else {
+                return false;
+            }
+            if (!request) {
+                return false;
+            }
+
+            result.numcansee = numcansee;
+        }
+
+        int32_t next;
+        std::vector<portal_update_t> updates;
+
+        {
+            std::unique_lock lock(portal_mutex);
+
+            if (portalnum != NET_NO_PORTAL) {
+                result.version = conn.version;
+                in_flight[portalnum] = false;
+                conn.working = nullptr;
+
+                // no use waiting for its turn if it's already out of date
+                if (ResultValid(portalnum, result)) {
+                    results.emplace(portalnum, std::move(result));
+                    CommitResults();
+                } else {
+                    coordinator_reflowed++;
+                }
+                TrimCommitLog();
+            }
+
+            next = DispatchPortal(conn);
+            updates = CollectUpdates(conn);
+        }
+
+        auto reply = NewMessage();
+        reply <= next;
+        WriteUpdates(reply, updates);
+
+        if (!SendMessage(conn.sock, reply)) {
+            return false;
+        }
+        if (next == NET_NO_PORTAL) {
+            return true;
+        }
+    }
+}
+
+static void ServeWorker(worker_connection_t &conn)
+{
+    std::istringstream hello_message;
+    dnethello_t hello{};
+
+    if (RecvMessage(conn.sock, hello_message, MaxRequestSize())) {
+        hello_message >= hello;
+    }
+
+    const bool accepted = (hello == CurrentHello());
+
+    auto reply = NewMessage();
+    reply <= CurrentHello();
+    if (!SendMessage(conn.sock, reply) || !accepted) {
+        logging::print("WARNING: rejected {}, it has different portals or settings\n", conn.name);
+        coordinator_connected--;
+        return;
+    }
+
+    logging::print(logging::flag::VERBOSE, "{} connected\n", conn.name);
+
+    {
+        std::unique_lock lock(portal_mutex);
+
+        // the worker has seen nothing yet
+        conn.dirty.resize(portals.size());
+        for (size_t i = 0; i < portals.size(); i++) {
+            conn.dirty[i] = true;
+        }
+        connections.push_back(&conn);
+    }
+
+    if (!ServeWorkerRequests(conn)) {
+        logging::print("WARNING: lost {}\n", conn.name);
+    }
+
+    {
+        std::unique_lock lock(portal_mutex);
+
+        if (conn.working) {
+            in_flight[conn.working - portals.data()] = false;
+            conn.working = nullptr;
+        }
+        connections.remove(&conn);
+    }
+
+    coordinator_connected--;
+}
+
+static socket_t OpenListener(int port)
+{
+    socket_t s = socket(AF_INET6, SOCK_STREAM, 0);
+    bool ipv6 = (s != INVALID_SOCKET);
+
+    if (!ipv6) {
+        s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s == INVALID_SOCKET) {
+            FError("can't create socket");
+        }
+    }
+
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one));
+
+    int result;
+
+    if (ipv6) {
+        // accept IPv4 as well
+        int zero = 0;
+        setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&zero, sizeof(zero));
+
+        sockaddr_in6 addr{};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        result = bind(s, (const sockaddr *)&addr, sizeof(addr));
+    } else {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        result = bind(s, (const sockaddr *)&addr, sizeof(addr));
+    }
+
+    if (result != 0 || listen(s, 16) != 0) {
+        StopVisJournal();
+        FError("can't listen on port {}", port);
+    }
+
+    return s;
+}
+
+static std::string PeerName(const sockaddr_storage &addr)
+{
+    char host[NI_MAXHOST], serv[NI_MAXSERV];
+
+    if (getnameinfo((const sockaddr *)&addr, sizeof(addr), host, sizeof(host), serv, sizeof(serv),
+            NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        return "worker";
+    }
+
+    return fmt::format("worker {}:{}", host, serv);
+}
+
+static bool PollListener(socket_t listener, int timeout_ms)
+{
+#ifdef _WIN32
+    WSAPOLLFD fd{listener, POLLRDNORM, 0};
+    return WSAPoll(&fd, 1, timeout_ms) > 0;
+#else
+    pollfd fd{listener, POLLIN, 0};
+    return poll(&fd, 1, timeout_ms) > 0;
+#endif
+}
+
+/*
+  ==============
+  RunVisCoordinator
+
+  Hands out portals until all numwaiting of them are done. Workers may come
+  and go; the portal of one that goes away is handed out again. Workers that
+  connect once everything is handed out are told there's nothing left.
+  ==============
+*/
+visstats_t RunVisCoordinator(int port, size_t numwaiting)
+{
+    InitSockets();
+
+    const socket_t listener = OpenListener(port);
+
+    logging::print("Waiting for vis workers on port {}\n", port);
+
+    serial_order.clear();
+    serial_key.assign(portals.size(), 0);
+    in_flight.assign(portals.size(), false);
+    results.clear();
+    commit_log.clear();
+    commit_log_base = 0;
+
+    for (size_t i = 0; i < portals.size(); i++) {
+        if (portals[i].status == pstat_none) {
+            serial_key[i] = portals[i].nummightsee;
+            serial_order.emplace(serial_key[i], i);
+        }
+    }
+
+    coordinator_stats = {};
+    coordinator_reflowed = 0;
+    coordinator_remaining = numwaiting;
+    coordinator_connected = 0;
+
+    std::list<worker_connection_t> workers;
+    std::list<std::thread> threads;
+
+    auto accept_worker = [&]() {
+        sockaddr_storage addr{};
+        socklen_t addrlen = sizeof(addr);
+        const socket_t s = accept(listener, (sockaddr *)&addr, &addrlen);
+        if (s == INVALID_SOCKET) {
+            return;
+        }
+
+        SetNoDelay(s);
+
+        worker_connection_t &conn = workers.emplace_back();
+        conn.sock = s;
+        conn.name = PeerName(addr);
+
+        coordinator_connected++;
+        threads.emplace_back(ServeWorker, std::ref(conn));
+    };
+
+    const auto wait_limit = std::chrono::seconds(vis_options.coordinatorwait.value());
+    auto last_worker = std::chrono::steady_clock::now();
+
+    {
+        logging::percent_clock clock(numwaiting);
+        coordinator_clock = &clock;
+
+        while (coordinator_remaining) {
+            if (PollListener(listener, 250)) {
+                accept_worker();
+            }
+
+            const auto now = std::chrono::steady_clock::now();
+            if (coordinator_connected) {
+                last_worker = now;
+            } else if (wait_limit.count() && now - last_worker > wait_limit) {
+                // keep the portals done so far for the next run
+                StopVisJournal();
+                FError("no vis workers connected for {} seconds", wait_limit.count());
+            }
+        }
+
+        // all portals are done; give the workers a moment to hear so, still
+        // answering any that turn up late
+        for (int i = 0; i < 100 && coordinator_connected; i++) {
+            if (PollListener(listener, 100)) {
+                accept_worker();
+            }
+        }
+
+        // workers still waiting to be accepted see the connection close
+        // before the hello, and take that as everything being done
+        CloseSocket(listener);
+
+        // wake any connections still waiting on their portal
+        {
+            std::unique_lock lock(portal_mutex);
+            for (worker_connection_t *conn : connections) {
+#ifdef _WIN32
+                shutdown(conn->sock, SD_BOTH);
+#else
+                shutdown(conn->sock, SHUT_RDWR);
+#endif
+            }
+        }
+
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        coordinator_clock = nullptr;
+    }
+
+    for (worker_connection_t &conn : workers) {
+        CloseSocket(conn.sock);
+    }
+
+    logging::print("{} workers connected\n", workers.size());
+    logging::print(
+        logging::flag::STAT, "     {:8} portals flowed again after their inputs changed\n", coordinator_reflowed);
+
+    return coordinator_stats;
+}
+
+/*
+  ============================================================================
+  Worker
+  ============================================================================
+*/
+
+// returns INVALID_SOCKET if nothing is listening at address within -workerwait
+static socket_t ConnectToCoordinator(const std::string &address)
+{
+    const size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        FError("-worker needs host:port, not \"{}\"", address);
+    }
+
+    std::string host = address.substr(0, colon);
+    const std::string port = address.substr(colon + 1);
+
+    // [::1]:port
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo *results;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &results) != 0) {
+        FError("can't resolve {}", address);
+    }
+
+    // the coordinator may still be loading the map or running base vis
+    const auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(vis_options.workerwait.value());
+
+    while (true) {
+        for (addrinfo *ai = results; ai; ai = ai->ai_next) {
+            socket_t s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (s == INVALID_SOCKET) {
+                continue;
+            }
+            if (connect(s, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) == 0) {
+                freeaddrinfo(results);
+                SetNoDelay(s);
+                return s;
+            }
+            CloseSocket(s);
+        }
+
+        if (std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+
+    freeaddrinfo(results);
+    return INVALID_SOCKET;
+}
+
+static bool ApplyUpdates(std::istream &s, std::vector<uint8_t> &compressed)
+{
+    uint32_t numupdates;
+    s >= numupdates;
+
+    for (uint32_t i = 0; i < numupdates && s; i++) {
+        dnetupdate_t update;
+        s >= update;
+
+        if (!s || update.portalnum >= portals.size()) {
+            return false;
+        }
+
+        visportal_t &p = portals[update.portalnum];
+        p.status = static_cast<pstatus_t>(update.status);
+        p.nummightsee = update.nummightsee;
+        p.numcansee = update.numcansee;
+
+        if (!ReadBits(s, p.mightsee, compressed)) {
+            return false;
+        }
+        if (p.status == pstat_done && !ReadBits(s, p.visbits, compressed)) {
+            return false;
+        }
+    }
+
+    return static_cast<bool>(s);
+}
+
+/*
+  ==============
+  RunVisWorker
+
+  Flows the portals the coordinator at address gives us, one at a time;
+  run more workers for more threads.
+  ==============
+*/
+int RunVisWorker(const std::string &address)
+{
+    InitSockets();
+
+    for (auto &p : portals) {
+        p.mightsee.resize(portalleafs);
+        p.visbits.resize(portalleafs);
+    }
+
+    const socket_t s = ConnectToCoordinator(address);
+
+    // a worker started after the coordinator finished has nothing to do
+    if (s == INVALID_SOCKET) {
+        logging::print("WARNING: can't connect to {}, assuming it has finished\n", address);
+        return 0;
+    }
+
+    {
+        auto hello = NewMessage();
+        hello <= CurrentHello();
+
+        std::istringstream reply;
+        dnethello_t coordinator_hello{};
+        if (!SendMessage(s, hello) || !RecvMessage(s, reply, MaxReplySize())) {
+            logging::print("WARNING: {} closed the connection, assuming it has finished\n", address);
+            CloseSocket(s);
+            return 0;
+        }
+        reply >= coordinator_hello;
+
+        if (!(coordinator_hello == CurrentHello())) {
+            FError("{} has different portals or settings", address);
+        }
+    }
+
+    logging::print("Connected to {}\n", address);
+
+    ResetSeparatorCache(static_cast<size_t>(vis_options.separatorcache.value()) << 20);
+
+    std::vector<uint8_t> compressed((portalleafs + 7) >> 3);
+    portalreads_t reads;
+    visportal_t *done = nullptr;
+    visstats_t stats;
+    size_t numflowed = 0;
+
+    while (true) {
+        auto request = NewMessage();
+        if (done) {
+            request <= static_cast<int32_t>(done - portals.data());
+            WriteBits(request, done->visbits, compressed);
+            request <= static_cast<uint32_t>(done->numcansee) <= stats;
+            if (reads.tested.size() > MAX_NET_TESTED) {
+                leafbits_t merged(portalleafs);
+                request <= NET_TESTED_MERGED <= static_cast<uint32_t>(reads.tested.size());
+                for (const auto &[testednum, tested] : reads.tested) {
+                    request <= static_cast<uint32_t>(testednum);
+                    merged |= tested;
+                }
+                WriteBits(request, merged, compressed);
+            } else {
+                request <= static_cast<uint32_t>(reads.tested.size());
+                for (const auto &[testednum, tested] : reads.tested) {
+                    request <= static_cast<uint32_t>(testednum);
+                    WriteBits(request, tested, compressed);
+                }
+            }
+        } else {
+            request <= NET_NO_PORTAL;
+        }
+
+        std::istringstream reply;
+        if (!SendMessage(s, request) || !RecvMessage(s, reply, MaxReplySize())) {
+            FError("lost connection to {}", address);
+        }
+
+        int32_t next;
+        reply >= next;
+
+        if (!ApplyUpdates(reply, compressed)) {
+            FError("bad reply from {}", address);
+        }
+
+        done = nullptr;
+
+        if (next == NET_NO_PORTAL) {
+            break;
+        } else if (next == NET_WAIT) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        } else if (next < 0 || static_cast<size_t>(next) >= portals.size()) {
+            FError("bad portal {} from {}", next, address);
+        }
+
+        visportal_t *p = &portals[next];
+        p->status = pstat_working;
+        p->numcansee = 0;
+        reads.tested.clear();
+
+        stats = PortalFlow(p, &reads);
+
+        // it's only done once the coordinator commits it
+        p->status = pstat_none;
+        done = p;
+        numflowed++;
+
+        logging::print(logging::flag::VERBOSE, "portal:{:4}  mightsee:{:4}  cansee:{:4}\n", next, p->nummightsee,
+            p->numcansee);
+    }
+
+    CloseSocket(s);
+    ResetSeparatorCache(0);
+
+    logging::print("Flowed {} portals\n", numflowed);
+
+    return 0;
+}
@@ -2,64 +2,101 @@
 #include <vis/leafbits.hh>
 #include <common/log.hh>
 #include <common/parallel.hh>
-#include <bit> // for std::popcount
+#include <atomic>
+#include <bit>
+#include <cstdlib>
+#include <mutex>
+
+// the portal's winding and plane in the precision the flow runs at
+template<typename W>
+static inline W *PortalWinding(const visportal_t *p)
+{
+    if constexpr (std::is_same_v<W, viswindingf_t>)
+        return p->windingf.get();
+    else
+        return p->winding.get();
+}
+
+template<typename W>
+static inline const typename W::plane_t &PortalPlane(const visportal_t *p)
+{
+    if constexpr (std::is_same_v<W, viswindingf_t>)
+        return p->planef;
+    else
+        return p->plane;
+}
 
 /*
   ==============
-  ClipToSeparators
-
-  Source, pass, and target are an ordering of portals.
+  FindSeparators
 
   Generates separating planes canidates by taking two points from source and
-  one point from pass, and clips target by them.
-
-  If target is totally clipped away, that portal can not be seen through.
-
-  Normal clip keeps target on the same side as pass, which is correct
-  if the order goes source, pass, target. If the order goes pass,
-  source, target then we flip the clipping plane. Test levels 0 and 2
-  use the 'normal', while 1 and 3 require the separating plane flip.
+  one point from pass, and calls visit with each one that has all of pass on
+  its front side, until visit returns false.
 
   Note that when passing in the 'source' plane, taking a copy, rather than a
   pointer, was measurably faster
+
+  With -floatclip the sides of the pass points are found for all of them at
+  once, and the separating plane is built in single precision.
   ==============
 */
-static void ClipToSeparators(visstats_t &stats, const viswinding_t *source, const qplane3d src_pl,
-    const viswinding_t *pass, viswinding_t *&target, unsigned int test, pstack_t &stack)
+template<typename W, typename F>
+static void FindSeparators(const W *source, const typename W::plane_t src_pl, const W *pass, F &&visit)
 {
+    using plane_t = typename W::plane_t;
+    using vec_t = decltype(plane_t::normal);
+    using float_t = typename vec_t::value_type;
+    constexpr bool soa = std::is_same_v<W, viswindingf_t>;
+
+    // sides of the pass points relative to the source plane
+    [[maybe_unused]] alignas(32) float pass_dists[MAX_WINDING];
+    [[maybe_unused]] uint64_t pass_front = 0, pass_back = 0;
+    if constexpr (soa) {
+        pass->plane_sides(src_pl, VIS_ON_EPSILON, pass_dists, pass_front, pass_back);
+    }
+
     // check all combinations
     for (size_t i = 0; i < source->size(); i++) {
         const size_t l = (i + 1) % source->size();
-        const qvec3d v1 = source->at(l) - source->at(i);
+        const vec_t v1 = source->at(l) - source->at(i);
 
         // find a vertex of pass that makes a plane that puts all of the
         // vertexes of pass on the front side and all of the vertexes of
         // source on the back side
         for (size_t j = 0; j < pass->size(); j++) {
-
             // Which side of the source portal is this point?
             // This also tells us which side of the separating plane has
             //  the source portal.
             bool fliptest;
-            double d = src_pl.distance_to(pass->at(j));
-            if (d < -VIS_ON_EPSILON)
-                fliptest = true;
-            else if (d > VIS_ON_EPSILON)
-                fliptest = false;
-            else
-                continue; // Point lies in source plane
+            if constexpr (soa) {
+                if (pass_back & (uint64_t(1) << j))
+                    fliptest = true;
+                else if (pass_front & (uint64_t(1) << j))
+                    fliptest = false;
+                else
+                    continue; // Point lies in source plane
+            } else {
+                const double d = src_pl.distance_to(pass->at(j));
+                if (d < -VIS_ON_EPSILON)
+                    fliptest = true;
+                else if (d > VIS_ON_EPSILON)
+                    fliptest = false;
+                else
+                    continue; // Point lies in source plane
+            }
 
             // Make a plane with the three points
-            qplane3d sep;
-            const qvec3d v2 = pass->at(j) - source->at(i);
+            plane_t sep;
+            const vec_t v2 = pass->at(j) - source->at(i);
             sep.normal = qv::cross(v1, v2);
-            const double len_sq = qv::length2(sep.normal);
+            const float_t len_sq = qv::length2(sep.normal);
 
             // If points don't make a valid plane, skip it.
             if (len_sq < VIS_ON_EPSILON)
                 continue;
 
-            sep.normal *= (1.0 / sqrt(len_sq));
+            sep.normal *= (float_t(1) / std::sqrt(len_sq));
             sep.dist = qv::dot(pass->at(j), sep.normal);
 
             //
@@ -72,50 +109,227 @@ static void ClipToSeparators(visstats_t &stats, const viswinding_t *source, cons
             // if all of the pass portal points are now on the positive side,
             // this is the separating plane
             //
-            int count = 0;
-            size_t k = 0;
-            for (; k < pass->size(); k++) {
-                if (k == j)
-                    continue;
-                d = sep.distance_to(pass->at(k));
-                if (d < -VIS_ON_EPSILON)
-                    break;
-                else if (d > VIS_ON_EPSILON)
-                    ++count;
+            if constexpr (soa) {
+                alignas(32) float dists[MAX_WINDING];
+                uint64_t front, back;
+                pass->plane_sides(sep, VIS_ON_EPSILON, dists, front, back);
+
+                const uint64_t others = ~(uint64_t(1) << j);
+                if (back & others)
+                    continue; // points on negative side, not a separating plane
+                if (!(front & others))
+                    continue; // planar with separating plane
+            } else {
+                int count = 0;
+                size_t k = 0;
+                for (; k < pass->size(); k++) {
+                    if (k == j)
+                        continue;
+                    const double d = sep.distance_to(pass->at(k));
+                    if (d < -VIS_ON_EPSILON)
+                        break;
+                    else if (d > VIS_ON_EPSILON)
+                        ++count;
+                }
+                if (k != pass->size())
+                    continue; // points on negative side, not a separating plane
+                if (!count)
+                    continue; // planar with separating plane
             }
-            if (k != pass->size())
-                continue; // points on negative side, not a separating plane
-            if (!count)
-                continue; // planar with separating plane
 
-            //
-            // flip the normal if we want the back side (tests 1 and 3)
-            //
-            if (test & 1) {
-                sep = -sep;
-            }
+            if (!visit(sep))
+                return;
 
-            /* Cache separating planes for tests 0, 1 */
-            if (test < 2) {
-                if (stack.numseparators[test] == MAX_SEPARATORS)
-                    FError("MAX_SEPARATORS");
-                stack.separators[test][stack.numseparators[test]] = sep;
-                stack.numseparators[test]++;
-            }
+            break;
+        }
+    }
+}
 
-            target = ClipStackWinding(stats, target, stack, sep);
+/*
+ * Separating planes between the unclipped windings of two portals, shared
+ * by all the portal flows. ClipToSeparators finds the same ones over and
+ * over for the portals near the start of each flow, where the windings
+ * haven't been clipped yet.
+ *
+ * A direct mapped table of -separatorcache bytes, where a new set replaces
+ * whatever was in its slot, guarded by a striped set of locks. Sets with
+ * more than MAX_CACHED_SEPARATORS planes aren't kept.
+ */
+template<typename W>
+class separator_cache_t
+{
+public:
+    using plane_t = typename W::plane_t;
 
-            if (!target)
-                return; // target is not visible
+    static constexpr size_t MAX_CACHED_SEPARATORS = 8;
 
-            break;
+private:
+    static constexpr size_t NUM_LOCKS = 256;
+
+    struct entry_t
+    {
+        uint64_t key; // portal pair + 1, 0 for empty
+        uint32_t count;
+        plane_t planes[MAX_CACHED_SEPARATORS];
+    };
+
+    struct entry_deleter_t
+    {
+        void operator()(entry_t *ptr) { free(ptr); }
+    };
+
+    // calloc'ed, so the pages of a large table that are never used stay untouched
+    std::unique_ptr<entry_t[], entry_deleter_t> entries;
+    size_t mask = 0;
+    std::mutex locks[NUM_LOCKS];
+
+    inline size_t slot_for(uint64_t key) const { return (key * 0x9E3779B97F4A7C15ull) >> 20 & mask; }
+
+public:
+    void reset(size_t capacity_bytes)
+    {
+        entries.reset();
+        mask = 0;
+
+        if (capacity_bytes < sizeof(entry_t)) {
+            return;
         }
+
+        const size_t numentries = std::bit_floor(capacity_bytes / sizeof(entry_t));
+        entries.reset(static_cast<entry_t *>(calloc(numentries, sizeof(entry_t))));
+        mask = numentries - 1;
     }
+
+    bool enabled() const { return entries != nullptr; }
+
+    // copies the set for the portal pair key to out, which needs room for MAX_CACHED_SEPARATORS
+    bool find(uint64_t key, plane_t *out, size_t &count)
+    {
+        const size_t slot = slot_for(key);
+        const entry_t &entry = entries[slot];
+        std::unique_lock lock(locks[slot % NUM_LOCKS]);
+
+        if (entry.key != key + 1)
+            return false;
+
+        count = entry.count;
+        std::copy_n(entry.planes, count, out);
+        return true;
+    }
+
+    void insert(uint64_t key, const plane_t *planes, size_t count)
+    {
+        if (count > MAX_CACHED_SEPARATORS)
+            return;
+
+        const size_t slot = slot_for(key);
+        entry_t &entry = entries[slot];
+        std::unique_lock lock(locks[slot % NUM_LOCKS]);
+
+        entry.key = key + 1;
+        entry.count = static_cast<uint32_t>(count);
+        std::copy_n(planes, count, entry.planes);
+    }
+};
+
+template<typename W>
+static separator_cache_t<W> separator_cache;
+
+void ResetSeparatorCache(size_t capacity_bytes)
+{
+    separator_cache<viswinding_t>.reset(capacity_bytes);
+    separator_cache<viswindingf_t>.reset(capacity_bytes);
 }
 
-static int CheckStack(leaf_t *leaf, threaddata_t *thread)
+/*
+  ==============
+  ClipToSeparators
+
+  Source, pass, and target are an ordering of portals.
+
+  Clips target by the separating planes between source and pass (see
+  FindSeparators).
+
+  If target is totally clipped away, that portal can not be seen through.
+
+  Normal clip keeps target on the same side as pass, which is correct
+  if the order goes source, pass, target. If the order goes pass,
+  source, target then we flip the clipping plane. Test levels 0 and 2
+  use the 'normal', while 1 and 3 require the separating plane flip.
+
+  src_pl must be the plane of source_portal. When source and pass are the
+  unclipped windings of source_portal and pass_portal, the planes come from
+  the separator cache.
+  ==============
+*/
+template<typename W>
+static void ClipToSeparators(visstats_t &stats, const W *source, const visportal_t *source_portal,
+    const typename W::plane_t src_pl, const W *pass, const visportal_t *pass_portal, W *&target, unsigned int test,
+    basic_pstack_t<W> &stack)
 {
-    for (pstack_t *p = thread->pstack_head.next; p; p = p->next)
+    using plane_t = typename W::plane_t;
+
+    auto clip = [&](plane_t sep) {
+        //
+        // flip the normal if we want the back side (tests 1 and 3)
+        //
+        if (test & 1) {
+            sep = -sep;
+        }
+
+        /* Cache separating planes for tests 0, 1 */
+        if (test < 2) {
+            if (stack.numseparators[test] == MAX_SEPARATORS)
+                FError("MAX_SEPARATORS");
+            stack.separators[test][stack.numseparators[test]] = sep;
+            stack.numseparators[test]++;
+        }
+
+        target = ClipStackWinding(stats, target, stack, sep);
+
+        return target != nullptr; // otherwise target is not visible
+    };
+
+    separator_cache_t<W> &cache = separator_cache<W>;
+
+    if (!cache.enabled() || source != PortalWinding<W>(source_portal) || pass != PortalWinding<W>(pass_portal)) {
+        FindSeparators(source, src_pl, pass, clip);
+        return;
+    }
+
+    const uint64_t key = (static_cast<uint64_t>(source_portal - portals.data()) << 32) | (pass_portal - portals.data());
+    plane_t separators[MAX_SEPARATORS];
+    size_t count;
+
+    if (cache.find(key, separators, count)) {
+        stats.c_sepcachehit++;
+
+        for (size_t i = 0; i < count; i++) {
+            if (!clip(separators[i]))
+                return;
+        }
+        return;
+    }
+
+    stats.c_sepcachemiss++;
+
+    // only a search that wasn't cut short by clipping away target found them all
+    count = 0;
+    bool complete = true;
+    FindSeparators(source, src_pl, pass, [&](const plane_t &sep) {
+        separators[count++] = sep;
+        return complete = clip(sep);
+    });
+
+    if (complete) {
+        cache.insert(key, separators, count);
+    }
+}
+
+template<typename W>
+static int CheckStack(leaf_t *leaf, threaddata_t<W> *thread)
+{
+    for (basic_pstack_t<W> *p = thread->pstack_head.next; p; p = p->next)
         if (p->leaf == leaf)
             return 1;
     return 0;
@@ -127,8 +341,9 @@ enum class vistest_action
     action_pass
 };
 
-static vistest_action VisTests(
-    visstats_t &stats, pstack_t &stack, const pstack_t *const head, const pstack_t *const prevstack)
+template<typename W>
+static vistest_action VisTests(visstats_t &stats, basic_pstack_t<W> &stack, const basic_pstack_t<W> *const head,
+    const basic_pstack_t<W> *const prevstack)
 {
     /* TEST 0 :: source -> pass -> target */
     if (vis_options.level.value() > 0) {
@@ -140,7 +355,8 @@ static vistest_action VisTests(
             }
         } else {
             /* Using prevstack source for separator cache correctness */
-            ClipToSeparators(stats, prevstack->source, head->portalplane, prevstack->pass, stack.pass, 0, stack);
+            ClipToSeparators(stats, prevstack->source, head->portal, head->portalplane, prevstack->pass,
+                prevstack->portal, stack.pass, 0, stack);
         }
         if (!stack.pass) {
             FreeStackWinding(stack.source, stack);
@@ -158,7 +374,8 @@ static vistest_action VisTests(
             }
         } else {
             /* Using prevstack source for separator cache correctness */
-            ClipToSeparators(stats, prevstack->pass, prevstack->portalplane, prevstack->source, stack.pass, 1, stack);
+            ClipToSeparators(stats, prevstack->pass, prevstack->portal, prevstack->portalplane, prevstack->source,
+                head->portal, stack.pass, 1, stack);
         }
         if (!stack.pass) {
             FreeStackWinding(stack.source, stack);
@@ -168,7 +385,8 @@ static vistest_action VisTests(
 
     /* TEST 2 :: target -> pass -> source */
     if (vis_options.level.value() > 2) {
-        ClipToSeparators(stats, stack.pass, stack.portalplane, prevstack->pass, stack.source, 2, stack);
+        ClipToSeparators(stats, stack.pass, stack.portal, stack.portalplane, prevstack->pass, prevstack->portal,
+            stack.source, 2, stack);
         if (!stack.source) {
             FreeStackWinding(stack.pass, stack);
             return vistest_action::action_continue;
@@ -177,7 +395,8 @@ static vistest_action VisTests(
 
     /* TEST 3 :: pass -> target -> source */
     if (vis_options.level.value() > 3) {
-        ClipToSeparators(stats, prevstack->pass, prevstack->portalplane, stack.pass, stack.source, 3, stack);
+        ClipToSeparators(stats, prevstack->pass, prevstack->portal, prevstack->portalplane, stack.pass, stack.portal,
+            stack.source, 3, stack);
         if (!stack.source) {
             FreeStackWinding(stack.pass, stack);
             return vistest_action::action_continue;
@@ -194,12 +413,13 @@ static vistest_action VisTests(
   Filter mightsee by clipping against all portals
   ==================
 */
-static unsigned TargetChecks(visstats_t &stats, const pstack_t *const head, const pstack_t *const prevstack,
-    leafbits_t &prevportalbits, leafbits_t &portalbits)
+template<typename W>
+static unsigned TargetChecks(visstats_t &stats, const basic_pstack_t<W> *const head,
+    const basic_pstack_t<W> *const prevstack, leafbits_t &prevportalbits, leafbits_t &portalbits)
 {
-    pstack_t stack;
+    basic_pstack_t<W> stack;
     visportal_t *p, *q;
-    qplane3d backplane;
+    typename W::plane_t backplane;
     int i, j, numchecks, numremain;
 
     if (prevstack->pass == NULL) {
@@ -236,10 +456,11 @@ static unsigned TargetChecks(visstats_t &stats, const pstack_t *const head, cons
             continue; // can't possibly see it
 
         // get plane of portal, point normal into the neighbor leaf
-        stack.portalplane = p->plane;
-        backplane = -p->plane;
+        stack.portalplane = PortalPlane<W>(p);
+        backplane = -stack.portalplane;
 
-        if (qv::epsilonEqual(prevstack->portalplane.normal, backplane.normal, VIS_EQUAL_EPSILON))
+        if (qv::epsilonEqual(
+                prevstack->portalplane.normal, backplane.normal, decltype(backplane.dist)(VIS_EQUAL_EPSILON)))
             continue; // can't go out a coplanar face
 
         numchecks++;
@@ -258,7 +479,7 @@ static unsigned TargetChecks(visstats_t &stats, const pstack_t *const head, cons
          */
 
         /* Clip any part of the target portal behind the source portal */
-        stack.pass = ClipStackWinding(stats, p->winding.get(), stack, head->portalplane);
+        stack.pass = ClipStackWinding(stats, PortalWinding<W>(p), stack, head->portalplane);
         if (!stack.pass)
             continue;
 
@@ -310,17 +531,17 @@ static unsigned TargetChecks(visstats_t &stats, const pstack_t *const head, cons
   Retrace the path and reduce mightsee by clipping the targets directly
   ==================
 */
-static unsigned IterativeTargetChecks(visstats_t &stats, pstack_t *const head)
+template<typename W>
+static unsigned IterativeTargetChecks(visstats_t &stats, basic_pstack_t<W> *const head)
 {
-    unsigned numchecks, numblocks;
+    unsigned numchecks;
 
     numchecks = 0;
-    numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
 
     leafbits_t portalbits(numportals * 2); // in contradiction to the typename, I know
     portalbits.setall();
 
-    for (pstack_t *stack = head; stack; stack = stack->next) {
+    for (basic_pstack_t<W> *stack = head; stack; stack = stack->next) {
         if (stack->did_targetchecks)
             continue;
 
@@ -330,11 +551,7 @@ static unsigned IterativeTargetChecks(visstats_t &stats, pstack_t *const head)
         portalbits = std::move(nextportalbits);
 
         if (stack->next) {
-            pstack_t *next = stack->next;
-            uint32_t *nextsee = next->mightsee->data();
-            uint32_t *mightsee = stack->mightsee->data();
-            for (int i = 0; i < numblocks; i++)
-                nextsee[i] &= mightsee[i];
+            *stack->next->mightsee &= *stack->mightsee;
         }
 
         // mark done
@@ -353,9 +570,10 @@ static unsigned IterativeTargetChecks(visstats_t &stats, pstack_t *const head)
   If src_portal is NULL, this is the originating leaf
   ==================
 */
-static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevstack)
+template<typename W>
+static void RecursiveLeafFlow(int leafnum, threaddata_t<W> *thread, basic_pstack_t<W> &prevstack)
 {
-    pstack_t stack;
+    basic_pstack_t<W> stack;
 
     ++thread->stats.c_chains;
 
@@ -399,8 +617,6 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
     leafbits_t local(portalleafs);
     stack.mightsee = &local;
 
-    const auto vis = thread->leafvis.data();
-
     // check all portals for flowing into other leafs
     for (visportal_t *p : leaf->portals) {
         if (!(*prevstack.mightsee)[p->leaf]) {
@@ -408,25 +624,23 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
             continue; // can't possibly see it
         }
 
-        uint32_t *test;
+        const compact_leafbits_t *test;
 
         // if the portal can't see anything we haven't allready seen, skip it
-        if (p->status == pstat_done) {
+        if (std::atomic_ref(p->status).load(std::memory_order_acquire) == pstat_done) {
             thread->stats.c_vistest++;
-            test = p->visbits.data();
+            test = &p->visbits;
         } else {
             thread->stats.c_mighttest++;
-            test = p->mightsee.data();
-        }
+            test = &p->mightsee;
 
-        const auto might = stack.mightsee->data(); // buffer of stack.mightsee can change between iterations
-        uint32_t more = 0;
-        const int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
-        for (int j = 0; j < numblocks; j++) {
-            might[j] = prevstack.mightsee->data()[j] & test[j];
-            more |= (might[j] & ~vis[j]);
+            if (thread->reads) {
+                thread->reads->add(p - portals.data(), *prevstack.mightsee);
+            }
         }
 
+        const bool more = stack.mightsee->assign_and(*prevstack.mightsee, *test, thread->leafvis);
+
         if (!more) {
             // can't see anything new
             thread->stats.c_portalskip++;
@@ -438,18 +652,15 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
 
         // calculate num_expected_targetchecks only if we're using it, since it's somewhat expensive to compute
         if (vis_options.targetratio.value() > 0.0) {
-            int nummightsee = 0;
-            for (int j = 0; j < numblocks; j++) {
-                nummightsee += std::popcount(might[j]);
-            }
-            stack.num_expected_targetchecks = prevstack.num_expected_targetchecks + nummightsee;
+            stack.num_expected_targetchecks = prevstack.num_expected_targetchecks + stack.mightsee->count();
         }
 
         // get plane of portal, point normal into the neighbor leaf
-        stack.portalplane = p->plane;
-        const qplane3d backplane = -p->plane;
+        stack.portalplane = PortalPlane<W>(p);
+        const typename W::plane_t backplane = -stack.portalplane;
 
-        if (qv::epsilonEqual(prevstack.portalplane.normal, backplane.normal, VIS_EQUAL_EPSILON))
+        if (qv::epsilonEqual(
+                prevstack.portalplane.normal, backplane.normal, decltype(backplane.dist)(VIS_EQUAL_EPSILON)))
             continue; // can't go out a coplanar face
 
         thread->numsteps++;
@@ -470,7 +681,7 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
          */
 
         /* Clip any part of the target portal behind the source portal */
-        stack.pass = ClipStackWinding(thread->stats, p->winding.get(), stack, thread->pstack_head.portalplane);
+        stack.pass = ClipStackWinding(thread->stats, PortalWinding<W>(p), stack, thread->pstack_head.portalplane);
         if (!stack.pass)
             continue;
 
@@ -514,29 +725,44 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
   PortalFlow
   ===============
 */
-visstats_t PortalFlow(visportal_t *p)
+template<typename W>
+static visstats_t PortalFlow(visportal_t *p, portalreads_t *reads)
 {
-    threaddata_t data{p->visbits};
-
     if (p->status != pstat_working)
         FError("reflowed");
 
-    data.leafvis.resize(portalleafs);
+    // flow with dense bits, then store the result compactly
+    leafbits_t leafvis(portalleafs);
+    leafbits_t mightsee = p->mightsee.expand();
+
+    threaddata_t<W> data{leafvis};
 
     data.base = p;
 
     data.pstack_head.portal = p;
-    data.pstack_head.source = p->winding.get();
-    data.pstack_head.portalplane = p->plane;
-    data.pstack_head.mightsee = &p->mightsee;
+    data.pstack_head.source = PortalWinding<W>(p);
+    data.pstack_head.portalplane = PortalPlane<W>(p);
+    data.pstack_head.mightsee = &mightsee;
     data.numsteps = 0;
     data.numtargetchecks = 0;
+    data.reads = reads;
 
     RecursiveLeafFlow(p->leaf, &data, data.pstack_head);
 
+    p->visbits = leafvis;
+
     return data.stats;
 }
 
+visstats_t PortalFlow(visportal_t *p, portalreads_t *reads)
+{
+    if (vis_options.floatclip.value()) {
+        return PortalFlow<viswindingf_t>(p, reads);
+    }
+
+    return PortalFlow<viswinding_t>(p, reads);
+}
+
 /*
   ============================================================================
   This is a rough first-order aproximation that is used to trivially reject
@@ -544,18 +770,96 @@ visstats_t PortalFlow(visportal_t *p)
   ============================================================================
 */
 
-static void SimpleFlood(visportal_t &srcportal, int leafnum, const leafbits_t &portalsee)
+/*
+  ==============
+  BasePortalCanSee
+
+  Rough test of whether anything on tp can be seen through p
+  ==============
+*/
+static bool BasePortalCanSee(const visportal_t &p, const visportal_t &tp)
 {
-    if (srcportal.mightsee[leafnum])
+    const viswinding_t &w = *p.winding;
+    const viswinding_t &tw = *tp.winding;
+
+    // Quick test - completely at the back?
+    float d = p.plane.distance_to(tw.origin);
+    if (d < -tw.radius)
+        return false;
+
+    int cctp = 0;
+    size_t j;
+    for (j = 0; j < tw.size(); j++) {
+        d = p.plane.distance_to(tw[j]);
+        cctp += d > -VIS_ON_EPSILON;
+        if (d > VIS_ON_EPSILON)
+            break;
+    }
+    if (j == tw.size()) {
+        if (cctp != tw.size())
+            return false; // no points on front
+    } else
+        cctp = 0;
+
+    // Quick test - completely on front?
+    d = tp.plane.distance_to(w.origin);
+    if (d > w.radius)
+        return false;
+
+    int ccp = 0;
+    for (j = 0; j < w.size(); j++) {
+        d = tp.plane.distance_to(w[j]);
+        ccp += d < VIS_ON_EPSILON;
+        if (d < -VIS_ON_EPSILON)
+            break;
+    }
+    if (j == w.size()) {
+        if (ccp != w.size())
+            return false; // no points on back
+    } else
+        ccp = 0;
+
+    // coplanarity check
+    if (cctp != 0 || ccp != 0)
+        if (qv::dot(p.plane.normal, tp.plane.normal) < -0.99)
+            return false;
+
+    if (vis_options.visdist.value() > 0) {
+        if (tp.winding->distFromPortal(p) > vis_options.visdist.value() ||
+            p.winding->distFromPortal(tp) > vis_options.visdist.value())
+            return false;
+    }
+
+    return true;
+}
+
+/*
+  ==============
+  SimpleFlood
+
+  Floods out from leafnum through the portals that pass BasePortalCanSee.
+  The portals are tested as the flood reaches their leaf, so the ones on
+  leafs it never reaches don't need testing at all.
+  ==============
+*/
+static void SimpleFlood(visportal_t &srcportal, leafbits_t &mightsee, int leafnum, int64_t &tested)
+{
+    if (mightsee[leafnum])
         return;
 
-    srcportal.mightsee[leafnum] = true;
+    mightsee[leafnum] = true;
     srcportal.nummightsee++;
 
     leaf_t &leaf = leafs[leafnum];
     for (const visportal_t *p : leaf.portals) {
-        if (portalsee[p - portals.data()]) {
-            SimpleFlood(srcportal, p->leaf, portalsee);
+        if (p == &srcportal) {
+            continue;
+        }
+
+        tested++;
+
+        if (BasePortalCanSee(srcportal, *p)) {
+            SimpleFlood(srcportal, mightsee, p->leaf, tested);
         }
     }
 }
@@ -565,78 +869,20 @@ static void SimpleFlood(visportal_t &srcportal, int leafnum, const leafbits_t &p
   BasePortalVis
   ==============
 */
-static void BasePortalThread(size_t portalnum)
+static void BasePortalThread(size_t portalnum, std::atomic_int64_t &c_tested)
 {
-    leafbits_t portalsee(numportals * 2);
-
     visportal_t &p = portals[portalnum];
-    viswinding_t &w = *p.winding;
 
-    p.mightsee.resize(portalleafs);
+    leafbits_t mightsee(portalleafs);
 
-    for (size_t i = 0; i < numportals * 2; i++) {
-        if (i == portalnum) {
-            continue;
-        }
-
-        visportal_t &tp = portals[i];
-        viswinding_t &tw = *tp.winding;
-
-        // Quick test - completely at the back?
-        float d = p.plane.distance_to(tw.origin);
-        if (d < -tw.radius)
-            continue;
-
-        int cctp = 0;
-        size_t j;
-        for (j = 0; j < tw.size(); j++) {
-            d = p.plane.distance_to(tw[j]);
-            cctp += d > -VIS_ON_EPSILON;
-            if (d > VIS_ON_EPSILON)
-                break;
-        }
-        if (j == tw.size()) {
-            if (cctp != tw.size())
-                continue; // no points on front
-        } else
-            cctp = 0;
-
-        // Quick test - completely on front?
-        d = tp.plane.distance_to(w.origin);
-        if (d > w.radius)
-            continue;
-
-        int ccp = 0;
-        for (j = 0; j < w.size(); j++) {
-            d = tp.plane.distance_to(w[j]);
-            ccp += d < VIS_ON_EPSILON;
-            if (d < -VIS_ON_EPSILON)
-                break;
-        }
-        if (j == w.size()) {
-            if (ccp != w.size())
-                continue; // no points on back
-        } else
-            ccp = 0;
-
-        // coplanarity check
-        if (cctp != 0 || ccp != 0)
-            if (qv::dot(p.plane.normal, tp.plane.normal) < -0.99)
-                continue;
-
-        if (vis_options.visdist.value() > 0) {
-            if (tp.winding->distFromPortal(p) > vis_options.visdist.value() ||
-                p.winding->distFromPortal(tp) > vis_options.visdist.value())
-                continue;
-        }
-
-        portalsee[i] = 1;
-    }
+    int64_t tested = 0;
 
     p.nummightsee = 0;
-    SimpleFlood(p, p.leaf, portalsee);
+    SimpleFlood(p, mightsee, p.leaf, tested);
+
+    p.mightsee = mightsee;
 
-    portalsee.clear();
+    c_tested += tested;
 }
 
 /*
@@ -646,5 +892,10 @@ static void BasePortalThread(size_t portalnum)
 */
 void BasePortalVis()
 {
-    logging::parallel_for(0, numportals * 2, BasePortalThread);
+    std::atomic_int64_t c_tested = 0;
+
+    logging::parallel_for(0, numportals * 2, [&](size_t i) { BasePortalThread(i, c_tested); });
+
+    const int64_t total = static_cast<int64_t>(numportals) * 2 * (numportals * 2 - 1);
+    logging::print(logging::flag::VERBOSE, "base vis: tested {} of {} portal pairs\n", c_tested.load(), total);
 }
@@ -21,34 +21,56 @@
 #include <vis/vis.hh>
 #include <common/bsputils.hh>
 #include <common/parallel.hh>
+
+#include <atomic>
+#include <bit>
+#include <optional>
+
 /*
 
 Some textures (sky, water, slime, lava) are considered ambien sound emiters.
-Find an aproximate distance to the nearest emiter of each class for each leaf.
+Each leaf plays the sounds of the emiters in the leafs it can see.
 
 */
 
 /*
   ====================
-  SurfaceBBox
+  FaceAmbientType
+
+  The ambient sound a face emits, if any
   ====================
 */
-static aabb3d SurfaceBBox(const mbsp_t *bsp, const mface_t *surf)
+static std::optional<ambient_type_t> FaceAmbientType(const mbsp_t *bsp, const mface_t *surf)
 {
-    aabb3d bounds;
+    // noambient surfflag
+    if (vis::extended_texinfo_flags[surf->texinfo].noambient)
+        return std::nullopt;
 
-    for (int32_t i = 0; i < surf->numedges; i++) {
-        int32_t edgenum = bsp->dsurfedges[surf->firstedge + i], vertnum;
+    const mtexinfo_t *info = &bsp->texinfo[surf->texinfo];
+    const char *name = bsp->dtex.textures[info->miptex].name.data();
+    const bool hl = bsp->loadversion->game->allows_hl_contents;
 
-        if (edgenum >= 0)
-            vertnum = bsp->dedges[edgenum][0];
-        else
-            vertnum = bsp->dedges[-edgenum][1];
-
-        bounds += bsp->dvertexes[vertnum];
+    if (!Q_strncasecmp(name, "sky", 3)) {
+        if (!vis_options.noambientsky.value()) {
+            return AMBIENT_SKY;
+        }
+    } else if (!Q_strncasecmp(name, "*water", 6) || (!Q_strncasecmp(name, "!water", 6) && hl) ||
+               !Q_strncasecmp(name, "*04water", 6) || (!Q_strncasecmp(name, "!04water", 6) && hl)) {
+        if (!vis_options.noambientwater.value()) {
+            return AMBIENT_WATER;
+        }
+    } else if (!Q_strncasecmp(name, "*slime", 6) || (!Q_strncasecmp(name, "!slime", 6) && hl)) {
+        if (!vis_options.noambientslime.value()) {
+            return AMBIENT_WATER; // AMBIENT_SLIME; // there should probably be a VIS arg to use the acutal
+                                  // AMBIENT_SLIME, for games on custom engines that can parse it
+        }
+    } else if (!Q_strncasecmp(name, "*lava", 5) || (!Q_strncasecmp(name, "!lava", 5) && hl)) {
+        if (!vis_options.noambientslime.value()) {
+            return AMBIENT_LAVA;
+        }
     }
 
-    return bounds;
+    return std::nullopt;
 }
 
 /*
@@ -72,106 +94,49 @@ void CalcAmbientSounds(mbsp_t *bsp)
         return;
     }
 
-    logging::parallel_for(0, portalleafs_real, [&bsp](int i) {
-        mleaf_t *leaf = &bsp->dleafs[i + 1];
+    //
+    // classify the faces once, and collect the sounds each leaf emits
+    //
+    std::vector<uint8_t> face_ambients(bsp->dfaces.size());
 
-        float dists[NUM_AMBIENTS];
+    logging::parallel_for(static_cast<size_t>(0), bsp->dfaces.size(), [&](size_t i) {
+        if (auto type = FaceAmbientType(bsp, &bsp->dfaces[i])) {
+            face_ambients[i] = nth_bit(*type);
+        }
+    });
+
+    // padded to whole rows, so the bits past the last leaf can be read too
+    std::vector<uint8_t> leaf_ambients(leafbytes_real * 8);
+
+    logging::parallel_for(0, portalleafs_real, [&](int i) {
+        const mleaf_t *leaf = &bsp->dleafs[i + 1];
 
-        //
-        // clear ambients
-        //
-        for (int j = 0; j < NUM_AMBIENTS; j++)
-            dists[j] = 1020;
+        for (int k = 0; k < leaf->nummarksurfaces; k++) {
+            leaf_ambients[i] |= face_ambients[bsp->dleaffaces[leaf->firstmarksurface + k]];
+        }
+    });
+
+    logging::parallel_for(0, portalleafs_real, [&](int i) {
+        mleaf_t *leaf = &bsp->dleafs[i + 1];
 
-        uint8_t *vis;
+        const uint8_t *vis;
         if (portalleafs != portalleafs_real) {
             vis = &uncompressed[leaf->cluster * leafbytes_real];
         } else {
             vis = &uncompressed[i * leafbytes_real];
         }
 
-        for (int j = 0; j < portalleafs_real; j++) {
-            if (!(vis[j >> 3] & nth_bit(j & 7)))
-                continue;
-
-            //
-            // check this leaf for sound textures
-            //
-            mleaf_t *hit = &bsp->dleafs[j + 1];
-
-            for (int k = 0; k < hit->nummarksurfaces; k++) {
-                const mface_t *surf = BSP_GetFace(bsp, bsp->dleaffaces[hit->firstmarksurface + k]);
-                const mtexinfo_t *info = &bsp->texinfo[surf->texinfo];
-                const auto &miptex = bsp->dtex.textures[info->miptex];
-
-                ambient_type_t ambient_type;
-                if (!Q_strncasecmp(miptex.name.data(), "sky", 3) && !vis_options.noambientsky.value()) {
-                    ambient_type = AMBIENT_SKY;
-                } else if (!Q_strncasecmp(miptex.name.data(), "*water", 6) ||
-                           (!Q_strncasecmp(miptex.name.data(), "!water", 6) &&
-                               bsp->loadversion->game->allows_hl_contents)) {
-                    if (!vis_options.noambientwater.value()) {
-                        ambient_type = AMBIENT_WATER;
-                    }
-                } else if (!Q_strncasecmp(miptex.name.data(), "*04water", 6) ||
-                           (!Q_strncasecmp(miptex.name.data(), "!04water", 6) &&
-                               bsp->loadversion->game->allows_hl_contents)) {
-                    if (!vis_options.noambientwater.value()) {
-                        ambient_type = AMBIENT_WATER;
-                    }
-                } else if (!Q_strncasecmp(miptex.name.data(), "*slime", 6) ||
-                           (!Q_strncasecmp(miptex.name.data(), "!slime", 6) &&
-                               bsp->loadversion->game->allows_hl_contents)) {
-                    if (!vis_options.noambientslime.value()) {
-                        ambient_type =
-                            AMBIENT_WATER; // AMBIENT_SLIME; // there should probably be a VIS arg to use the acutal
-                                           // AMBIENT_SLIME, for games on custom engines that can parse it
-                    }
-                } else if (!Q_strncasecmp(miptex.name.data(), "*lava", 5) ||
-                           (!Q_strncasecmp(miptex.name.data(), "!lava", 5) &&
-                               bsp->loadversion->game->allows_hl_contents)) {
-                    if (!vis_options.noambientslime.value()) {
-                        ambient_type = AMBIENT_LAVA;
-                    }
-                } else {
-                    continue;
-                }
-
-                // noambient surfflag
-                if (vis::extended_texinfo_flags[surf->texinfo].noambient)
-                    continue;
-
-                // find distance from source leaf to polygon
-                aabb3d bounds = SurfaceBBox(bsp, surf);
-                float maxd = 0;
-                for (int l = 0; l < 3; l++) {
-                    float d;
-                    if (bounds.mins()[l] > leaf->maxs[l])
-                        d = bounds.mins()[l] - leaf->maxs[l];
-                    else if (bounds.maxs()[l] < leaf->mins[l])
-                        d = leaf->mins[l] - bounds.mins()[l];
-                    else
-                        d = 0;
-                    if (d > maxd)
-                        maxd = d;
-                }
-
-                maxd = 0.25;
-                if (maxd < dists[ambient_type])
-                    dists[ambient_type] = maxd;
+        // the sounds of every visible leaf
+        uint8_t heard = 0;
+        for (int j = 0; j < portalleafs_real; j += 8) {
+            for (uint32_t bits = vis[j >> 3]; bits; bits &= bits - 1) {
+                heard |= leaf_ambients[j + std::countr_zero(bits)];
             }
         }
 
+        // any sound that's visible at all plays at full volume
         for (int j = 0; j < NUM_AMBIENTS; j++) {
-            float vol;
-            if (dists[j] < 100)
-                vol = 1.0;
-            else {
-                vol = (double)(1.0 - dists[2] * 0.002);
-                if (vol < 0)
-                    vol = 0;
-            }
-            leaf->ambient_level[j] = (uint8_t)(vol * 255);
+            leaf->ambient_level[j] = (heard & nth_bit(j)) ? 255 : 0;
         }
     });
 }
@@ -189,62 +154,60 @@ void CalcPHS(mbsp_t *bsp)
     logging::funcheader();
 
     const int32_t leafbytes = (portalleafs + 7) >> 3;
-    const int32_t leaflongs = leafbytes / sizeof(long);
+    const uint8_t *const visend = bsp->dvis.bits.data() + bsp->dvis.bits.size();
 
-    // increase the bits size with approximately how much space we'll need
-    bsp->dvis.bits.reserve(bsp->dvis.bits.size() * 2);
+    // decompress every PVS row once
+    std::vector<leafbits_t> pvs(portalleafs);
 
-    std::vector<uint8_t> uncompressed(leafbytes);
-    std::vector<uint8_t> uncompressed_2(leafbytes);
-    std::vector<uint8_t> compressed(leafbytes * 2);
-    std::vector<uint8_t> uncompressed_orig(leafbytes);
+    logging::parallel_for(0, portalleafs, [&](int32_t i) {
+        std::vector<uint8_t> row(leafbytes);
 
-    int32_t count = 0;
-    for (int32_t i = 0; i < portalleafs; i++) {
-        const uint8_t *scan = bsp->dvis.bits.data() + bsp->dvis.get_bit_offset(VIS_PVS, i);
-
-        DecompressVis(scan, bsp->dvis.bits.data() + bsp->dvis.bits.size(), uncompressed.data(),
-            uncompressed.data() + uncompressed.size());
-        std::copy(uncompressed.begin(), uncompressed.end(), uncompressed_orig.begin());
-
-        scan = uncompressed_orig.data();
-
-        for (int32_t j = 0; j < leafbytes; j++) {
-            uint8_t bitbyte = scan[j];
-            if (!bitbyte)
-                continue;
-            for (int32_t k = 0; k < 8; k++) {
-                if (!(bitbyte & nth_bit(k)))
-                    continue;
-                // OR this pvs row into the phs
-                int32_t index = ((j << 3) + k);
-                if (index >= portalleafs)
-                    FError("Bad bit in PVS"); // pad bits should be 0
-                const uint8_t *src_compressed = bsp->dvis.bits.data() + bsp->dvis.get_bit_offset(VIS_PVS, index);
-                DecompressVis(src_compressed, bsp->dvis.bits.data() + bsp->dvis.bits.size(), uncompressed_2.data(),
-                    uncompressed_2.data() + uncompressed_2.size());
-                const long *src = reinterpret_cast<long *>(uncompressed_2.data());
-                long *dest = reinterpret_cast<long *>(uncompressed.data());
-                for (int32_t l = 0; l < leaflongs; l++)
-                    dest[l] |= src[l];
-            }
+        DecompressVis(bsp->dvis.bits.data() + bsp->dvis.get_bit_offset(VIS_PVS, i), visend, row.data(),
+            row.data() + row.size());
+
+        // pad bits should be 0
+        if (portalleafs & 7) {
+            if (row[leafbytes - 1] >> (portalleafs & 7))
+                FError("Bad bit in PVS");
         }
-        for (int32_t j = 0; j < portalleafs; j++)
-            if (uncompressed[j >> 3] & nth_bit(j & 7))
-                count++;
 
-        //
-        // compress the bit string
-        //
-        compressed.clear();
-        CompressRow(uncompressed.data(), leafbytes, std::back_inserter(compressed));
+        pvs[i].resize(portalleafs);
+        pvs[i].from_bytes(row.data(), leafbytes);
+    });
+
+    // OR together the rows visible from each cluster and compress the result
+    std::vector<std::vector<uint8_t>> compressed(portalleafs);
+    std::atomic_int64_t count = 0;
+
+    logging::parallel_for(0, portalleafs, [&](int32_t i) {
+        leafbits_t phs = pvs[i];
+        pvs[i].for_each_set([&](size_t index) { phs |= pvs[index]; });
+
+        count += phs.count();
 
+        std::vector<uint8_t> row(leafbytes);
+        phs.to_bytes(row.data(), leafbytes);
+
+        compressed[i].reserve(leafbytes);
+        CompressRow(row.data(), leafbytes, std::back_inserter(compressed[i]));
+    });
+
+    pvs.clear();
+
+    // append in cluster order so the lump layout doesn't depend on scheduling
+    size_t total = 0;
+    for (auto &row : compressed) {
+        total += row.size();
+    }
+    bsp->dvis.bits.reserve(bsp->dvis.bits.size() + total);
+
+    for (int32_t i = 0; i < portalleafs; i++) {
         bsp->dvis.set_bit_offset(VIS_PHS, i, bsp->dvis.bits.size());
 
-        std::copy(compressed.begin(), compressed.end(), std::back_inserter(bsp->dvis.bits));
+        std::copy(compressed[i].begin(), compressed[i].end(), std::back_inserter(bsp->dvis.bits));
     }
 
     fmt::print("Average clusters hearable: {}\n", count / portalleafs);
 
     bsp->dvis.bits.shrink_to_fit();
-}
\ No newline at end of file
+}
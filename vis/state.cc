@@ -28,7 +28,13 @@
 #include <common/cmdlib.hh>
 #include "common/fs.hh"
 #include <common/log.hh>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <condition_variable>
 #include <fstream>
+#include <thread>
+#include <unordered_map>
 
 constexpr uint32_t VIS_STATE_VERSION = ('T' << 24 | 'Y' << 16 | 'R' << 8 | '1');
 
@@ -54,7 +60,7 @@ struct dportal_t
     auto stream_data() { return std::tie(status, might, vis, nummightsee, numcansee); }
 };
 
-static int CompressBits(uint8_t *out, const leafbits_t &in)
+int CompressBits(uint8_t *out, const leafbits_t &in)
 {
     int i, rep, shift, numbytes;
     uint8_t val, repval, *dst;
@@ -94,6 +100,11 @@ static int CompressBits(uint8_t *out, const leafbits_t &in)
     return numbytes;
 }
 
+int CompressBits(uint8_t *out, const compact_leafbits_t &in)
+{
+    return CompressBits(out, in.expand());
+}
+
 static void DecompressBits(leafbits_t &dst, const uint8_t *src)
 {
     const size_t numbytes = (portalleafs + 7) >> 3;
@@ -103,7 +114,7 @@ static void DecompressBits(leafbits_t &dst, const uint8_t *src)
     for (size_t i = 0; i < numbytes; i++) {
         uint8_t val = *src++;
         uint32_t shift = (i << 3) & leafbits_t::mask;
-        dst.data()[i >> (leafbits_t::shift - 3)] |= (uint32_t)val << shift;
+        dst.data()[i >> (leafbits_t::shift - 3)] |= (leafbits_t::block_t)val << shift;
         if (val != 0 && val != 0xff)
             continue;
 
@@ -115,7 +126,7 @@ static void DecompressBits(leafbits_t &dst, const uint8_t *src)
         while (--rep) {
             i++;
             shift = (i << 3) & leafbits_t::mask;
-            dst.data()[i >> (leafbits_t::shift - 3)] |= (uint32_t)val << shift;
+            dst.data()[i >> (leafbits_t::shift - 3)] |= (leafbits_t::block_t)val << shift;
         }
     }
 }
@@ -127,11 +138,22 @@ static void CopyLeafBits(leafbits_t &dst, const uint8_t *src, size_t numleafs)
 
     for (size_t i = 0; i < numbytes; i++) {
         const uint32_t shift = (i << 3) & leafbits_t::mask;
-        dst.data()[i >> (leafbits_t::shift - 3)] |= (uint32_t)(*src++) << shift;
+        dst.data()[i >> (leafbits_t::shift - 3)] |= (leafbits_t::block_t)(*src++) << shift;
     }
 }
 
-void SaveVisState()
+/*
+ * What to save of a portal; mightsee is only a copy for portals that may
+ * still be updated while the state is written
+ */
+struct savedportal_t
+{
+    pstatus_t status;
+    int nummightsee;
+    const compact_leafbits_t *mightsee;
+};
+
+static size_t WriteVisState(const std::vector<savedportal_t> &saved)
 {
     int vis_len, might_len;
     dvisstate_t state;
@@ -145,7 +167,7 @@ void SaveVisState()
     state.numportals = numportals;
     state.numleafs = portalleafs;
     state.testlevel = vis_options.visdist.value();
-    state.time_elapsed = (uint32_t)(statetime - starttime).count();
+    state.time_elapsed = (uint32_t)(I_FloatTime() - starttime).count();
 
     out <= state;
 
@@ -153,19 +175,22 @@ void SaveVisState()
     std::vector<uint8_t> might((portalleafs + 7) >> 3);
     std::vector<uint8_t> vis((portalleafs + 7) >> 3);
 
-    for (const auto &p : portals) {
-        might_len = CompressBits(might.data(), p.mightsee);
-        if (p.status == pstat_done) {
+    for (size_t i = 0; i < portals.size(); i++) {
+        const visportal_t &p = portals[i];
+        const savedportal_t &sp = saved[i];
+
+        might_len = CompressBits(might.data(), *sp.mightsee);
+        if (sp.status == pstat_done) {
             vis_len = CompressBits(vis.data(), p.visbits);
         } else {
             vis_len = 0;
         }
 
-        pstate.status = p.status;
+        pstate.status = sp.status;
         pstate.might = might_len;
         pstate.vis = vis_len;
-        pstate.nummightsee = p.nummightsee;
-        pstate.numcansee = p.numcansee;
+        pstate.nummightsee = sp.nummightsee;
+        pstate.numcansee = sp.status == pstat_done ? p.numcansee : 0;
 
         out <= pstate;
         out.write((const char *)might.data(), might_len);
@@ -174,6 +199,7 @@ void SaveVisState()
         }
     }
 
+    const size_t size = out.tellp();
     out.close();
 
     std::error_code ec;
@@ -185,6 +211,211 @@ void SaveVisState()
     fs::rename(statetmpfile, statefile, ec);
     if (ec)
         FError("error renaming state file ({})", ec.message());
+
+    return size;
+}
+
+/*
+  ============================================================================
+  State journal
+
+  Appended to after the state file, one record per completed portal. Done
+  portals don't change any more, so the writer can read them without the
+  lock. A crash can leave a partial record at the end, which is dropped.
+  ============================================================================
+*/
+
+constexpr uint32_t VIS_JOURNAL_VERSION = ('T' << 24 | 'Y' << 16 | 'J' << 8 | '1');
+
+struct dvisjournal_t
+{
+    uint32_t version;
+    uint32_t numportals;
+    uint32_t numleafs;
+
+    auto stream_data() { return std::tie(version, numportals, numleafs); }
+};
+
+struct djournalportal_t
+{
+    uint32_t portalnum;
+    uint32_t time_elapsed;
+    uint32_t might;
+    uint32_t vis;
+    uint32_t nummightsee;
+    uint32_t numcansee;
+
+    auto stream_data() { return std::tie(portalnum, time_elapsed, might, vis, nummightsee, numcansee); }
+};
+
+static std::mutex journal_mutex;
+static std::condition_variable journal_cond;
+static std::vector<const visportal_t *> journal_pending;
+static bool journal_stop;
+static std::thread journal_thread;
+static std::ofstream journal_out;
+static size_t journal_size, state_size;
+
+static void OpenJournal()
+{
+    dvisjournal_t header;
+
+    journal_out = std::ofstream(journalfile, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    journal_out << endianness<std::endian::little>;
+
+    header.version = VIS_JOURNAL_VERSION;
+    header.numportals = numportals;
+    header.numleafs = portalleafs;
+
+    journal_out <= header;
+    journal_out.flush();
+
+    journal_size = journal_out.tellp();
+}
+
+static void WriteJournal(const std::vector<const visportal_t *> &completed)
+{
+    djournalportal_t record;
+    std::vector<uint8_t> might((portalleafs + 7) >> 3);
+    std::vector<uint8_t> vis((portalleafs + 7) >> 3);
+
+    const uint32_t time_elapsed = (uint32_t)(I_FloatTime() - starttime).count();
+
+    for (const visportal_t *p : completed) {
+        record.portalnum = p - portals.data();
+        record.time_elapsed = time_elapsed;
+        record.might = CompressBits(might.data(), p->mightsee);
+        record.vis = CompressBits(vis.data(), p->visbits);
+        record.nummightsee = p->nummightsee;
+        record.numcansee = p->numcansee;
+
+        journal_out <= record;
+        journal_out.write((const char *)might.data(), record.might);
+        journal_out.write((const char *)vis.data(), record.vis);
+    }
+
+    journal_out.flush();
+    journal_size = journal_out.tellp();
+}
+
+/*
+ * Fold the journal into a new state file. Only the mightsee of portals
+ * that haven't started can still change, so those are copied under the
+ * lock and everything else is written after it's released.
+ */
+static void CompactVisState(std::mutex &portal_mutex)
+{
+    std::vector<savedportal_t> saved(portals.size());
+    std::vector<compact_leafbits_t> copies;
+
+    {
+        std::unique_lock lock(portal_mutex);
+
+        size_t numwaiting = 0;
+        for (const auto &p : portals) {
+            numwaiting += (p.status == pstat_none);
+        }
+        copies.reserve(numwaiting);
+
+        for (size_t i = 0; i < portals.size(); i++) {
+            const visportal_t &p = portals[i];
+            saved[i].status = p.status;
+            saved[i].nummightsee = p.nummightsee;
+            if (p.status == pstat_none) {
+                saved[i].mightsee = &copies.emplace_back(p.mightsee);
+            } else {
+                saved[i].mightsee = &p.mightsee;
+            }
+        }
+
+        // anything completed since the last write is in the new state file
+        std::unique_lock journal_lock(journal_mutex);
+        journal_pending.clear();
+    }
+
+    state_size = WriteVisState(saved);
+    OpenJournal();
+}
+
+static void JournalThread(duration interval, std::mutex &portal_mutex)
+{
+    std::unique_lock lock(journal_mutex);
+
+    while (true) {
+        journal_cond.wait_for(lock, interval, [] { return journal_stop; });
+
+        const bool stop = journal_stop;
+        std::vector<const visportal_t *> completed;
+        completed.swap(journal_pending);
+
+        lock.unlock();
+
+        if (!completed.empty()) {
+            WriteJournal(completed);
+        }
+        if (!stop && journal_size > state_size) {
+            CompactVisState(portal_mutex);
+        }
+
+        lock.lock();
+
+        if (stop) {
+            break;
+        }
+    }
+}
+
+void StartVisJournal(duration interval, std::mutex &portal_mutex)
+{
+    OpenJournal();
+
+    journal_stop = false;
+    journal_thread = std::thread(JournalThread, interval, std::ref(portal_mutex));
+}
+
+void JournalPortalCompleted(const visportal_t *p)
+{
+    if (!journal_thread.joinable()) {
+        return;
+    }
+
+    std::unique_lock lock(journal_mutex);
+    journal_pending.push_back(p);
+}
+
+void StopVisJournal()
+{
+    if (!journal_thread.joinable()) {
+        return;
+    }
+
+    {
+        std::unique_lock lock(journal_mutex);
+        journal_stop = true;
+    }
+    journal_cond.notify_one();
+    journal_thread.join();
+
+    journal_out.close();
+}
+
+/*
+ * Write the whole state file. Called while no portals are being flowed;
+ * the journal is empty afterwards.
+ */
+void SaveVisState()
+{
+    std::vector<savedportal_t> saved;
+    saved.reserve(portals.size());
+
+    for (const auto &p : portals) {
+        saved.push_back({p.status, p.nummightsee, &p.mightsee});
+    }
+
+    state_size = WriteVisState(saved);
+
+    std::error_code ec;
+    fs::remove(journalfile, ec);
 }
 
 void CleanVisState()
@@ -192,6 +423,102 @@ void CleanVisState()
     if (fs::exists(statefile)) {
         fs::remove(statefile);
     }
+    if (fs::exists(journalfile)) {
+        fs::remove(journalfile);
+    }
+}
+
+void UncompressBits(leafbits_t &dst, const uint8_t *src, size_t len)
+{
+    const size_t numbytes = (portalleafs + 7) >> 3;
+
+    dst.resize(portalleafs);
+
+    if (len < numbytes) {
+        DecompressBits(dst, src);
+    } else {
+        CopyLeafBits(dst, src, portalleafs);
+    }
+}
+
+static void ReadLeafBits(std::ifstream &in, leafbits_t &dst, std::vector<uint8_t> &compressed, size_t len)
+{
+    in.read((char *)compressed.data(), len);
+    UncompressBits(dst, compressed.data(), len);
+}
+
+static void ReadLeafBits(std::ifstream &in, compact_leafbits_t &dst, std::vector<uint8_t> &compressed, size_t len)
+{
+    leafbits_t bits;
+    ReadLeafBits(in, bits, compressed, len);
+    dst = bits;
+}
+
+/*
+ * Replay the journal over the loaded state, in the order the portals
+ * completed. Returns the time elapsed at the last record.
+ */
+static uint32_t ReplayVisJournal(const fs::file_time_type &prt_time)
+{
+    dvisjournal_t header;
+    djournalportal_t record;
+    uint32_t time_elapsed = 0;
+
+    if (!fs::exists(journalfile) || fs::last_write_time(journalfile) < prt_time) {
+        return 0;
+    }
+
+    std::ifstream in(journalfile, std::ios_base::in | std::ios_base::binary);
+    in >> endianness<std::endian::little>;
+
+    in >= header;
+
+    if (!in || header.version != VIS_JOURNAL_VERSION || header.numportals != numportals ||
+        header.numleafs != portalleafs) {
+        logging::print("State journal {} does not match, ignoring it\n", journalfile);
+        return 0;
+    }
+
+    const size_t numbytes = (portalleafs + 7) >> 3;
+    std::vector<uint8_t> compressed(numbytes);
+    leafbits_t mightsee, visbits;
+    size_t numreplayed = 0;
+
+    while (in >= record) {
+        if (record.portalnum >= portals.size() || record.might > numbytes || record.vis > numbytes) {
+            break;
+        }
+
+        ReadLeafBits(in, mightsee, compressed, record.might);
+        ReadLeafBits(in, visbits, compressed, record.vis);
+
+        // partial record from a crash
+        if (!in) {
+            break;
+        }
+
+        visportal_t &p = portals[record.portalnum];
+
+        // already in the state file if we stopped while compacting
+        if (p.status == pstat_done) {
+            continue;
+        }
+
+        p.mightsee = mightsee;
+        p.visbits = visbits;
+        p.nummightsee = record.nummightsee;
+        p.numcansee = record.numcansee;
+        p.status = pstat_done;
+
+        ReplayPortalCompleted(&p);
+
+        time_elapsed = record.time_elapsed;
+        numreplayed++;
+    }
+
+    logging::print("Replayed {} portals from the state journal\n", numreplayed);
+
+    return time_elapsed;
 }
 
 bool LoadVisState()
@@ -239,9 +566,6 @@ bool LoadVisState()
         FError("state file {} does not match portal file {}", statefile, portalfile);
     }
 
-    /* Move back the start time to simulate already elapsed time */
-    starttime -= duration(state.time_elapsed);
-
     numbytes = (portalleafs + 7) >> 3;
     std::vector<uint8_t> compressed(numbytes);
 
@@ -253,24 +577,12 @@ bool LoadVisState()
         p.nummightsee = pstate.nummightsee;
         p.numcansee = pstate.numcansee;
 
-        in.read((char *)compressed.data(), pstate.might);
-        p.mightsee.resize(portalleafs);
-
-        if (pstate.might < numbytes) {
-            DecompressBits(p.mightsee, compressed.data());
-        } else {
-            CopyLeafBits(p.mightsee, compressed.data(), portalleafs);
-        }
-
-        p.visbits.resize(portalleafs);
+        ReadLeafBits(in, p.mightsee, compressed, pstate.might);
 
         if (pstate.vis) {
-            in.read((char *)compressed.data(), pstate.vis);
-            if (pstate.vis < numbytes) {
-                DecompressBits(p.visbits, compressed.data());
-            } else {
-                CopyLeafBits(p.visbits, compressed.data(), portalleafs);
-            }
+            ReadLeafBits(in, p.visbits, compressed, pstate.vis);
+        } else {
+            p.visbits.resize(portalleafs);
         }
 
         /* Portals that were in progress need to be started again */
@@ -279,5 +591,271 @@ bool LoadVisState()
         }
     }
 
+    const uint32_t journal_elapsed = ReplayVisJournal(prt_time);
+
+    /* Move back the start time to simulate already elapsed time */
+    starttime -= duration(std::max(state.time_elapsed, journal_elapsed));
+
     return true;
 }
+
+/*
+  ============================================================================
+  Incremental vis
+
+  With -incremental the finished portals are kept next to the map, keyed by
+  their geometry, so the next -incremental run after an edit can take over
+  the ones the edit can't have changed. qbsp renumbers the leafs, so those
+  are matched up through the portals around them.
+  ============================================================================
+*/
+
+constexpr uint32_t VIS_INCREMENTAL_VERSION = ('T' << 24 | 'Y' << 16 | 'I' << 8 | '1');
+
+struct dvisincremental_t
+{
+    uint32_t version;
+    uint32_t numportals;
+    uint32_t numleafs;
+
+    auto stream_data() { return std::tie(version, numportals, numleafs); }
+};
+
+// followed by (numleafs + 7) / 8 bytes of uncompressed visbits
+struct dincrementalportal_t
+{
+    uint64_t hash;
+    uint32_t leaf;
+
+    auto stream_data() { return std::tie(hash, leaf); }
+};
+
+static uint64_t PortalHash(const visportal_t &p)
+{
+    // sorted, so it doesn't matter which point the winding starts at
+    std::vector<std::array<int64_t, 3>> points(p.winding->size());
+    for (size_t i = 0; i < points.size(); i++) {
+        for (int j = 0; j < 3; j++) {
+            points[i][j] = std::llround(p.winding->at(i)[j] * 16.0);
+        }
+    }
+    std::sort(points.begin(), points.end());
+
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](int64_t value) {
+        hash = (hash ^ static_cast<uint64_t>(value)) * 1099511628211ULL;
+        hash ^= hash >> 29;
+    };
+
+    for (auto &point : points) {
+        mix(point[0]);
+        mix(point[1]);
+        mix(point[2]);
+    }
+    // the two sides of a portal share their points
+    for (int j = 0; j < 3; j++) {
+        mix(std::llround(p.plane.normal[j] * 1024.0));
+    }
+
+    return hash;
+}
+
+// the leaf a portal leads out of; portals come in pairs, each leading into the other's leaf
+template<typename T>
+static auto SourceLeaf(const std::vector<T> &list, size_t portalnum)
+{
+    return list[portalnum ^ 1].leaf;
+}
+
+void SaveIncrementalVis()
+{
+    dvisincremental_t header;
+    dincrementalportal_t record;
+
+    std::ofstream out(incrementalfile, std::ios_base::out | std::ios_base::binary);
+    out << endianness<std::endian::little>;
+
+    header.version = VIS_INCREMENTAL_VERSION;
+    header.numportals = numportals;
+    header.numleafs = portalleafs;
+
+    out <= header;
+
+    std::vector<uint8_t> vis((portalleafs + 7) >> 3);
+
+    for (const auto &p : portals) {
+        record.hash = PortalHash(p);
+        record.leaf = p.leaf;
+
+        out <= record;
+        p.visbits.expand().to_bytes(vis.data(), vis.size());
+        out.write((const char *)vis.data(), vis.size());
+    }
+}
+
+struct oldportal_t
+{
+    uint64_t hash;
+    int leaf;
+    leafbits_t visbits;
+};
+
+void LoadIncrementalVis()
+{
+    dvisincremental_t header;
+    dincrementalportal_t record;
+
+    if (!fs::exists(incrementalfile)) {
+        logging::print("No previous vis in {}, starting from scratch\n", incrementalfile);
+        return;
+    }
+
+    std::ifstream in(incrementalfile, std::ios_base::in | std::ios_base::binary);
+    in >> endianness<std::endian::little>;
+
+    in >= header;
+
+    if (!in || header.version != VIS_INCREMENTAL_VERSION) {
+        logging::print("Previous vis {} does not match, ignoring it\n", incrementalfile);
+        return;
+    }
+
+    const size_t oldleafs = header.numleafs;
+
+    // the counts come from the file, so check they fit in it before allocating for them
+    const uint64_t recordsize = sizeof(uint64_t) + sizeof(uint32_t) + ((oldleafs + 7) >> 3);
+    const uint64_t expectedsize = sizeof(uint32_t) * 3 + uint64_t(header.numportals) * 2 * recordsize;
+    std::error_code ec;
+    if (fs::file_size(incrementalfile, ec) != expectedsize || ec) {
+        logging::print("Previous vis {} is the wrong size for its header, ignoring it\n", incrementalfile);
+        return;
+    }
+
+    std::vector<uint8_t> vis((oldleafs + 7) >> 3);
+    std::vector<oldportal_t> oldportals(size_t(header.numportals) * 2);
+
+    for (auto &old : oldportals) {
+        in >= record;
+        in.read((char *)vis.data(), vis.size());
+
+        if (!in || record.leaf >= oldleafs) {
+            logging::print("Previous vis {} is truncated, ignoring it\n", incrementalfile);
+            return;
+        }
+
+        old.hash = record.hash;
+        old.leaf = record.leaf;
+        CopyLeafBits(old.visbits, vis.data(), oldleafs);
+    }
+
+    /*
+     * Match the portals by geometry; one that isn't unique can't be
+     * told apart, so it counts as changed
+     */
+    std::unordered_map<uint64_t, int> oldbyhash;
+    for (size_t i = 0; i < oldportals.size(); i++) {
+        auto [it, inserted] = oldbyhash.try_emplace(oldportals[i].hash, static_cast<int>(i));
+        if (!inserted) {
+            it->second = -1;
+        }
+    }
+
+    std::vector<int> match(portals.size(), -1);
+    std::unordered_map<uint64_t, int> newcount;
+    for (size_t i = 0; i < portals.size(); i++) {
+        const uint64_t hash = PortalHash(portals[i]);
+        newcount[hash]++;
+        if (auto it = oldbyhash.find(hash); it != oldbyhash.end()) {
+            match[i] = it->second;
+        }
+    }
+    for (size_t i = 0; i < portals.size(); i++) {
+        if (match[i] != -1 && newcount[oldportals[match[i]].hash] > 1) {
+            match[i] = -1;
+        }
+    }
+
+    /*
+     * A leaf is unchanged when all of its portals matched portals of one old
+     * leaf, and that leaf had no others
+     */
+    std::vector<size_t> oldnumportals(oldleafs);
+    for (size_t i = 0; i < oldportals.size(); i++) {
+        oldnumportals[SourceLeaf(oldportals, i)]++;
+    }
+
+    std::vector<int> oldtonew(oldleafs, -1);
+    std::vector<bool> changed(portalleafs);
+
+    for (int leafnum = 0; leafnum < portalleafs; leafnum++) {
+        const auto &leafportals = leafs[leafnum].portals;
+        int oldleaf = -1;
+        bool same = true;
+
+        for (const visportal_t *p : leafportals) {
+            const int old = match[p - portals.data()];
+            if (old == -1 || (oldleaf != -1 && SourceLeaf(oldportals, old) != oldleaf)) {
+                same = false;
+                break;
+            }
+            oldleaf = SourceLeaf(oldportals, old);
+        }
+
+        // no portals, so nothing can see it
+        if (leafportals.empty()) {
+            continue;
+        }
+
+        if (same && oldnumportals[oldleaf] == leafportals.size() && oldtonew[oldleaf] == -1) {
+            oldtonew[oldleaf] = leafnum;
+        } else {
+            changed[leafnum] = true;
+        }
+    }
+
+    /*
+     * The flow from a portal never leaves the leafs it might see, so if the
+     * edit touched none of those, its old result still holds
+     */
+    std::vector<visportal_t *> reused;
+
+    for (size_t i = 0; i < portals.size(); i++) {
+        visportal_t &p = portals[i];
+
+        if (match[i] == -1 || changed[p.leaf] || changed[SourceLeaf(portals, i)]) {
+            continue;
+        }
+
+        bool reachable = false;
+        p.mightsee.for_each_set([&](size_t leafnum) { reachable |= changed[leafnum]; });
+        if (reachable) {
+            continue;
+        }
+
+        leafbits_t visbits(portalleafs);
+        bool valid = true;
+        oldportals[match[i]].visbits.for_each_set([&](size_t oldleaf) {
+            const int leafnum = oldtonew[oldleaf];
+            if (leafnum == -1 || !p.mightsee[leafnum]) {
+                valid = false;
+            } else {
+                visbits[leafnum] = true;
+            }
+        });
+        if (!valid) {
+            continue;
+        }
+
+        p.visbits = visbits;
+        p.numcansee = static_cast<int>(visbits.count());
+        p.status = pstat_done;
+        reused.push_back(&p);
+    }
+
+    for (visportal_t *p : reused) {
+        ReplayPortalCompleted(p);
+    }
+
+    logging::print("Reused {} of {} portals from {} ({} of {} leafs changed)\n", reused.size(), portals.size(),
+        incrementalfile, std::count(changed.begin(), changed.end(), true), portalleafs);
+}
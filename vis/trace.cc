@@ -0,0 +1,230 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <vis/vis.hh>
+#include <common/log.hh>
+#include <common/json.hh>
+#include <common/ostream.hh>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <tuple>
+#include <vector>
+
+/*
+ * Portals are flowed smallest mightsee first, and the flow time grows much
+ * faster than the mightsee, so counting finished portals makes a very
+ * uneven progress bar. Instead each portal is weighted by its expected flow
+ * time: a fit of log(time) against log(mightsee) over the portals done so
+ * far, i.e. time = scale * mightsee ^ exponent.
+ */
+
+struct portaltiming_t
+{
+    int64_t order = -1; // completion order, or -1 if not flowed this run
+    int nummightsee;
+    int numcansee;
+    duration elapsed;
+    visstats_t stats;
+};
+
+static std::vector<portaltiming_t> timings;
+static int64_t numtimed;
+
+// least squares sums for the cost model, over portals with nonzero mightsee and time
+static double fit_n, fit_x, fit_y, fit_xx, fit_xy;
+
+// time flowing the portals so far, summed over the threads
+static duration flowtime;
+static qtime_point last_progress;
+static uint64_t last_progress_count;
+
+// the progress bar resolution
+constexpr uint64_t PROGRESS_MAX = 1000;
+
+// parameters of time = scale * mightsee ^ exponent
+static std::pair<double, double> CostModel()
+{
+    if (fit_n < 1) {
+        return {1.0, 1.0};
+    }
+
+    double exponent = 1.0;
+    const double varx = fit_n * fit_xx - fit_x * fit_x;
+
+    // until the mightsee spread is large enough to fit the growth, assume it's linear
+    if (fit_n >= 16 && varx > fit_n * fit_n * 0.01) {
+        exponent = std::clamp((fit_n * fit_xy - fit_x * fit_y) / varx, 0.5, 4.0);
+    }
+
+    return {std::exp((fit_y - exponent * fit_x) / fit_n), exponent};
+}
+
+static double PredictedTime(int nummightsee, const std::pair<double, double> &model)
+{
+    return model.first * std::pow(std::max(nummightsee, 1), model.second);
+}
+
+/*
+  ==================
+  UpdateProgress
+
+  The share of the expected flow time that's done
+  ==================
+*/
+static void UpdateProgress()
+{
+    const auto model = CostModel();
+
+    double remaining = 0;
+    for (const auto &p : portals) {
+        if (p.status != pstat_done) {
+            remaining += PredictedTime(p.nummightsee, model);
+        }
+    }
+
+    const double done = flowtime.count();
+    const double fraction = done + remaining > 0 ? done / (done + remaining) : 0.0;
+
+    // keep it moving forwards as the model changes; PROGRESS_MAX would end it
+    const uint64_t count = std::min(static_cast<uint64_t>(fraction * PROGRESS_MAX), PROGRESS_MAX - 1);
+    last_progress_count = std::max(last_progress_count, count);
+
+    logging::percent(last_progress_count, PROGRESS_MAX);
+}
+
+void StartPortalTimings()
+{
+    timings.clear();
+    timings.resize(portals.size());
+    numtimed = 0;
+    fit_n = fit_x = fit_y = fit_xx = fit_xy = 0;
+    flowtime = {};
+    last_progress = I_FloatTime();
+    last_progress_count = 0;
+
+    logging::percent(0, PROGRESS_MAX);
+}
+
+void PortalTimed(const visportal_t *p, duration elapsed, const visstats_t &stats)
+{
+    const int nummightsee = p->nummightsee;
+
+    portaltiming_t &timing = timings[p - portals.data()];
+    timing.order = numtimed++;
+    timing.nummightsee = nummightsee;
+    timing.numcansee = p->numcansee;
+    timing.elapsed = elapsed;
+    timing.stats = stats;
+
+    flowtime += elapsed;
+
+    if (nummightsee > 0 && elapsed.count() > 0) {
+        const double x = std::log(static_cast<double>(nummightsee));
+        const double y = std::log(elapsed.count());
+        fit_n += 1;
+        fit_x += x;
+        fit_y += y;
+        fit_xx += x * x;
+        fit_xy += x * y;
+    }
+
+    // summing up the remaining portals isn't free, so don't do it for every one
+    const qtime_point now = I_FloatTime();
+    if (now - last_progress >= std::chrono::milliseconds(250)) {
+        last_progress = now;
+        UpdateProgress();
+    }
+}
+
+static const char *const stat_names[] = {"portaltest", "portalpass", "portalcheck", "mightseeupdate", "noclip",
+    "vistest", "mighttest", "chains", "leafskip", "portalskip", "targetcheck", "sepcachehit", "sepcachemiss"};
+
+static_assert(std::size(stat_names) == std::tuple_size_v<decltype(visstats_t{}.stream_data())>);
+
+static void WritePortalTrace(const fs::path &name)
+{
+    std::vector<size_t> order;
+    for (size_t i = 0; i < timings.size(); i++) {
+        if (timings[i].order != -1) {
+            order.push_back(i);
+        }
+    }
+    std::sort(order.begin(), order.end(), [](size_t a, size_t b) { return timings[a].order < timings[b].order; });
+
+    std::ofstream f(name);
+
+    if (!f)
+        FError("Can't write {}", name);
+
+    const bool json = name.extension() == ".json";
+
+    if (json) {
+        Json::Value j = Json::Value(Json::arrayValue);
+
+        for (size_t i : order) {
+            portaltiming_t &timing = timings[i];
+            Json::Value &record = j.append(Json::Value(Json::objectValue));
+            record["portal"] = static_cast<Json::UInt64>(i);
+            record["leaf"] = portals[i].leaf;
+            record["seconds"] = timing.elapsed.count();
+            record["mightsee"] = timing.nummightsee;
+            record["cansee"] = timing.numcansee;
+
+            size_t s = 0;
+            std::apply(
+                [&](auto &...counters) { ((record[stat_names[s++]] = static_cast<Json::Int64>(counters)), ...); },
+                timing.stats.stream_data());
+        }
+
+        f << j;
+    } else {
+        ewt::print(f, "portal,leaf,seconds,mightsee,cansee");
+        for (const char *stat : stat_names) {
+            ewt::print(f, ",{}", stat);
+        }
+        ewt::print(f, "\n");
+
+        for (size_t i : order) {
+            portaltiming_t &timing = timings[i];
+            ewt::print(f, "{},{},{:.6f},{},{}", i, portals[i].leaf, timing.elapsed.count(), timing.nummightsee,
+                timing.numcansee);
+            std::apply([&](auto &...counters) { ((ewt::print(f, ",{}", counters)), ...); }, timing.stats.stream_data());
+            ewt::print(f, "\n");
+        }
+    }
+
+    logging::print("Wrote the flow times of {} portals to {}\n", order.size(), name);
+}
+
+void StopPortalTimings()
+{
+    logging::percent(PROGRESS_MAX, PROGRESS_MAX);
+
+    const auto [scale, exponent] = CostModel();
+    logging::print(logging::flag::VERBOSE, "portal flow time model: {:.3g} s * mightsee ^ {:.2f}, {:.1f} s total\n",
+        scale, exponent, flowtime.count());
+
+    if (!vis_options.trace.value().empty()) {
+        WritePortalTrace(vis_options.trace.value());
+    }
+
+    timings.clear();
+}
@@ -6,9 +6,12 @@
 #include <common/fs.hh>
 #include <common/parallel.hh>
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <functional> // for std::greater
 #include <climits>
 #include <cstdint>
-#include <bit> // for std::countr_zero
 #include <numeric> // for std::accumulate
 
 #include <fmt/chrono.h>
@@ -67,7 +70,7 @@ void vis_settings::initialize(int argc, const char **argv)
 
 settings::vis_settings vis_options;
 
-fs::path portalfile, statefile, statetmpfile;
+fs::path portalfile, statefile, statetmpfile, journalfile, incrementalfile;
 
 /*
   ==================
@@ -77,7 +80,8 @@ fs::path portalfile, statefile, statetmpfile;
   The memory is not initialized.
   ==================
 */
-viswinding_t *AllocStackWinding(pstack_t &stack)
+template<typename W>
+W *AllocStackWinding(basic_pstack_t<W> &stack)
 {
     for (size_t i = 0; i < STACK_WINDINGS; i++) {
         if (!stack.windings_used[i]) {
@@ -98,7 +102,8 @@ viswinding_t *AllocStackWinding(pstack_t &stack)
   structure further up the call chain).
   ==================
 */
-void FreeStackWinding(viswinding_t *&w, pstack_t &stack)
+template<typename W>
+void FreeStackWinding(W *&w, basic_pstack_t<W> &stack)
 {
     if (w >= stack.windings && w <= &stack.windings[STACK_WINDINGS]) {
         size_t i = w - stack.windings;
@@ -109,6 +114,11 @@ void FreeStackWinding(viswinding_t *&w, pstack_t &stack)
     }
 }
 
+template viswinding_t *AllocStackWinding(pstack_t &stack);
+template viswindingf_t *AllocStackWinding(pstackf_t &stack);
+template void FreeStackWinding(viswinding_t *&w, pstack_t &stack);
+template void FreeStackWinding(viswindingf_t *&w, pstackf_t &stack);
+
 /*
   ==================
   ClipStackWinding
@@ -222,12 +232,159 @@ noclip:
     return in;
 }
 
+/*
+  ==================
+  ClipStackWinding
+
+  Single precision version for -floatclip; the sides of all the points are
+  found a vector at a time.
+  ==================
+*/
+viswindingf_t *ClipStackWinding(visstats_t &stats, viswindingf_t *in, pstackf_t &stack, const qplane3f &split)
+{
+    alignas(32) float dists[MAX_WINDING];
+    uint64_t front, back;
+
+    /* Fast test first */
+    const float dot = split.distance_to(in->origin);
+    if (dot < -in->radius) {
+        FreeStackWinding(in, stack);
+        return nullptr;
+    } else if (dot > in->radius) {
+        return in;
+    }
+
+    in->plane_sides(split, VIS_ON_EPSILON, dists, front, back);
+
+    // ericw -- coplanar portals: return without clipping (see the double version)
+    if (!front && !back) {
+        return in;
+    }
+
+    if (!front) {
+        FreeStackWinding(in, stack);
+        return nullptr;
+    }
+    if (!back)
+        return in;
+
+    const size_t numpoints = in->size();
+    const uint64_t first = uint64_t(1) << (numpoints - 1);
+
+    // the sides of each point's successor, and the edges from a point on one
+    // side to a point on the other, which get a split point
+    const uint64_t next_front = (front >> 1) | ((front & 1) ? first : 0);
+    const uint64_t next_back = (back >> 1) | ((back & 1) ? first : 0);
+    const uint64_t crossing = (front & next_back) | (back & next_front);
+    const uint64_t kept = ~back & (first | (first - 1));
+
+    if (std::popcount(kept) + std::popcount(crossing) > MAX_WINDING_FIXED) {
+        stats.c_noclip++;
+        return in;
+    }
+
+    auto *neww = AllocStackWinding(stack);
+    neww->numpoints = 0;
+    neww->origin = in->origin;
+    neww->radius = in->radius;
+
+    for (size_t i = 0; i < numpoints; i++) {
+        const uint64_t bit = uint64_t(1) << i;
+
+        if (kept & bit)
+            neww->push_back(in->at(i));
+
+        if (!(crossing & bit))
+            continue;
+
+        /* generate a split point */
+        const size_t next = (i + 1) == numpoints ? 0 : i + 1;
+        const qvec3f p1 = in->at(i);
+        const qvec3f p2 = in->at(next);
+        qvec3f mid;
+        const float fraction = dists[i] / (dists[i] - dists[next]);
+        for (size_t j = 0; j < 3; j++) {
+            /* avoid round off error when possible */
+            if (split.normal[j] == 1)
+                mid[j] = split.dist;
+            else if (split.normal[j] == -1)
+                mid[j] = -split.dist;
+            else
+                mid[j] = p1[j] + fraction * (p2[j] - p1[j]);
+        }
+
+        neww->push_back(mid);
+    }
+
+    neww->pad_lanes();
+    FreeStackWinding(in, stack);
+    return neww;
+}
+
 //============================================================================
 
 #include <mutex>
 
-static std::mutex portal_mutex;
-static std::atomic_int64_t portalIndex;
+std::mutex portal_mutex;
+
+/*
+  =============
+  portal_queue_t
+
+  Portals waiting to be flowed, bucketed by nummightsee so the least complex
+  one can be found without scanning every portal. nummightsee only ever goes
+  down while a portal waits, so rather than moving a portal between buckets
+  it's pushed again into the lower bucket; the stale entry is skipped when
+  it's reached. Each bucket is a heap on the portal number, so ties go to the
+  lowest numbered portal like a linear scan would.
+
+  Called with the lock held.
+  =============
+*/
+struct portal_queue_t
+{
+    std::vector<std::vector<visportal_t *>> buckets;
+    // no waiting portal has a nummightsee lower than this
+    size_t lowest = 0;
+
+    void clear()
+    {
+        buckets.clear();
+        lowest = 0;
+    }
+
+    void push(visportal_t *p)
+    {
+        size_t bucket = p->nummightsee;
+        if (bucket >= buckets.size()) {
+            buckets.resize(bucket + 1);
+        }
+        buckets[bucket].push_back(p);
+        std::push_heap(buckets[bucket].begin(), buckets[bucket].end(), std::greater<>());
+        lowest = std::min(lowest, bucket);
+    }
+
+    visportal_t *pop()
+    {
+        for (; lowest < buckets.size(); lowest++) {
+            auto &bucket = buckets[lowest];
+            while (!bucket.empty()) {
+                std::pop_heap(bucket.begin(), bucket.end(), std::greater<>());
+                visportal_t *p = bucket.back();
+                bucket.pop_back();
+                if (p->status == pstat_none && p->nummightsee == lowest) {
+                    return p;
+                }
+            }
+        }
+        return nullptr;
+    }
+};
+
+static portal_queue_t portal_queue;
+// portals handed out this run, for -stopafter
+static int32_t portals_handed_out;
+static bool stopped_early;
 
 /*
   =============
@@ -240,24 +397,20 @@ static std::atomic_int64_t portalIndex;
 */
 visportal_t *GetNextPortal()
 {
-    visportal_t *ret = nullptr;
-    uint32_t min = INT_MAX;
+    std::unique_lock lock(portal_mutex);
 
-    portal_mutex.lock();
-
-    for (auto &p : portals) {
-        if (p.nummightsee < min && p.status == pstat_none) {
-            min = p.nummightsee;
-            ret = &p;
-        }
+    if (vis_options.stopafter.value() && portals_handed_out >= vis_options.stopafter.value()) {
+        return nullptr;
     }
 
+    visportal_t *ret = portal_queue.pop();
+
     if (ret) {
-        ret->status = pstat_working;
+        // the flow threads can be reading it; working is treated the same as none there
+        std::atomic_ref(ret->status).store(pstat_working, std::memory_order_relaxed);
+        portals_handed_out++;
     }
 
-    portal_mutex.unlock();
-
     return ret;
 }
 
@@ -268,12 +421,14 @@ visportal_t *GetNextPortal()
   Called after completing a portal and finding that the source leaf is no
   longer visible from the dest leaf. Visibility is symetrical, so the reverse
   must also be true. Update mightsee for any portals on the source leaf which
-  haven't yet started processing.
+  haven't yet started processing. Portals whose nummightsee dropped are
+  added to requeue.
 
   Called with the lock held.
   =============
 */
-static void UpdateMightsee(visstats_t &stats, const leaf_t &source, const leaf_t &dest)
+static void UpdateMightsee(
+    visstats_t &stats, const leaf_t &source, const leaf_t &dest, std::vector<visportal_t *> &requeue)
 {
     size_t leafnum = &dest - leafs.data();
     for (visportal_t *p : source.portals) {
@@ -281,79 +436,125 @@ static void UpdateMightsee(visstats_t &stats, const leaf_t &source, const leaf_t
             continue;
         }
         if (p->mightsee[leafnum]) {
-            p->mightsee[leafnum] = false;
+            p->mightsee.reset(leafnum);
             p->nummightsee--;
             stats.c_mightseeupdate++;
+            requeue.push_back(p);
         }
     }
 }
 
 /*
   =============
-  PortalCompleted
+  PropagateCompleted
 
-  Mark the portal completed and propogate new vis information across
-  to the complementry portals.
+  For each portal on the completed portal's leaf, check the leafs we
+  eliminated from mightsee during the full vis so far.
 
   Called with the lock held.
   =============
 */
-static void PortalCompleted(visstats_t &stats, visportal_t *completed)
+static void PropagateCompleted(visstats_t &stats, const visportal_t *completed, std::vector<visportal_t *> &requeue)
 {
-    portal_mutex.lock();
-
-    completed->status = pstat_done;
-
-    /*
-     * For each portal on the leaf, check the leafs we eliminated from
-     * mightsee during the full vis so far.
-     */
     const leaf_t &myleaf = leafs[completed->leaf];
+    leafbits_t changed(portalleafs);
     for (int i = 0; i < myleaf.portals.size(); i++) {
         const visportal_t *p = myleaf.portals[i];
         if (p->status != pstat_done)
             continue;
 
-        auto might = p->mightsee.data();
-        auto vis = p->visbits.data();
-        int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
-        for (int j = 0; j < numblocks; j++) {
-            uint32_t changed = might[j] & ~vis[j];
-            if (!changed)
-                continue;
+        if (!changed.assign_andnot(p->mightsee, p->visbits))
+            continue;
 
-            /*
-             * If any of these changed bits are still visible from another
-             * portal, we can't update yet.
-             */
-            for (int k = 0; k < myleaf.portals.size(); k++) {
-                if (k == i)
-                    continue;
-                const visportal_t *p2 = myleaf.portals[k];
-                if (p2->status == pstat_done)
-                    changed &= ~p2->visbits.data()[j];
-                else
-                    changed &= ~p2->mightsee.data()[j];
-                if (!changed)
-                    break;
-            }
+        /*
+         * If any of these changed bits are still visible from another
+         * portal, we can't update yet.
+         */
+        bool remaining = true;
+        for (int k = 0; k < myleaf.portals.size() && remaining; k++) {
+            if (k == i)
+                continue;
+            const visportal_t *p2 = myleaf.portals[k];
+            if (p2->status == pstat_done)
+                remaining = changed.andnot(p2->visbits);
+            else
+                remaining = changed.andnot(p2->mightsee);
+        }
 
-            /*
-             * Update mightsee for any of the changed bits that survived
-             */
-            while (changed) {
-                int bit = std::countr_zero(changed);
-                changed &= ~nth_bit(bit);
-                int leafnum = (j << leafbits_t::shift) + bit;
-                UpdateMightsee(stats, leafs[leafnum], myleaf);
-            }
+        /*
+         * Update mightsee for any of the changed bits that survived
+         */
+        if (remaining) {
+            changed.for_each_set(
+                [&](size_t leafnum) { UpdateMightsee(stats, leafs[leafnum], myleaf, requeue); });
         }
     }
+}
+
+/*
+  =============
+  CommitPortal
+
+  Mark the portal completed and propogate new vis information across
+  to the complementry portals. The portals whose mightsee went down are
+  returned in changed.
+
+  Called with the lock held.
+  =============
+*/
+void CommitPortal(visstats_t &stats, visportal_t *completed, std::vector<visportal_t *> &changed)
+{
+    // PortalFlow reads the visbits of done portals without the lock
+    std::atomic_ref(completed->status).store(pstat_done, std::memory_order_release);
+
+    JournalPortalCompleted(completed);
+
+    PropagateCompleted(stats, completed, changed);
+
+    /*
+     * Move the portals that got cheaper to their new buckets
+     */
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+
+    for (visportal_t *p : changed) {
+        portal_queue.push(p);
+    }
+}
 
-    portal_mutex.unlock();
+/*
+  =============
+  PortalCompleted
+  =============
+*/
+static void PortalCompleted(visstats_t &stats, visportal_t *completed, duration elapsed)
+{
+    std::vector<visportal_t *> changed;
+
+    std::unique_lock lock(portal_mutex);
+
+    CommitPortal(stats, completed, changed);
+
+    PortalTimed(completed, elapsed, stats);
 }
 
-qtime_point starttime, endtime, statetime;
+/*
+  =============
+  ReplayPortalCompleted
+
+  Called by LoadVisState before the portal queue is built, so nothing is
+  requeued.
+  =============
+*/
+void ReplayPortalCompleted(visportal_t *p)
+{
+    visstats_t stats;
+    std::vector<visportal_t *> requeue;
+
+    PropagateCompleted(stats, p, requeue);
+}
+
+qtime_point starttime, endtime;
 static duration stateinterval;
 
 /*
@@ -363,22 +564,14 @@ static duration stateinterval;
 */
 static visstats_t LeafThread()
 {
-    portal_mutex.lock();
-    /* Save state if sufficient time has elapsed */
-    auto now = I_FloatTime();
-    if (now > statetime + stateinterval) {
-        statetime = now;
-        SaveVisState();
-    }
-    portal_mutex.unlock();
-
     visportal_t *p = GetNextPortal();
     if (!p)
         return {};
 
+    const qtime_point start = I_FloatTime();
     visstats_t stats = PortalFlow(p);
 
-    PortalCompleted(stats, p);
+    PortalCompleted(stats, p, I_FloatTime() - start);
 
     logging::print(logging::flag::VERBOSE, "portal:{:4}  mightsee:{:4}  cansee:{:4}\n", (ptrdiff_t)(p - portals.data()),
         p->nummightsee, p->numcansee);
@@ -386,29 +579,30 @@ static visstats_t LeafThread()
     return stats;
 }
 
+std::atomic_int64_t totalvis;
+
 /*
   ===============
-  LeafFlow
+  ClusterFlow
 
-  Builds the entire visibility list for a leaf
+  Builds the entire visibility list for a cluster into its row of
+  uncompressed, and the compressed row into compressed. Returns the
+  number of leafs visible.
   ===============
 */
-int64_t totalvis;
-
-static std::vector<uint8_t> compressed;
-
-static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
+static int ClusterFlow(int clusternum, const std::vector<std::vector<int>> &clusterleafs, const mbsp_t *bsp,
+    std::vector<uint8_t> &compressed)
 {
     /*
      * Collect visible bits from all portals into buffer
      */
+    leafbits_t buffer(portalleafs);
+
     leaf_t *leaf = &leafs[clusternum];
-    int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
     for (const visportal_t *p : leaf->portals) {
         if (p->status != pstat_done)
             FError("portal not done");
-        for (int j = 0; j < numblocks; j++)
-            buffer.data()[j] |= p->visbits.data()[j];
+        buffer |= p->visbits;
     }
 
     if (buffer[clusternum])
@@ -422,29 +616,25 @@ static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
     int numvis = 0;
 
     uint8_t *outbuffer;
+    int outbytes;
     if (bsp->loadversion->game->has_cluster_support) {
         outbuffer = uncompressed.data() + clusternum * leafbytes;
-        for (int i = 0; i < portalleafs; i++) {
-            if (buffer[i]) {
-                outbuffer[i >> 3] |= nth_bit(i & 7);
-                numvis++;
-            }
-        }
+        outbytes = (portalleafs + 7) >> 3;
+        buffer.for_each_set([&](size_t i) {
+            outbuffer[i >> 3] |= nth_bit(i & 7);
+            numvis++;
+        });
     } else {
         outbuffer = uncompressed.data() + clusternum * leafbytes_real;
-        for (int i = 0; i < portalleafs_real; i++) {
-            if (buffer[bsp->dleafs[i + 1].cluster]) {
+        outbytes = (portalleafs_real + 7) >> 3;
+        buffer.for_each_set([&](size_t cluster) {
+            for (int i : clusterleafs[cluster]) {
                 outbuffer[i >> 3] |= nth_bit(i & 7);
-                numvis++;
             }
-        }
+            numvis += clusterleafs[cluster].size();
+        });
     }
 
-    /*
-     * compress the bit string
-     */
-    logging::print(logging::flag::VERBOSE, "cluster {:4} : {:4} visible\n", clusternum, numvis);
-
     /*
      * increment totalvis by
      * (# of real leafs in this cluster) x (# of real leafs visible from this cluster)
@@ -453,37 +643,18 @@ static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
         // FIXME: not sure what this is supposed to be?
         totalvis += numvis;
     } else {
-        for (int i = 0; i < portalleafs_real; i++) {
-            if (bsp->dleafs[i + 1].cluster == clusternum) {
-                totalvis += numvis;
-            }
-        }
+        totalvis += static_cast<int64_t>(clusterleafs[clusternum].size()) * numvis;
     }
 
+    /*
+     * compress the bit string
+     */
     compressed.clear();
-
     /* Allocate for worst case where RLE might grow the data (unlikely) */
-    if (bsp->loadversion->game->has_cluster_support) {
-        CompressRow(outbuffer, (portalleafs + 7) >> 3, std::back_inserter(compressed));
-    } else {
-        CompressRow(outbuffer, (portalleafs_real + 7) >> 3, std::back_inserter(compressed));
-    }
+    compressed.reserve(std::max(1, outbytes * 2));
+    CompressRow(outbuffer, outbytes, std::back_inserter(compressed));
 
-    /* leaf 0 is a common solid */
-    int32_t visofs = vismap.size();
-
-    bsp->dvis.set_bit_offset(VIS_PVS, clusternum, visofs);
-
-    // Set pointers
-    if (!bsp->loadversion->game->has_cluster_support) {
-        for (int i = 0; i < portalleafs_real; i++) {
-            if (bsp->dleafs[i + 1].cluster == clusternum) {
-                bsp->dleafs[i + 1].visofs = visofs;
-            }
-        }
-    }
-
-    std::copy(compressed.begin(), compressed.end(), std::back_inserter(vismap));
+    return numvis;
 }
 
 /*
@@ -502,6 +673,12 @@ visstats_t CalcPortalVis(const mbsp_t *bsp)
         return {};
     }
 
+    // sampled rays for a tighter bound than -fast, still in a fraction of the time
+    if (vis_options.approx.value()) {
+        ApproximatePortalVis(vis_options.approx.value(), vis_options.approxgraze.value());
+        return {};
+    }
+
     /*
      * Count the already completed portals in case we loaded previous state
      */
@@ -512,26 +689,93 @@ visstats_t CalcPortalVis(const mbsp_t *bsp)
         }
     }
 
-    portalIndex = startcount;
+    portal_queue.clear();
+    for (auto &p : portals) {
+        if (p.status == pstat_none) {
+            portal_queue.push(&p);
+        }
+    }
+    portals_handed_out = 0;
 
-    std::vector<visstats_t> stats_perportal;
-    stats_perportal.resize(numportals * 2);
+    /*
+     * Start from a full state file, then only journal completed portals
+     * while the threads are running
+     */
+    SaveVisState();
+    StartVisJournal(stateinterval, portal_mutex);
+    ResetSeparatorCache(static_cast<size_t>(vis_options.separatorcache.value()) << 20);
+
+    visstats_t stats;
 
-    logging::parallel_for(startcount, numportals * 2, [&](size_t i) { stats_perportal[i] = LeafThread(); });
+    if (vis_options.coordinator.value()) {
+        // the workers time their own flows, and don't report them back
+        if (!vis_options.trace.value().empty()) {
+            logging::print("WARNING: -trace isn't supported with -coordinator, ignoring it\n");
+        }
+        stats = RunVisCoordinator(vis_options.coordinator.value(), numportals * 2 - startcount);
+    } else {
+        std::vector<visstats_t> stats_perportal;
+        stats_perportal.resize(numportals * 2);
 
-    const visstats_t stats = std::accumulate(stats_perportal.begin(), stats_perportal.end(), visstats_t{});
+        // the progress is weighted by the expected flow time of each portal, instead of by count
+        StartPortalTimings();
+        tbb::parallel_for(startcount, numportals * 2, [&](int32_t i) { stats_perportal[i] = LeafThread(); });
+        StopPortalTimings();
+
+        stats = std::accumulate(stats_perportal.begin(), stats_perportal.end(), visstats_t{});
+    }
+
+    StopVisJournal();
+    ResetSeparatorCache(0);
+
+    // -stopafter leaves the state file and journal as a stopped run would
+    if (std::ranges::any_of(portals, [](const visportal_t &p) { return p.status != pstat_done; })) {
+        stopped_early = true;
+        return stats;
+    }
 
     SaveVisState();
 
+    if (vis_options.incremental.value()) {
+        SaveIncrementalVis();
+    }
+
     logging::print(logging::flag::VERBOSE, "portalcheck: {}  portaltest: {}  portalpass: {}\n", stats.c_portalcheck,
         stats.c_portaltest, stats.c_portalpass);
     logging::print(logging::flag::VERBOSE, "c_vistest: {}  c_mighttest: {}  c_mightseeupdate {}\n", stats.c_vistest,
         stats.c_mighttest, stats.c_mightseeupdate);
     logging::print(logging::flag::VERBOSE, "c_targetcheck: {}\n", stats.c_targetcheck);
+    logging::print(logging::flag::VERBOSE, "separator cache hits: {}  misses: {}\n", stats.c_sepcachehit,
+        stats.c_sepcachemiss);
 
     return stats;
 }
 
+/*
+  ==================
+  PrintPortalBitsMemory
+
+  How much the compact mightsee and visbits take, against keeping them all dense
+  ==================
+*/
+static void PrintPortalBitsMemory(logging::flag logflag)
+{
+    const size_t dense_size = ((portalleafs + leafbits_t::mask) >> leafbits_t::shift) * sizeof(leafbits_t::block_t);
+
+    size_t mightsee = 0, visbits = 0, dense = 0, numsparse = 0;
+    for (const auto &p : portals) {
+        mightsee += p.mightsee.memory_size();
+        visbits += p.visbits.memory_size();
+        dense += dense_size * (p.status == pstat_done ? 2 : 1);
+        numsparse += p.mightsee.sparse();
+    }
+
+    constexpr double MB = 1024.0 * 1024.0;
+    logging::print(logflag,
+        "portal bits: {:.1f} MB mightsee, {:.1f} MB visbits ({:.1f} MB dense), {} of {} mightsee sparse\n",
+        mightsee / MB, visbits / MB, dense / MB, numsparse, portals.size());
+}
+
 /*
   ==================
   CalcVis
@@ -540,23 +784,65 @@ visstats_t CalcPortalVis(const mbsp_t *bsp)
 visstats_t CalcVis(mbsp_t *bsp)
 {
     if (LoadVisState()) {
-        logging::print("Loaded previous state. Resuming progress...\n");
+        const auto numdone = std::ranges::count_if(portals, [](const visportal_t &p) { return p.status == pstat_done; });
+        logging::print("Loaded previous state with {} of {} portals done. Resuming progress...\n", numdone,
+            portals.size());
     } else {
         logging::print("Calculating Base Vis:\n");
         BasePortalVis();
+
+        if (vis_options.incremental.value()) {
+            LoadIncrementalVis();
+        }
     }
 
+    PrintPortalBitsMemory(logging::flag::DEFAULT);
+
     logging::print("Calculating Full Vis:\n");
     auto stats = CalcPortalVis(bsp);
 
+    if (stopped_early) {
+        return stats;
+    }
+
+    PrintPortalBitsMemory(logging::flag::VERBOSE);
+
     //
     // assemble the leaf vis lists by oring and compressing the portal lists
     //
     logging::print("Expanding clusters...\n");
-    leafbits_t buffer(portalleafs);
+
+    // real leafs of each cluster; Q2 leafs are only expanded at runtime
+    std::vector<std::vector<int>> clusterleafs(portalleafs);
+    if (!bsp->loadversion->game->has_cluster_support) {
+        for (int i = 0; i < portalleafs_real; i++) {
+            const int cluster = bsp->dleafs[i + 1].cluster;
+            if (cluster >= 0 && cluster < portalleafs) {
+                clusterleafs[cluster].push_back(i);
+            }
+        }
+    }
+
+    std::vector<std::vector<uint8_t>> compressed(portalleafs);
+    std::vector<int> numvisible(portalleafs);
+    logging::parallel_for(
+        0, portalleafs, [&](int i) { numvisible[i] = ClusterFlow(i, clusterleafs, bsp, compressed[i]); });
+
+    // append the rows in cluster order, so the lump (and the log) is the same however the work was scheduled
     for (int i = 0; i < portalleafs; i++) {
-        ClusterFlow(i, buffer, bsp);
-        buffer.clear();
+        logging::print(logging::flag::VERBOSE, "cluster {:4} : {:4} visible\n", i, numvisible[i]);
+
+        /* leaf 0 is a common solid */
+        const int32_t visofs = vismap.size();
+
+        bsp->dvis.set_bit_offset(VIS_PVS, i, visofs);
+
+        // Set pointers
+        for (int leafnum : clusterleafs[i]) {
+            bsp->dleafs[leafnum + 1].visofs = visofs;
+        }
+
+        std::copy(compressed[i].begin(), compressed[i].end(), std::back_inserter(vismap));
     }
 
     int64_t avg = totalvis;
@@ -591,13 +877,6 @@ static void LoadPortals(const fs::path &name, mbsp_t *bsp)
     portalleafs = prtfile.portalleafs;
     portalleafs_real = prtfile.portalleafs_real;
 
-    /* Allocate for worst case where RLE might grow the data (unlikely) */
-    if (bsp->loadversion->game->has_cluster_support) {
-        compressed.reserve(std::max(1, (portalleafs * 2) / 8));
-    } else {
-        compressed.reserve(std::max(1, (portalleafs_real * 2) / 8));
-    }
-
     numportals = prtfile.portals.size();
 
     if (!bsp->loadversion->game->has_cluster_support) {
@@ -648,6 +927,10 @@ static void LoadPortals(const fs::path &name, mbsp_t *bsp)
 
             p.plane = -plane;
             p.leaf = sourceportal.leafnums[1];
+            if (vis_options.floatclip.value()) {
+                p.planef = qplane3f(p.plane);
+                p.windingf = viswindingf_t::copy_winding(*p.winding);
+            }
             dest_portal_it++;
         }
 
@@ -663,6 +946,10 @@ static void LoadPortals(const fs::path &name, mbsp_t *bsp)
 
             p.plane = plane;
             p.leaf = sourceportal.leafnums[0];
+            if (vis_options.floatclip.value()) {
+                p.planef = qplane3f(p.plane);
+                p.windingf = viswindingf_t::copy_winding(*p.winding);
+            }
             dest_portal_it++;
         }
     }
@@ -702,17 +989,19 @@ void vis_reset()
     portalfile = fs::path();
     statefile = fs::path();
     statetmpfile = fs::path();
+    journalfile = fs::path();
+    incrementalfile = fs::path();
 
-    portalIndex = 0;
+    portal_queue.clear();
+    portals_handed_out = 0;
+    stopped_early = false;
 
     starttime = {};
     endtime = {};
-    statetime = {};
 
     stateinterval = duration();
 
     totalvis = 0;
-    compressed.clear();
 
     vis::extended_texinfo_flags.clear();
 }
@@ -730,15 +1019,20 @@ int vis_main(int argc, const char **argv)
 
     vis_options.sourceMap.replace_extension("bsp");
 
-    logging::init(fs::path(vis_options.sourceMap)
-                      .replace_filename(vis_options.sourceMap.stem().string() + "-vis")
-                      .replace_extension("log"),
-        vis_options);
+    // several workers can share a map, so they only log with -logfile
+    if (!vis_options.worker.value().empty()) {
+        logging::init(std::nullopt, vis_options);
+    } else {
+        logging::init(fs::path(vis_options.sourceMap)
+                          .replace_filename(vis_options.sourceMap.stem().string() + "-vis")
+                          .replace_extension("log"),
+            vis_options);
+    }
 
     vis_options.print_summary();
 
-    stateinterval = std::chrono::minutes(5); /* 5 minutes */
-    starttime = statetime = I_FloatTime();
+    stateinterval = duration(vis_options.stateinterval.value());
+    starttime = I_FloatTime();
 
     LoadBSPFile(vis_options.sourceMap, &bspdata);
 
@@ -767,8 +1061,16 @@ int vis_main(int argc, const char **argv)
         portalfile = fs::path(vis_options.sourceMap).replace_extension("prt");
         LoadPortals(portalfile, &bsp);
 
+        if (!vis_options.worker.value().empty()) {
+            const int ret = RunVisWorker(vis_options.worker.value());
+            logging::close();
+            return ret;
+        }
+
         statefile = fs::path(vis_options.sourceMap).replace_extension("vis");
         statetmpfile = fs::path(vis_options.sourceMap).replace_extension("vi0");
+        journalfile = fs::path(vis_options.sourceMap).replace_extension("vsj");
+        incrementalfile = fs::path(vis_options.sourceMap).replace_extension("vsi");
 
         if (!bsp.loadversion->game->has_cluster_support) {
             uncompressed.resize(portalleafs * leafbytes_real);
@@ -778,6 +1080,12 @@ int vis_main(int argc, const char **argv)
 
         auto stats = CalcVis(&bsp);
 
+        if (stopped_early) {
+            logging::print("Stopped after {} portals, run vis again to resume\n", portals_handed_out);
+            logging::close();
+            return 0;
+        }
+
         logging::print("c_noclip: {}\n", stats.c_noclip);
         logging::print("c_chains: {}\n", stats.c_chains);
 